@@ -0,0 +1,233 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <sys/stat.h>
+#include "batch_runner.h"
+#include "emulator_base.h"
+#include "memory_manager.h"
+#include "os_core.h"
+
+namespace {
+    bool makeDirectory(const std::string &path) {
+        return mkdir(path.c_str(), 0777) == 0 || errno == EEXIST;
+    }
+
+    bool startsWith(const std::string &text, const char *prefix, std::string &rest) {
+        size_t length = strlen(prefix);
+        if (text.compare(0, length, prefix) != 0) return false;
+        rest = text.substr(length);
+        return true;
+    }
+
+    double secondsSince(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+}
+
+bool BatchRunner::parseManifest(const char *path, std::vector<_job> &jobs, std::string &error) {
+    std::ifstream manifest(path);
+    if (!manifest.is_open()) {
+        error = std::string("cannot open ") + path;
+        return false;
+    }
+    std::string line;
+    for (int lineNumber = 1; std::getline(manifest, line); lineNumber++) {
+        size_t comment = line.find('#');
+        if (comment != std::string::npos) line.erase(comment);
+        std::istringstream words(line);
+        std::vector<std::string> positional;
+        _job job;
+        job.name = std::to_string(lineNumber);
+        job.fastSwitch = false;
+        job.translate = false;
+        job.sharePages = false;
+        job.maxCycles = 0;
+        std::string word, value;
+        while (words >> word) {
+            if (word == "--fast-switch") job.fastSwitch = true;
+            else if (word == "--translate") job.translate = true;
+            else if (word == "--share-pages") job.sharePages = true;
+            else if (startsWith(word, "--name=", value)) job.name = value;
+            else if (startsWith(word, "--input=", value)) job.input = value;
+            else if (startsWith(word, "--max-cycles=", value)) job.maxCycles = strtoull(value.c_str(), NULL, 10);
+            else positional.push_back(word);
+        }
+        if (positional.empty()) continue;
+
+        std::string where = std::string(path) + ":" + std::to_string(lineNumber) + ": ";
+        if (positional.size() > 6) {
+            error = where + "too many arguments";
+            return false;
+        }
+        job.program = positional[0];
+        job.logMode = PageLog::LOG_FULL;
+        if (positional.size() >= 2 && !PageLog::modeFromName(positional[1].c_str(), job.logMode)) {
+            error = where + "unknown log mode " + positional[1];
+            return false;
+        }
+        job.frames = (positional.size() >= 4) ? atoi(positional[3].c_str()) : FRAME_COUNT;
+        job.pageSize = (positional.size() >= 5) ? atoi(positional[4].c_str()) : PAGE_SIZE;
+        job.processes = (positional.size() >= 6) ? atoi(positional[5].c_str()) : PROCESS_COUNT;
+        const char *configError = Memory::isValidConfig(job.frames, job.pageSize, job.processes);
+        if (configError != NULL) {
+            error = where + "bad memory configuration: " + configError;
+            return false;
+        }
+        if (positional.size() >= 3) {
+            job.policy = positional[2];
+            ReplacementPolicy *policy = ReplacementPolicy::create(job.policy.c_str(), job.frames);
+            if (policy == NULL) {
+                error = where + "unknown replacement policy " + job.policy;
+                return false;
+            }
+            delete policy;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+BatchRunner::BatchRunner(const std::vector<_job> &jobs, int threads) : jobs(jobs), seconds(0) {
+    if (threads < 1)
+        threads = (int) std::thread::hardware_concurrency();
+    if (threads < 1)
+        threads = 1;
+    for (int i = 0; i < threads; i++)
+        workers.push_back(std::unique_ptr<_worker>(new _worker()));
+}
+
+void BatchRunner::run(const char *directory) {
+    outputDirectory = directory;
+    if (!makeDirectory(outputDirectory)) {
+        fprintf(stderr, "error: cannot create %s--\n", directory);
+        exit(1);
+    }
+    _result pending = {"not run", 0, 0, 0, 0, 0};
+    results.assign(jobs.size(), pending);
+    for (size_t i = 0; i < jobs.size(); i++)
+        workers[i % workers.size()]->jobs.push_back(i);
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < workers.size(); i++)
+        threads.push_back(std::thread(&BatchRunner::workerLoop, this, (int) i));
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+    seconds = secondsSince(start);
+}
+
+// Own jobs newest first, then the oldest job of the next busy worker.
+// Jobs are only ever queued before the threads start, so once every
+// deque is seen empty there is nothing left to do.
+bool BatchRunner::nextJob(int self, size_t &job) {
+    {
+        _worker &own = *workers[self];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.jobs.empty()) {
+            job = own.jobs.back();
+            own.jobs.pop_back();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < workers.size(); i++) {
+        _worker &victim = *workers[(self + i) % workers.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.jobs.empty()) {
+            job = victim.jobs.front();
+            victim.jobs.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void BatchRunner::workerLoop(int self) {
+    size_t job;
+    while (nextJob(self, job))
+        runJob(job);
+}
+
+void BatchRunner::runJob(size_t index) {
+    const _job &job = jobs[index];
+    _result &result = results[index];
+    auto start = std::chrono::steady_clock::now();
+
+    std::string directory = outputDirectory + "/" + job.name;
+    if (!makeDirectory(directory)) {
+        result.status = "cannot create its directory";
+        return;
+    }
+    std::ofstream output((directory + "/output.txt").c_str(), std::ios::out | std::ios::trunc);
+    std::ifstream input;
+    if (!job.input.empty()) {
+        input.open(job.input.c_str());
+        if (!input.is_open()) {
+            result.status = "input cannot be opened";
+            return;
+        }
+    }
+
+    Memory mem((uint64_t) job.frames * job.pageSize, PageLog::LOG_OFF, job.pageSize, job.processes);
+    mem.setLogMode(job.logMode, directory.c_str());
+    if (!job.policy.empty())
+        mem.setReplacementPolicy(ReplacementPolicy::create(job.policy.c_str(), mem.getFrameCount()));
+    mem.setPageSharing(job.sharePages);
+    CPU8080 cpu(&mem);
+    cpu.setExitOnFault(false);
+    cpu.setFastContextSwitch(job.fastSwitch);
+    cpu.setTranslation(job.translate);
+    GTUOS os(job.input.empty() ? NULL : &input, &output);
+
+    cpu.ReadFileIntoMemoryAt(job.program.c_str(), 0x0000);
+    result.status = cpu.getFault();
+    while (result.status == NULL) {
+        CPU8080::StopReason reason = cpu.Run(BATCH_CYCLE_BUDGET, 0);
+        if (reason == CPU8080::STOP_SYSCALL)
+            os.handleCall(cpu, 0);
+        if (reason == CPU8080::STOP_HALT)
+            result.status = "halt";
+        else if (cpu.getFault() != NULL)
+            result.status = cpu.getFault();
+        else if (job.maxCycles != 0 && cpu.getTotalCycles() >= job.maxCycles)
+            result.status = "cycle limit";
+    }
+    os.flush();
+
+    result.pc = cpu.getState()->pc;
+    result.cycles = cpu.getTotalCycles();
+    result.pageFaults = mem.getPageFaultCount();
+    result.writeBacks = mem.getWriteBackCount();
+    result.seconds = secondsSince(start);
+}
+
+void BatchRunner::printSummary(std::ostream &out) const {
+    char line[256];
+    snprintf(line, sizeof(line), "%-16s %-20s %-26s %5s %14s %10s %10s %9s\n",
+             "Job", "Program", "Status", "PC", "Cycles", "Faults", "WriteBacks", "Seconds");
+    out << line;
+    uint64_t cycles = 0, pageFaults = 0, writeBacks = 0;
+    size_t halted = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const _result &r = results[i];
+        snprintf(line, sizeof(line), "%-16s %-20s %-26s %04x %14llu %10llu %10llu %9.3f\n",
+                 jobs[i].name.c_str(), jobs[i].program.c_str(), r.status, r.pc,
+                 (unsigned long long) r.cycles, (unsigned long long) r.pageFaults,
+                 (unsigned long long) r.writeBacks, r.seconds);
+        out << line;
+        cycles += r.cycles;
+        pageFaults += r.pageFaults;
+        writeBacks += r.writeBacks;
+        if (strcmp(r.status, "halt") == 0) halted++;
+    }
+    snprintf(line, sizeof(line), "%zu jobs, %zu halted, %llu cycles, %llu page faults, %llu write-backs "
+             "in %.3f s on %zu threads, %.1f M cycles/s\n",
+             jobs.size(), halted, (unsigned long long) cycles, (unsigned long long) pageFaults,
+             (unsigned long long) writeBacks, seconds, workers.size(),
+             seconds > 0 ? cycles / seconds / 1e6 : 0.0);
+    out << line;
+}
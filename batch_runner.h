@@ -0,0 +1,97 @@
+#ifndef BATCH_RUNNER_H
+#define BATCH_RUNNER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "page_log.h"
+
+#define BATCH_CYCLE_BUDGET 100000   // Cycles per Run, as in main
+
+// Runs many guest programs at once, each on its own Memory, CPU8080 and
+// GTUOS. Nothing global is shared between jobs: job n writes its console
+// output and page logs into its own directory, reads console input from
+// its own file, and a fault ends only that job (see setExitOnFault).
+//
+// Jobs are dealt round robin onto one deque per worker thread. A worker
+// takes its newest job first and, once its own deque is empty, steals the
+// oldest job of another, so long jobs do not leave threads idle.
+//
+// Manifest, one job per line, blank lines and # comments ignored:
+//   exeFile [off|summary|full|binary [fifo|clock|lru|ws [frames [pageSize [processes]]]]]
+// as main's arguments after debugOption, plus these switches anywhere:
+//   --name=dir        directory of the job, default its line number
+//   --input=file      console input, default none
+//   --fast-switch     see CPU8080::setFastContextSwitch
+//   --translate       see CPU8080::setTranslation
+//   --share-pages     see Memory::setPageSharing
+//   --max-cycles=n    stop the job after about n clock cycles
+// Debug output is always off.
+
+class BatchRunner {
+public:
+    typedef struct _job {
+        std::string name;
+        std::string program;
+        std::string input;          // Empty for no console input
+        PageLog::LogMode logMode;
+        std::string policy;         // Empty for FIFO
+        int frames;
+        int pageSize;
+        int processes;
+        bool fastSwitch;
+        bool translate;
+        bool sharePages;
+        uint64_t maxCycles;         // 0 for no limit
+    } _job;
+
+    typedef struct _result {
+        const char *status;         // "halt", "cycle limit" or the fault
+        uint16_t pc;                // Where the guest stopped
+        uint64_t cycles;
+        uint64_t pageFaults;
+        uint64_t writeBacks;
+        double seconds;             // Wall time of the job
+    } _result;
+
+    /**
+     * Read a manifest.
+     * @return false with error set on the first bad line; jobs is then
+     *         left partly filled.
+     */
+    static bool parseManifest(const char *path, std::vector<_job> &jobs, std::string &error);
+
+    // threads below 1 use one per hardware thread.
+    BatchRunner(const std::vector<_job> &jobs, int threads);
+
+    // Run every job with its directory under outputDirectory, which is
+    // created if it does not exist. Returns once all of them are done.
+    void run(const char *outputDirectory);
+
+    const std::vector<_result> &getResults() const { return results; }
+    // One line per job in manifest order, then the totals.
+    void printSummary(std::ostream &out) const;
+
+private:
+    typedef struct _worker {
+        std::mutex lock;
+        std::deque<size_t> jobs;    // Indices into BatchRunner::jobs
+    } _worker;
+
+    bool nextJob(int self, size_t &job);
+    void workerLoop(int self);
+    void runJob(size_t index);
+
+    std::vector<_job> jobs;
+    std::vector<_result> results;
+    std::vector<std::unique_ptr<_worker> > workers;
+    std::string outputDirectory;
+    double seconds;                 // Wall time of the last run
+};
+
+#endif
@@ -0,0 +1,365 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "emulator_base.h"
+#include "memory_manager.h"
+#include "os_core.h"
+
+// Whole program benchmark of the emulator, `make bench` runs it.
+//
+// Every workload runs its guest for BENCH_CYCLES clock cycles through
+// CPU8080::Run, as main does, BENCH_REPEATS times, and the fastest run
+// counts. A program that stops sooner is started again on a fresh Memory,
+// CPU and GTUOS. Guest instructions are counted in one more, untimed run
+// that single steps through the same cycles, so the timed runs carry no
+// counters of their own.
+//
+// The programs are copied into the work directory under the names the
+// microkernel loads them by, which is also where the guests' console
+// output goes, one file per workload. Page logs are off.
+//
+// Results, one line per workload after a # format line and a # header:
+//   name cycles instructions seconds mips ns_per_instruction
+//   faults_per_minstr switches cycles_per_switch
+// cycles_per_switch are the clock cycles process 0, the microkernel, ran
+// per context switch. Against a baseline, a workload whose MIPS dropped by
+// more than the tolerance is a regression and the exit status is 1.
+
+#define BENCH_CYCLES     50000000ULL    // Guest clock cycles per workload
+#define BENCH_REPEATS    5
+#define BENCH_TOLERANCE  10             // Percent of MIPS, see --tolerance
+#define BENCH_RUN_BUDGET 100000         // Cycles per Run, as in main
+
+namespace {
+    typedef struct _workload {
+        const char *name;
+        const char *program;
+        const char *policy;     // NULL for FIFO
+        int frames;
+        int pageSize;
+        int processes;
+        bool fastSwitch;
+        bool translate;
+        bool sharePages;
+    } _workload;
+
+    const _workload WORKLOADS[] = {
+        {"sum",             "sum.com",          NULL,    FRAME_COUNT, PAGE_SIZE, PROCESS_COUNT, false, false, false},
+        {"primes",          "primes.com",       NULL,    FRAME_COUNT, PAGE_SIZE, PROCESS_COUNT, false, false, false},
+        {"collatz",         "Collatz.com",      NULL,    FRAME_COUNT, PAGE_SIZE, PROCESS_COUNT, false, false, false},
+        {"kernel",          "microkernel.com",  NULL,    FRAME_COUNT, PAGE_SIZE, PROCESS_COUNT, false, false, false},
+        {"kernel-tight",    "microkernel.com",  "lru",   4,           512,       PROCESS_COUNT, false, false, false},
+        {"kernel-roomy",    "microkernel.com",  "clock", 64,          1024,      PROCESS_COUNT, false, false, false},
+        {"kernel-fast",     "microkernel.com",  NULL,    FRAME_COUNT, PAGE_SIZE, PROCESS_COUNT, true,  false, false},
+        {"kernel-translate","microkernel.com",  NULL,    FRAME_COUNT, PAGE_SIZE, PROCESS_COUNT, false, true,  false},
+        {"kernel-shared",   "microkernel.com",  NULL,    FRAME_COUNT, PAGE_SIZE, PROCESS_COUNT, false, false, true},
+    };
+
+    // Work directory name and source of each program copied into it.
+    const char *const PROGRAMS[][2] = {
+        {"sum.com", "sum.com"},
+        {"primes.com", "primes.com"},
+        {"Collatz.com", "Collatz.com"},
+        {"microkernel.com", "microkernel.com"},
+        {"Sum.com", "sum.com"},
+        {"Primes.com", "primes.com"},
+    };
+
+    typedef struct _result {
+        std::string name;
+        uint64_t cycles;
+        uint64_t instructions;
+        double seconds;
+        uint64_t pageFaults;
+        uint64_t switches;
+        uint64_t kernelCycles;
+    } _result;
+
+    // One guest of a workload, set up as BatchRunner sets up a job.
+    class Guest {
+    public:
+        Guest(const _workload &work, std::ostream *output)
+            : mem((uint64_t) work.frames * work.pageSize, PageLog::LOG_OFF, work.pageSize, work.processes),
+              cpu(&mem), os(NULL, output) {
+            if (work.policy != NULL)
+                mem.setReplacementPolicy(ReplacementPolicy::create(work.policy, mem.getFrameCount()));
+            cpu.setExitOnFault(false);
+            cpu.setFastContextSwitch(work.fastSwitch);
+            cpu.setTranslation(work.translate);
+            mem.setPageSharing(work.sharePages);
+            cpu.ReadFileIntoMemoryAt(work.program, 0x0000);
+        }
+
+        // Run until the guest stops or has run cycles; false once it stopped.
+        bool run(uint64_t cycles) {
+            while (cpu.getFault() == NULL && cpu.getTotalCycles() < cycles) {
+                uint64_t budget = cycles - cpu.getTotalCycles();
+                CPU8080::StopReason reason = cpu.Run(budget < BENCH_RUN_BUDGET ? budget : BENCH_RUN_BUDGET, 0);
+                if (reason == CPU8080::STOP_SYSCALL)
+                    os.handleCall(cpu, 0);
+                else if (reason == CPU8080::STOP_HALT)
+                    return false;
+            }
+            return cpu.getFault() == NULL;
+        }
+
+        // Single step to cycles, which run() reached exactly; the steps taken.
+        uint64_t step(uint64_t cycles) {
+            uint64_t steps = 0;
+            while (cpu.getFault() == NULL && cpu.getTotalCycles() < cycles) {
+                cpu.Emulate8080p(0);
+                steps++;
+                if (cpu.isHalted())
+                    break;
+                // Run reports the interrupt instead, as main always did.
+                if (cpu.isSystemCall() && cpu.interrupt == 0)
+                    os.handleCall(cpu, 0);
+            }
+            return steps;
+        }
+
+        Memory mem;
+        CPU8080 cpu;
+        GTUOS os;
+    };
+
+    double secondsSince(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    bool copyFile(const std::string &from, const std::string &to) {
+        std::ifstream in(from.c_str(), std::ios::in | std::ios::binary);
+        std::ofstream out(to.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!in.is_open() || !out.is_open())
+            return false;
+        out << in.rdbuf();
+        return (bool) out;
+    }
+
+    // The guests of one timed run, with the cycles each stopped after.
+    _result runWorkload(const _workload &work, uint64_t cycles, std::vector<uint64_t> &passes) {
+        _result result = {work.name, 0, 0, 0, 0, 0, 0};
+        std::ofstream output((std::string(work.name) + ".txt").c_str(), std::ios::out | std::ios::trunc);
+        passes.clear();
+        auto start = std::chrono::steady_clock::now();
+        while (result.cycles < cycles) {
+            Guest guest(work, &output);
+            bool running = guest.run(cycles - result.cycles);
+            guest.os.flush();
+            uint64_t ran = guest.cpu.getTotalCycles();
+            passes.push_back(ran);
+            result.cycles += ran;
+            result.pageFaults += guest.mem.getPageFaultCount();
+            result.switches += guest.mem.getContextSwitchCount();
+            result.kernelCycles += guest.cpu.getProcessCycles(0);
+            if (!running && ran == 0) {
+                fprintf(stderr, "error: %s stops at once: %s\n", work.name,
+                        guest.cpu.getFault() != NULL ? guest.cpu.getFault() : "halt");
+                exit(1);
+            }
+        }
+        result.seconds = secondsSince(start);
+        return result;
+    }
+
+    uint64_t countInstructions(const _workload &work, const std::vector<uint64_t> &passes) {
+        std::ofstream output((std::string(work.name) + ".txt").c_str(), std::ios::out | std::ios::trunc);
+        _workload interpreted = work;
+        interpreted.translate = false;
+        uint64_t instructions = 0;
+        for (size_t i = 0; i < passes.size(); i++) {
+            Guest guest(interpreted, &output);
+            instructions += guest.step(passes[i]);
+            if (guest.cpu.getTotalCycles() != passes[i])
+                fprintf(stderr, "warning: %s single steps to cycle %llu, not %llu; its instruction count is off\n",
+                        work.name, (unsigned long long) guest.cpu.getTotalCycles(), (unsigned long long) passes[i]);
+        }
+        return instructions;
+    }
+
+    double mips(const _result &r) {
+        return r.seconds > 0 ? r.instructions / r.seconds / 1e6 : 0.0;
+    }
+
+    void printResult(std::ostream &out, const _result &r) {
+        char line[256];
+        snprintf(line, sizeof(line), "%-16s %10llu %10llu %8.4f %8.2f %8.2f %10.2f %8llu %10.1f\n",
+                 r.name.c_str(), (unsigned long long) r.cycles, (unsigned long long) r.instructions,
+                 r.seconds, mips(r), r.instructions > 0 ? r.seconds * 1e9 / r.instructions : 0.0,
+                 r.instructions > 0 ? r.pageFaults * 1e6 / r.instructions : 0.0,
+                 (unsigned long long) r.switches,
+                 r.switches > 0 ? (double) r.kernelCycles / r.switches : 0.0);
+        out << line;
+    }
+
+    // First line of a results file. Raised when results stop being
+    // comparable with older ones. 2: the kernel workloads no longer make
+    // a system call again when its cycles run the quantum out.
+    const char *RESULT_FORMAT = "# os_bench 2\n";
+
+    const char *RESULT_HEADER =
+        "# name           cycles     instructions seconds mips ns_per_instruction "
+        "faults_per_minstr switches cycles_per_switch\n";
+
+    // Results of an earlier run by name; false if path cannot be read.
+    // current is false if it was written in an older RESULT_FORMAT.
+    bool readResults(const char *path, std::map<std::string, _result> &results, bool &current) {
+        std::ifstream in(path);
+        if (!in.is_open())
+            return false;
+        std::string line;
+        current = std::getline(in, line) && line + "\n" == RESULT_FORMAT;
+        while (std::getline(in, line)) {
+            if (line.empty() || line[0] == '#')
+                continue;
+            std::istringstream fields(line);
+            _result r;
+            double mipsValue, ns, faultRate, switchCycles;
+            if (fields >> r.name >> r.cycles >> r.instructions >> r.seconds >> mipsValue >> ns >> faultRate
+                       >> r.switches >> switchCycles)
+                results[r.name] = r;
+        }
+        return true;
+    }
+
+    bool startsWith(const char *text, const char *prefix, const char **rest) {
+        size_t length = strlen(prefix);
+        if (strncmp(text, prefix, length) != 0) return false;
+        *rest = text + length;
+        return true;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *programs = ".";
+    const char *work = "bench_work";
+    const char *output = NULL;
+    const char *baseline = NULL;
+    const char *only = NULL;
+    uint64_t cycles = BENCH_CYCLES;
+    int repeats = BENCH_REPEATS;
+    double tolerance = BENCH_TOLERANCE;
+    for (int i = 1; i < argc; i++) {
+        const char *value;
+        if (startsWith(argv[i], "--programs=", &value)) programs = value;
+        else if (startsWith(argv[i], "--work=", &value)) work = value;
+        else if (startsWith(argv[i], "--output=", &value)) output = value;
+        else if (startsWith(argv[i], "--baseline=", &value)) baseline = value;
+        else if (startsWith(argv[i], "--only=", &value)) only = value;
+        else if (startsWith(argv[i], "--cycles=", &value)) cycles = strtoull(value, NULL, 10);
+        else if (startsWith(argv[i], "--repeats=", &value)) repeats = atoi(value);
+        else if (startsWith(argv[i], "--tolerance=", &value)) tolerance = atof(value);
+        else {
+            std::cerr << "Usage: os_bench [--programs=dir] [--work=dir] [--output=file] [--baseline=file]\n"
+                         "                [--only=workload] [--cycles=n] [--repeats=n] [--tolerance=percent]\n";
+            return 1;
+        }
+    }
+    if (cycles == 0 || repeats < 1) {
+        std::cerr << "error: cycles and repeats must be positive\n";
+        return 1;
+    }
+
+    // Paths given relative to where we started still work from work.
+    std::string outputPath = output != NULL ? output : "";
+    std::string baselinePath = baseline != NULL ? baseline : "";
+    std::string programDir = programs;
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        if (!outputPath.empty() && outputPath[0] != '/') outputPath = std::string(cwd) + "/" + outputPath;
+        if (!baselinePath.empty() && baselinePath[0] != '/') baselinePath = std::string(cwd) + "/" + baselinePath;
+        if (programDir[0] != '/') programDir = std::string(cwd) + "/" + programDir;
+    }
+    if (mkdir(work, 0777) != 0 && errno != EEXIST) {
+        std::cerr << "error: cannot create " << work << "--\n";
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof(PROGRAMS) / sizeof(PROGRAMS[0]); i++) {
+        if (!copyFile(programDir + "/" + PROGRAMS[i][1], std::string(work) + "/" + PROGRAMS[i][0])) {
+            std::cerr << "error: Couldn't copy " << PROGRAMS[i][1] << " from " << programDir << "--\n";
+            return 1;
+        }
+    }
+    if (chdir(work) != 0) {
+        std::cerr << "error: cannot enter " << work << "--\n";
+        return 1;
+    }
+
+    std::vector<_result> results;
+    std::cout << RESULT_HEADER;
+    for (size_t i = 0; i < sizeof(WORKLOADS) / sizeof(WORKLOADS[0]); i++) {
+        const _workload &workload = WORKLOADS[i];
+        if (only != NULL && strcmp(only, workload.name) != 0)
+            continue;
+        std::vector<uint64_t> passes;
+        _result best = runWorkload(workload, cycles, passes);
+        for (int r = 1; r < repeats; r++) {
+            _result again = runWorkload(workload, cycles, passes);
+            if (again.seconds < best.seconds)
+                best.seconds = again.seconds;
+        }
+        best.instructions = countInstructions(workload, passes);
+        printResult(std::cout, best);
+        results.push_back(best);
+    }
+
+    if (!outputPath.empty()) {
+        std::ofstream file(outputPath.c_str(), std::ios::out | std::ios::trunc);
+        if (!file.is_open()) {
+            std::cerr << "error: Couldn't open " << outputPath << "--\n";
+            return 1;
+        }
+        file << RESULT_FORMAT << RESULT_HEADER;
+        for (size_t i = 0; i < results.size(); i++)
+            printResult(file, results[i]);
+    }
+
+    if (baselinePath.empty())
+        return 0;
+    std::map<std::string, _result> before;
+    bool current;
+    if (!readResults(baselinePath.c_str(), before, current)) {
+        std::cout << "No baseline at " << baselinePath << ", nothing compared\n";
+        return 0;
+    }
+    if (!current) {
+        std::cout << "Baseline at " << baselinePath << " is from an older os_bench, nothing compared; "
+                     "run make bench-baseline again\n";
+        return 0;
+    }
+    int regressions = 0;
+    std::cout << "\n# name           mips_before mips_now change_percent status\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const _result &now = results[i];
+        std::map<std::string, _result>::const_iterator old = before.find(now.name);
+        if (old == before.end()) {
+            std::cout << now.name << " not in the baseline\n";
+            continue;
+        }
+        double was = mips(old->second), is = mips(now);
+        double change = was > 0 ? (is - was) * 100 / was : 0.0;
+        const char *status = "ok";
+        if (change < -tolerance) {
+            status = "REGRESSION";
+            regressions++;
+        } else if (old->second.instructions != now.instructions || old->second.cycles != now.cycles) {
+            // The same cycles now run other instructions: the guest behaves differently.
+            status = "changed";
+        }
+        char line[256];
+        snprintf(line, sizeof(line), "%-16s %11.2f %8.2f %+14.1f %s\n", now.name.c_str(), was, is, change, status);
+        std::cout << line;
+    }
+    return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,140 @@
+#include <cstdlib>
+#include <cstring>
+#include "block_cache.h"
+
+BlockCache::BlockCache(int slots) {
+    this->slots = slots;
+    slotSpace = 0x10000 / slots;
+    blocks = (_basicBlock *) calloc(BLOCK_CACHE_SIZE, sizeof(_basicBlock));
+    memset(pageVersion, 0, sizeof(pageVersion));
+    memset(codeLines, 0, sizeof(codeLines));
+    ops = (_cachedOp **) calloc(slots, sizeof(*ops));
+    opMisses = 0;
+}
+
+BlockCache::~BlockCache() {
+    free(blocks);
+    for (int i = 0; i < slots; i++)
+        free(ops[i]);
+    free(ops);
+}
+
+BlockCache::_basicBlock *BlockCache::lookup(MemoryBase *memory, int slot, uint16_t pc) {
+    _basicBlock *block = &blocks[(pc ^ (slot << 9)) & (BLOCK_CACHE_SIZE - 1)];
+    if (block->valid && block->start == pc && block->slot == slot && !isStale(block))
+        return block;
+    return decode(block, memory, slot, pc);
+}
+
+BlockCache::_basicBlock *BlockCache::decode(_basicBlock *block, MemoryBase *memory, int slot, uint16_t pc) {
+    uint16_t address = pc;
+    block->valid = 1;
+    block->slot = slot;
+    block->start = pc;
+    block->count = 0;
+    block->firstPage = guestAddress(slot, pc) / BLOCK_PAGE_SIZE;
+    block->executions = 0;
+    block->hostCode = NULL;
+    block->hostOps = 0;
+
+    while (block->count < BLOCK_MAX_OPS) {
+        _decodedOp *op = &block->ops[block->count++];
+        op->bytes[0] = memory->at(address);
+        op->length = (uint8_t) instructionLength(op->bytes[0]);
+        for (int i = 1; i < op->length; i++)
+            op->bytes[i] = memory->at((uint16_t) (address + i));
+        for (int i = 0; i < op->length; i++)
+            codeLines[guestAddress(slot, (uint16_t) (address + i)) >> BLOCK_LINE_SHIFT] = 1;
+        block->lastPage = guestAddress(slot, (uint16_t) (address + op->length - 1)) / BLOCK_PAGE_SIZE;
+        address += op->length;
+        if (endsBlock(op->bytes[0]) || address == SYSTEM_CALL_PC || address % BLOCK_PAGE_SIZE == 0)
+            break;
+    }
+    block->firstVersion = pageVersion[block->firstPage];
+    block->lastVersion = pageVersion[block->lastPage];
+    return block;
+}
+
+// An instruction that crosses a page is decoded on every lookup, as only
+// the version of its first page is kept.
+BlockCache::_decodedOp *BlockCache::decodeOp(MemoryBase *memory, int slot, uint16_t pc) {
+    if (ops[slot] == NULL)
+        ops[slot] = (_cachedOp *) calloc(0x10000, sizeof(_cachedOp));
+    opMisses++;
+    _cachedOp *cached = &ops[slot][pc];
+    cached->op.bytes[0] = memory->at(pc);
+    cached->op.length = (uint8_t) instructionLength(cached->op.bytes[0]);
+    for (int i = 1; i < cached->op.length; i++)
+        cached->op.bytes[i] = memory->at((uint16_t) (pc + i));
+    for (int i = 0; i < cached->op.length; i++)
+        codeLines[guestAddress(slot, (uint16_t) (pc + i)) >> BLOCK_LINE_SHIFT] = 1;
+    uint32_t first = guestAddress(slot, pc);
+    uint32_t last = guestAddress(slot, (uint16_t) (pc + cached->op.length - 1));
+    if (last / BLOCK_PAGE_SIZE == first / BLOCK_PAGE_SIZE)
+        cached->version = pageVersion[first / BLOCK_PAGE_SIZE] + 1;
+    else
+        cached->version = 0;
+    return &cached->op;
+}
+
+// A slot smaller than a page shares it with its neighbours, which lose
+// their blocks too.
+void BlockCache::invalidateSlot(int slot) {
+    uint32_t first = (uint32_t) slot * slotSpace;
+    for (uint32_t page = first / BLOCK_PAGE_SIZE; page <= (first + slotSpace - 1) / BLOCK_PAGE_SIZE; page++)
+        pageVersion[page]++;
+}
+
+void BlockCache::flush() {
+    for (int i = 0; i < BLOCK_PAGES; i++)
+        pageVersion[i]++;
+}
+
+void BlockCache::dropTranslations() {
+    for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
+        blocks[i].executions = 0;
+        blocks[i].hostCode = NULL;
+        blocks[i].hostOps = 0;
+    }
+}
+
+int BlockCache::instructionLength(uint8_t opcode) {
+    switch (opcode) {
+        case 0x06: case 0x0e: case 0x16: case 0x1e:     // MVI r,byte
+        case 0x26: case 0x2e: case 0x36: case 0x3e:
+        case 0xc6: case 0xce: case 0xd3: case 0xd6:     // ADI ACI OUT SUI
+        case 0xdb: case 0xde: case 0xe6: case 0xee:     // IN SBI ANI XRI
+        case 0xf6: case 0xfe:                           // ORI CPI
+            return 2;
+        case 0x01: case 0x11: case 0x21: case 0x31:     // LXI rp,word
+        case 0x22: case 0x2a: case 0x32: case 0x3a:     // SHLD LHLD STA LDA
+        case 0xc2: case 0xc3: case 0xca: case 0xd2:     // JMP, Jcc
+        case 0xda: case 0xe2: case 0xea: case 0xf2: case 0xfa:
+        case 0xc4: case 0xcc: case 0xcd: case 0xd4:     // CALL, Ccc
+        case 0xdc: case 0xe4: case 0xec: case 0xf4: case 0xfc:
+            return 3;
+        default:
+            return 1;
+    }
+}
+
+bool BlockCache::endsBlock(uint8_t opcode) {
+    switch (opcode) {
+        case 0x76:                                      // HLT
+        case 0xe9:                                      // PCHL, also switches base
+        case 0xc2: case 0xc3: case 0xca: case 0xd2:     // JMP, Jcc
+        case 0xda: case 0xe2: case 0xea: case 0xf2: case 0xfa:
+        case 0xc4: case 0xcc: case 0xcd: case 0xd4:     // CALL, Ccc
+        case 0xdc: case 0xe4: case 0xec: case 0xf4: case 0xfc:
+        case 0xc0: case 0xc8: case 0xc9: case 0xd0:     // RET, Rcc
+        case 0xd8: case 0xe0: case 0xe8: case 0xf0: case 0xf8:
+        case 0xc7: case 0xcf: case 0xd7: case 0xdf:     // RST n
+        case 0xe7: case 0xef: case 0xf7: case 0xff:
+        case 0x08: case 0x10: case 0x18: case 0x20:     // Unimplemented
+        case 0x28: case 0x30: case 0x38: case 0xcb:
+        case 0xd9: case 0xdd: case 0xed: case 0xfd:
+            return true;
+        default:
+            return false;
+    }
+}
@@ -0,0 +1,111 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <cstdint>
+#include "memory_base.h"
+
+#define BLOCK_MAX_OPS     32
+#define BLOCK_CACHE_SIZE  2048   // Number of cached blocks, power of two
+#define BLOCK_PAGE_SIZE   1024
+#define BLOCK_PAGES       64     // Pages in a 64K guest address space
+#define BLOCK_SLOTS       4      // Default, one per page table in Memory
+#define BLOCK_LINE_SHIFT  6      // Code tracking granularity, 64 bytes
+#define BLOCK_LINES       (0x10000 >> BLOCK_LINE_SHIFT)
+#define SYSTEM_CALL_PC    0x0007
+
+// Cache of pre-decoded straight-line guest code.
+// A block starts at a pc and runs until the first branch, call, return,
+// RST, PCHL or HLT, stops before the system call pc, and holds at most
+// BLOCK_MAX_OPS instructions. Blocks belong to a process slot (the page
+// table picked by the base register) and are dropped as soon as any guest
+// page they were decoded from is written.
+// The 64K guest space is split evenly between the slots, and an address
+// past a slot's share runs into the next slot's, as in Memory. Pages and
+// code lines are therefore tracked by that flat guest address, so a store
+// through one slot drops blocks another slot decoded from the same bytes.
+// Single instructions are cached the same way, per slot in a flat array
+// indexed by pc, for stepping one instruction at a time.
+
+class BlockCache {
+public:
+    typedef struct _decodedOp {
+        uint8_t bytes[3];
+        uint8_t length;
+    } _decodedOp;
+
+    typedef struct _cachedOp {
+        _decodedOp op;
+        uint32_t version;       // pageVersion + 1 when decoded, 0 if not cached
+    } _cachedOp;
+
+    typedef struct _basicBlock {
+        int valid;
+        int slot;
+        uint16_t start;
+        int firstPage;          // Flat guest pages, see guestAddress
+        int lastPage;
+        uint32_t firstVersion;
+        uint32_t lastVersion;
+        int count;
+        _decodedOp ops[BLOCK_MAX_OPS];
+        uint32_t executions;    // Counted only while translation is on
+        void *hostCode;         // BlockTranslator::_hostCode, NULL to interpret
+        int hostOps;            // Leading ops hostCode runs, the rest are interpreted
+    } _basicBlock;
+
+    BlockCache(int slots = BLOCK_SLOTS);
+    ~BlockCache();
+
+    // Cached block for (slot, pc), decoded from memory on a miss.
+    _basicBlock * lookup(MemoryBase *memory, int slot, uint16_t pc);
+
+    // Cached instruction at (slot, pc), decoded from memory on a miss.
+    _decodedOp * lookupOp(MemoryBase *memory, int slot, uint16_t pc) {
+        if (ops[slot] != NULL) {
+            _cachedOp *cached = &ops[slot][pc];
+            if (cached->version != 0 && cached->version == pageVersion[guestAddress(slot, pc) / BLOCK_PAGE_SIZE] + 1)
+                return &cached->op;
+        }
+        return decodeOp(memory, slot, pc);
+    }
+    uint64_t getOpMisses() const { return opMisses; }
+
+    bool isStale(const _basicBlock *block) const {
+        return pageVersion[block->firstPage] != block->firstVersion ||
+               pageVersion[block->lastPage] != block->lastVersion;
+    }
+
+    // Called for every guest store; only writes to decoded code are counted.
+    void noteWrite(int slot, uint16_t address) {
+        uint32_t guest = guestAddress(slot, address);
+        if (codeLines[guest >> BLOCK_LINE_SHIFT])
+            pageVersion[guest / BLOCK_PAGE_SIZE]++;
+    }
+
+    void invalidateSlot(int slot);
+    void flush();
+    // Forget every block's host code, which BlockTranslator is about to reuse.
+    void dropTranslations();
+
+    static int instructionLength(uint8_t opcode);
+    static bool endsBlock(uint8_t opcode);
+
+private:
+    // Where slot's CPU address lands in the flat guest space.
+    uint32_t guestAddress(int slot, uint16_t address) const {
+        return ((uint32_t) slot * slotSpace + address) & 0xffff;
+    }
+
+    _basicBlock * decode(_basicBlock *block, MemoryBase *memory, int slot, uint16_t pc);
+    _decodedOp * decodeOp(MemoryBase *memory, int slot, uint16_t pc);
+
+    _basicBlock * blocks;
+    _cachedOp ** ops;       // 64K entries per slot, allocated on first use
+    uint64_t opMisses;
+    int slots;
+    uint32_t slotSpace;     // 0x10000 / slots
+    uint32_t pageVersion[BLOCK_PAGES];
+    uint8_t codeLines[BLOCK_LINES];
+};
+
+#endif
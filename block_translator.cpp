@@ -0,0 +1,651 @@
+#include <cstring>
+#include <initializer_list>
+#include <vector>
+#include "block_translator.h"
+#if TRANSLATE_X86_64
+#include <sys/mman.h>
+#endif
+
+#define TRANSLATE_OP_CODE     192   // Host code bytes of one instruction at most, exits included
+#define TRANSLATE_BLOCK_CODE  (128 + BLOCK_MAX_OPS * TRANSLATE_OP_CODE)
+
+#if TRANSLATE_X86_64
+
+namespace {
+    // Instructions left to the interpreter: they change the interrupt
+    // state or the base register, or are DAA, XTHL, HLT and the opcodes
+    // the interpreter does not implement.
+    bool isTranslated(uint8_t opcode) {
+        switch (opcode) {
+            case 0x27: case 0x76: case 0xe3: case 0xe9:     // DAA HLT XTHL PCHL
+            case 0xf3: case 0xfb:                           // DI EI
+            case 0xcb: case 0xd9: case 0xdd: case 0xed: case 0xfd:
+                return false;
+            default:
+                if ((opcode & 0xc7) == 0xc7)                // RST n
+                    return false;
+                return (opcode & 0xc7) != 0x00 || opcode == 0x00;
+        }
+    }
+
+    // State8080 fields, as 8-bit displacements off rbx.
+    enum {
+        S_A = offsetof(State8080, a), S_B = offsetof(State8080, b), S_C = offsetof(State8080, c),
+        S_D = offsetof(State8080, d), S_E = offsetof(State8080, e), S_H = offsetof(State8080, h),
+        S_L = offsetof(State8080, l), S_SP = offsetof(State8080, sp), S_PC = offsetof(State8080, pc),
+        S_CC = offsetof(State8080, cc), S_ZR = offsetof(State8080, zsp_result),
+        S_ZP = offsetof(State8080, zsp_pending)
+    };
+
+    // Guest register fields by the 3-bit code in opcodes, M has none.
+    const int REGISTER_FIELD[8] = { S_B, S_C, S_D, S_E, S_H, S_L, -1, S_A };
+    const int M = 6;
+    // High byte of BC, DE and HL; the low byte follows it.
+    const int PAIR_FIELD[3] = { S_B, S_D, S_H };
+    const int PAIR_HL = 2, PAIR_SP = 3;
+
+    // x86 "op al, cl" for ADD ADC SUB SBB ANA XRA ORA CMP; CMP subtracts
+    // and drops the result.
+    const uint8_t ALU_OPCODE[8] = { 0x00, 0x10, 0x28, 0x18, 0x20, 0x30, 0x08, 0x28 };
+
+    // x86 condition codes, JUMP for an unconditional jump.
+    enum { JUMP = -1, X86_E = 0x4, X86_NE = 0x5, X86_A = 0x7, X86_S = 0x8, X86_P = 0xa };
+    // 32-bit general registers, by their x86 number.
+    enum { EAX = 0, ECX = 1, EDX = 2, ESI = 6 };
+
+    class Emitter {
+    public:
+        Emitter(uint8_t *at) : p(at) {}
+        void put(std::initializer_list<int> bytes) {
+            for (int byte : bytes)
+                *p++ = (uint8_t) byte;
+        }
+        void put16(uint16_t value) { memcpy(p, &value, 2); p += 2; }
+        void put32(uint32_t value) { memcpy(p, &value, 4); p += 4; }
+        void put64(uint64_t value) { memcpy(p, &value, 8); p += 8; }
+        uint8_t *here() const { return p; }
+
+        // Jump, forward to a target patched in later. Returns what to patch.
+        uint8_t *jump(int condition) {
+            if (condition == JUMP)
+                put({0xe9});
+            else
+                put({0x0f, 0x80 | condition});
+            uint8_t *displacement = p;
+            put32(0);
+            return displacement;
+        }
+        uint8_t *shortJump(int condition) {
+            put({condition == JUMP ? 0xeb : 0x70 | condition, 0});
+            return p - 1;
+        }
+        static void patch(uint8_t *displacement, const uint8_t *target) {
+            int32_t offset = (int32_t) (target - (displacement + 4));
+            memcpy(displacement, &offset, 4);
+        }
+        static void patchShort(uint8_t *displacement, const uint8_t *target) {
+            *displacement = (uint8_t) (int8_t) (target - (displacement + 1));
+        }
+
+    private:
+        uint8_t *p;
+    };
+
+    // Host code of one block. Register use:
+    //   rbx state, r14 cpu, r12d scheduler timer, r13d quantum,
+    //   r15d non-zero once a store made the block stale,
+    //   ebp kept across memory calls, eax ecx edx esi edi scratch.
+    // Memory calls take the address in esi and the value in edx.
+    class Translation {
+    public:
+        Translation(uint8_t *code, const BlockTranslator::_memoryCalls &calls)
+            : out(code), calls(calls), zsp(ZSP_UNKNOWN), stores(false) {}
+
+        // Returns the end of the code; ops is set to the instructions in it.
+        uint8_t *run(const BlockCache::_basicBlock *block, int &ops);
+
+    private:
+        // What the translator knows about the lazy Z, S and P flags here.
+        enum ZspState {
+            ZSP_UNKNOWN,    // As the interpreter left them on entry
+            ZSP_SYNCED,     // zsp_pending is clear
+            ZSP_PENDING     // zsp_pending is set and zsp_result has them
+        };
+        typedef struct _exit {
+            uint8_t *displacement;
+            uint16_t pc;
+        } _exit;
+
+        bool emitOp(const BlockCache::_decodedOp &op, uint16_t next);
+        void branch(uint8_t opcode, uint16_t target, uint16_t next);
+        void alu(int operation, int source, uint8_t immediate);
+
+        void loadPair(int reg, int pair);
+        void callMemory(const void *function);
+        void load() { callMemory((const void *) calls.load); }
+        void store();
+        void storeStack(int below, int field, uint8_t value);
+        void push(int highField, int lowField, uint16_t value);
+        void pop(int lowField, int highField);
+        void ret();
+        void setZSP();
+        void carryFromHost();
+        void carryFromDL();
+        void carryToHost();
+        void syncFlags();
+        int condition(int code);
+        void setPC(uint16_t pc) { out.put({0x66, 0xc7, 0x43, S_PC}); out.put16(pc); }
+        void addCycles(unsigned cycles);
+        void toEpilogue() { epilogueJumps.push_back(out.jump(JUMP)); }
+
+        Emitter out;
+        const BlockTranslator::_memoryCalls &calls;
+        ZspState zsp;
+        bool stores;                // The instruction being emitted stores
+        std::vector<_exit> exits;
+        std::vector<uint8_t *> epilogueJumps;
+    };
+
+    uint8_t *Translation::run(const BlockCache::_basicBlock *block, int &ops) {
+        out.put({0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57});  // push rbx rbp r12-r15
+        out.put({0x48, 0x83, 0xec, 0x08});      // sub rsp, 8
+        out.put({0x48, 0x89, 0xfb});            // mov rbx, rdi
+        out.put({0x49, 0x89, 0xf6});            // mov r14, rsi
+        out.put({0x41, 0x89, 0xd4});            // mov r12d, edx
+        out.put({0x41, 0x89, 0xcd});            // mov r13d, ecx
+        out.put({0x45, 0x31, 0xff});            // xor r15d, r15d
+
+        uint16_t pc = block->start;
+        for (ops = 0; ops < block->count && isTranslated(block->ops[ops].bytes[0]); ops++) {
+            const BlockCache::_decodedOp &op = block->ops[ops];
+            uint16_t next = (uint16_t) (pc + op.length);
+            stores = false;
+            if (emitOp(op, next)) {
+                ops++;
+                break;                          // A branch, always the last one
+            }
+            addCycles(TIMING_TABLE[op.bytes[0]].base_cycles);
+            if (ops + 1 == block->count || !isTranslated(block->ops[ops + 1].bytes[0])) {
+                ops++;
+                setPC(next);
+                toEpilogue();
+                break;
+            }
+            // Leave where the interpreter's block loop would: quantum used
+            // up, then a store to this block's code.
+            out.put({0x45, 0x39, 0xec});        // cmp r12d, r13d
+            _exit quantum = { out.jump(X86_A), next };
+            exits.push_back(quantum);
+            if (stores) {
+                out.put({0x45, 0x85, 0xff});    // test r15d, r15d
+                _exit stale = { out.jump(X86_NE), next };
+                exits.push_back(stale);
+            }
+            pc = next;
+        }
+
+        for (size_t i = 0; i < exits.size(); i++) {
+            Emitter::patch(exits[i].displacement, out.here());
+            setPC(exits[i].pc);
+            toEpilogue();
+        }
+        for (size_t i = 0; i < epilogueJumps.size(); i++)
+            Emitter::patch(epilogueJumps[i], out.here());
+        out.put({0x44, 0x89, 0xe0});            // mov eax, r12d
+        out.put({0x48, 0x83, 0xc4, 0x08});      // add rsp, 8
+        out.put({0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b});  // pop r15-r12 rbp rbx
+        out.put({0xc3});                        // ret
+        return out.here();
+    }
+
+    // Emits op, the interpreter's Execute8080Op case for it.
+    // @return true for a branch, which set pc, its cycles and left.
+    bool Translation::emitOp(const BlockCache::_decodedOp &op, uint16_t next) {
+        uint8_t opcode = op.bytes[0];
+        uint16_t word = (uint16_t) (op.bytes[1] | (op.bytes[2] << 8));
+        int code = (opcode >> 3) & 7;
+        int pair = (opcode >> 4) & 3;
+
+        if (opcode >= 0x40 && opcode < 0x80) {  // MOV
+            int source = opcode & 7;
+            if (source == M) {
+                loadPair(ESI, PAIR_HL);
+                load();
+                out.put({0x88, 0x43, REGISTER_FIELD[code]});    // mov [dst], al
+            } else if (code == M) {
+                loadPair(ESI, PAIR_HL);
+                out.put({0x0f, 0xb6, 0x53, REGISTER_FIELD[source]});    // movzx edx, [src]
+                store();
+            } else if (code != source) {
+                out.put({0x8a, 0x43, REGISTER_FIELD[source]});  // mov al, [src]
+                out.put({0x88, 0x43, REGISTER_FIELD[code]});    // mov [dst], al
+            }
+            return false;
+        }
+        if (opcode >= 0x80 && opcode < 0xc0) {
+            alu(code, opcode & 7, 0);
+            return false;
+        }
+        switch (opcode & 0xc7) {
+            case 0xc6:                          // ADI ACI SUI SBI ANI XRI ORI CPI
+                alu(code, -1, op.bytes[1]);
+                return false;
+            case 0x04:                          // INR
+            case 0x05:                          // DCR
+            {
+                int step = (opcode & 1) ? 0xc8 : 0xc0;  // dec al, inc al
+                if (code == M) {
+                    loadPair(ESI, PAIR_HL);
+                    load();
+                    out.put({0xfe, step});
+                    setZSP();
+                    out.put({0x89, 0xc2});      // mov edx, eax
+                    loadPair(ESI, PAIR_HL);
+                    store();
+                } else {
+                    out.put({0x8a, 0x43, REGISTER_FIELD[code]});
+                    out.put({0xfe, step});
+                    out.put({0x88, 0x43, REGISTER_FIELD[code]});
+                    setZSP();
+                }
+                return false;
+            }
+            case 0x06:                          // MVI
+                if (code == M) {
+                    loadPair(ESI, PAIR_HL);
+                    out.put({0xba});            // mov edx, byte
+                    out.put32(op.bytes[1]);
+                    store();
+                } else
+                    out.put({0xc6, 0x43, REGISTER_FIELD[code], op.bytes[1]});
+                return false;
+            case 0xc2:                          // Jcc
+            case 0xc4:                          // Ccc
+            case 0xc0:                          // Rcc
+                branch(opcode, word, next);
+                return true;
+        }
+        switch (opcode & 0xcf) {
+            case 0x01:                          // LXI
+                if (pair == PAIR_SP) {
+                    out.put({0x66, 0xc7, 0x43, S_SP});
+                    out.put16(word);
+                } else {
+                    out.put({0x66, 0xc7, 0x43, PAIR_FIELD[pair]});
+                    out.put16((uint16_t) (op.bytes[2] | (op.bytes[1] << 8)));
+                }
+                return false;
+            case 0x03:                          // INX
+                if (pair == PAIR_SP)
+                    out.put({0x66, 0xff, 0x43, S_SP});  // inc word [sp]
+                else {
+                    out.put({0x80, 0x43, PAIR_FIELD[pair] + 1, 0x01});  // add [low], 1
+                    out.put({0x80, 0x53, PAIR_FIELD[pair], 0x00});      // adc [high], 0
+                }
+                return false;
+            case 0x0b:                          // DCX
+                if (pair == PAIR_SP)
+                    out.put({0x66, 0xff, 0x4b, S_SP});  // dec word [sp]
+                else {
+                    out.put({0x80, 0x6b, PAIR_FIELD[pair] + 1, 0x01});  // sub [low], 1
+                    out.put({0x80, 0x5b, PAIR_FIELD[pair], 0x00});      // sbb [high], 0
+                }
+                return false;
+            case 0x09:                          // DAD
+                loadPair(EAX, PAIR_HL);
+                loadPair(ECX, pair);
+                out.put({0x66, 0x01, 0xc8});    // add ax, cx
+                out.put({0x0f, 0x92, 0xc2});    // setc dl
+                out.put({0x66, 0xc1, 0xc0, 0x08});  // rol ax, 8
+                out.put({0x66, 0x89, 0x43, S_H});
+                carryFromDL();
+                return false;
+            case 0xc5:                          // PUSH
+                if (pair == PAIR_SP) {
+                    syncFlags();
+                    push(S_A, S_CC, 0);
+                } else
+                    push(PAIR_FIELD[pair], PAIR_FIELD[pair] + 1, 0);
+                return false;
+            case 0xc1:                          // POP
+                if (pair == PAIR_SP) {
+                    // The flags are replaced whole, so syncing them first
+                    // comes down to dropping the pending result.
+                    out.put({0xc6, 0x43, S_ZP, 0x00});
+                    zsp = ZSP_SYNCED;
+                    pop(S_CC, S_A);
+                } else
+                    pop(PAIR_FIELD[pair] + 1, PAIR_FIELD[pair]);
+                return false;
+        }
+        switch (opcode) {
+            case 0x02:                          // STAX B
+            case 0x12:                          // STAX D
+                loadPair(ESI, pair);
+                out.put({0x0f, 0xb6, 0x53, S_A});
+                store();
+                return false;
+            case 0x0a:                          // LDAX B
+            case 0x1a:                          // LDAX D
+                loadPair(ESI, pair);
+                load();
+                out.put({0x88, 0x43, S_A});
+                return false;
+            case 0x22:                          // SHLD
+                out.put({0xbe});
+                out.put32(word);
+                out.put({0x0f, 0xb6, 0x53, S_L});
+                store();
+                out.put({0xbe});
+                out.put32((uint16_t) (word + 1));
+                out.put({0x0f, 0xb6, 0x53, S_H});
+                store();
+                return false;
+            case 0x2a:                          // LHLD, offset + 1 is not wrapped
+                out.put({0xbe});
+                out.put32(word);
+                load();
+                out.put({0x88, 0x43, S_L});
+                out.put({0xbe});
+                out.put32((uint32_t) word + 1);
+                load();
+                out.put({0x88, 0x43, S_H});
+                return false;
+            case 0x32:                          // STA
+                out.put({0xbe});
+                out.put32(word);
+                out.put({0x0f, 0xb6, 0x53, S_A});
+                store();
+                return false;
+            case 0x3a:                          // LDA
+                out.put({0xbe});
+                out.put32(word);
+                load();
+                out.put({0x88, 0x43, S_A});
+                return false;
+            case 0x07:                          // RLC
+                out.put({0xd0, 0x43, S_A});     // rol byte [a], 1
+                carryFromHost();
+                return false;
+            case 0x0f:                          // RRC
+                out.put({0xd0, 0x4b, S_A});     // ror byte [a], 1
+                carryFromHost();
+                return false;
+            case 0x17:                          // RAL
+                carryToHost();
+                out.put({0xd0, 0x53, S_A});     // rcl byte [a], 1
+                carryFromHost();
+                return false;
+            case 0x1f:                          // RAR
+                carryToHost();
+                out.put({0xd0, 0x5b, S_A});     // rcr byte [a], 1
+                carryFromHost();
+                return false;
+            case 0x2f:                          // CMA
+                out.put({0xf6, 0x53, S_A});     // not byte [a]
+                return false;
+            case 0x37:                          // STC
+                out.put({0x80, 0x4b, S_CC, 0x01});
+                return false;
+            case 0x3f:                          // CMC, which clears cy here
+                out.put({0x80, 0x63, S_CC, 0xfe});
+                return false;
+            case 0xeb:                          // XCHG
+                out.put({0x66, 0x8b, 0x43, S_D});
+                out.put({0x66, 0x8b, 0x4b, S_H});
+                out.put({0x66, 0x89, 0x4b, S_D});
+                out.put({0x66, 0x89, 0x43, S_H});
+                return false;
+            case 0xf9:                          // SPHL
+                loadPair(EAX, PAIR_HL);
+                out.put({0x66, 0x89, 0x43, S_SP});
+                return false;
+            case 0xc3:                          // JMP
+            case 0xcd:                          // CALL
+            case 0xc9:                          // RET
+                branch(opcode, word, next);
+                return true;
+            default:                            // NOP, IN, OUT
+                return false;
+        }
+    }
+
+    // A jump, call or return, and its cycles; then leaves.
+    void Translation::branch(uint8_t opcode, uint16_t target, uint16_t next) {
+        bool conditional = (opcode & 0x01) == 0;    // Not JMP, CALL or RET
+        int kind = conditional ? opcode & 0x06 : (opcode == 0xc9 ? 0 : opcode == 0xc3 ? 2 : 4);  // RET, JMP, CALL
+        unsigned cycles = TIMING_TABLE[opcode].base_cycles;
+
+        uint8_t *notTaken = NULL;
+        if (conditional)
+            notTaken = out.jump(condition((opcode >> 3) & 7) ^ 1);
+        if (kind == 0)
+            ret();
+        else {
+            if (kind == 4)
+                push(-1, -1, next);
+            setPC(target);
+        }
+        addCycles(conditional && kind != 2 ? cycles + TIMING_TABLE[opcode].condition_cycles : cycles);
+        toEpilogue();
+        if (conditional) {
+            Emitter::patch(notTaken, out.here());
+            setPC(next);
+            addCycles(cycles);
+            toEpilogue();
+        }
+    }
+
+    // A op source, source -1 for immediate. Flags as ArithFlagsA and
+    // LogicFlagsA; XRI and ORI leave ac alone.
+    void Translation::alu(int operation, int source, uint8_t immediate) {
+        if (source == M) {
+            loadPair(ESI, PAIR_HL);
+            load();
+            out.put({0x89, 0xc1});              // mov ecx, eax
+        }
+        out.put({0x8a, 0x43, S_A});             // mov al, [a]
+        if (source < 0)
+            out.put({0xb1, immediate});         // mov cl, byte
+        else if (source != M)
+            out.put({0x8a, 0x4b, REGISTER_FIELD[source]});
+        if (operation == 1 || operation == 3)   // ADC SBB
+            carryToHost();
+        out.put({ALU_OPCODE[operation], 0xc8});
+        if (operation < 4 || operation == 7)
+            carryFromHost();
+        else if (source < 0 && operation != 4)
+            out.put({0x80, 0x63, S_CC, 0xfe});  // cy = 0
+        else
+            out.put({0x80, 0x63, S_CC, 0xee});  // cy = ac = 0
+        if (operation != 7)
+            out.put({0x88, 0x43, S_A});
+        setZSP();
+    }
+
+    // reg = pair as a 16-bit value.
+    void Translation::loadPair(int reg, int pair) {
+        if (pair == PAIR_SP) {
+            out.put({0x0f, 0xb7, 0x43 | (reg << 3), S_SP});    // movzx reg, word [sp]
+            return;
+        }
+        out.put({0x0f, 0xb7, 0x43 | (reg << 3), PAIR_FIELD[pair]});
+        out.put({0x66, 0xc1, 0xc0 | reg, 0x08});    // rol reg16, 8
+    }
+
+    void Translation::callMemory(const void *function) {
+        out.put({0x4c, 0x89, 0xf7});            // mov rdi, r14
+        out.put({0x48, 0xb8});                  // mov rax, function
+        out.put64((uint64_t) function);
+        out.put({0xff, 0xd0});                  // call rax
+    }
+
+    void Translation::store() {
+        callMemory((const void *) calls.store);
+        out.put({0x41, 0x09, 0xc7});            // or r15d, eax
+        stores = true;
+    }
+
+    // Byte below sp = field, or value without a field.
+    void Translation::storeStack(int below, int field, uint8_t value) {
+        out.put({0x0f, 0xb7, 0x73, S_SP});      // movzx esi, word [sp]
+        out.put({0x83, 0xee, below});           // sub esi, below
+        if (field >= 0)
+            out.put({0x0f, 0xb6, 0x53, field});
+        else {
+            out.put({0xba});
+            out.put32(value);
+        }
+        store();
+    }
+
+    void Translation::push(int highField, int lowField, uint16_t value) {
+        storeStack(1, highField, (uint8_t) (value >> 8));
+        storeStack(2, lowField, (uint8_t) value);
+        out.put({0x66, 0x83, 0x6b, S_SP, 0x02});    // sub word [sp], 2
+    }
+
+    void Translation::pop(int lowField, int highField) {
+        out.put({0x0f, 0xb7, 0x73, S_SP});
+        load();
+        out.put({0x88, 0x43, lowField});
+        out.put({0x0f, 0xb7, 0x73, S_SP});
+        out.put({0xff, 0xc6});                  // inc esi, sp + 1 is not wrapped
+        load();
+        out.put({0x88, 0x43, highField});
+        out.put({0x66, 0x83, 0x43, S_SP, 0x02});    // add word [sp], 2
+    }
+
+    void Translation::ret() {
+        out.put({0x0f, 0xb7, 0x73, S_SP});
+        load();
+        out.put({0x89, 0xc5});                  // mov ebp, eax
+        out.put({0x0f, 0xb7, 0x73, S_SP});
+        out.put({0xff, 0xc6});
+        load();
+        out.put({0xc1, 0xe0, 0x08});            // shl eax, 8
+        out.put({0x09, 0xe8});                  // or eax, ebp
+        out.put({0x66, 0x89, 0x43, S_PC});
+        out.put({0x66, 0x83, 0x43, S_SP, 0x02});
+    }
+
+    // FlagsZSP of al.
+    void Translation::setZSP() {
+        out.put({0x88, 0x43, S_ZR});
+        out.put({0xc6, 0x43, S_ZP, 0x01});
+        zsp = ZSP_PENDING;
+    }
+
+    void Translation::carryFromHost() {
+        out.put({0x0f, 0x92, 0xc2});            // setc dl
+        carryFromDL();
+    }
+
+    void Translation::carryFromDL() {
+        out.put({0x80, 0x63, S_CC, 0xfe});      // and byte [cc], ~cy
+        out.put({0x08, 0x53, S_CC});            // or [cc], dl
+    }
+
+    void Translation::carryToHost() {
+        out.put({0x8a, 0x53, S_CC});            // mov dl, [cc]
+        out.put({0xd0, 0xea});                  // shr dl, 1
+    }
+
+    // SyncFlags. LAHF puts x86 SF, ZF and PF where cc keeps S, Z and P.
+    void Translation::syncFlags() {
+        if (zsp == ZSP_SYNCED)
+            return;
+        uint8_t *skip = NULL;
+        if (zsp == ZSP_UNKNOWN) {
+            out.put({0x80, 0x7b, S_ZP, 0x00});  // cmp byte [pending], 0
+            skip = out.shortJump(X86_E);
+        }
+        out.put({0x8a, 0x43, S_ZR});            // mov al, [result]
+        out.put({0x84, 0xc0});                  // test al, al
+        out.put({0x9f});                        // lahf
+        out.put({0x80, 0xe4, 0xc4});            // and ah, S Z P
+        out.put({0x8a, 0x43, S_CC});
+        out.put({0x24, 0x3b});                  // and al, ~(S Z P)
+        out.put({0x08, 0xe0});                  // or al, ah
+        out.put({0x88, 0x43, S_CC});
+        out.put({0xc6, 0x43, S_ZP, 0x00});
+        if (skip != NULL)
+            Emitter::patchShort(skip, out.here());
+        zsp = ZSP_SYNCED;
+    }
+
+    // Sets host flags for the 8080 condition code (NZ Z NC C PO PE P M).
+    // @return x86 condition that holds when it does.
+    int Translation::condition(int code) {
+        static const uint8_t FLAG_MASK[4] = { 0x40, 0x01, 0x04, 0x80 };    // Z CY P S
+        static const int HOST_CONDITION[4] = { X86_E, 0, X86_P, X86_S };
+        int flag = code >> 1;
+        bool set = code & 1;
+        if (flag != 1 && zsp == ZSP_PENDING) {
+            // Still pending: the result byte itself has x86 ZF, SF and PF.
+            out.put({0x80, 0x7b, S_ZR, 0x00});  // cmp byte [result], 0
+            return set ? HOST_CONDITION[flag] : HOST_CONDITION[flag] ^ 1;
+        }
+        if (flag != 1)
+            syncFlags();
+        out.put({0xf6, 0x43, S_CC, FLAG_MASK[flag]});  // test byte [cc], mask
+        return set ? X86_NE : X86_E;
+    }
+
+    void Translation::addCycles(unsigned cycles) {
+        if (cycles < 0x80)
+            out.put({0x41, 0x83, 0xc4, (int) cycles});  // add r12d, cycles
+        else {
+            out.put({0x41, 0x81, 0xc4});
+            out.put32(cycles);
+        }
+    }
+}
+
+BlockTranslator::BlockTranslator() : codeUsed(0), translatedBlocks(0), codeFlushes(0) {
+    void *area = mmap(NULL, TRANSLATE_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    code = (area == MAP_FAILED) ? NULL : (uint8_t *) area;
+}
+
+BlockTranslator::~BlockTranslator() {
+    if (code != NULL)
+        munmap(code, TRANSLATE_CODE_SIZE);
+}
+
+bool BlockTranslator::isAvailable() {
+    return true;
+}
+
+bool BlockTranslator::translate(BlockCache &cache, BlockCache::_basicBlock *block, const _memoryCalls &calls) {
+    if (code == NULL || block->count == 0 || !isTranslated(block->ops[0].bytes[0]))
+        return false;
+    if (TRANSLATE_CODE_SIZE - codeUsed < TRANSLATE_BLOCK_CODE) {
+        cache.dropTranslations();
+        codeUsed = 0;
+        codeFlushes++;
+    }
+    uint8_t *start = code + codeUsed;
+    Translation translation(start, calls);
+    uint8_t *end = translation.run(block, block->hostOps);
+    codeUsed = ((size_t) (end - code) + 15) & ~(size_t) 15;
+    block->hostCode = (void *) start;
+    translatedBlocks++;
+    return true;
+}
+
+#else
+
+BlockTranslator::BlockTranslator() : code(NULL), codeUsed(0), translatedBlocks(0), codeFlushes(0) {}
+
+BlockTranslator::~BlockTranslator() {}
+
+bool BlockTranslator::isAvailable() {
+    return false;
+}
+
+bool BlockTranslator::translate(BlockCache &, BlockCache::_basicBlock *, const _memoryCalls &) {
+    return false;
+}
+
+#endif
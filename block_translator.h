@@ -0,0 +1,77 @@
+#ifndef BLOCK_TRANSLATOR_H
+#define BLOCK_TRANSLATOR_H
+
+#include <cstdint>
+#include <cstddef>
+#include "emulator_base.h"
+#include "block_cache.h"
+
+#define TRANSLATE_THRESHOLD   32          // Executions before a block is translated
+#define TRANSLATE_CODE_SIZE   (4 << 20)   // Bytes of host code, all dropped when full
+
+// Hosts with a backend: x86-64 with the System V calling convention.
+#if defined(__x86_64__) && !defined(_WIN32)
+#define TRANSLATE_X86_64 1
+#else
+#define TRANSLATE_X86_64 0
+#endif
+
+// Second tier behind BlockCache: hot blocks become x86-64 host code.
+// A block is translated from its first instruction up to the end, or up
+// to the first one the translator does not handle: EI, DI, DAA, XTHL,
+// PCHL, RST, HLT and the unimplemented opcodes; CPU8080 interprets the
+// rest of the block. Host code also returns as soon as the block writes
+// its own code or the quantum runs out, after the same instruction the
+// interpreter would stop after. The guest registers stay in State8080,
+// one base register away, and every guest load and store calls back into
+// the CPU's memory model so faults, logs and code invalidation happen
+// exactly as before.
+//
+// CPU8080 enters host code only at TRACE_NONE, which is what lets each
+// instruction's timer update and quantum check compile down to an add and
+// a compare; with interrupts off it passes a quantum that never runs out.
+// Other hosts have no backend; the CPU interprets as usual.
+
+class BlockTranslator {
+public:
+    /**
+     * Host code of one block, run from its first instruction.
+     * @param timer scheduler_timer on entry.
+     * @return scheduler_timer after the last instruction run; past quantum
+     *         when the quantum ran out, which the caller has to act on.
+     */
+    typedef uint32_t (*_hostCode)(State8080 *state, CPU8080 *cpu, uint32_t timer, uint32_t quantum);
+
+    // The CPU's memory model, as called from host code.
+    typedef struct _memoryCalls {
+        uint32_t (*load)(CPU8080 *cpu, uint32_t address);
+        // Non-zero once the running block is stale.
+        uint32_t (*store)(CPU8080 *cpu, uint32_t address, uint32_t value);
+    } _memoryCalls;
+
+    BlockTranslator();
+    ~BlockTranslator();
+
+    // Whether this build has a backend for the host.
+    static bool isAvailable();
+
+    // Fill in block's hostCode and hostOps, with calls baked into the code.
+    // false if its first instruction is not handled. When the code area is
+    // full everything in it is dropped first, through cache.dropTranslations().
+    bool translate(BlockCache &cache, BlockCache::_basicBlock *block, const _memoryCalls &calls);
+
+    uint64_t getTranslatedBlocks() const { return translatedBlocks; }
+    uint64_t getCodeFlushes() const { return codeFlushes; }
+    size_t getCodeUsed() const { return codeUsed; }
+
+private:
+    BlockTranslator(const BlockTranslator &);
+    void operator=(const BlockTranslator &);
+
+    uint8_t *code;          // TRANSLATE_CODE_SIZE bytes, NULL if unavailable
+    size_t codeUsed;
+    uint64_t translatedBlocks;
+    uint64_t codeFlushes;
+};
+
+#endif
@@ -0,0 +1,170 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include "console_io.h"
+
+namespace {
+    // Guests such as an unimplemented instruction leave through exit(), so
+    // buffered output is written from an atexit hook too.
+    std::mutex openConsolesLock;
+    std::vector<ConsoleIO *> openConsoles;
+
+    void flushOpenConsoles() {
+        std::lock_guard<std::mutex> guard(openConsolesLock);
+        for (size_t i = 0; i < openConsoles.size(); i++)
+            openConsoles[i]->flush();
+    }
+
+    bool isSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+}
+
+ConsoleIO::ConsoleIO(std::ostream *sink)
+    : sink(sink), used(0), lastFlush(std::chrono::steady_clock::now()),
+      source(NULL), inputPos(0), afterNumber(false) {
+    buffer = (char *) malloc(CONSOLE_BUFFER_SIZE);
+
+    std::lock_guard<std::mutex> guard(openConsolesLock);
+    static bool hooked = false;
+    if (!hooked) {
+        std::atexit(flushOpenConsoles);
+        hooked = true;
+    }
+    openConsoles.push_back(this);
+}
+
+ConsoleIO::~ConsoleIO() {
+    {
+        std::lock_guard<std::mutex> guard(openConsolesLock);
+        openConsoles.erase(std::remove(openConsoles.begin(), openConsoles.end(), this), openConsoles.end());
+    }
+    flush();
+    free(buffer);
+}
+
+void ConsoleIO::setInput(std::istream *in) {
+    source = in;
+}
+
+bool ConsoleIO::preload(const char *path) {
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    if (!file.is_open())
+        return false;
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    input = contents.str();
+    inputPos = 0;
+    source = NULL;
+    return true;
+}
+
+void ConsoleIO::write(const void *data, size_t length) {
+    const char *bytes = (const char *) data;
+    while (length > 0) {
+        if (used == CONSOLE_BUFFER_SIZE) flush();
+        size_t count = std::min(length, (size_t) CONSOLE_BUFFER_SIZE - used);
+        memcpy(buffer + used, bytes, count);
+        used += count;
+        bytes += count;
+        length -= count;
+    }
+}
+
+void ConsoleIO::write(const char *text) {
+    write(text, strlen(text));
+}
+
+void ConsoleIO::putNumber(int value) {
+    char digits[16];
+    int length = snprintf(digits, sizeof(digits), "%d", value);
+    write(digits, (size_t) length);
+}
+
+void ConsoleIO::flush() {
+    lastFlush = std::chrono::steady_clock::now();
+    if (used == 0)
+        return;
+    sink->write(buffer, (std::streamsize) used);
+    sink->flush();
+    used = 0;
+}
+
+void ConsoleIO::flushIfDue() {
+    if (used == 0)
+        return;
+    if (std::chrono::steady_clock::now() - lastFlush >= std::chrono::milliseconds(CONSOLE_FLUSH_MS))
+        flush();
+}
+
+// Append the next input line, newline included. false at the end of input.
+bool ConsoleIO::fill() {
+    if (source == NULL)
+        return false;
+    std::string line;
+    if (!std::getline(*source, line))
+        return false;
+    input.erase(0, inputPos);
+    inputPos = 0;
+    input += line;
+    input += '\n';
+    return true;
+}
+
+bool ConsoleIO::readLine(std::string &line) {
+    flush();
+    if (afterNumber) {
+        // What cin.sync() was there for: the newline ending the number.
+        size_t pos = inputPos;
+        while (pos < input.size() && input[pos] != '\n' && isSpace(input[pos]))
+            pos++;
+        if (pos < input.size() && input[pos] == '\n')
+            inputPos = pos + 1;
+        afterNumber = false;
+    }
+    size_t end;
+    while ((end = input.find('\n', inputPos)) == std::string::npos) {
+        if (!fill()) {
+            if (inputPos >= input.size())
+                return false;
+            end = input.size();
+            break;
+        }
+    }
+    line.assign(input, inputPos, end - inputPos);
+    if (!line.empty() && line[line.size() - 1] == '\r')
+        line.erase(line.size() - 1);
+    inputPos = std::min(end + 1, input.size());
+    return true;
+}
+
+bool ConsoleIO::readInt(int &value) {
+    flush();
+    afterNumber = false;
+    for (;;) {
+        while (inputPos < input.size() && isSpace(input[inputPos]))
+            inputPos++;
+        if (inputPos < input.size())
+            break;
+        if (!fill())
+            return false;
+    }
+    // Lines always end in a newline once filled, so the number is complete.
+    const char *start = input.c_str() + inputPos;
+    char *end;
+    long number = strtol(start, &end, 10);
+    if (end == start || (*end != '\0' && !isSpace(*end))) {
+        size_t newline = input.find('\n', inputPos);
+        inputPos = (newline == std::string::npos) ? input.size() : newline + 1;
+        return false;
+    }
+    inputPos += (size_t) (end - start);
+    afterNumber = true;
+    value = (int) number;
+    return true;
+}
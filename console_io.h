@@ -0,0 +1,71 @@
+#ifndef CONSOLE_IO_H
+#define CONSOLE_IO_H
+
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <istream>
+#include <ostream>
+#include <string>
+
+#define CONSOLE_BUFFER_SIZE  (64 * 1024)   // Bytes of output held before a write
+#define CONSOLE_FLUSH_MS     50            // Longest a syscall leaves output unwritten
+
+// Console behind the GTUOS system calls.
+// Output is appended to one large buffer and reaches the sink stream in a
+// single write, only at the flush points: a full buffer, any read, flush()
+// (GTUOS calls it on PROCESS_EXIT, after every call while a trace is being
+// printed, and through flushIfDue() at most CONSOLE_FLUSH_MS apart), and
+// destruction or exit().
+// Input is either streamed line by line or loaded from a file up front.
+
+class ConsoleIO {
+public:
+    ConsoleIO(std::ostream *sink);
+    ~ConsoleIO();
+
+    // Read input from in, one line at a time as it is needed.
+    void setInput(std::istream *in);
+    /**
+     * Read all input from path now; the console never waits on it later.
+     * @return false if path cannot be opened, the input is left unchanged.
+     */
+    bool preload(const char *path);
+
+    void write(const void *data, size_t length);
+    void write(const char *text);
+    void put(char c) {
+        if (used == CONSOLE_BUFFER_SIZE) flush();
+        buffer[used++] = c;
+    }
+    void putNumber(int value);
+
+    void flush();
+    // Flush when output has waited CONSOLE_FLUSH_MS or longer.
+    void flushIfDue();
+
+    // Next line without its newline. A number read just before it does not
+    // leave an empty line behind. false at the end of the input.
+    bool readLine(std::string &line);
+    // Next decimal number, skipping white space. On a bad number the rest of
+    // its line is dropped and false returned.
+    bool readInt(int &value);
+
+private:
+    bool fill();
+
+    ConsoleIO(const ConsoleIO &);
+    void operator=(const ConsoleIO &);
+
+    std::ostream *sink;
+    char *buffer;
+    size_t used;
+    std::chrono::steady_clock::time_point lastFlush;
+
+    std::istream *source;       // NULL once the input is preloaded
+    std::string input;          // Input not consumed yet starts at inputPos
+    size_t inputPos;
+    bool afterNumber;
+};
+
+#endif
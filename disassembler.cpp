@@ -0,0 +1,366 @@
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include "disassembler.h"
+
+namespace {
+    const char HEX_DIGITS[] = "0123456789abcdef";
+
+    // Two hex digits of byte at out, ?? if it is past the available bytes.
+    char *byteDigits(char *out, const uint8_t *code, size_t index, size_t available) {
+        if (index < available) {
+            *out++ = HEX_DIGITS[code[index] >> 4];
+            *out++ = HEX_DIGITS[code[index] & 0xf];
+        } else {
+            *out++ = '?';
+            *out++ = '?';
+        }
+        return out;
+    }
+}
+
+constexpr OpcodeFormat OPCODE_FORMATS[256] = {
+    {"NOP",         OPERAND_NONE},  //0x00
+    {"LXI    B,",   OPERAND_WORD},  //0x01
+    {"STAX   B",    OPERAND_NONE},  //0x02
+    {"INX    B",    OPERAND_NONE},  //0x03
+    {"INR    B",    OPERAND_NONE},  //0x04
+    {"DCR    B",    OPERAND_NONE},  //0x05
+    {"MVI    B,",   OPERAND_BYTE},  //0x06
+    {"RLC",         OPERAND_NONE},  //0x07
+    {"NOP",         OPERAND_NONE},  //0x08
+    {"DAD    B",    OPERAND_NONE},  //0x09
+    {"LDAX   B",    OPERAND_NONE},  //0x0a
+    {"DCX    B",    OPERAND_NONE},  //0x0b
+    {"INR    C",    OPERAND_NONE},  //0x0c
+    {"DCR    C",    OPERAND_NONE},  //0x0d
+    {"MVI    C,",   OPERAND_BYTE},  //0x0e
+    {"RRC",         OPERAND_NONE},  //0x0f
+    {"NOP",         OPERAND_NONE},  //0x10
+    {"LXI    D,",   OPERAND_WORD},  //0x11
+    {"STAX   D",    OPERAND_NONE},  //0x12
+    {"INX    D",    OPERAND_NONE},  //0x13
+    {"INR    D",    OPERAND_NONE},  //0x14
+    {"DCR    D",    OPERAND_NONE},  //0x15
+    {"MVI    D,",   OPERAND_BYTE},  //0x16
+    {"RAL",         OPERAND_NONE},  //0x17
+    {"NOP",         OPERAND_NONE},  //0x18
+    {"DAD    D",    OPERAND_NONE},  //0x19
+    {"LDAX   D",    OPERAND_NONE},  //0x1a
+    {"DCX    D",    OPERAND_NONE},  //0x1b
+    {"INR    E",    OPERAND_NONE},  //0x1c
+    {"DCR    E",    OPERAND_NONE},  //0x1d
+    {"MVI    E,",   OPERAND_BYTE},  //0x1e
+    {"RAR",         OPERAND_NONE},  //0x1f
+    {"NOP",         OPERAND_NONE},  //0x20
+    {"LXI    H,",   OPERAND_WORD},  //0x21
+    {"SHLD   ",     OPERAND_ADDRESS},  //0x22
+    {"INX    H",    OPERAND_NONE},  //0x23
+    {"INR    H",    OPERAND_NONE},  //0x24
+    {"DCR    H",    OPERAND_NONE},  //0x25
+    {"MVI    H,",   OPERAND_BYTE},  //0x26
+    {"DAA",         OPERAND_NONE},  //0x27
+    {"NOP",         OPERAND_NONE},  //0x28
+    {"DAD    H",    OPERAND_NONE},  //0x29
+    {"LHLD   ",     OPERAND_ADDRESS},  //0x2a
+    {"DCX    H",    OPERAND_NONE},  //0x2b
+    {"INR    L",    OPERAND_NONE},  //0x2c
+    {"DCR    L",    OPERAND_NONE},  //0x2d
+    {"MVI    L,",   OPERAND_BYTE},  //0x2e
+    {"CMA",         OPERAND_NONE},  //0x2f
+    {"NOP",         OPERAND_NONE},  //0x30
+    {"LXI    SP,",  OPERAND_WORD},  //0x31
+    {"STA    ",     OPERAND_ADDRESS},  //0x32
+    {"INX    SP",   OPERAND_NONE},  //0x33
+    {"INR    M",    OPERAND_NONE},  //0x34
+    {"DCR    M",    OPERAND_NONE},  //0x35
+    {"MVI    M,",   OPERAND_BYTE},  //0x36
+    {"STC",         OPERAND_NONE},  //0x37
+    {"NOP",         OPERAND_NONE},  //0x38
+    {"DAD    SP",   OPERAND_NONE},  //0x39
+    {"LDA    ",     OPERAND_ADDRESS},  //0x3a
+    {"DCX    SP",   OPERAND_NONE},  //0x3b
+    {"INR    A",    OPERAND_NONE},  //0x3c
+    {"DCR    A",    OPERAND_NONE},  //0x3d
+    {"MVI    A,",   OPERAND_BYTE},  //0x3e
+    {"CMC",         OPERAND_NONE},  //0x3f
+    {"MOV    B,B",  OPERAND_NONE},  //0x40
+    {"MOV    B,C",  OPERAND_NONE},  //0x41
+    {"MOV    B,D",  OPERAND_NONE},  //0x42
+    {"MOV    B,E",  OPERAND_NONE},  //0x43
+    {"MOV    B,H",  OPERAND_NONE},  //0x44
+    {"MOV    B,L",  OPERAND_NONE},  //0x45
+    {"MOV    B,M",  OPERAND_NONE},  //0x46
+    {"MOV    B,A",  OPERAND_NONE},  //0x47
+    {"MOV    C,B",  OPERAND_NONE},  //0x48
+    {"MOV    C,C",  OPERAND_NONE},  //0x49
+    {"MOV    C,D",  OPERAND_NONE},  //0x4a
+    {"MOV    C,E",  OPERAND_NONE},  //0x4b
+    {"MOV    C,H",  OPERAND_NONE},  //0x4c
+    {"MOV    C,L",  OPERAND_NONE},  //0x4d
+    {"MOV    C,M",  OPERAND_NONE},  //0x4e
+    {"MOV    C,A",  OPERAND_NONE},  //0x4f
+    {"MOV    D,B",  OPERAND_NONE},  //0x50
+    {"MOV    D,C",  OPERAND_NONE},  //0x51
+    {"MOV    D,D",  OPERAND_NONE},  //0x52
+    {"MOV    D.E",  OPERAND_NONE},  //0x53
+    {"MOV    D,H",  OPERAND_NONE},  //0x54
+    {"MOV    D,L",  OPERAND_NONE},  //0x55
+    {"MOV    D,M",  OPERAND_NONE},  //0x56
+    {"MOV    D,A",  OPERAND_NONE},  //0x57
+    {"MOV    E,B",  OPERAND_NONE},  //0x58
+    {"MOV    E,C",  OPERAND_NONE},  //0x59
+    {"MOV    E,D",  OPERAND_NONE},  //0x5a
+    {"MOV    E,E",  OPERAND_NONE},  //0x5b
+    {"MOV    E,H",  OPERAND_NONE},  //0x5c
+    {"MOV    E,L",  OPERAND_NONE},  //0x5d
+    {"MOV    E,M",  OPERAND_NONE},  //0x5e
+    {"MOV    E,A",  OPERAND_NONE},  //0x5f
+    {"MOV    H,B",  OPERAND_NONE},  //0x60
+    {"MOV    H,C",  OPERAND_NONE},  //0x61
+    {"MOV    H,D",  OPERAND_NONE},  //0x62
+    {"MOV    H.E",  OPERAND_NONE},  //0x63
+    {"MOV    H,H",  OPERAND_NONE},  //0x64
+    {"MOV    H,L",  OPERAND_NONE},  //0x65
+    {"MOV    H,M",  OPERAND_NONE},  //0x66
+    {"MOV    H,A",  OPERAND_NONE},  //0x67
+    {"MOV    L,B",  OPERAND_NONE},  //0x68
+    {"MOV    L,C",  OPERAND_NONE},  //0x69
+    {"MOV    L,D",  OPERAND_NONE},  //0x6a
+    {"MOV    L,E",  OPERAND_NONE},  //0x6b
+    {"MOV    L,H",  OPERAND_NONE},  //0x6c
+    {"MOV    L,L",  OPERAND_NONE},  //0x6d
+    {"MOV    L,M",  OPERAND_NONE},  //0x6e
+    {"MOV    L,A",  OPERAND_NONE},  //0x6f
+    {"MOV    M,B",  OPERAND_NONE},  //0x70
+    {"MOV    M,C",  OPERAND_NONE},  //0x71
+    {"MOV    M,D",  OPERAND_NONE},  //0x72
+    {"MOV    M.E",  OPERAND_NONE},  //0x73
+    {"MOV    M,H",  OPERAND_NONE},  //0x74
+    {"MOV    M,L",  OPERAND_NONE},  //0x75
+    {"HLT",         OPERAND_NONE},  //0x76
+    {"MOV    M,A",  OPERAND_NONE},  //0x77
+    {"MOV    A,B",  OPERAND_NONE},  //0x78
+    {"MOV    A,C",  OPERAND_NONE},  //0x79
+    {"MOV    A,D",  OPERAND_NONE},  //0x7a
+    {"MOV    A,E",  OPERAND_NONE},  //0x7b
+    {"MOV    A,H",  OPERAND_NONE},  //0x7c
+    {"MOV    A,L",  OPERAND_NONE},  //0x7d
+    {"MOV    A,M",  OPERAND_NONE},  //0x7e
+    {"MOV    A,A",  OPERAND_NONE},  //0x7f
+    {"ADD    B",    OPERAND_NONE},  //0x80
+    {"ADD    C",    OPERAND_NONE},  //0x81
+    {"ADD    D",    OPERAND_NONE},  //0x82
+    {"ADD    E",    OPERAND_NONE},  //0x83
+    {"ADD    H",    OPERAND_NONE},  //0x84
+    {"ADD    L",    OPERAND_NONE},  //0x85
+    {"ADD    M",    OPERAND_NONE},  //0x86
+    {"ADD    A",    OPERAND_NONE},  //0x87
+    {"ADC    B",    OPERAND_NONE},  //0x88
+    {"ADC    C",    OPERAND_NONE},  //0x89
+    {"ADC    D",    OPERAND_NONE},  //0x8a
+    {"ADC    E",    OPERAND_NONE},  //0x8b
+    {"ADC    H",    OPERAND_NONE},  //0x8c
+    {"ADC    L",    OPERAND_NONE},  //0x8d
+    {"ADC    M",    OPERAND_NONE},  //0x8e
+    {"ADC    A",    OPERAND_NONE},  //0x8f
+    {"SUB    B",    OPERAND_NONE},  //0x90
+    {"SUB    C",    OPERAND_NONE},  //0x91
+    {"SUB    D",    OPERAND_NONE},  //0x92
+    {"SUB    E",    OPERAND_NONE},  //0x93
+    {"SUB    H",    OPERAND_NONE},  //0x94
+    {"SUB    L",    OPERAND_NONE},  //0x95
+    {"SUB    M",    OPERAND_NONE},  //0x96
+    {"SUB    A",    OPERAND_NONE},  //0x97
+    {"SBB    B",    OPERAND_NONE},  //0x98
+    {"SBB    C",    OPERAND_NONE},  //0x99
+    {"SBB    D",    OPERAND_NONE},  //0x9a
+    {"SBB    E",    OPERAND_NONE},  //0x9b
+    {"SBB    H",    OPERAND_NONE},  //0x9c
+    {"SBB    L",    OPERAND_NONE},  //0x9d
+    {"SBB    M",    OPERAND_NONE},  //0x9e
+    {"SBB    A",    OPERAND_NONE},  //0x9f
+    {"ANA    B",    OPERAND_NONE},  //0xa0
+    {"ANA    C",    OPERAND_NONE},  //0xa1
+    {"ANA    D",    OPERAND_NONE},  //0xa2
+    {"ANA    E",    OPERAND_NONE},  //0xa3
+    {"ANA    H",    OPERAND_NONE},  //0xa4
+    {"ANA    L",    OPERAND_NONE},  //0xa5
+    {"ANA    M",    OPERAND_NONE},  //0xa6
+    {"ANA    A",    OPERAND_NONE},  //0xa7
+    {"XRA    B",    OPERAND_NONE},  //0xa8
+    {"XRA    C",    OPERAND_NONE},  //0xa9
+    {"XRA    D",    OPERAND_NONE},  //0xaa
+    {"XRA    E",    OPERAND_NONE},  //0xab
+    {"XRA    H",    OPERAND_NONE},  //0xac
+    {"XRA    L",    OPERAND_NONE},  //0xad
+    {"XRA    M",    OPERAND_NONE},  //0xae
+    {"XRA    A",    OPERAND_NONE},  //0xaf
+    {"ORA    B",    OPERAND_NONE},  //0xb0
+    {"ORA    C",    OPERAND_NONE},  //0xb1
+    {"ORA    D",    OPERAND_NONE},  //0xb2
+    {"ORA    E",    OPERAND_NONE},  //0xb3
+    {"ORA    H",    OPERAND_NONE},  //0xb4
+    {"ORA    L",    OPERAND_NONE},  //0xb5
+    {"ORA    M",    OPERAND_NONE},  //0xb6
+    {"ORA    A",    OPERAND_NONE},  //0xb7
+    {"CMP    B",    OPERAND_NONE},  //0xb8
+    {"CMP    C",    OPERAND_NONE},  //0xb9
+    {"CMP    D",    OPERAND_NONE},  //0xba
+    {"CMP    E",    OPERAND_NONE},  //0xbb
+    {"CMP    H",    OPERAND_NONE},  //0xbc
+    {"CMP    L",    OPERAND_NONE},  //0xbd
+    {"CMP    M",    OPERAND_NONE},  //0xbe
+    {"CMP    A",    OPERAND_NONE},  //0xbf
+    {"RNZ",         OPERAND_NONE},  //0xc0
+    {"POP    B",    OPERAND_NONE},  //0xc1
+    {"JNZ    ",     OPERAND_ADDRESS},  //0xc2
+    {"JMP    ",     OPERAND_ADDRESS},  //0xc3
+    {"CNZ    ",     OPERAND_ADDRESS},  //0xc4
+    {"PUSH   B",    OPERAND_NONE},  //0xc5
+    {"ADI    ",     OPERAND_BYTE},  //0xc6
+    {"RST    0",    OPERAND_NONE},  //0xc7
+    {"RZ",          OPERAND_NONE},  //0xc8
+    {"RET",         OPERAND_NONE},  //0xc9
+    {"JZ     ",     OPERAND_ADDRESS},  //0xca
+    {"JMP    ",     OPERAND_ADDRESS},  //0xcb
+    {"CZ     ",     OPERAND_ADDRESS},  //0xcc
+    {"CALL   ",     OPERAND_ADDRESS},  //0xcd
+    {"ACI    ",     OPERAND_BYTE},  //0xce
+    {"RST    1",    OPERAND_NONE},  //0xcf
+    {"RNC",         OPERAND_NONE},  //0xd0
+    {"POP    D",    OPERAND_NONE},  //0xd1
+    {"JNC    ",     OPERAND_ADDRESS},  //0xd2
+    {"OUT    ",     OPERAND_BYTE},  //0xd3
+    {"CNC    ",     OPERAND_ADDRESS},  //0xd4
+    {"PUSH   D",    OPERAND_NONE},  //0xd5
+    {"SUI    ",     OPERAND_BYTE},  //0xd6
+    {"RST    2",    OPERAND_NONE},  //0xd7
+    {"RC",          OPERAND_NONE},  //0xd8
+    {"RET",         OPERAND_NONE},  //0xd9
+    {"JC     ",     OPERAND_ADDRESS},  //0xda
+    {"IN     ",     OPERAND_BYTE},  //0xdb
+    {"CC     ",     OPERAND_ADDRESS},  //0xdc
+    {"CALL   ",     OPERAND_ADDRESS},  //0xdd
+    {"SBI    ",     OPERAND_BYTE},  //0xde
+    {"RST    3",    OPERAND_NONE},  //0xdf
+    {"RPO",         OPERAND_NONE},  //0xe0
+    {"POP    H",    OPERAND_NONE},  //0xe1
+    {"JPO    ",     OPERAND_ADDRESS},  //0xe2
+    {"XTHL",        OPERAND_NONE},  //0xe3
+    {"CPO    ",     OPERAND_ADDRESS},  //0xe4
+    {"PUSH   H",    OPERAND_NONE},  //0xe5
+    {"ANI    ",     OPERAND_BYTE},  //0xe6
+    {"RST    4",    OPERAND_NONE},  //0xe7
+    {"RPE",         OPERAND_NONE},  //0xe8
+    {"PCHL",        OPERAND_NONE},  //0xe9
+    {"JPE    ",     OPERAND_ADDRESS},  //0xea
+    {"XCHG",        OPERAND_NONE},  //0xeb
+    {"CPE     ",    OPERAND_ADDRESS},  //0xec
+    {"CALL   ",     OPERAND_ADDRESS},  //0xed
+    {"XRI    ",     OPERAND_BYTE},  //0xee
+    {"RST    5",    OPERAND_NONE},  //0xef
+    {"RP",          OPERAND_NONE},  //0xf0
+    {"POP    PSW",  OPERAND_NONE},  //0xf1
+    {"JP     ",     OPERAND_ADDRESS},  //0xf2
+    {"DI",          OPERAND_NONE},  //0xf3
+    {"CP     ",     OPERAND_ADDRESS},  //0xf4
+    {"PUSH   PSW",  OPERAND_NONE},  //0xf5
+    {"ORI    ",     OPERAND_BYTE},  //0xf6
+    {"RST    6",    OPERAND_NONE},  //0xf7
+    {"RM",          OPERAND_NONE},  //0xf8
+    {"SPHL",        OPERAND_NONE},  //0xf9
+    {"JM     ",     OPERAND_ADDRESS},  //0xfa
+    {"EI",          OPERAND_NONE},  //0xfb
+    {"CM     ",     OPERAND_ADDRESS},  //0xfc
+    {"CALL   ",     OPERAND_ADDRESS},  //0xfd
+    {"CPI    ",     OPERAND_BYTE},  //0xfe
+    {"RST    7",    OPERAND_NONE},  //0xff
+};
+
+int Disassemble8080Op(const uint8_t *code, size_t available, char *buf, size_t size) {
+    const OpcodeFormat &format = OPCODE_FORMATS[available > 0 ? code[0] : 0];
+    char text[DISASSEMBLY_SIZE];
+    size_t length = strlen(format.text);
+    memcpy(text, format.text, length);
+    char *end = text + length;
+    int opbytes = 1;
+    switch (format.operand) {
+        case OPERAND_BYTE:
+            *end++ = '#';
+            *end++ = '$';
+            end = byteDigits(end, code, 1, available);
+            opbytes = 2;
+            break;
+        case OPERAND_WORD:
+            *end++ = '#';
+            // fall through
+        case OPERAND_ADDRESS:
+            *end++ = '$';
+            end = byteDigits(end, code, 2, available);
+            end = byteDigits(end, code, 1, available);
+            opbytes = 3;
+            break;
+    }
+    if (size > 0) {
+        length = std::min((size_t) (end - text), size - 1);
+        memcpy(buf, text, length);
+        buf[length] = '\0';
+    }
+    return opbytes;
+}
+
+TraceSink::TraceSink(FILE *out) : out(out), used(0) {
+    buffer = (char *) malloc(TRACE_SINK_SIZE);
+}
+
+TraceSink::~TraceSink() {
+    flush();
+    free(buffer);
+}
+
+void TraceSink::write(const char *data, size_t length) {
+    while (length > 0) {
+        if (used == TRACE_SINK_SIZE) flush();
+        size_t count = std::min(length, (size_t) TRACE_SINK_SIZE - used);
+        memcpy(buffer + used, data, count);
+        used += count;
+        data += count;
+        length -= count;
+    }
+}
+
+void TraceSink::write(const char *text) {
+    write(text, strlen(text));
+}
+
+void TraceSink::pad(const char *text, size_t width) {
+    size_t length = strlen(text);
+    write(text, length);
+    for (; length < width; length++)
+        put(' ');
+}
+
+void TraceSink::hex(uint32_t value, int digits) {
+    char text[8];
+    for (int i = digits - 1; i >= 0; i--, value >>= 4)
+        text[i] = HEX_DIGITS[value & 0xf];
+    write(text, (size_t) digits);
+}
+
+void TraceSink::decimal(uint32_t value) {
+    char text[10];
+    int start = sizeof(text);
+    do {
+        text[--start] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    write(text + start, sizeof(text) - start);
+}
+
+void TraceSink::flush() {
+    if (used == 0)
+        return;
+    fwrite(buffer, 1, used, out);
+    used = 0;
+}
@@ -0,0 +1,69 @@
+#ifndef DISASSEMBLER_H
+#define DISASSEMBLER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+
+#define DISASSEMBLY_SIZE   20            // Longest mnemonic, LXI SP,word, and its NUL
+#define TRACE_SINK_SIZE    (64 * 1024)   // Bytes of trace held before a write
+
+// How the operand bytes of an opcode are printed after its text.
+enum OperandFormat {
+    OPERAND_NONE,       // One byte instruction
+    OPERAND_BYTE,       // #$nn
+    OPERAND_WORD,       // #$nnnn, an immediate
+    OPERAND_ADDRESS     // $nnnn, a jump, call or memory address
+};
+
+struct OpcodeFormat {
+    const char *text;           // Mnemonic and fixed operands, such as "MVI    B,"
+    uint8_t operand;            // OperandFormat
+};
+
+// Indexed by the opcode byte.
+extern const OpcodeFormat OPCODE_FORMATS[256];
+
+/**
+ * Mnemonic of the instruction at code into buf, at most size bytes with
+ * the NUL; DISASSEMBLY_SIZE are always enough.
+ * @param available Bytes readable at code. Operand bytes past them are
+ *        printed as ?? and never read.
+ * @return Length of the instruction, whatever available is.
+ */
+int Disassemble8080Op(const uint8_t *code, size_t available, char *buf, size_t size);
+
+// Debug trace of the CPU, one line per instruction at TRACE_FULL.
+// Lines are formatted straight into one buffer and written to out in a
+// single fwrite when it is full or on flush(); CPU8080 flushes before it
+// hands control back, so the trace and the guest's console output, which
+// both end up on stdout, stay in order.
+class TraceSink {
+public:
+    TraceSink(FILE *out);
+    ~TraceSink();
+
+    void write(const char *data, size_t length);
+    void write(const char *text);
+    // text, then spaces up to width characters.
+    void pad(const char *text, size_t width);
+    void put(char c) {
+        if (used == TRACE_SINK_SIZE) flush();
+        buffer[used++] = c;
+    }
+    // The low digits hex digits of value, lower case and zero filled.
+    void hex(uint32_t value, int digits);
+    void decimal(uint32_t value);
+
+    void flush();
+
+private:
+    TraceSink(const TraceSink &);
+    void operator=(const TraceSink &);
+
+    FILE *out;
+    char *buffer;
+    size_t used;
+};
+
+#endif
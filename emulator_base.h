@@ -15,8 +15,25 @@
   typedef unsigned long long uint64_t;
 #endif
 #include "memory_base.h"
+#include "block_cache.h"
+#include "interrupt_controller.h"
 //#include <sys/time>
 
+// Build with EMULATOR_TRACE=1 to keep the POP and interrupt entry trace at
+// debug level 0; otherwise that interpreter does no I/O at all.
+#ifndef EMULATOR_TRACE
+#define EMULATOR_TRACE 0
+#endif
+
+// Clock cycles of one opcode, TIMING_TABLE is indexed by the opcode byte.
+struct InstructionTiming {
+    uint8_t base_cycles;        // Not taken, for conditional CALL and RET
+    uint8_t condition_cycles;   // Added when the condition holds
+    uint8_t memory_cycles;      // Part of base_cycles spent on (HL)
+};
+
+extern const InstructionTiming TIMING_TABLE[256];
+
 //Some code cares that these flags are in exact 
 // right bits when.  For instance, some code
 // "pops" values into the PSW that they didn't push.
@@ -45,40 +62,165 @@ typedef struct State8080 {
 //	uint8_t		*memory;
 	struct ConditionCodes		cc;
 	uint8_t		int_enable;
+	// Lazy flags: while zsp_pending is set, Z, S and P in cc are stale
+	// and follow from zsp_result. Cleared whenever the CPU returns.
+	uint8_t		zsp_result;
+	uint8_t		zsp_pending;
 
 } State8080;
 
 
 
+class BlockTranslator;
+class TraceSink;
+class ProcessTable;
+class Memory;
+
 class CPU8080 {
 	friend class GTUOS;
 public:
+	// Why Run() handed control back to the host.
+	enum StopReason {
+		STOP_BUDGET,     // Cycle budget used up
+		STOP_HALT,       // HLT executed
+		STOP_SYSCALL,    // pc reached the GTUOS entry, see isSystemCall()
+		STOP_INTERRUPT,  // Interrupt raised, taken on the next Run()
+		STOP_FAULT       // Guest fault with exits off, see getFault()
+	};
+
+	// Output compiled into an interpreter instantiation, see traceLevelFor().
+	enum TraceLevel {
+		TRACE_NONE,      // No I/O
+		TRACE_EVENTS,    // POP trace and interrupt entry disassembly
+		TRACE_FULL       // Also every instruction, its flags and the timer
+	};
+
 	uint8_t interrupt = 0;  // Interrupt
 	uint8_t interrupt_code =0; // Interrupt code Unnecessary
-	uint8_t quantum = 80;  // Round Robin quantum
-	uint8_t scheduler_timer = 0; //Current Execution Time
+	uint16_t quantum = 80;  // Round Robin quantum, clock cycles
+	uint32_t scheduler_timer = 0; // Cycles since the slice started
 	uint8_t initialized = 0;
 	uint16_t int_buffer = 256; // Interrupt Buffer Address
        CPU8080(MemoryBase *mem);        
 		~CPU8080();
         unsigned Emulate8080p(int debug = 0);
+        unsigned EmulateBlock(int debug = 0);
+        // One instruction like Emulate8080p, fetched from BlockCache::lookupOp.
+        unsigned EmulateCached(int debug = 0);
+        StopReason Run(uint64_t cycleBudget, int debug = 0);
+        // TRACE_FULL for a non-zero debug option, else per EMULATOR_TRACE.
+        static TraceLevel traceLevelFor(int debug);
         void ClearInterrupt();
-	void raiseInterrupt(uint8_t code);
+	// Queue code; it is latched as soon as interrupts are enabled and
+	// nothing else is latched. Duplicates of a pending vector are merged.
+	void raiseInterrupt(uint8_t code, uint8_t priority = INTERRUPT_PRIORITY_DEFAULT);
 	void dispatchScheduler();
         bool isHalted() const;
         bool isSystemCall() const;
 	uint16_t getInterruptBufferAddress(){return int_buffer;}
 	void setInterruptBufferAddress(uint16_t address){int_buffer = address;}
-	void setQuantum(uint8_t quant);
+	void setQuantum(uint16_t quant);
+	// Cycles spent for the running process outside the interpreter, such as
+	// a system call; they count against its quantum like its own.
+	void chargeCycles(unsigned cycles);
+	// Clock cycles run while slot's page table was selected.
+	uint64_t getProcessCycles(int slot) const { return processCycles[slot]; }
+	uint64_t getTotalCycles() const { return totalCycles; }
+	// Guest instructions run, interrupt entry's RST included.
+	uint64_t getInstructionCount() const { return instructions; }
+	const State8080 *getState() const { return state; }
 	void onInterrupt();
+	// Opt-in: take timer interrupts through ProcessTable::switchProcess
+	// instead of the guest's readFromInterruptBuffer handler.
+	void setFastContextSwitch(bool enable);
+	const ProcessTable *getProcessTable() const { return processTable; }
+	const InterruptController &getInterrupts() const { return *interrupts; }
 	void ReadFileIntoMemoryAt(const char* filename, uint32_t offset);
+	// On by default: an unimplemented instruction or a program that cannot
+	// be loaded prints an error and exits. Off, it sets getFault() instead
+	// and Run returns STOP_FAULT, so many CPUs can share one host process.
+	void setExitOnFault(bool enable) { exitOnFault = enable; }
+	// What went wrong, NULL while the guest has not faulted.
+	const char *getFault() const { return fault; }
+	// Drop pre-decoded code after guest memory was replaced wholesale,
+	// such as by StateManager::restoreSnapshot.
+	void invalidateCode();
+	// Opt-in: run hot blocks as host code, see block_translator.h. Only at
+	// TRACE_NONE; false, and left off, if the host has no backend.
+	bool setTranslation(bool enable);
+	const BlockTranslator *getTranslator() const { return translator; }
+	// On by default: Run recognises a loop that comes back to the same pc
+	// and registers without a store, page fault or pending interrupt, such
+	// as a kernel idle loop polling a flag, and credits the iterations up
+	// to the next preemption or the end of the budget in one go. The guest
+	// sees the same cycles, timer and instructions as if it had stepped
+	// them; only TLB statistics and translation warm-up differ.
+	void setIdleSkip(bool enable) { idleSkip = enable; }
+	// Clock cycles credited by skipping idle iterations.
+	uint64_t getIdleCycles() const { return idleCycles; }
 protected:
 		void operator=(const CPU8080 & o) {}
 		CPU8080(const CPU8080 & o) {}
 
+        // Execution is instantiated per memory model, see memory_model.h.
+        template <TraceLevel Trace, class Model> unsigned Step();
+        template <TraceLevel Trace, class Model> unsigned StepBlock();
+        template <TraceLevel Trace, class Model> unsigned StepCached();
+        template <TraceLevel Trace, class Model> StopReason RunLoop(uint64_t cycleBudget);
+        template <TraceLevel Trace, class Model> unsigned Execute8080Op();
+        template <class Model> void WriteMem(uint16_t address, uint8_t value);
+        template <class Model> void WriteToHL(uint8_t value);
+        template <class Model> void Push(uint8_t high, uint8_t low);
+        template <class Model> void selectModel();
+        // BlockTranslator::_memoryCalls of the model.
+        template <class Model> static uint32_t translatedLoad(CPU8080 *cpu, uint32_t address);
+        template <class Model> static uint32_t translatedStore(CPU8080 *cpu, uint32_t address, uint32_t value);
+        unsigned RunTranslated(BlockCache::_basicBlock *block);
+        uint64_t SkipIdle(uint64_t cycles, uint64_t cycleBudget);
+        void MarkIdleCandidate();
+        int processSlot() const;
+        // Base register, pc and mnemonic: how a TRACE_FULL line starts.
+        void TraceInstruction(uint16_t pc, const uint8_t *code, size_t available);
+        void TraceInstructionAt(uint16_t pc);
+        void UnimplementedInstruction();
+        void raiseFault(const char *what);
+        void pollInterrupts();
+
         State8080 * state;
         MemoryBase * memory;
-	unsigned char * lastOpcode;
+	Memory * paged;                 // memory if it is a Memory, else NULL
+	// Entry points for the memory's model, indexed by TraceLevel.
+	unsigned (CPU8080::*stepFunctions[3])();
+	unsigned (CPU8080::*blockFunctions[3])();
+	unsigned (CPU8080::*cachedFunctions[3])();
+	StopReason (CPU8080::*runFunctions[3])(uint64_t);
+	unsigned char * lastOpcode;     // Bytes of the instruction being executed
+	uint8_t fetchWindow[3];         // Step's copy of them
+	BlockCache * blockCache;
+	BlockTranslator * translator;   // NULL unless translation is on
+	const BlockCache::_basicBlock * translatedBlock;    // Running as host code
+	InterruptController * interrupts;   // Requests not latched yet
+	TraceSink * trace;              // Debug output, see disassembler.h
+	ProcessTable * processTable;    // NULL unless fast context switch is on
+	uint64_t * processCycles;       // One counter per process slot
+	uint64_t totalCycles;
+	uint64_t instructions;
+	uint64_t stores;                // Guest stores, for the idle detector
+	// Where a backward branch last landed, see SkipIdle.
+	struct {
+		State8080 state;
+		uint64_t totalCycles;
+		uint64_t instructions;
+		uint64_t stores;
+		uint64_t faults;
+		uint32_t timer;
+		bool valid;
+	} idleCandidate;
+	bool idleSkip;
+	uint64_t idleCycles;
+	int runningSlot;                // processSlot() since the last base change
+	bool exitOnFault;
+	const char *fault;
 };
 
 #endif
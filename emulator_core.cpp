@@ -1,968 +1,491 @@
 #include "memory_base.h"
 #include "memory_manager.h"
 #include "emulator_base.h"
+#include "block_cache.h"
+#include "block_translator.h"
+#include "disassembler.h"
+#include "program_cache.h"
+#include "process_table.h"
+#include "memory_model.h"
 
 #define PRINTOPS 1
+#define LAZY_FLAGS 1    // Z, S and P are derived from the last result only when read
+
+// ConditionCodes bits as the flag byte of PUSH PSW lays them out.
+#define FLAG_P 0x04
+#define FLAG_Z 0x40
+#define FLAG_S 0x80
+#define FLAGS_ZSP (FLAG_Z | FLAG_S | FLAG_P)
+
+// Cycles of every opcode: base_cycles when a conditional CALL or RET is not
+// taken, condition_cycles more when it is. memory_cycles is the part of
+// base_cycles spent on an (HL) operand.
+const InstructionTiming TIMING_TABLE[256] = {
+    { 4, 0, 0}, {10, 0, 0}, { 7, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 7, 0, 0}, { 4, 0, 0},  //0x00
+    { 4, 0, 0}, {10, 0, 0}, { 7, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 7, 0, 0}, { 4, 0, 0},  //0x08
+    { 4, 0, 0}, {10, 0, 0}, { 7, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 7, 0, 0}, { 4, 0, 0},  //0x10
+    { 4, 0, 0}, {10, 0, 0}, { 7, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 7, 0, 0}, { 4, 0, 0},  //0x18
+    { 4, 0, 0}, {10, 0, 0}, {16, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 7, 0, 0}, { 4, 0, 0},  //0x20
+    { 4, 0, 0}, {10, 0, 0}, {16, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 7, 0, 0}, { 4, 0, 0},  //0x28
+    { 4, 0, 0}, {10, 0, 0}, {13, 0, 0}, { 5, 0, 0}, {10, 0, 5}, {10, 0, 5}, {10, 0, 3}, { 4, 0, 0},  //0x30
+    { 4, 0, 0}, {10, 0, 0}, {13, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 7, 0, 0}, { 4, 0, 0},  //0x38
+    { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 7, 0, 2}, { 5, 0, 0},  //0x40
+    { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 7, 0, 2}, { 5, 0, 0},  //0x48
+    { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 7, 0, 2}, { 5, 0, 0},  //0x50
+    { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 7, 0, 2}, { 5, 0, 0},  //0x58
+    { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 7, 0, 2}, { 5, 0, 0},  //0x60
+    { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 7, 0, 2}, { 5, 0, 0},  //0x68
+    { 7, 0, 2}, { 7, 0, 2}, { 7, 0, 2}, { 7, 0, 2}, { 7, 0, 2}, { 7, 0, 2}, { 7, 0, 0}, { 7, 0, 2},  //0x70
+    { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 5, 0, 0}, { 7, 0, 2}, { 5, 0, 0},  //0x78
+    { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 7, 0, 3}, { 4, 0, 0},  //0x80
+    { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 7, 0, 3}, { 4, 0, 0},  //0x88
+    { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 7, 0, 3}, { 4, 0, 0},  //0x90
+    { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 7, 0, 3}, { 4, 0, 0},  //0x98
+    { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 7, 0, 3}, { 4, 0, 0},  //0xa0
+    { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 7, 0, 3}, { 4, 0, 0},  //0xa8
+    { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 7, 0, 3}, { 4, 0, 0},  //0xb0
+    { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 4, 0, 0}, { 7, 0, 3}, { 4, 0, 0},  //0xb8
+    { 5, 6, 0}, {10, 0, 0}, {10, 0, 0}, {10, 0, 0}, {11, 6, 0}, {11, 0, 0}, { 7, 0, 0}, {11, 0, 0},  //0xc0
+    { 5, 6, 0}, {10, 0, 0}, {10, 0, 0}, {10, 0, 0}, {11, 6, 0}, {17, 0, 0}, { 7, 0, 0}, {11, 0, 0},  //0xc8
+    { 5, 6, 0}, {10, 0, 0}, {10, 0, 0}, {10, 0, 0}, {11, 6, 0}, {11, 0, 0}, { 7, 0, 0}, {11, 0, 0},  //0xd0
+    { 5, 6, 0}, {10, 0, 0}, {10, 0, 0}, {10, 0, 0}, {11, 6, 0}, {17, 0, 0}, { 7, 0, 0}, {11, 0, 0},  //0xd8
+    { 5, 6, 0}, {10, 0, 0}, {10, 0, 0}, {18, 0, 0}, {11, 6, 0}, {11, 0, 0}, { 7, 0, 0}, {11, 0, 0},  //0xe0
+    { 5, 6, 0}, { 5, 0, 0}, {10, 0, 0}, { 5, 0, 0}, {11, 6, 0}, {17, 0, 0}, { 7, 0, 0}, {11, 0, 0},  //0xe8
+    { 5, 6, 0}, {10, 0, 0}, {10, 0, 0}, { 4, 0, 0}, {11, 6, 0}, {11, 0, 0}, { 7, 0, 0}, {11, 0, 0},  //0xf0
+    { 5, 6, 0}, { 5, 0, 0}, {10, 0, 0}, { 4, 0, 0}, {11, 6, 0}, {17, 0, 0}, { 7, 0, 0}, {11, 0, 0},  //0xf8
+};
 
 namespace {
-    static int parity(int x, int size) {
-      int i;
-      int p = 0;
-      x = (x & ((1 << size) - 1));
-      for (i = 0; i < size; i++) {
-        if (x & 0x1) p++;
-        x = x >> 1;
+    // Z, S and P of every result byte, in flag byte positions.
+    struct ZspTable {
+      uint8_t flags[256];
+      constexpr ZspTable() : flags() {
+        for (int value = 0; value < 256; value++) {
+          int bits = 0;
+          for (int x = value; x != 0; x >>= 1) bits += x & 1;
+          flags[value] = (uint8_t) ((value == 0 ? FLAG_Z : 0) | (value & 0x80 ? FLAG_S : 0) |
+                                    ((bits & 1) == 0 ? FLAG_P : 0));
+        }
       }
-      return (0 == (p & 0x1));
-    }
-
-
-    unsigned char cycles8080[] = {
-            4, 10, 7, 5, 5, 5, 7, 4, 4, 10, 7, 5, 5, 5, 7, 4, //0x00..0x0f
-            4, 10, 7, 5, 5, 5, 7, 4, 4, 10, 7, 5, 5, 5, 7, 4, //0x10..0x1f
-            4, 10, 16, 5, 5, 5, 7, 4, 4, 10, 16, 5, 5, 5, 7, 4, //etc
-            4, 10, 13, 5, 10, 10, 10, 4, 4, 10, 13, 5, 5, 5, 7, 4,
-
-            5, 5, 5, 5, 5, 5, 7, 5, 5, 5, 5, 5, 5, 5, 7, 5, //0x40..0x4f
-            5, 5, 5, 5, 5, 5, 7, 5, 5, 5, 5, 5, 5, 5, 7, 5,
-            5, 5, 5, 5, 5, 5, 7, 5, 5, 5, 5, 5, 5, 5, 7, 5,
-            7, 7, 7, 7, 7, 7, 7, 7, 5, 5, 5, 5, 5, 5, 7, 5,
+    };
+    constexpr ZspTable zspTable;
 
-            4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4, //0x80..8x4f
-            4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
-            4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
-            4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
+    inline void ApplyZSP(State8080 *state, uint8_t value) {
+      uint8_t *flags = (uint8_t *) &state->cc;
+      *flags = (uint8_t) ((*flags & ~FLAGS_ZSP) | zspTable.flags[value]);
+    }
 
-            11, 10, 10, 10, 17, 11, 7, 11, 11, 10, 10, 10, 10, 17, 7, 11, //0xc0..0xcf
-            11, 10, 10, 10, 17, 11, 7, 11, 11, 10, 10, 10, 10, 17, 7, 11,
-            11, 10, 10, 18, 17, 11, 7, 11, 11, 5, 10, 5, 17, 17, 7, 11,
-            11, 10, 10, 4, 17, 11, 7, 11, 11, 5, 10, 4, 17, 17, 7, 11,
-    };
+    inline void FlagsZSP(State8080 *state, uint8_t value) {
+#if LAZY_FLAGS
+      state->zsp_result = value;
+      state->zsp_pending = 1;
+#else
+      ApplyZSP(state, value);
+#endif
+    }
 
-    int Disassemble8080Op(MemoryBase *codebuffer, int pc) {
-      unsigned char *code = &codebuffer->at(pc);
-      char buf[50];
-      int opbytes = 1;
-      printf("%04x ", ((Memory *)codebuffer)->getBaseRegister());
-      printf("%04x ", pc);
-      switch (*code) {
-        case 0x00:
-          sprintf(buf, "NOP");
-          break;
-        case 0x01:
-          sprintf(buf, "LXI    B,#$%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0x02:
-          sprintf(buf, "STAX   B");
-          break;
-        case 0x03:
-          sprintf(buf, "INX    B");
-          break;
-        case 0x04:
-          sprintf(buf, "INR    B");
-          break;
-        case 0x05:
-          sprintf(buf, "DCR    B");
-          break;
-        case 0x06:
-          sprintf(buf, "MVI    B,#$%02x", code[1]);
-          opbytes = 2;
-          break;
-        case 0x07:
-          sprintf(buf, "RLC");
-          break;
-        case 0x08:
-          sprintf(buf, "NOP");
-          break;
-        case 0x09:
-          sprintf(buf, "DAD    B");
-          break;
-        case 0x0a:
-          sprintf(buf, "LDAX   B");
-          break;
-        case 0x0b:
-          sprintf(buf, "DCX    B");
-          break;
-        case 0x0c:
-          sprintf(buf, "INR    C");
-          break;
-        case 0x0d:
-          sprintf(buf, "DCR    C");
-          break;
-        case 0x0e:
-          sprintf(buf, "MVI    C,#$%02x", code[1]);
-          opbytes = 2;
-          break;
-        case 0x0f:
-          sprintf(buf, "RRC");
-          break;
-
-        case 0x10:
-          sprintf(buf, "NOP");
-          break;
-        case 0x11:
-          sprintf(buf, "LXI    D,#$%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0x12:
-          sprintf(buf, "STAX   D");
-          break;
-        case 0x13:
-          sprintf(buf, "INX    D");
-          break;
-        case 0x14:
-          sprintf(buf, "INR    D");
-          break;
-        case 0x15:
-          sprintf(buf, "DCR    D");
-          break;
-        case 0x16:
-          sprintf(buf, "MVI    D,#$%02x", code[1]);
-          opbytes = 2;
-          break;
-        case 0x17:
-          sprintf(buf, "RAL");
-          break;
-        case 0x18:
-          sprintf(buf, "NOP");
-          break;
-        case 0x19:
-          sprintf(buf, "DAD    D");
-          break;
-        case 0x1a:
-          sprintf(buf, "LDAX   D");
-          break;
-        case 0x1b:
-          sprintf(buf, "DCX    D");
-          break;
-        case 0x1c:
-          sprintf(buf, "INR    E");
-          break;
-        case 0x1d:
-          sprintf(buf, "DCR    E");
-          break;
-        case 0x1e:
-          sprintf(buf, "MVI    E,#$%02x", code[1]);
-          opbytes = 2;
-          break;
-        case 0x1f:
-          sprintf(buf, "RAR");
-          break;
-
-        case 0x20:
-          sprintf(buf, "NOP");
-          break;
-        case 0x21:
-          sprintf(buf, "LXI    H,#$%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0x22:
-          sprintf(buf, "SHLD   $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0x23:
-          sprintf(buf, "INX    H");
-          break;
-        case 0x24:
-          sprintf(buf, "INR    H");
-          break;
-        case 0x25:
-          sprintf(buf, "DCR    H");
-          break;
-        case 0x26:
-          sprintf(buf, "MVI    H,#$%02x", code[1]);
-          opbytes = 2;
-          break;
-        case 0x27:
-          sprintf(buf, "DAA");
-          break;
-        case 0x28:
-          sprintf(buf, "NOP");
-          break;
-        case 0x29:
-          sprintf(buf, "DAD    H");
-          break;
-        case 0x2a:
-          sprintf(buf, "LHLD   $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0x2b:
-          sprintf(buf, "DCX    H");
-          break;
-        case 0x2c:
-          sprintf(buf, "INR    L");
-          break;
-        case 0x2d:
-          sprintf(buf, "DCR    L");
-          break;
-        case 0x2e:
-          sprintf(buf, "MVI    L,#$%02x", code[1]);
-          opbytes = 2;
-          break;
-        case 0x2f:
-          sprintf(buf, "CMA");
-          break;
-
-        case 0x30:
-          sprintf(buf, "NOP");
-          break;
-        case 0x31:
-          sprintf(buf, "LXI    SP,#$%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0x32:
-          sprintf(buf, "STA    $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0x33:
-          sprintf(buf, "INX    SP");
-          break;
-        case 0x34:
-          sprintf(buf, "INR    M");
-          break;
-        case 0x35:
-          sprintf(buf, "DCR    M");
-          break;
-        case 0x36:
-          sprintf(buf, "MVI    M,#$%02x", code[1]);
-          opbytes = 2;
-          break;
-        case 0x37:
-          sprintf(buf, "STC");
-          break;
-        case 0x38:
-          sprintf(buf, "NOP");
-          break;
-        case 0x39:
-          sprintf(buf, "DAD    SP");
-          break;
-        case 0x3a:
-          sprintf(buf, "LDA    $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0x3b:
-          sprintf(buf, "DCX    SP");
-          break;
-        case 0x3c:
-          sprintf(buf, "INR    A");
-          break;
-        case 0x3d:
-          sprintf(buf, "DCR    A");
-          break;
-        case 0x3e:
-          sprintf(buf, "MVI    A,#$%02x", code[1]);
-          opbytes = 2;
-          break;
-        case 0x3f:
-          sprintf(buf, "CMC");
-          break;
-
-        case 0x40:
-          sprintf(buf, "MOV    B,B");
-          break;
-        case 0x41:
-          sprintf(buf, "MOV    B,C");
-          break;
-        case 0x42:
-          sprintf(buf, "MOV    B,D");
-          break;
-        case 0x43:
-          sprintf(buf, "MOV    B,E");
-          break;
-        case 0x44:
-          sprintf(buf, "MOV    B,H");
-          break;
-        case 0x45:
-          sprintf(buf, "MOV    B,L");
-          break;
-        case 0x46:
-          sprintf(buf, "MOV    B,M");
-          break;
-        case 0x47:
-          sprintf(buf, "MOV    B,A");
-          break;
-        case 0x48:
-          sprintf(buf, "MOV    C,B");
-          break;
-        case 0x49:
-          sprintf(buf, "MOV    C,C");
-          break;
-        case 0x4a:
-          sprintf(buf, "MOV    C,D");
-          break;
-        case 0x4b:
-          sprintf(buf, "MOV    C,E");
-          break;
-        case 0x4c:
-          sprintf(buf, "MOV    C,H");
-          break;
-        case 0x4d:
-          sprintf(buf, "MOV    C,L");
-          break;
-        case 0x4e:
-          sprintf(buf, "MOV    C,M");
-          break;
-        case 0x4f:
-          sprintf(buf, "MOV    C,A");
-          break;
-
-        case 0x50:
-          sprintf(buf, "MOV    D,B");
-          break;
-        case 0x51:
-          sprintf(buf, "MOV    D,C");
-          break;
-        case 0x52:
-          sprintf(buf, "MOV    D,D");
-          break;
-        case 0x53:
-          sprintf(buf, "MOV    D.E");
-          break;
-        case 0x54:
-          sprintf(buf, "MOV    D,H");
-          break;
-        case 0x55:
-          sprintf(buf, "MOV    D,L");
-          break;
-        case 0x56:
-          sprintf(buf, "MOV    D,M");
-          break;
-        case 0x57:
-          sprintf(buf, "MOV    D,A");
-          break;
-        case 0x58:
-          sprintf(buf, "MOV    E,B");
-          break;
-        case 0x59:
-          sprintf(buf, "MOV    E,C");
-          break;
-        case 0x5a:
-          sprintf(buf, "MOV    E,D");
-          break;
-        case 0x5b:
-          sprintf(buf, "MOV    E,E");
-          break;
-        case 0x5c:
-          sprintf(buf, "MOV    E,H");
-          break;
-        case 0x5d:
-          sprintf(buf, "MOV    E,L");
-          break;
-        case 0x5e:
-          sprintf(buf, "MOV    E,M");
-          break;
-        case 0x5f:
-          sprintf(buf, "MOV    E,A");
-          break;
-
-        case 0x60:
-          sprintf(buf, "MOV    H,B");
-          break;
-        case 0x61:
-          sprintf(buf, "MOV    H,C");
-          break;
-        case 0x62:
-          sprintf(buf, "MOV    H,D");
-          break;
-        case 0x63:
-          sprintf(buf, "MOV    H.E");
-          break;
-        case 0x64:
-          sprintf(buf, "MOV    H,H");
-          break;
-        case 0x65:
-          sprintf(buf, "MOV    H,L");
-          break;
-        case 0x66:
-          sprintf(buf, "MOV    H,M");
-          break;
-        case 0x67:
-          sprintf(buf, "MOV    H,A");
-          break;
-        case 0x68:
-          sprintf(buf, "MOV    L,B");
-          break;
-        case 0x69:
-          sprintf(buf, "MOV    L,C");
-          break;
-        case 0x6a:
-          sprintf(buf, "MOV    L,D");
-          break;
-        case 0x6b:
-          sprintf(buf, "MOV    L,E");
-          break;
-        case 0x6c:
-          sprintf(buf, "MOV    L,H");
-          break;
-        case 0x6d:
-          sprintf(buf, "MOV    L,L");
-          break;
-        case 0x6e:
-          sprintf(buf, "MOV    L,M");
-          break;
-        case 0x6f:
-          sprintf(buf, "MOV    L,A");
-          break;
-
-        case 0x70:
-          sprintf(buf, "MOV    M,B");
-          break;
-        case 0x71:
-          sprintf(buf, "MOV    M,C");
-          break;
-        case 0x72:
-          sprintf(buf, "MOV    M,D");
-          break;
-        case 0x73:
-          sprintf(buf, "MOV    M.E");
-          break;
-        case 0x74:
-          sprintf(buf, "MOV    M,H");
-          break;
-        case 0x75:
-          sprintf(buf, "MOV    M,L");
-          break;
-        case 0x76:
-          sprintf(buf, "HLT");
-          break;
-        case 0x77:
-          sprintf(buf, "MOV    M,A");
-          break;
-        case 0x78:
-          sprintf(buf, "MOV    A,B");
-          break;
-        case 0x79:
-          sprintf(buf, "MOV    A,C");
-          break;
-        case 0x7a:
-          sprintf(buf, "MOV    A,D");
-          break;
-        case 0x7b:
-          sprintf(buf, "MOV    A,E");
-          break;
-        case 0x7c:
-          sprintf(buf, "MOV    A,H");
-          break;
-        case 0x7d:
-          sprintf(buf, "MOV    A,L");
-          break;
-        case 0x7e:
-          sprintf(buf, "MOV    A,M");
-          break;
-        case 0x7f:
-          sprintf(buf, "MOV    A,A");
-          break;
-
-        case 0x80:
-          sprintf(buf, "ADD    B");
-          break;
-        case 0x81:
-          sprintf(buf, "ADD    C");
-          break;
-        case 0x82:
-          sprintf(buf, "ADD    D");
-          break;
-        case 0x83:
-          sprintf(buf, "ADD    E");
-          break;
-        case 0x84:
-          sprintf(buf, "ADD    H");
-          break;
-        case 0x85:
-          sprintf(buf, "ADD    L");
-          break;
-        case 0x86:
-          sprintf(buf, "ADD    M");
-          break;
-        case 0x87:
-          sprintf(buf, "ADD    A");
-          break;
-        case 0x88:
-          sprintf(buf, "ADC    B");
-          break;
-        case 0x89:
-          sprintf(buf, "ADC    C");
-          break;
-        case 0x8a:
-          sprintf(buf, "ADC    D");
-          break;
-        case 0x8b:
-          sprintf(buf, "ADC    E");
-          break;
-        case 0x8c:
-          sprintf(buf, "ADC    H");
-          break;
-        case 0x8d:
-          sprintf(buf, "ADC    L");
-          break;
-        case 0x8e:
-          sprintf(buf, "ADC    M");
-          break;
-        case 0x8f:
-          sprintf(buf, "ADC    A");
-          break;
-
-        case 0x90:
-          sprintf(buf, "SUB    B");
-          break;
-        case 0x91:
-          sprintf(buf, "SUB    C");
-          break;
-        case 0x92:
-          sprintf(buf, "SUB    D");
-          break;
-        case 0x93:
-          sprintf(buf, "SUB    E");
-          break;
-        case 0x94:
-          sprintf(buf, "SUB    H");
-          break;
-        case 0x95:
-          sprintf(buf, "SUB    L");
-          break;
-        case 0x96:
-          sprintf(buf, "SUB    M");
-          break;
-        case 0x97:
-          sprintf(buf, "SUB    A");
-          break;
-        case 0x98:
-          sprintf(buf, "SBB    B");
-          break;
-        case 0x99:
-          sprintf(buf, "SBB    C");
-          break;
-        case 0x9a:
-          sprintf(buf, "SBB    D");
-          break;
-        case 0x9b:
-          sprintf(buf, "SBB    E");
-          break;
-        case 0x9c:
-          sprintf(buf, "SBB    H");
-          break;
-        case 0x9d:
-          sprintf(buf, "SBB    L");
-          break;
-        case 0x9e:
-          sprintf(buf, "SBB    M");
-          break;
-        case 0x9f:
-          sprintf(buf, "SBB    A");
-          break;
-
-        case 0xa0:
-          sprintf(buf, "ANA    B");
-          break;
-        case 0xa1:
-          sprintf(buf, "ANA    C");
-          break;
-        case 0xa2:
-          sprintf(buf, "ANA    D");
-          break;
-        case 0xa3:
-          sprintf(buf, "ANA    E");
-          break;
-        case 0xa4:
-          sprintf(buf, "ANA    H");
-          break;
-        case 0xa5:
-          sprintf(buf, "ANA    L");
-          break;
-        case 0xa6:
-          sprintf(buf, "ANA    M");
-          break;
-        case 0xa7:
-          sprintf(buf, "ANA    A");
-          break;
-        case 0xa8:
-          sprintf(buf, "XRA    B");
-          break;
-        case 0xa9:
-          sprintf(buf, "XRA    C");
-          break;
-        case 0xaa:
-          sprintf(buf, "XRA    D");
-          break;
-        case 0xab:
-          sprintf(buf, "XRA    E");
-          break;
-        case 0xac:
-          sprintf(buf, "XRA    H");
-          break;
-        case 0xad:
-          sprintf(buf, "XRA    L");
-          break;
-        case 0xae:
-          sprintf(buf, "XRA    M");
-          break;
-        case 0xaf:
-          sprintf(buf, "XRA    A");
-          break;
-
-        case 0xb0:
-          sprintf(buf, "ORA    B");
-          break;
-        case 0xb1:
-          sprintf(buf, "ORA    C");
-          break;
-        case 0xb2:
-          sprintf(buf, "ORA    D");
-          break;
-        case 0xb3:
-          sprintf(buf, "ORA    E");
-          break;
-        case 0xb4:
-          sprintf(buf, "ORA    H");
-          break;
-        case 0xb5:
-          sprintf(buf, "ORA    L");
-          break;
-        case 0xb6:
-          sprintf(buf, "ORA    M");
-          break;
-        case 0xb7:
-          sprintf(buf, "ORA    A");
-          break;
-        case 0xb8:
-          sprintf(buf, "CMP    B");
-          break;
-        case 0xb9:
-          sprintf(buf, "CMP    C");
-          break;
-        case 0xba:
-          sprintf(buf, "CMP    D");
-          break;
-        case 0xbb:
-          sprintf(buf, "CMP    E");
-          break;
-        case 0xbc:
-          sprintf(buf, "CMP    H");
-          break;
-        case 0xbd:
-          sprintf(buf, "CMP    L");
-          break;
-        case 0xbe:
-          sprintf(buf, "CMP    M");
-          break;
-        case 0xbf:
-          sprintf(buf, "CMP    A");
-          break;
-
-        case 0xc0:
-          sprintf(buf, "RNZ");
-          break;
-        case 0xc1:
-          sprintf(buf, "POP    B");
-          break;
-        case 0xc2:
-          sprintf(buf, "JNZ    $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0xc3:
-          sprintf(buf, "JMP    $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0xc4:
-          sprintf(buf, "CNZ    $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0xc5:
-          sprintf(buf, "PUSH   B");
-          break;
-        case 0xc6:
-          sprintf(buf, "ADI    #$%02x", code[1]);
-          opbytes = 2;
-          break;
-        case 0xc7:
-          sprintf(buf, "RST    0");
-          break;
-        case 0xc8:
-          sprintf(buf, "RZ");
-          break;
-        case 0xc9:
-          sprintf(buf, "RET");
-          break;
-        case 0xca:
-          sprintf(buf, "JZ     $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0xcb:
-          sprintf(buf, "JMP    $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0xcc:
-          sprintf(buf, "CZ     $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0xcd:
-          sprintf(buf, "CALL   $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0xce:
-          sprintf(buf, "ACI    #$%02x", code[1]);
-          opbytes = 2;
-          break;
-        case 0xcf:
-          sprintf(buf, "RST    1");
-          break;
-
-        case 0xd0:
-          sprintf(buf, "RNC");
-          break;
-        case 0xd1:
-          sprintf(buf, "POP    D");
-          break;
-        case 0xd2:
-          sprintf(buf, "JNC    $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0xd3:
-          sprintf(buf, "OUT    #$%02x", code[1]);
-          opbytes = 2;
-          break;
-        case 0xd4:
-          sprintf(buf, "CNC    $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0xd5:
-          sprintf(buf, "PUSH   D");
-          break;
-        case 0xd6:
-          sprintf(buf, "SUI    #$%02x", code[1]);
-          opbytes = 2;
-          break;
-        case 0xd7:
-          sprintf(buf, "RST    2");
-          break;
-        case 0xd8:
-          sprintf(buf, "RC");
-          break;
-        case 0xd9:
-          sprintf(buf, "RET");
-          break;
-        case 0xda:
-          sprintf(buf, "JC     $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0xdb:
-          sprintf(buf, "IN     #$%02x", code[1]);
-          opbytes = 2;
-          break;
-        case 0xdc:
-          sprintf(buf, "CC     $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0xdd:
-          sprintf(buf, "CALL   $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0xde:
-          sprintf(buf, "SBI    #$%02x", code[1]);
-          opbytes = 2;
-          break;
-        case 0xdf:
-          sprintf(buf, "RST    3");
-          break;
-
-        case 0xe0:
-          sprintf(buf, "RPO");
-          break;
-        case 0xe1:
-          sprintf(buf, "POP    H");
-          break;
-        case 0xe2:
-          sprintf(buf, "JPO    $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0xe3:
-          sprintf(buf, "XTHL");
-          break;
-        case 0xe4:
-          sprintf(buf, "CPO    $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0xe5:
-          sprintf(buf, "PUSH   H");
-          break;
-        case 0xe6:
-          sprintf(buf, "ANI    #$%02x", code[1]);
-          opbytes = 2;
-          break;
-        case 0xe7:
-          sprintf(buf, "RST    4");
-          break;
-        case 0xe8:
-          sprintf(buf, "RPE");
-          break;
-        case 0xe9:
-          sprintf(buf, "PCHL");
-          break;
-        case 0xea:
-          sprintf(buf, "JPE    $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0xeb:
-          sprintf(buf, "XCHG");
-          break;
-        case 0xec:
-          sprintf(buf, "CPE     $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0xed:
-          sprintf(buf, "CALL   $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0xee:
-          sprintf(buf, "XRI    #$%02x", code[1]);
-          opbytes = 2;
-          break;
-        case 0xef:
-          sprintf(buf, "RST    5");
-          break;
-
-        case 0xf0:
-          sprintf(buf, "RP");
-          break;
-        case 0xf1:
-          sprintf(buf, "POP    PSW");
-          break;
-        case 0xf2:
-          sprintf(buf, "JP     $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0xf3:
-          sprintf(buf, "DI");
-          break;
-        case 0xf4:
-          sprintf(buf, "CP     $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0xf5:
-          sprintf(buf, "PUSH   PSW");
-          break;
-        case 0xf6:
-          sprintf(buf, "ORI    #$%02x", code[1]);
-          opbytes = 2;
-          break;
-        case 0xf7:
-          sprintf(buf, "RST    6");
-          break;
-        case 0xf8:
-          sprintf(buf, "RM");
-          break;
-        case 0xf9:
-          sprintf(buf, "SPHL");
-          break;
-        case 0xfa:
-          sprintf(buf, "JM     $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0xfb:
-          sprintf(buf, "EI");
-          break;
-        case 0xfc:
-          sprintf(buf, "CM     $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0xfd:
-          sprintf(buf, "CALL   $%02x%02x", code[2], code[1]);
-          opbytes = 3;
-          break;
-        case 0xfe:
-          sprintf(buf, "CPI    #$%02x", code[1]);
-          opbytes = 2;
-          break;
-        case 0xff:
-          sprintf(buf, "RST    7");
-          break;
+    // Brings Z, S and P up to date before cc is read as a whole or tested.
+    inline void SyncFlags(State8080 *state) {
+#if LAZY_FLAGS
+      if (state->zsp_pending) {
+        ApplyZSP(state, state->zsp_result);
+        state->zsp_pending = 0;
       }
-      printf("%-15s", buf);
-
-      return opbytes;
+#else
+      (void) state;
+#endif
     }
 
     void LogicFlagsA(State8080 *state) {
       state->cc.cy = state->cc.ac = 0;
-      state->cc.z = (state->a == 0);
-      state->cc.s = (0x80 == (state->a & 0x80));
-      state->cc.p = parity(state->a, 8);
+      FlagsZSP(state, state->a);
     }
 
     void ArithFlagsA(State8080 *state, uint16_t res) {
       state->cc.cy = (res > 0xff);
-      state->cc.z = ((res & 0xff) == 0);
-      state->cc.s = (0x80 == (res & 0x80));
-      state->cc.p = parity(res & 0xff, 8);
+      FlagsZSP(state, res & 0xff);
     }
 
-    void UnimplementedInstruction(MemoryBase *memory, State8080 *state) {
-      //pc will have advanced one, so undo that
-      printf("Error: Unimplemented instruction\n");
-      state->pc--;
-      Disassemble8080Op(memory, state->pc);
-      printf("\n");
-      exit(1);
+    template <class Model>
+    uint8_t ReadFromHL(typename Model::Type *mem, State8080 *state) {
+      uint16_t offset = (state->h << 8) | state->l;
+      return Model::load(mem, offset);
     }
 
-    void WriteMem(MemoryBase *memory, uint16_t address, uint8_t value) {
-      fflush(stdout);
-      //printf("Memory: %d\n",address);
-      memory->at(address) = value;
+    template <CPU8080::TraceLevel Trace, class Model>
+    void Pop(typename Model::Type *mem, State8080 *state, TraceSink *trace, uint8_t *high, uint8_t *low) {
+      *low = Model::load(mem, state->sp);
+      *high = Model::load(mem, state->sp + 1);
+      state->sp += 2;
+      if (Trace != CPU8080::TRACE_NONE) {
+          trace->hex(state->pc, 4);
+          trace->put(' ');
+          trace->hex(state->sp, 4);
+          trace->write(" pop\n");
+      }
     }
 
-    uint8_t ReadFromHL(MemoryBase *memory, State8080 *state) {
-      uint16_t offset = (state->h << 8) | state->l;
-      return memory->at(offset);
-    }
+}
 
-    void WriteToHL(MemoryBase *memory, State8080 *state, uint8_t value) {
-      uint16_t offset = (state->h << 8) | state->l;
-      WriteMem(memory, offset, value);
-    }
 
-    void Push(MemoryBase *memory, State8080 *state, uint8_t high, uint8_t low) {
-      WriteMem(memory, state->sp - 1, high);
-      WriteMem(memory, state->sp - 2, low);
-      state->sp = state->sp - 2;
-      //    printf ("%04x %04x\n", state->pc, state->sp);
-    }
+int CPU8080::processSlot() const {
+  return paged != NULL ? paged->getProcessIndex() : 0;
+}
 
-    void Pop(MemoryBase *memory, State8080 *state, uint8_t *high, uint8_t *low) {
-      *low = memory->at(state->sp);
-      *high = memory->at(state->sp + 1);
-      state->sp += 2;
-          printf ("%04x %04x pop\n", state->pc, state->sp);
-    }
+void CPU8080::UnimplementedInstruction() {
+  //pc will have advanced one, so undo that
+  state->pc--;
+  if (!exitOnFault) {
+    raiseFault("unimplemented instruction");
+    return;
+  }
+  trace->write("Error: Unimplemented instruction\n");
+  TraceInstructionAt(state->pc);
+  trace->put('\n');
+  trace->flush();
+  exit(1);
+}
 
-    void FlagsZSP(State8080 *state, uint8_t value) {
-      state->cc.z = (value == 0);
-      state->cc.s = (0x80 == (value & 0x80));
-      state->cc.p = parity(value, 8);
-    }
+void CPU8080::TraceInstruction(uint16_t pc, const uint8_t *code, size_t available) {
+  char mnemonic[DISASSEMBLY_SIZE];
+  Disassemble8080Op(code, available, mnemonic, sizeof(mnemonic));
+  trace->hex(paged != NULL ? paged->getBaseRegister() : 0, 4);
+  trace->put(' ');
+  trace->hex(pc, 4);
+  trace->put(' ');
+  trace->pad(mnemonic, 15);
+}
+
+// Only pc's page is read, the trace never faults another one in.
+void CPU8080::TraceInstructionAt(uint16_t pc) {
+  uint8_t code[3];
+  size_t available = 0;
+  int pageSize = paged != NULL ? paged->getPageSize() : 0x10000;
+  do {
+    code[available] = memory->at((uint16_t) (pc + available));
+    available++;
+  } while (available < sizeof(code) && ((pc + available) & (pageSize - 1)) != 0);
+  TraceInstruction(pc, code, available);
 }
 
+// The first fault is kept; Run stops on it every time it is called again.
+void CPU8080::raiseFault(const char *what) {
+  if (fault == NULL)
+    fault = what;
+}
 
+template <class Model>
+void CPU8080::WriteMem(uint16_t address, uint8_t value) {
+  //printf("Memory: %d\n",address);
+  typename Model::Type *mem = static_cast<typename Model::Type *>(memory);
+  Model::store(mem, address) = value;
+  stores++;
+  blockCache->noteWrite(Model::slot(mem), address);
+}
+
+template <class Model>
+void CPU8080::WriteToHL(uint8_t value) {
+  uint16_t offset = (state->h << 8) | state->l;
+  WriteMem<Model>(offset, value);
+}
+
+template <class Model>
+void CPU8080::Push(uint8_t high, uint8_t low) {
+  WriteMem<Model>(state->sp - 1, high);
+  WriteMem<Model>(state->sp - 2, low);
+  state->sp = state->sp - 2;
+  //    printf ("%04x %04x\n", state->pc, state->sp);
+}
+
+template <class Model>
+uint32_t CPU8080::translatedLoad(CPU8080 *cpu, uint32_t address) {
+  return Model::load(static_cast<typename Model::Type *>(cpu->memory), address);
+}
+
+template <class Model>
+uint32_t CPU8080::translatedStore(CPU8080 *cpu, uint32_t address, uint32_t value) {
+  cpu->WriteMem<Model>((uint16_t) address, (uint8_t) value);
+  return cpu->blockCache->isStale(cpu->translatedBlock);
+}
+
+CPU8080::TraceLevel CPU8080::traceLevelFor(int debug) {
+	if (debug != 0)
+		return TRACE_FULL;
+	return EMULATOR_TRACE ? TRACE_EVENTS : TRACE_NONE;
+}
+
+// Traced entry points flush the trace before they return, see TraceSink.
 unsigned CPU8080::Emulate8080p(int debug) {
-	  lastOpcode = &memory->at(state->pc);
+	TraceLevel level = traceLevelFor(debug);
+	unsigned cycles = (this->*stepFunctions[level])();
+	if (level != TRACE_NONE)
+		trace->flush();
+	return cycles;
+}
+
+unsigned CPU8080::EmulateBlock(int debug) {
+	TraceLevel level = traceLevelFor(debug);
+	unsigned cycles = (this->*blockFunctions[level])();
+	if (level != TRACE_NONE)
+		trace->flush();
+	return cycles;
+}
+
+unsigned CPU8080::EmulateCached(int debug) {
+	TraceLevel level = traceLevelFor(debug);
+	unsigned cycles = (this->*cachedFunctions[level])();
+	if (level != TRACE_NONE)
+		trace->flush();
+	return cycles;
+}
+
+CPU8080::StopReason CPU8080::Run(uint64_t cycleBudget, int debug) {
+	TraceLevel level = traceLevelFor(debug);
+	StopReason reason = (this->*runFunctions[level])(cycleBudget);
+	if (level != TRACE_NONE)
+		trace->flush();
+	return reason;
+}
+
+template <class Model>
+void CPU8080::selectModel() {
+	stepFunctions[TRACE_NONE] = &CPU8080::Step<TRACE_NONE, Model>;
+	stepFunctions[TRACE_EVENTS] = &CPU8080::Step<TRACE_EVENTS, Model>;
+	stepFunctions[TRACE_FULL] = &CPU8080::Step<TRACE_FULL, Model>;
+	blockFunctions[TRACE_NONE] = &CPU8080::StepBlock<TRACE_NONE, Model>;
+	blockFunctions[TRACE_EVENTS] = &CPU8080::StepBlock<TRACE_EVENTS, Model>;
+	blockFunctions[TRACE_FULL] = &CPU8080::StepBlock<TRACE_FULL, Model>;
+	cachedFunctions[TRACE_NONE] = &CPU8080::StepCached<TRACE_NONE, Model>;
+	cachedFunctions[TRACE_EVENTS] = &CPU8080::StepCached<TRACE_EVENTS, Model>;
+	cachedFunctions[TRACE_FULL] = &CPU8080::StepCached<TRACE_FULL, Model>;
+	runFunctions[TRACE_NONE] = &CPU8080::RunLoop<TRACE_NONE, Model>;
+	runFunctions[TRACE_EVENTS] = &CPU8080::RunLoop<TRACE_EVENTS, Model>;
+	runFunctions[TRACE_FULL] = &CPU8080::RunLoop<TRACE_FULL, Model>;
+}
+
+template <CPU8080::TraceLevel Trace, class Model>
+unsigned CPU8080::Step() {
+	typename Model::Type *mem = static_cast<typename Model::Type *>(memory);
+	if (interrupt != 0 && processTable != NULL && interrupt_code == TIMER_INTERRUPT) {
+		interrupt = 0;
+		lastOpcode = &interrupt_code;
+		SyncFlags(state);
+		processTable->switchProcess(state, paged, blockCache);
+		scheduler_timer = 0;
+		runningSlot = processSlot();
+		return TIMING_TABLE[TIMER_INTERRUPT].base_cycles;
+	}
+	// The opcode is read even when an interrupt is taken instead.
+	fetchWindow[0] = Model::load(mem, state->pc);
 
 	if(interrupt ==0){	
-		lastOpcode = &memory->at(state->pc);
-		if(debug != 0)
-			Disassemble8080Op(memory, state->pc);
+		// Operands go through the model a byte at a time, so an instruction
+		// running into the next page takes them from that page's frame.
+		int length = BlockCache::instructionLength(fetchWindow[0]);
+		for (int i = 1; i < length; i++)
+			fetchWindow[i] = Model::load(mem, (uint16_t) (state->pc + i));
+		Model::prefetch(mem, (uint16_t) (state->pc + length));
+		lastOpcode = fetchWindow;
+		if(Trace == TRACE_FULL)
+			TraceInstruction(state->pc, fetchWindow, length);
 		state->pc+=1;   
 	}
 	else{
 	   	
 		lastOpcode = &interrupt_code;
-		Disassemble8080Op(memory,*lastOpcode);
+		if(Trace != TRACE_NONE)
+			TraceInstructionAt(*lastOpcode);
 		onInterrupt();
 		state->pc-=2; 
-		((Memory *)(memory))->setBaseRegister(0);
+		Model::setBase(mem, 0);
+		runningSlot = 0;
 	}
-    		
-  switch (*lastOpcode) {
+	unsigned cycles = Execute8080Op<Trace, Model>();
+	SyncFlags(state);
+	return cycles;
+}
+
+/**
+ * Run one pre-decoded basic block starting at the current pc.
+ * Interrupt entry and full tracing single step through Step instead.
+ * @return Clock cycles of the instructions executed.
+ */
+template <CPU8080::TraceLevel Trace, class Model>
+unsigned CPU8080::StepBlock() {
+	typename Model::Type *mem = static_cast<typename Model::Type *>(memory);
+	if (interrupt != 0 || Trace == TRACE_FULL)
+		return Step<Trace, Model>();
+
+	BlockCache::_basicBlock *block = blockCache->lookup(memory, Model::slot(mem), state->pc);
+	unsigned cycles = 0;
+	int i = 0;
+	if (Trace == TRACE_NONE && translator != NULL) {
+		if (block->hostCode == NULL && ++block->executions == TRANSLATE_THRESHOLD) {
+			BlockTranslator::_memoryCalls calls = { &CPU8080::translatedLoad<Model>,
+			                                        &CPU8080::translatedStore<Model> };
+			translator->translate(*blockCache, block, calls);
+		}
+		if (block->hostCode != NULL) {
+			cycles = RunTranslated(block);
+			if (block->hostOps == block->count || interrupt != 0 || blockCache->isStale(block))
+				return cycles;
+			i = block->hostOps;
+		}
+	}
+	for (; i < block->count; i++) {
+		lastOpcode = block->ops[i].bytes;
+		state->pc += 1;
+		cycles += Execute8080Op<Trace, Model>();
+		if (interrupt != 0 || blockCache->isStale(block))
+			break;
+	}
+	SyncFlags(state);
+	return cycles;
+}
+
+/**
+ * Run block's host code, the same instructions StepBlock would interpret,
+ * and account for its cycles as Execute8080Op does.
+ * @return Clock cycles of the instructions executed.
+ */
+unsigned CPU8080::RunTranslated(BlockCache::_basicBlock *block) {
+	translatedBlock = block;
+	// Host code leaves the interrupt enable alone, so with interrupts off
+	// the quantum can never run out and the timer ends up cleared.
+	uint32_t start = scheduler_timer;
+	uint32_t limit = state->int_enable ? quantum : UINT32_MAX;
+	uint32_t timer = ((BlockTranslator::_hostCode) block->hostCode)(state, this, start, limit);
+	unsigned cycles = timer - start;
+	totalCycles += cycles;
+	// Only the last instruction host code runs can take extra cycles, a
+	// conditional CALL or RET, so the base cycles tell how far it got.
+	unsigned ran = 0;
+	for (int i = 0; i < block->hostOps && ran < cycles; i++) {
+		ran += TIMING_TABLE[block->ops[i].bytes[0]].base_cycles;
+		instructions++;
+	}
+	processCycles[runningSlot] += cycles;
+	if (!state->int_enable)
+		scheduler_timer = 0;
+	else if (timer > quantum) {
+		scheduler_timer = 0;
+		dispatchScheduler();
+	} else
+		scheduler_timer = timer;
+	lastOpcode = block->ops[0].bytes;
+	SyncFlags(state);
+	return cycles;
+}
+
+/**
+ * Run the instruction at pc from the decode cache, as Step would.
+ * Interrupt entry and full tracing go through Step instead.
+ * @return Clock cycles of the instruction.
+ */
+template <CPU8080::TraceLevel Trace, class Model>
+unsigned CPU8080::StepCached() {
+	typename Model::Type *mem = static_cast<typename Model::Type *>(memory);
+	if (interrupt != 0 || Trace == TRACE_FULL)
+		return Step<Trace, Model>();
+
+	lastOpcode = blockCache->lookupOp(memory, Model::slot(mem), state->pc)->bytes;
+	state->pc += 1;
+	unsigned cycles = Execute8080Op<Trace, Model>();
+	SyncFlags(state);
+	return cycles;
+}
+
+/**
+ * Run guest code until the cycle budget is used up or the host has to act.
+ * At least one instruction is executed, so a call made while stopped at the
+ * system call pc resumes the guest.
+ * @param cycleBudget Clock cycles to run before returning STOP_BUDGET.
+ * @return Reason the loop stopped.
+ */
+template <CPU8080::TraceLevel Trace, class Model>
+CPU8080::StopReason CPU8080::RunLoop(uint64_t cycleBudget) {
+	uint64_t cycles = 0;
+	idleCandidate.valid = false;
+	do {
+		uint16_t start = state->pc;
+		cycles += StepBlock<Trace, Model>();
+		if (isHalted())
+			return STOP_HALT;
+		if (interrupt != 0)
+			return STOP_INTERRUPT;
+		if (isSystemCall())
+			return STOP_SYSCALL;
+		if (fault != NULL)
+			return STOP_FAULT;
+		// Traced runs print every iteration, so only these skip.
+		if (Trace == TRACE_NONE && idleSkip && state->pc <= start)
+			cycles += SkipIdle(cycles, cycleBudget);
+	} while (cycles < cycleBudget);
+	return STOP_BUDGET;
+}
+
+/**
+ * Called where a backward branch landed. Coming back to the candidate with
+ * the same registers, no store, no page fault and nothing pending means
+ * the loop in between can only repeat itself: memory and registers are
+ * what they were, so every iteration reads and computes the same. Those
+ * iterations are credited at once, as long as none of them would end the
+ * budget or, with the timer running, the quantum.
+ * @return Clock cycles credited.
+ */
+uint64_t CPU8080::SkipIdle(uint64_t cycles, uint64_t cycleBudget) {
+	const State8080 &was = idleCandidate.state;
+	uint64_t faults = paged != NULL ? paged->getPageFaultCount() : 0;
+	if (!idleCandidate.valid || was.pc != state->pc || stores != idleCandidate.stores ||
+	    faults != idleCandidate.faults || interrupts->hasInterrupt() || cycles >= cycleBudget ||
+	    was.a != state->a || was.b != state->b || was.c != state->c || was.d != state->d ||
+	    was.e != state->e || was.h != state->h || was.l != state->l || was.sp != state->sp ||
+	    *(const uint8_t *) &was.cc != *(const uint8_t *) &state->cc || was.int_enable != state->int_enable) {
+		MarkIdleCandidate();
+		return 0;
+	}
+
+	uint64_t length = totalCycles - idleCandidate.totalCycles;
+	uint64_t iterations = (cycleBudget - 1 - cycles) / length;
+	bool timerRuns = scheduler_timer != idleCandidate.timer;
+	if (timerRuns) {
+		// Only a timer that never went back to 0 grows by the whole loop,
+		// so interrupts stayed on and the quantum is checked as it grows.
+		if (scheduler_timer != idleCandidate.timer + length || scheduler_timer > quantum) {
+			MarkIdleCandidate();
+			return 0;
+		}
+		uint64_t beforeQuantum = (quantum - scheduler_timer) / length;
+		if (beforeQuantum < iterations)
+			iterations = beforeQuantum;
+	}
+	uint64_t credited = iterations * length;
+	totalCycles += credited;
+	processCycles[runningSlot] += credited;
+	instructions += iterations * (instructions - idleCandidate.instructions);
+	if (timerRuns)
+		scheduler_timer += (uint32_t) credited;
+	idleCycles += credited;
+	MarkIdleCandidate();
+	return credited;
+}
+
+void CPU8080::MarkIdleCandidate() {
+	idleCandidate.state = *state;
+	idleCandidate.totalCycles = totalCycles;
+	idleCandidate.instructions = instructions;
+	idleCandidate.stores = stores;
+	idleCandidate.faults = paged != NULL ? paged->getPageFaultCount() : 0;
+	idleCandidate.timer = scheduler_timer;
+	idleCandidate.valid = true;
+}
+
+template <CPU8080::TraceLevel Trace, class Model>
+unsigned CPU8080::Execute8080Op() {
+  typename Model::Type *mem = static_cast<typename Model::Type *>(memory);
+  uint8_t opcode = *lastOpcode;
+  unsigned branchCycles = 0;   // Taken conditional CALL or RET
+  switch (opcode) {
     case 0x00:
       break;  //NOP
     case 0x01:              //LXI	B,word
@@ -973,7 +496,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
     case 0x02:              //STAX B
     {
       uint16_t offset = (state->b << 8) | state->c;
-      WriteMem(memory, offset, state->a);
+      WriteMem<Model>(offset, state->a);
     }
       break;
     case 0x03:              //INX    B
@@ -1001,7 +524,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
     }
       break;
     case 0x08:
-      UnimplementedInstruction(memory, state);
+      UnimplementedInstruction();
       break;
     case 0x09:              //DAD B
     {
@@ -1016,7 +539,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
     case 0x0a:              //LDAX   B
     {
       uint16_t offset = (state->b << 8) | state->c;
-      state->a = memory->at(offset);
+      state->a = Model::load(mem, offset);
     }
       break;
     case 0x0b:              //DCX B
@@ -1046,7 +569,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
       break;
 
     case 0x10:
-      UnimplementedInstruction(memory, state);
+      UnimplementedInstruction();
       break;
     case 0x11:              //LXI	D,word
       state->e = lastOpcode[1];
@@ -1056,7 +579,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
     case 0x12:              //STAX D
     {
       uint16_t offset = (state->d << 8) | state->e;
-      WriteMem(memory, offset, state->a);
+      WriteMem<Model>(offset, state->a);
     }
       break;
     case 0x13:              //INX    D
@@ -1084,7 +607,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
     }
       break;
     case 0x18:
-      UnimplementedInstruction(memory, state);
+      UnimplementedInstruction();
       break;
     case 0x19:              //DAD    D
     {
@@ -1099,7 +622,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
     case 0x1a:              //LDAX	D
     {
       uint16_t offset = (state->d << 8) | state->e;
-      state->a = memory->at(offset);
+      state->a = Model::load(mem, offset);
     }
       break;
     case 0x1b:              //DCX D
@@ -1128,7 +651,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
     }
       break;
     case 0x20:
-      UnimplementedInstruction(memory, state);
+      UnimplementedInstruction();
       break;
     case 0x21:              //LXI	H,word
       state->l = lastOpcode[1];
@@ -1138,8 +661,8 @@ unsigned CPU8080::Emulate8080p(int debug) {
     case 0x22:              //SHLD
     {
       uint16_t offset = lastOpcode[1] | (lastOpcode[2] << 8);
-      WriteMem(memory, offset, state->l);
-      WriteMem(memory, offset + 1, state->h);
+      WriteMem<Model>(offset, state->l);
+      WriteMem<Model>(offset + 1, state->h);
       state->pc += 2;
     }
       break;
@@ -1170,7 +693,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
       }
       break;
     case 0x28:
-      UnimplementedInstruction(memory, state);
+      UnimplementedInstruction();
       break;
     case 0x29:                //DAD    H
     {
@@ -1184,8 +707,8 @@ unsigned CPU8080::Emulate8080p(int debug) {
     case 0x2a:                //LHLD adr
     {
       uint16_t offset = lastOpcode[1] | (lastOpcode[2] << 8);
-      state->l = memory->at(offset);
-      state->h = memory->at(offset + 1);
+      state->l = Model::load(mem, offset);
+      state->h = Model::load(mem, offset + 1);
       state->pc += 2;
     }
       break;
@@ -1210,7 +733,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
       state->a = ~state->a;      //CMA
       break;
     case 0x30:
-      UnimplementedInstruction(memory, state);
+      UnimplementedInstruction();
       break;
     case 0x31:              //LXI	SP,word
       state->sp = (lastOpcode[2] << 8) | lastOpcode[1];
@@ -1219,7 +742,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
     case 0x32:              //STA    (word)
     {
       uint16_t offset = (lastOpcode[2] << 8) | (lastOpcode[1]);
-      WriteMem(memory, offset, state->a);
+      WriteMem<Model>(offset, state->a);
       state->pc += 2;
     }
       break;
@@ -1228,21 +751,21 @@ unsigned CPU8080::Emulate8080p(int debug) {
       break;
     case 0x34:              //INR	M
     {
-      uint8_t res = ReadFromHL(memory, state) + 1;
+      uint8_t res = ReadFromHL<Model>(mem, state) + 1;
       FlagsZSP(state, res);
-      WriteToHL(memory, state, res);
+      WriteToHL<Model>(res);
     }
       break;
     case 0x35:              //DCR    M
     {
-      uint8_t res = ReadFromHL(memory, state) - 1;
+      uint8_t res = ReadFromHL<Model>(mem, state) - 1;
       FlagsZSP(state, res);
-      WriteToHL(memory, state, res);
+      WriteToHL<Model>(res);
     }
       break;
     case 0x36:              //MVI	M,byte
     {
-      WriteToHL(memory, state, lastOpcode[1]);
+      WriteToHL<Model>(lastOpcode[1]);
       state->pc++;
     }
       break;
@@ -1250,7 +773,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
       state->cc.cy = 1;
       break;
     case 0x38:
-      UnimplementedInstruction(memory, state);
+      UnimplementedInstruction();
       break;
     case 0x39:              //DAD    SP
     {
@@ -1264,7 +787,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
     case 0x3a:              //LDA    (word)
     {
       uint16_t offset = (lastOpcode[2] << 8) | (lastOpcode[1]);
-      state->a = memory->at(offset);
+      state->a = Model::load(mem, offset);
       state->pc += 2;
     }
       break;
@@ -1306,7 +829,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
       state->b = state->l;
       break;
     case 0x46:
-      state->b = ReadFromHL(memory, state);
+      state->b = ReadFromHL<Model>(mem, state);
       break;
     case 0x47:
       state->b = state->a;
@@ -1331,7 +854,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
       state->c = state->l;
       break;
     case 0x4e:
-      state->c = ReadFromHL(memory, state);
+      state->c = ReadFromHL<Model>(mem, state);
       break;
     case 0x4f:
       state->c = state->a;
@@ -1356,7 +879,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
       state->d = state->l;
       break;
     case 0x56:
-      state->d = ReadFromHL(memory, state);
+      state->d = ReadFromHL<Model>(mem, state);
       break;
     case 0x57:
       state->d = state->a;
@@ -1381,7 +904,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
       state->e = state->l;
       break;
     case 0x5e:
-      state->e = ReadFromHL(memory, state);
+      state->e = ReadFromHL<Model>(mem, state);
       break;
     case 0x5f:
       state->e = state->a;
@@ -1406,7 +929,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
       state->h = state->l;
       break;
     case 0x66:
-      state->h = ReadFromHL(memory, state);
+      state->h = ReadFromHL<Model>(mem, state);
       break;
     case 0x67:
       state->h = state->a;
@@ -1431,34 +954,34 @@ unsigned CPU8080::Emulate8080p(int debug) {
       state->l = state->l;
       break;
     case 0x6e:
-      state->l = ReadFromHL(memory, state);
+      state->l = ReadFromHL<Model>(mem, state);
       break;
     case 0x6f:
       state->l = state->a;
       break;
 
     case 0x70:
-      WriteToHL(memory, state, state->b);
+      WriteToHL<Model>(state->b);
       break;    //MOV    M,B
     case 0x71:
-      WriteToHL(memory, state, state->c);
+      WriteToHL<Model>(state->c);
       break;    //MOV    M,C
     case 0x72:
-      WriteToHL(memory, state, state->d);
+      WriteToHL<Model>(state->d);
       break;    //MOV    M,D
     case 0x73:
-      WriteToHL(memory, state, state->e);
+      WriteToHL<Model>(state->e);
       break;    //MOV    M,E
     case 0x74:
-      WriteToHL(memory, state, state->h);
+      WriteToHL<Model>(state->h);
       break;    //MOV    M,H
     case 0x75:
-      WriteToHL(memory, state, state->l);
+      WriteToHL<Model>(state->l);
       break;    //MOV    M,L
     case 0x76:
       break;                                  //HLT
     case 0x77:
-      WriteToHL(memory, state, state->a);
+      WriteToHL<Model>(state->a);
       break;    //MOV    M,A
 
     case 0x78:
@@ -1480,7 +1003,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
       state->a = state->l;
       break;
     case 0x7e:
-      state->a = ReadFromHL(memory, state);
+      state->a = ReadFromHL<Model>(mem, state);
       break;
     case 0x7f:
       break;
@@ -1523,7 +1046,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
       break;  //ADD L
     case 0x86:            //ADD M
     {
-      uint16_t res = (uint16_t) state->a + (uint16_t) ReadFromHL(memory, state);
+      uint16_t res = (uint16_t) state->a + (uint16_t) ReadFromHL<Model>(mem, state);
       ArithFlagsA(state, res);
       state->a = (res & 0xff);
     }
@@ -1573,7 +1096,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
       break;  //ADC L
     case 0x8e:          //ADC M
     {
-      uint16_t res = (uint16_t) state->a + (uint16_t) ReadFromHL(memory, state) + state->cc.cy;
+      uint16_t res = (uint16_t) state->a + (uint16_t) ReadFromHL<Model>(mem, state) + state->cc.cy;
       ArithFlagsA(state, res);
       state->a = (res & 0xff);
     }
@@ -1624,7 +1147,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
       break;  //SUB L
     case 0x96:            //SUB M
     {
-      uint16_t res = (uint16_t) state->a - (uint16_t) ReadFromHL(memory, state);
+      uint16_t res = (uint16_t) state->a - (uint16_t) ReadFromHL<Model>(mem, state);
       ArithFlagsA(state, res);
       state->a = (res & 0xff);
     }
@@ -1674,7 +1197,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
       break;  //SBB L
     case 0x9e:          //SBB M
     {
-      uint16_t res = (uint16_t) state->a - (uint16_t) ReadFromHL(memory, state) - state->cc.cy;
+      uint16_t res = (uint16_t) state->a - (uint16_t) ReadFromHL<Model>(mem, state) - state->cc.cy;
       ArithFlagsA(state, res);
       state->a = (res & 0xff);
     }
@@ -1711,7 +1234,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
       LogicFlagsA(state);
       break;
     case 0xa6:
-      state->a = state->a & ReadFromHL(memory, state);
+      state->a = state->a & ReadFromHL<Model>(mem, state);
       LogicFlagsA(state);
       break;
     case 0xa7:
@@ -1744,7 +1267,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
       LogicFlagsA(state);
       break;
     case 0xae:
-      state->a = state->a ^ ReadFromHL(memory, state);
+      state->a = state->a ^ ReadFromHL<Model>(mem, state);
       LogicFlagsA(state);
       break;
     case 0xaf:
@@ -1777,7 +1300,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
       LogicFlagsA(state);
       break;
     case 0xb6:
-      state->a = state->a | ReadFromHL(memory, state);
+      state->a = state->a | ReadFromHL<Model>(mem, state);
       LogicFlagsA(state);
       break;
     case 0xb7:
@@ -1816,7 +1339,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
     }
       break;  //CMP L
     case 0xbe: {
-      uint16_t res = (uint16_t) state->a - (uint16_t) ReadFromHL(memory, state);
+      uint16_t res = (uint16_t) state->a - (uint16_t) ReadFromHL<Model>(mem, state);
       ArithFlagsA(state, res);
     }
       break;  //CMP L
@@ -1827,16 +1350,19 @@ unsigned CPU8080::Emulate8080p(int debug) {
       break;  //CMP A
 
     case 0xc0:            //RNZ
+      SyncFlags(state);
       if (state->cc.z == 0) {
-        state->pc = memory->at(state->sp) | (memory->at(state->sp + 1) << 8);
+        branchCycles = TIMING_TABLE[opcode].condition_cycles;
+        state->pc = Model::load(mem, state->sp) | (Model::load(mem, state->sp + 1) << 8);
         state->sp += 2;
       }
       break;
 
     case 0xc1:            //POP    B
-      Pop(memory, state, &state->b, &state->c);
+      Pop<Trace, Model>(mem, state, trace, &state->b, &state->c);
       break;
     case 0xc2:            //JNZ address
+      SyncFlags(state);
       if (0 == state->cc.z)
         state->pc = (lastOpcode[2] << 8) | lastOpcode[1];
       else
@@ -1846,10 +1372,12 @@ unsigned CPU8080::Emulate8080p(int debug) {
       state->pc = (lastOpcode[2] << 8) | lastOpcode[1];
       break;
     case 0xc4:            //CNZ adr
+      SyncFlags(state);
       if (state->cc.z == 0) {
+        branchCycles = TIMING_TABLE[opcode].condition_cycles;
         uint16_t ret = state->pc + 2;
-        WriteMem(memory, state->sp - 1, (ret >> 8) & 0xff);
-        WriteMem(memory, state->sp - 2, (ret & 0xff));
+        WriteMem<Model>(state->sp - 1, (ret >> 8) & 0xff);
+        WriteMem<Model>(state->sp - 2, (ret & 0xff));
         state->sp = state->sp - 2;
         state->pc = (lastOpcode[2] << 8) | lastOpcode[1];
       } else
@@ -1857,7 +1385,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
       break;
 
     case 0xc5:            //PUSH   B
-      Push(memory, state, state->b, state->c);
+      Push<Model>(state->b, state->c);
       break;
     case 0xc6:            //ADI    byte
     {
@@ -1871,36 +1399,41 @@ unsigned CPU8080::Emulate8080p(int debug) {
     case 0xc7:          //RST 0
     {
       uint16_t ret = state->pc + 2;
-      WriteMem(memory, state->sp - 1, (ret >> 8) & 0xff);
-      WriteMem(memory, state->sp - 2, (ret & 0xff));
+      WriteMem<Model>(state->sp - 1, (ret >> 8) & 0xff);
+      WriteMem<Model>(state->sp - 2, (ret & 0xff));
       state->sp = state->sp - 2;
       state->pc = 0x0000;
     }
       break;
     case 0xc8:          //RZ
+      SyncFlags(state);
       if (state->cc.z) {
-        state->pc = memory->at(state->sp) | (memory->at(state->sp + 1) << 8);
+        branchCycles = TIMING_TABLE[opcode].condition_cycles;
+        state->pc = Model::load(mem, state->sp) | (Model::load(mem, state->sp + 1) << 8);
         state->sp += 2;
       }
       break;
     case 0xc9:            //RET
-      state->pc = memory->at(state->sp) | (memory->at(state->sp + 1) << 8);
+      state->pc = Model::load(mem, state->sp) | (Model::load(mem, state->sp + 1) << 8);
       state->sp += 2;
       break;
     case 0xca:            //JZ adr
+      SyncFlags(state);
       if (state->cc.z)
         state->pc = (lastOpcode[2] << 8) | lastOpcode[1];
       else
         state->pc += 2;
       break;
     case 0xcb:
-      UnimplementedInstruction(memory, state);
+      UnimplementedInstruction();
       break;
     case 0xcc:            //CZ adr
+      SyncFlags(state);
       if (state->cc.z == 1) {
+        branchCycles = TIMING_TABLE[opcode].condition_cycles;
         uint16_t ret = state->pc + 2;
-        WriteMem(memory, state->sp - 1, (ret >> 8) & 0xff);
-        WriteMem(memory, state->sp - 2, (ret & 0xff));
+        WriteMem<Model>(state->sp - 1, (ret >> 8) & 0xff);
+        WriteMem<Model>(state->sp - 2, (ret & 0xff));
         state->sp = state->sp - 2;
         state->pc = (lastOpcode[2] << 8) | lastOpcode[1];
       } else
@@ -1909,8 +1442,8 @@ unsigned CPU8080::Emulate8080p(int debug) {
     case 0xcd:            //CALL address
     {
       uint16_t ret = state->pc + 2;
-      WriteMem(memory, state->sp - 1, (ret >> 8) & 0xff);
-      WriteMem(memory, state->sp - 2, (ret & 0xff));
+      WriteMem<Model>(state->sp - 1, (ret >> 8) & 0xff);
+      WriteMem<Model>(state->sp - 2, (ret & 0xff));
       state->sp = state->sp - 2;
       state->pc = (lastOpcode[2] << 8) | lastOpcode[1];
     }
@@ -1927,8 +1460,8 @@ unsigned CPU8080::Emulate8080p(int debug) {
     case 0xcf:          //RST 1
     {
       uint16_t ret = state->pc + 2;
-      WriteMem(memory, state->sp - 1, (ret >> 8) & 0xff);
-      WriteMem(memory, state->sp - 2, (ret & 0xff));
+      WriteMem<Model>(state->sp - 1, (ret >> 8) & 0xff);
+      WriteMem<Model>(state->sp - 2, (ret & 0xff));
       state->sp = state->sp - 2;
       state->pc = 0x0008;
     }
@@ -1936,12 +1469,13 @@ unsigned CPU8080::Emulate8080p(int debug) {
 
     case 0xd0:          //RNC
       if (state->cc.cy == 0) {
-        state->pc = memory->at(state->sp) | (memory->at(state->sp + 1) << 8);
+        branchCycles = TIMING_TABLE[opcode].condition_cycles;
+        state->pc = Model::load(mem, state->sp) | (Model::load(mem, state->sp + 1) << 8);
         state->sp += 2;
       }
       break;
     case 0xd1:            //POP    D
-      Pop(memory, state, &state->d, &state->e);
+      Pop<Trace, Model>(mem, state, trace, &state->d, &state->e);
       break;
     case 0xd2:            //JNC
       if (state->cc.cy == 0)
@@ -1954,16 +1488,17 @@ unsigned CPU8080::Emulate8080p(int debug) {
       break;
     case 0xd4:            //CNC adr
       if (state->cc.cy == 0) {
+        branchCycles = TIMING_TABLE[opcode].condition_cycles;
         uint16_t ret = state->pc + 2;
-        WriteMem(memory, state->sp - 1, (ret >> 8) & 0xff);
-        WriteMem(memory, state->sp - 2, (ret & 0xff));
+        WriteMem<Model>(state->sp - 1, (ret >> 8) & 0xff);
+        WriteMem<Model>(state->sp - 2, (ret & 0xff));
         state->sp = state->sp - 2;
         state->pc = (lastOpcode[2] << 8) | lastOpcode[1];
       } else
         state->pc += 2;
       break;
     case 0xd5:            //PUSH   D
-      Push(memory, state, state->d, state->e);
+      Push<Model>(state->d, state->e);
       break;
     case 0xd6:            //SUI    byte
     {
@@ -1977,20 +1512,21 @@ unsigned CPU8080::Emulate8080p(int debug) {
     case 0xd7:          //RST 2
     {
       uint16_t ret = state->pc + 2;
-      WriteMem(memory, state->sp - 1, (ret >> 8) & 0xff);
-      WriteMem(memory, state->sp - 2, (ret & 0xff));
+      WriteMem<Model>(state->sp - 1, (ret >> 8) & 0xff);
+      WriteMem<Model>(state->sp - 2, (ret & 0xff));
       state->sp = state->sp - 2;
       state->pc = 0x10;
     }
       break;
     case 0xd8:          //RC
       if (state->cc.cy != 0) {
-        state->pc = memory->at(state->sp) | (memory->at(state->sp + 1) << 8);
+        branchCycles = TIMING_TABLE[opcode].condition_cycles;
+        state->pc = Model::load(mem, state->sp) | (Model::load(mem, state->sp + 1) << 8);
         state->sp += 2;
       }
       break;
     case 0xd9:
-      UnimplementedInstruction(memory, state);
+      UnimplementedInstruction();
       break;
     case 0xda:          //JC
       if (state->cc.cy != 0)
@@ -2003,16 +1539,17 @@ unsigned CPU8080::Emulate8080p(int debug) {
       break;
     case 0xdc:          //CC adr
       if (state->cc.cy != 0) {
+        branchCycles = TIMING_TABLE[opcode].condition_cycles;
         uint16_t ret = state->pc + 2;
-        WriteMem(memory, state->sp - 1, (ret >> 8) & 0xff);
-        WriteMem(memory, state->sp - 2, (ret & 0xff));
+        WriteMem<Model>(state->sp - 1, (ret >> 8) & 0xff);
+        WriteMem<Model>(state->sp - 2, (ret & 0xff));
         state->sp = state->sp - 2;
         state->pc = (lastOpcode[2] << 8) | lastOpcode[1];
       } else
         state->pc += 2;
       break;
     case 0xdd:
-      UnimplementedInstruction(memory, state);
+      UnimplementedInstruction();
       break;
     case 0xde:          //SBI byte
     {
@@ -2026,23 +1563,26 @@ unsigned CPU8080::Emulate8080p(int debug) {
     case 0xdf:          //RST 3
     {
       uint16_t ret = state->pc + 2;
-      WriteMem(memory, state->sp - 1, (ret >> 8) & 0xff);
-      WriteMem(memory, state->sp - 2, (ret & 0xff));
+      WriteMem<Model>(state->sp - 1, (ret >> 8) & 0xff);
+      WriteMem<Model>(state->sp - 2, (ret & 0xff));
       state->sp = state->sp - 2;
       state->pc = 0x18;
     }
       break;
 
     case 0xe0:          //RPO
+      SyncFlags(state);
       if (state->cc.p == 0) {
-        state->pc = memory->at(state->sp) | (memory->at(state->sp + 1) << 8);
+        branchCycles = TIMING_TABLE[opcode].condition_cycles;
+        state->pc = Model::load(mem, state->sp) | (Model::load(mem, state->sp + 1) << 8);
         state->sp += 2;
       }
       break;
     case 0xe1:          //POP    H
-      Pop(memory, state, &state->h, &state->l);
+      Pop<Trace, Model>(mem, state, trace, &state->h, &state->l);
       break;
     case 0xe2:            //JPO
+      SyncFlags(state);
       if (state->cc.p == 0)
         state->pc = (lastOpcode[2] << 8) | lastOpcode[1];
       else
@@ -2052,24 +1592,26 @@ unsigned CPU8080::Emulate8080p(int debug) {
     {
       uint8_t h = state->h;
       uint8_t l = state->l;
-      state->l = memory->at(state->sp);
-      state->h = memory->at(state->sp + 1);
-      WriteMem(memory, state->sp, l);
-      WriteMem(memory, state->sp + 1, h);
+      state->l = Model::load(mem, state->sp);
+      state->h = Model::load(mem, state->sp + 1);
+      WriteMem<Model>(state->sp, l);
+      WriteMem<Model>(state->sp + 1, h);
     }
       break;
     case 0xe4:            //CPO adr
+      SyncFlags(state);
       if (state->cc.p == 0) {
+        branchCycles = TIMING_TABLE[opcode].condition_cycles;
         uint16_t ret = state->pc + 2;
-        WriteMem(memory, state->sp - 1, (ret >> 8) & 0xff);
-        WriteMem(memory, state->sp - 2, (ret & 0xff));
+        WriteMem<Model>(state->sp - 1, (ret >> 8) & 0xff);
+        WriteMem<Model>(state->sp - 2, (ret & 0xff));
         state->sp = state->sp - 2;
         state->pc = (lastOpcode[2] << 8) | lastOpcode[1];
       } else
         state->pc += 2;
       break;
     case 0xe5:            //PUSH   H
-      Push(memory, state, state->h, state->l);
+      Push<Model>(state->h, state->l);
       break;
     case 0xe6:            //ANI    byte
     {
@@ -2081,15 +1623,17 @@ unsigned CPU8080::Emulate8080p(int debug) {
     case 0xe7:          //RST 4
     {
       uint16_t ret = state->pc + 2;
-      WriteMem(memory, state->sp - 1, (ret >> 8) & 0xff);
-      WriteMem(memory, state->sp - 2, (ret & 0xff));
+      WriteMem<Model>(state->sp - 1, (ret >> 8) & 0xff);
+      WriteMem<Model>(state->sp - 2, (ret & 0xff));
       state->sp = state->sp - 2;
       state->pc = 0x20;
     }
       break;
     case 0xe8:          //RPE
+      SyncFlags(state);
       if (state->cc.p != 0) {
-        state->pc = memory->at(state->sp) | (memory->at(state->sp + 1) << 8);
+        branchCycles = TIMING_TABLE[opcode].condition_cycles;
+        state->pc = Model::load(mem, state->sp) | (Model::load(mem, state->sp + 1) << 8);
         state->sp += 2;
       }
       break;
@@ -2098,12 +1642,14 @@ unsigned CPU8080::Emulate8080p(int debug) {
         uint8_t Dtemp = state->d;
         uint8_t Etemp = state->e;
         state->pc = (state->h << 8) | state->l;
-        Pop(memory, state, &state->h, &state->l);
-        Pop(memory, state, &state->d, &state->e);
-        ((Memory *) (memory))->setBaseRegister((Dtemp << 8) | Etemp);
+        Pop<Trace, Model>(mem, state, trace, &state->h, &state->l);
+        Pop<Trace, Model>(mem, state, trace, &state->d, &state->e);
+        Model::setBase(mem, (Dtemp << 8) | Etemp);
+        runningSlot = Model::slot(mem);
         break;
     }
     case 0xea:            //JPE
+      SyncFlags(state);
       if (state->cc.p != 0)
         state->pc = (lastOpcode[2] << 8) | lastOpcode[1];
 
@@ -2121,17 +1667,19 @@ unsigned CPU8080::Emulate8080p(int debug) {
     }
       break;
     case 0xec:          //CPE adr
+      SyncFlags(state);
       if (state->cc.p != 0) {
+        branchCycles = TIMING_TABLE[opcode].condition_cycles;
         uint16_t ret = state->pc + 2;
-        WriteMem(memory, state->sp - 1, (ret >> 8) & 0xff);
-        WriteMem(memory, state->sp - 2, (ret & 0xff));
+        WriteMem<Model>(state->sp - 1, (ret >> 8) & 0xff);
+        WriteMem<Model>(state->sp - 2, (ret & 0xff));
         state->sp = state->sp - 2;
         state->pc = (lastOpcode[2] << 8) | lastOpcode[1];
       } else
         state->pc += 2;
       break;
     case 0xed:
-      UnimplementedInstruction(memory, state);
+      UnimplementedInstruction();
       break;
     case 0xee:          //XRI    data
     {
@@ -2145,23 +1693,27 @@ unsigned CPU8080::Emulate8080p(int debug) {
     case 0xef:          //RST 5
     {
       uint16_t ret = state->pc + 2;
-      WriteMem(memory, state->sp - 1, (ret >> 8) & 0xff);
-      WriteMem(memory, state->sp - 2, (ret & 0xff));
+      WriteMem<Model>(state->sp - 1, (ret >> 8) & 0xff);
+      WriteMem<Model>(state->sp - 2, (ret & 0xff));
       state->sp = state->sp - 2;
       state->pc = 0x28;
     }
       break;
 
     case 0xf0:          //RP
+      SyncFlags(state);
       if (state->cc.s == 0) {
-        state->pc = memory->at(state->sp) | (memory->at(state->sp + 1) << 8);
+        branchCycles = TIMING_TABLE[opcode].condition_cycles;
+        state->pc = Model::load(mem, state->sp) | (Model::load(mem, state->sp + 1) << 8);
         state->sp += 2;
       }
       break;
     case 0xf1:          //POP    PSW
-      Pop(memory, state, &state->a, (unsigned char *) &state->cc);
+      SyncFlags(state);
+      Pop<Trace, Model>(mem, state, trace, &state->a, (unsigned char *) &state->cc);
       break;
     case 0xf2:
+      SyncFlags(state);
       if (state->cc.s == 0)
         state->pc = (lastOpcode[2] << 8) | lastOpcode[1];
       else
@@ -2171,10 +1723,12 @@ unsigned CPU8080::Emulate8080p(int debug) {
       state->int_enable = 0;
       break;
     case 0xf4:            //CP
+      SyncFlags(state);
       if (state->cc.s == 0) {
+        branchCycles = TIMING_TABLE[opcode].condition_cycles;
         uint16_t ret = state->pc + 2;
-        WriteMem(memory, state->sp - 1, (ret >> 8) & 0xff);
-        WriteMem(memory, state->sp - 2, (ret & 0xff));
+        WriteMem<Model>(state->sp - 1, (ret >> 8) & 0xff);
+        WriteMem<Model>(state->sp - 2, (ret & 0xff));
         state->sp = state->sp - 2;
         state->pc = (lastOpcode[2] << 8) | lastOpcode[1];
       } else
@@ -2182,7 +1736,8 @@ unsigned CPU8080::Emulate8080p(int debug) {
       break;
 
     case 0xf5:            //PUSH   PSW
-      Push(memory, state, state->a, *(unsigned char *) &state->cc);
+      SyncFlags(state);
+      Push<Model>(state->a, *(unsigned char *) &state->cc);
       break;
 
     case 0xf6:            //ORI    byte
@@ -2198,15 +1753,17 @@ unsigned CPU8080::Emulate8080p(int debug) {
     case 0xf7:          //RST 6
     {
       uint16_t ret = state->pc + 2;
-      WriteMem(memory, state->sp - 1, (ret >> 8) & 0xff);
-      WriteMem(memory, state->sp - 2, (ret & 0xff));
+      WriteMem<Model>(state->sp - 1, (ret >> 8) & 0xff);
+      WriteMem<Model>(state->sp - 2, (ret & 0xff));
       state->sp = state->sp - 2;
       state->pc = 0x30;
     }
       break;
     case 0xf8:          //RM
+      SyncFlags(state);
       if (state->cc.s != 0) {
-        state->pc = memory->at(state->sp) | (memory->at(state->sp + 1) << 8);
+        branchCycles = TIMING_TABLE[opcode].condition_cycles;
+        state->pc = Model::load(mem, state->sp) | (Model::load(mem, state->sp + 1) << 8);
         state->sp += 2;
       }
       break;
@@ -2214,6 +1771,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
       state->sp =   state->l | (state->h << 8);
       break;
     case 0xfa:          //JM
+      SyncFlags(state);
       if (state->cc.s != 0)
         state->pc = (lastOpcode[2] << 8) | lastOpcode[1];
       else
@@ -2221,12 +1779,15 @@ unsigned CPU8080::Emulate8080p(int debug) {
       break;
     case 0xfb:
       state->int_enable = 1;
+      pollInterrupts();
       break;
     case 0xfc:          //CM
+      SyncFlags(state);
       if (state->cc.s != 0) {
+        branchCycles = TIMING_TABLE[opcode].condition_cycles;
         uint16_t ret = state->pc + 2;
-        WriteMem(memory, state->sp - 1, (ret >> 8) & 0xff);
-        WriteMem(memory, state->sp - 2, (ret & 0xff));
+        WriteMem<Model>(state->sp - 1, (ret >> 8) & 0xff);
+        WriteMem<Model>(state->sp - 2, (ret & 0xff));
         state->sp = state->sp - 2;
         state->pc = (lastOpcode[2] << 8) | lastOpcode[1];
       } else
@@ -2234,7 +1795,7 @@ unsigned CPU8080::Emulate8080p(int debug) {
       break;
 
     case 0xfd:
-      UnimplementedInstruction(memory, state);
+      UnimplementedInstruction();
       break;
     case 0xfe:            //CPI  byte
     {
@@ -2247,53 +1808,96 @@ unsigned CPU8080::Emulate8080p(int debug) {
     case 0xff:          //RST 7
     {
       uint16_t ret = state->pc + 2;
-      WriteMem(memory, state->sp - 1, (ret >> 8) & 0xff);
-      WriteMem(memory, state->sp - 2, (ret & 0xff));
+      WriteMem<Model>(state->sp - 1, (ret >> 8) & 0xff);
+      WriteMem<Model>(state->sp - 2, (ret & 0xff));
       state->sp = state->sp - 2;
       state->pc = 0x38;
     }
       break;
   }
 
-  if (debug != 0) {
-    printf("\t");
-    printf("%c", state->cc.z ? 'z' : '.');
-    printf("%c", state->cc.s ? 's' : '.');
-    printf("%c", state->cc.p ? 'p' : '.');
-    printf("%c", state->cc.cy ? 'c' : '.');
-    printf("%c  ", state->cc.ac ? 'a' : '.');
-    printf("A $%02x B $%02x C $%02x D $%02x E $%02x H $%02x L $%02x SP %04x\n", state->a, state->b, state->c,
-           state->d, state->e, state->h, state->l, state->sp);
+  if (Trace == TRACE_FULL) {
+    SyncFlags(state);
+    trace->put('\t');
+    trace->put(state->cc.z ? 'z' : '.');
+    trace->put(state->cc.s ? 's' : '.');
+    trace->put(state->cc.p ? 'p' : '.');
+    trace->put(state->cc.cy ? 'c' : '.');
+    trace->put(state->cc.ac ? 'a' : '.');
+    static const char *const names[7] = {"  A $", " B $", " C $", " D $", " E $", " H $", " L $"};
+    const uint8_t registers[7] = {state->a, state->b, state->c, state->d, state->e, state->h, state->l};
+    for (int i = 0; i < 7; i++) {
+      trace->write(names[i]);
+      trace->hex(registers[i], 2);
+    }
+    trace->write(" SP ");
+    trace->hex(state->sp, 4);
+    trace->put('\n');
   }
-	scheduler_timer += cycles8080[*lastOpcode];
+	unsigned cycles = TIMING_TABLE[opcode].base_cycles + branchCycles;
+	totalCycles += cycles;
+	instructions++;
+	processCycles[runningSlot] += cycles;
+	scheduler_timer += cycles;
 	if(state->int_enable ==0)
 		scheduler_timer =0;
-	if (debug != 0)
-		printf("Scheduler Timer is: %d\n",scheduler_timer);
+	if (Trace == TRACE_FULL) {
+		trace->write("Scheduler Timer is: ");
+		trace->decimal(scheduler_timer);
+		trace->put('\n');
+	}
 	if(state->int_enable ==1 && scheduler_timer > quantum)
 	{
-	        if (debug != 0)
-			printf("Interrupt: %d\n",scheduler_timer);
+	        if (Trace == TRACE_FULL) {
+			trace->write("Interrupt: ");
+			trace->decimal(scheduler_timer);
+			trace->put('\n');
+		}
 		scheduler_timer = 0;
 		dispatchScheduler();
 
 	}
 
-	return cycles8080[*lastOpcode];
+	return cycles;
 }
-void CPU8080::setQuantum(uint8_t quant){
+void CPU8080::setQuantum(uint16_t quant){
 	
 	quantum  = quant;	
 }
+// The timer may be left past the quantum; the interrupt is raised by the
+// next instruction's check, once pc has left SYSTEM_CALL_PC. Raised here,
+// it would be taken at pc 7 and the call made again on return.
+void CPU8080::chargeCycles(unsigned cycles){
+
+	totalCycles += cycles;
+	processCycles[runningSlot] += cycles;
+	if(state->int_enable ==0)
+		return;
+	scheduler_timer += cycles;
+}
 void CPU8080::dispatchScheduler(){
      
-     raiseInterrupt(0xef);
+     raiseInterrupt(TIMER_INTERRUPT, INTERRUPT_PRIORITY_TIMER);
 	
 }
-void CPU8080::raiseInterrupt(uint8_t code){
+void CPU8080::raiseInterrupt(uint8_t code, uint8_t priority){
+
+     // The latched vector is still pending as far as the guest can tell.
+     if (interrupt != 0 && interrupt_code == code)
+          interrupts->noteCoalesced();
+     else
+          interrupts->queueInterrupt(code, priority);
+     pollInterrupts();
+}
+
+// Latch the most urgent request, like the single INT line of the 8080.
+void CPU8080::pollInterrupts(){
 
-     interrupt = 1;
-     interrupt_code = code;	
+     InterruptController::InterruptRequest request;
+     if (interrupt == 0 && state->int_enable && interrupts->tryGetNext(request)) {
+          interrupt = 1;
+          interrupt_code = request.code;
+     }
 }
 /*
 void CPU8080::onInterrupt(){
@@ -2324,29 +1928,35 @@ void CPU8080::onInterrupt(){
 void CPU8080::onInterrupt(){
     interrupt = 0;
 
-    uint16_t base = ((Memory *)memory)->getBaseRegister();
-    uint16_t limit = ((Memory *)memory)->getLimitRegister();
+    // Other memory models have no base register and no pages to mark.
+    auto physicalWriteAt = [this](uint32_t ind) -> uint8_t & {
+        return paged != NULL ? paged->physicalWriteAt(ind) : memory->physicalAt(ind);
+    };
+    uint16_t base = paged != NULL ? paged->getBaseRegister() : 0;
 
-    memory->physicalAt(int_buffer+0) = state->a;
+    physicalWriteAt(int_buffer+0) = state->a;
 
-    memory->physicalAt(int_buffer+1) = state->b;
-    memory->physicalAt(int_buffer+2) = state->c;
+    physicalWriteAt(int_buffer+1) = state->b;
+    physicalWriteAt(int_buffer+2) = state->c;
 
-    memory->physicalAt(int_buffer+3) = state->d;
-    memory->physicalAt(int_buffer+4) = state->e;
-    memory->physicalAt(int_buffer+5) = state->h;
-    memory->physicalAt(int_buffer+6) = state->l;
+    physicalWriteAt(int_buffer+3) = state->d;
+    physicalWriteAt(int_buffer+4) = state->e;
+    physicalWriteAt(int_buffer+5) = state->h;
+    physicalWriteAt(int_buffer+6) = state->l;
 
-    memory->physicalAt(int_buffer+8) = (state->sp >> 8) & 0xff;
-    memory->physicalAt(int_buffer+7) = (state->sp & 0xff);
+    physicalWriteAt(int_buffer+8) = (state->sp >> 8) & 0xff;
+    physicalWriteAt(int_buffer+7) = (state->sp & 0xff);
 
-    memory->physicalAt(int_buffer+10) = (state->pc >> 8) & 0xff;
-    memory->physicalAt(int_buffer+9) = (state->pc & 0xff);
+    physicalWriteAt(int_buffer+10) = (state->pc >> 8) & 0xff;
+    physicalWriteAt(int_buffer+9) = (state->pc & 0xff);
 
-    memory->physicalAt(int_buffer+12) = (base >> 8) & 0xff;
-    memory->physicalAt(int_buffer+11) = (base & 0xff);
+    physicalWriteAt(int_buffer+12) = (base >> 8) & 0xff;
+    physicalWriteAt(int_buffer+11) = (base & 0xff);
 
-    memory->physicalAt(int_buffer+13) = *(unsigned char *)&state->cc;
+    SyncFlags(state);
+    physicalWriteAt(int_buffer+13) = *(unsigned char *)&state->cc;
+    blockCache->noteWrite(0, int_buffer);
+    blockCache->noteWrite(0, int_buffer+13);
 
 }
 
@@ -2357,37 +1967,113 @@ void CPU8080::ClearInterrupt(){
 	
 	interrupt = 0;
 	interrupt_code = 0x00;
+	interrupts->clear();
 
 }
 
 
+// The image is mapped once through ProgramCache and paged in lazily by
+// Memory, so loading the same program again copies nothing.
 void CPU8080::ReadFileIntoMemoryAt(const char *filename, uint32_t offset) {
-  FILE *f = fopen(filename, "rb");
-  if (f == NULL) {
+  const ProgramCache::_programImage *image = ProgramCache::shared().load(filename);
+  if (image == NULL) {
+    if (!exitOnFault) {
+      raiseFault("program cannot be opened");
+      return;
+    }
     printf("error: Couldn't open %s--\n", filename);
     exit(1);
   }
-  fseek(f, 0L, SEEK_END);
-  int fsize = ftell(f);
-  fseek(f, 0L, SEEK_SET);
-
-  uint8_t *buffer = &memory->physicalAt(offset);
-  fread(buffer, fsize, 1, f);
-  fclose(f);
+  bool fits;
+  if (paged == NULL) {
+    fits = offset + image->size <= 0x10000;
+    for (size_t i = 0; fits && i < image->size; i++)
+      memory->physicalAt(offset + (uint32_t) i) = image->data[i];
+  } else
+    fits = paged->loadImage(offset, image->data, image->size);
+  if (!fits) {
+    if (!exitOnFault) {
+      raiseFault("program does not fit");
+      return;
+    }
+    printf("error: %s (%zu bytes) does not fit at %04x--\n", filename, image->size, offset);
+    exit(1);
+  }
+  blockCache->flush();
 }
 
 CPU8080::CPU8080(MemoryBase *mem) {
   state = (State8080 *) calloc(1, sizeof(State8080));
   //memory = (uint8_t*) malloc(0x10000);  //16K
   memory = mem;
+  // The interpreter's memory model, picked once; see memory_model.h.
+  paged = dynamic_cast<Memory *>(mem);
+  if (paged != NULL)
+    selectModel<PagedModel>();
+  else if (dynamic_cast<FlatMemory *>(mem) != NULL)
+    selectModel<FlatModel>();
+  else if (dynamic_cast<MemoryBankController *>(mem) != NULL)
+    selectModel<BankedModel>();
+  else {
+    printf("error: unsupported memory type--\n");
+    exit(1);
+  }
+  int slots = paged != NULL ? paged->getProcessCount() : 1;
+  blockCache = new BlockCache(slots);
+  translator = NULL;
+  translatedBlock = NULL;
+  interrupts = new InterruptController();
+  trace = new TraceSink(stdout);
+  processTable = NULL;
+  processCycles = (uint64_t *) calloc(slots, sizeof(uint64_t));
+  totalCycles = 0;
+  instructions = 0;
+  stores = 0;
+  idleCandidate.valid = false;
+  idleSkip = true;
+  idleCycles = 0;
+  runningSlot = processSlot();
+  exitOnFault = true;
+  fault = NULL;
   state->int_enable =1;
 }
 
 CPU8080::~CPU8080() {
   free(state);
+  delete blockCache;
+  delete translator;
+  delete interrupts;
+  delete trace;
+  delete processTable;
+  free(processCycles);
   //free(memory);
 }
 
+void CPU8080::invalidateCode() {
+  blockCache->flush();
+  runningSlot = processSlot();
+}
+
+bool CPU8080::setTranslation(bool enable) {
+  if (enable && translator == NULL && BlockTranslator::isAvailable())
+    translator = new BlockTranslator();
+  else if (!enable) {
+    delete translator;
+    translator = NULL;
+    blockCache->dropTranslations();
+  }
+  return translator != NULL;
+}
+
+void CPU8080::setFastContextSwitch(bool enable) {
+  if (enable && processTable == NULL)
+    processTable = new ProcessTable();
+  else if (!enable) {
+    delete processTable;
+    processTable = NULL;
+  }
+}
+
 bool CPU8080::isHalted() const {
   return (*lastOpcode == 0x76);
 }
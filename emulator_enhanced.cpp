@@ -1,6 +1,13 @@
 #include "emulator_enhanced.h"
-#include <fstream>
+#include "block_cache.h"
+#include "disassembler.h"
+#include "memory_model.h"
+#include "os_core.h"
 #include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <cstring>
 #include <iomanip>
 #include <sstream>
 #include <unordered_map>
@@ -25,218 +32,9 @@ const uint8_t PARITY_TABLE[256] = {
     1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1
 };
 
-// Performance optimization: Cache for frequently accessed memory locations
-class MemoryCache {
-private:
-    static constexpr size_t CACHE_SIZE = 256;
-    struct CacheEntry {
-        uint16_t address;
-        uint8_t value;
-        bool valid;
-        bool dirty;
-    };
-    std::array<CacheEntry, CACHE_SIZE> cache;
-    MemoryBase* memory;
-
-public:
-    MemoryCache(MemoryBase* mem) : memory(mem) {
-        for (auto& entry : cache) {
-            entry.valid = false;
-            entry.dirty = false;
-        }
-    }
-
-    uint8_t read(uint16_t address) {
-        size_t index = address & (CACHE_SIZE - 1);
-        auto& entry = cache[index];
-        
-        if (entry.valid && entry.address == address) {
-            return entry.value;
-        }
-
-        // Cache miss
-        if (entry.valid && entry.dirty) {
-            memory->at(entry.address) = entry.value;
-        }
-
-        entry.address = address;
-        entry.value = memory->at(address);
-        entry.valid = true;
-        entry.dirty = false;
-        
-        return entry.value;
-    }
-
-    void write(uint16_t address, uint8_t value) {
-        try {
-            size_t index = address & (CACHE_SIZE - 1);
-            auto& entry = cache[index];
-
-            entry.address = address;
-            entry.value = value;
-            entry.valid = true;
-            entry.dirty = true;
-        } catch (const std::exception& e) {
-            throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
-                                  "Cache write failed");
-        }
-    }
-
-    void flush() {
-        try {
-            for (auto& entry : cache) {
-                if (entry.valid && entry.dirty) {
-                    memory->at(entry.address) = entry.value;
-                    entry.dirty = false;
-                }
-            }
-        } catch (const std::exception& e) {
-            throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
-                                  "Cache flush failed");
-        }
-    }
-};
-
-// Performance optimization: Instruction decoder lookup table
-struct DecodedInstruction {
-    uint8_t length;      // Instruction length in bytes
-    uint8_t cycles;      // Base cycle count
-    bool affects_flags;  // Whether instruction affects flags
-    bool memory_access;  // Whether instruction accesses memory
-};
-
-// Helper function to create instruction table
-static std::array<DecodedInstruction, 256> createInstructionTable() {
-    std::array<DecodedInstruction, 256> table;
-    
-    // Initialize all entries with default values
-    for (auto& entry : table) {
-        entry = {1, 4, false, false};  // Default: 1 byte, 4 cycles, no flags, no memory
-    }
-    
-    // Set specific instruction properties
-    // Data Transfer Group
-    table[0x00] = {1, 4, false, false};  // NOP
-    table[0x01] = {3, 10, false, false}; // LXI B,word
-    table[0x02] = {1, 7, false, true};   // STAX B
-    table[0x03] = {1, 5, false, false};  // INX B
-    table[0x04] = {1, 5, true, false};   // INR B
-    table[0x05] = {1, 5, true, false};   // DCR B
-    table[0x06] = {2, 7, false, false};  // MVI B,byte
-    table[0x07] = {1, 4, true, false};   // RLC
-    table[0x08] = {1, 4, false, false};  // NOP
-    table[0x09] = {1, 10, false, false}; // DAD B
-    table[0x0A] = {1, 7, false, true};   // LDAX B
-    table[0x0B] = {1, 5, false, false};  // DCX B
-    table[0x0C] = {1, 5, true, false};   // INR C
-    table[0x0D] = {1, 5, true, false};   // DCR C
-    table[0x0E] = {2, 7, false, false};  // MVI C,byte
-    table[0x0F] = {1, 4, true, false};   // RRC
-    
-    // More Data Transfer
-    table[0x11] = {3, 10, false, false}; // LXI D,word
-    table[0x12] = {1, 7, false, true};   // STAX D
-    table[0x13] = {1, 5, false, false};  // INX D
-    table[0x14] = {1, 5, true, false};   // INR D
-    table[0x15] = {1, 5, true, false};   // DCR D
-    table[0x16] = {2, 7, false, false};  // MVI D,byte
-    table[0x17] = {1, 4, true, false};   // RAL
-    
-    // Memory and Register Operations
-    table[0x21] = {3, 10, false, false}; // LXI H,word
-    table[0x22] = {3, 16, false, true};  // SHLD addr
-    table[0x23] = {1, 5, false, false};  // INX H
-    table[0x24] = {1, 5, true, false};   // INR H
-    table[0x25] = {1, 5, true, false};   // DCR H
-    table[0x26] = {2, 7, false, false};  // MVI H,byte
-    table[0x27] = {1, 4, true, false};   // DAA
-    
-    // Stack Operations
-    table[0x31] = {3, 10, false, false}; // LXI SP,word
-    table[0x32] = {3, 13, false, true};  // STA addr
-    table[0x33] = {1, 5, false, false};  // INX SP
-    table[0x34] = {1, 10, true, true};   // INR M
-    table[0x35] = {1, 10, true, true};   // DCR M
-    table[0x36] = {2, 10, false, true};  // MVI M,byte
-    table[0x37] = {1, 4, true, false};   // STC
-    
-    // Register Move Instructions
-    for (int i = 0x40; i <= 0x7F; i++) {
-        bool isMemoryOp = ((i & 0x07) == 0x06) || ((i & 0x3F) == 0x36);
-        table[static_cast<uint8_t>(i)] = {1, static_cast<uint8_t>(isMemoryOp ? 7 : 5), false, isMemoryOp};
-    }
-    
-    // Arithmetic Group
-    for (int i = 0x80; i <= 0x87; i++) {
-        bool isMemoryOp = (i & 0x07) == 0x06;
-        table[static_cast<uint8_t>(i)] = {1, static_cast<uint8_t>(isMemoryOp ? 7 : 4), true, isMemoryOp};
-    }
-    for (int i = 0x88; i <= 0x8F; i++) {
-        bool isMemoryOp = (i & 0x07) == 0x06;
-        table[static_cast<uint8_t>(i)] = {1, static_cast<uint8_t>(isMemoryOp ? 7 : 4), true, isMemoryOp};
-    }
-    for (int i = 0x90; i <= 0x97; i++) {
-        bool isMemoryOp = (i & 0x07) == 0x06;
-        table[static_cast<uint8_t>(i)] = {1, static_cast<uint8_t>(isMemoryOp ? 7 : 4), true, isMemoryOp};
-    }
-    for (int i = 0x98; i <= 0x9F; i++) {
-        bool isMemoryOp = (i & 0x07) == 0x06;
-        table[static_cast<uint8_t>(i)] = {1, static_cast<uint8_t>(isMemoryOp ? 7 : 4), true, isMemoryOp};
-    }
-    
-    // Logical Group
-    for (int i = 0xA0; i <= 0xA7; i++) {
-        bool isMemoryOp = (i & 0x07) == 0x06;
-        table[static_cast<uint8_t>(i)] = {1, static_cast<uint8_t>(isMemoryOp ? 7 : 4), true, isMemoryOp};
-    }
-    for (int i = 0xA8; i <= 0xAF; i++) {
-        bool isMemoryOp = (i & 0x07) == 0x06;
-        table[static_cast<uint8_t>(i)] = {1, static_cast<uint8_t>(isMemoryOp ? 7 : 4), true, isMemoryOp};
-    }
-    for (int i = 0xB0; i <= 0xB7; i++) {
-        bool isMemoryOp = (i & 0x07) == 0x06;
-        table[static_cast<uint8_t>(i)] = {1, static_cast<uint8_t>(isMemoryOp ? 7 : 4), true, isMemoryOp};
-    }
-    for (int i = 0xB8; i <= 0xBF; i++) {
-        bool isMemoryOp = (i & 0x07) == 0x06;
-        table[static_cast<uint8_t>(i)] = {1, static_cast<uint8_t>(isMemoryOp ? 7 : 4), true, isMemoryOp};
-    }
-    
-    // Branch Group
-    table[0xC0] = {1, 11, false, false}; // RNZ
-    table[0xC1] = {1, 10, false, false}; // POP B
-    table[0xC2] = {3, 10, false, false}; // JNZ addr
-    table[0xC3] = {3, 10, false, false}; // JMP addr
-    table[0xC4] = {3, 17, false, false}; // CNZ addr
-    table[0xC5] = {1, 11, false, false}; // PUSH B
-    table[0xC6] = {2, 7, true, false};   // ADI byte
-    table[0xC7] = {1, 11, false, false}; // RST 0
-    
-    // More Branch Instructions
-    table[0xC8] = {1, 11, false, false}; // RZ
-    table[0xC9] = {1, 10, false, false}; // RET
-    table[0xCA] = {3, 10, false, false}; // JZ addr
-    table[0xCC] = {3, 17, false, false}; // CZ addr
-    table[0xCD] = {3, 17, false, false}; // CALL addr
-    table[0xCE] = {2, 7, true, false};   // ACI byte
-    table[0xCF] = {1, 11, false, false}; // RST 1
-    
-    // I/O and Special Instructions
-    table[0xD3] = {2, 10, false, false}; // OUT port
-    table[0xDB] = {2, 10, false, false}; // IN port
-    table[0xE3] = {1, 18, false, false}; // XTHL
-    table[0xE9] = {1, 5, false, false};  // PCHL
-    table[0xEB] = {1, 5, false, false};  // XCHG
-    table[0xF3] = {1, 4, false, false};  // DI
-    table[0xFB] = {1, 4, false, false};  // EI
-    
-    return table;
-}
-
-// Initialize instruction table
-static const std::array<DecodedInstruction, 256> INSTRUCTION_TABLE = createInstructionTable();
-
 // Instruction Tracer Implementation
+// The ring and the stream are in instruction_tracer.cpp, which does not
+// depend on EmulatorException.
 void InstructionTracer::dumpTrace(const char* filename) {
     std::ofstream file(filename);
     if (!file) {
@@ -244,257 +42,334 @@ void InstructionTracer::dumpTrace(const char* filename) {
                               "Failed to open trace file");
     }
 
-    file << "PC    | Opcode | A  B  C  D  E  H  L  | Flags | Cycle\n";
-    file << "------+--------+--------------------+-------+-------\n";
-
-    for (const auto& entry : trace_buffer) {
-        file << std::hex << std::setw(4) << std::setfill('0') << entry.pc << " | "
-             << std::setw(2) << static_cast<int>(entry.opcode) << "     | "
-             << std::setw(2) << static_cast<int>(entry.state.a) << " "
-             << std::setw(2) << static_cast<int>(entry.state.b) << " "
-             << std::setw(2) << static_cast<int>(entry.state.c) << " "
-             << std::setw(2) << static_cast<int>(entry.state.d) << " "
-             << std::setw(2) << static_cast<int>(entry.state.e) << " "
-             << std::setw(2) << static_cast<int>(entry.state.h) << " "
-             << std::setw(2) << static_cast<int>(entry.state.l) << " | "
-             << (entry.state.cc.z ? 'Z' : '.') 
-             << (entry.state.cc.s ? 'S' : '.')
-             << (entry.state.cc.p ? 'P' : '.')
-             << (entry.state.cc.cy ? 'C' : '.')
-             << (entry.state.cc.ac ? 'A' : '.') << " | "
-             << std::dec << entry.cycle << "\n";
-    }
-}
-
-void InstructionTracer::addTrace(uint16_t pc, uint8_t opcode, const State8080& state, uint64_t cycle) {
-    TraceEntry entry{pc, opcode, state, cycle};
-    trace_buffer.push_back(entry);
-    if (trace_buffer.size() > max_entries) {
-        trace_buffer.erase(trace_buffer.begin());
+    char line[128];
+    file << tableHeader();
+    for (size_t i = 0; i < size(); i++) {
+        formatEntry(line, sizeof(line), get(i));
+        file << line;
     }
 }
 
 // Interrupt Controller Implementation
-void InterruptController::queueInterrupt(uint8_t code, uint8_t priority) {
-    InterruptRequest req{code, priority, true};
-    int_queue.push(req);
-}
-
+// The rest is in interrupt_controller.cpp, which does not depend on
+// EmulatorException.
 InterruptController::InterruptRequest InterruptController::getNextInterrupt() {
-    if (int_queue.empty()) {
+    InterruptRequest req;
+    if (!tryGetNext(req)) {
         throw EmulatorException(EmulatorException::ErrorCode::INVALID_INTERRUPT,
                               "No pending interrupts");
     }
-    auto req = int_queue.front();
-    int_queue.pop();
     return req;
 }
 
 // Memory Bank Controller Implementation
 MemoryBankController::MemoryBankController(size_t num_banks, size_t bank_size)
-    : currentBank(0), bankSize(bank_size) {
+    : currentBank(0), bankSize(bank_size), discard(0) {
+    if (num_banks == 0 || num_banks > 256) {
+        throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
+                              "Invalid number of banks");
+    }
+    if (bank_size == 0 || bank_size > 0x10000 || bank_size % BANK_PAGE_SIZE != 0) {
+        throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
+                              "Invalid bank size");
+    }
     banks.reserve(num_banks);
     for (size_t i = 0; i < num_banks; i++) {
         banks.push_back(std::make_unique<uint8_t[]>(bank_size));
     }
+    rebuildPages();
 }
 
 void MemoryBankController::switchBank(uint8_t bank) {
-    try {
-        if (bank >= banks.size()) {
-            throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
-                                  "Invalid bank number");
-        }
-        
-        // Flush any pending writes in current bank
-        for (auto& entry : mappings) {
-            if (entry.bank == currentBank) {
-                // Flush changes before switching
-                // Implementation depends on your memory management
-            }
-        }
-        
-        currentBank = bank;
-    } catch (const std::bad_alloc& e) {
-        throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
-                              "Memory allocation failed during bank switch");
-    } catch (const std::exception& e) {
+    if (bank >= banks.size()) {
         throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
-                              e.what());
+                              "Invalid bank number");
     }
+    currentBank = bank;
+    rebuildPages();
 }
 
-void MemoryBankController::mapMemory(uint16_t address, uint8_t bank) {
-    try {
-        if (bank >= banks.size()) {
+void MemoryBankController::mapMemory(uint16_t address, uint8_t bank, bool readOnly) {
+    if (bank >= banks.size()) {
+        throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
+                              "Invalid bank number");
+    }
+    if (address % BANK_PAGE_SIZE != 0) {
+        throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
+                              "Memory mapping not page aligned");
+    }
+    if (address + bankSize > 0x10000) {
+        throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
+                              "Memory mapping exceeds address space");
+    }
+    for (const auto& mapping : mappings) {
+        if (address < mapping.baseAddr + mapping.size && mapping.baseAddr < address + bankSize) {
             throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
-                                  "Invalid bank number");
+                                  "Memory mapping overlap");
         }
+    }
 
-        // Check for overlapping mappings
-        for (const auto& mapping : mappings) {
-            if ((address >= mapping.baseAddr && 
-                 address < mapping.baseAddr + mapping.size) ||
-                (address + bankSize > mapping.baseAddr && 
-                 address + bankSize <= mapping.baseAddr + mapping.size)) {
-                throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
-                                      "Memory mapping overlap");
-            }
-        }
+    mappings.push_back(BankMapping{bank, address, static_cast<uint32_t>(bankSize), readOnly});
+    rebuildPages();
+}
 
-        // Validate address range
-        if (address + bankSize > 0xFFFF) {
-            throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
-                                  "Memory mapping exceeds address space");
+// The current bank from address 0, then the mappings over it.
+void MemoryBankController::rebuildPages() {
+    for (size_t i = 0; i < BANK_PAGES; i++) {
+        size_t offset = i * BANK_PAGE_SIZE;
+        pages[i].data = offset < bankSize ? banks[currentBank].get() + offset : nullptr;
+        pages[i].readOnly = false;
+    }
+    for (const auto& mapping : mappings) {
+        for (size_t offset = 0; offset < mapping.size; offset += BANK_PAGE_SIZE) {
+            Page& page = pages[(mapping.baseAddr + offset) >> BANK_PAGE_SHIFT];
+            page.data = banks[mapping.bank].get() + offset;
+            page.readOnly = mapping.readOnly;
         }
+    }
+}
 
-        // Add new mapping
-        BankMapping mapping{
-            bank,
-            address,
-            static_cast<uint16_t>(bankSize),
-            false  // Default to read-write
-        };
-        mappings.push_back(mapping);
-    } catch (const std::bad_alloc& e) {
+uint8_t& MemoryBankController::physicalAt(uint32_t ind) {
+    if (ind >= banks.size() * bankSize) {
         throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
-                              "Memory allocation failed during mapping");
-    } catch (const std::exception& e) {
-        throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
-                              e.what());
+                              "Address out of range");
     }
+    return banks[ind / bankSize][ind % bankSize];
 }
 
-uint8_t MemoryBankController::read(uint16_t address) {
-    try {
-        // Check mapped regions first
-        for (const auto& mapping : mappings) {
-            if (address >= mapping.baseAddr && 
-                address < mapping.baseAddr + mapping.size) {
-                uint16_t bankOffset = address - mapping.baseAddr;
-                if (bankOffset >= bankSize) {
-                    throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
-                                          "Bank offset out of range");
-                }
-                return banks[mapping.bank][bankOffset];
-            }
-        }
+void MemoryBankController::unmapped(uint32_t address) const {
+    (void) address;
+    throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
+                          "Address out of range");
+}
 
-        // If not mapped, use current bank
-        if (address >= bankSize) {
-            throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
-                                  "Address out of range");
-        }
-        return banks[currentBank][address];
-    } catch (const std::out_of_range& e) {
-        throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
-                              "Invalid memory access");
-    } catch (const std::exception& e) {
-        throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
-                              e.what());
+void MemoryBankController::rejectWrite(uint16_t address) const {
+    if (pages[address >> BANK_PAGE_SHIFT].data == nullptr) {
+        unmapped(address);
     }
+    throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
+                          "Write to read-only memory");
 }
 
-void MemoryBankController::write(uint16_t address, uint8_t value) {
-    try {
-        // Check mapped regions first
-        for (const auto& mapping : mappings) {
-            if (address >= mapping.baseAddr && 
-                address < mapping.baseAddr + mapping.size) {
-                if (mapping.readOnly) {
-                    throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
-                                          "Write to read-only memory");
-                }
-                uint16_t bankOffset = address - mapping.baseAddr;
-                if (bankOffset >= bankSize) {
-                    throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
-                                          "Bank offset out of range");
-                }
-                banks[mapping.bank][bankOffset] = value;
+// State Manager Implementation
+namespace {
+    const char STATE_FILE_MAGIC[8] = {'I', '8', '0', '8', '0', 'S', 'T', '1'};
+
+    struct StateFileHeader {
+        char magic[8];
+        uint32_t incremental;   // 1 if only changed chunks follow
+        uint32_t chunkSize;
+        uint32_t chunkCount;
+        uint32_t tablesSize;
+        uint32_t writtenChunks;
+    };
+
+    void checkFile(const std::ios& file, const char* message) {
+        if (!file) {
+            throw EmulatorException(EmulatorException::ErrorCode::INVALID_OPCODE, message);
+        }
+    }
+
+    // The chunks StateManager saves of a memory. A Memory has a chunk per
+    // page and frame, its tables and write epochs; any other MemoryBase is
+    // a single 64K chunk read and written through at(), which never counts
+    // as unchanged, so it is copied whole every time.
+    class ChunkView {
+    public:
+        explicit ChunkView(const MemoryBase* memory)
+            : base(const_cast<MemoryBase*>(memory)), paged(dynamic_cast<Memory*>(base)) {}
+
+        uint32_t checkpoint() { return paged != nullptr ? paged->checkpoint() : 0; }
+        int chunkCount() const { return paged != nullptr ? paged->getChunkCount() : 1; }
+        size_t chunkSize() const { return paged != nullptr ? (size_t) paged->getPageSize() : 0x10000; }
+        size_t tablesSize() const { return paged != nullptr ? paged->getTablesSize() : 0; }
+        void saveTables(uint8_t* out) const { if (paged != nullptr) paged->saveTables(out); }
+        void loadTables(const uint8_t* in) { if (paged != nullptr) paged->loadTables(in); }
+        bool isWrittenSince(int chunk, uint32_t epoch) const {
+            return paged == nullptr || paged->isChunkWrittenSince(chunk, epoch);
+        }
+
+        // chunkSize() bytes, valid until the next read.
+        const uint8_t* read(int chunk) {
+            if (paged != nullptr) return paged->getChunk(chunk);
+            flat.resize(0x10000);
+            for (uint32_t i = 0; i < 0x10000; i++)
+                flat[i] = base->at(i);
+            return flat.data();
+        }
+        void write(int chunk, const uint8_t* data) {
+            if (paged != nullptr) {
+                memcpy(paged->writeChunk(chunk), data, chunkSize());
                 return;
             }
+            for (uint32_t i = 0; i < 0x10000; i++)
+                base->at(i) = data[i];
         }
 
-        // If not mapped, use current bank
-        if (address >= bankSize) {
-            throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
-                                  "Address out of range");
-        }
-        banks[currentBank][address] = value;
-    } catch (const std::out_of_range& e) {
-        throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
-                              "Invalid memory access");
-    } catch (const std::exception& e) {
-        throw EmulatorException(EmulatorException::ErrorCode::MEMORY_ACCESS_VIOLATION,
-                              e.what());
-    }
+    private:
+        MemoryBase* base;
+        Memory* paged;
+        std::vector<uint8_t> flat;
+    };
 }
 
-// State Manager Implementation
-void StateManager::saveState(const char* filename, const State8080& state, const MemoryBase* memory) {
+// File layout, raw host order: StateFileHeader, State8080, the Memory
+// tables, then writtenChunks times { index:u32, chunkSize bytes }.
+void StateManager::saveState(const char* filename, const State8080& state, const MemoryBase* memory,
+                             bool incremental) {
     std::ofstream file(filename, std::ios::binary);
-    if (!file) {
-        throw EmulatorException(EmulatorException::ErrorCode::INVALID_OPCODE,
-                              "Failed to open state file");
+    checkFile(file, "Failed to open state file");
+
+    ChunkView mem(memory);
+    uint32_t ended = mem.checkpoint();
+    bool partial = incremental && savedMemory == memory;
+    std::vector<uint32_t> written;
+    for (int chunk = 0; chunk < mem.chunkCount(); chunk++) {
+        if (!partial || mem.isWrittenSince(chunk, savedEpoch))
+            written.push_back((uint32_t) chunk);
     }
 
-    // Save CPU state
+    StateFileHeader header;
+    memcpy(header.magic, STATE_FILE_MAGIC, sizeof(header.magic));
+    header.incremental = partial ? 1 : 0;
+    header.chunkSize = (uint32_t) mem.chunkSize();
+    header.chunkCount = (uint32_t) mem.chunkCount();
+    header.tablesSize = (uint32_t) mem.tablesSize();
+    header.writtenChunks = (uint32_t) written.size();
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
     file.write(reinterpret_cast<const char*>(&state), sizeof(State8080));
 
-    // Save memory contents
-    // This assumes memory is contiguous - modify if using banking
-    for (uint32_t i = 0; i < 0x10000; i++) {
-        // Use const_cast since we know we're only reading
-        file.put(const_cast<MemoryBase*>(memory)->at(i));
+    std::vector<uint8_t> tables(header.tablesSize);
+    mem.saveTables(tables.data());
+    file.write(reinterpret_cast<const char*>(tables.data()), tables.size());
+    for (size_t i = 0; i < written.size(); i++) {
+        file.write(reinterpret_cast<const char*>(&written[i]), sizeof(uint32_t));
+        file.write(reinterpret_cast<const char*>(mem.read((int) written[i])), header.chunkSize);
     }
+    checkFile(file, "Failed to write state file");
+
+    savedMemory = memory;
+    savedEpoch = ended;
 }
 
 void StateManager::loadState(const char* filename, State8080& state, MemoryBase* memory) {
     std::ifstream file(filename, std::ios::binary);
-    if (!file) {
+    checkFile(file, "Failed to open state file");
+
+    ChunkView mem(memory);
+    StateFileHeader header;
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    checkFile(file, "Truncated state file");
+    if (memcmp(header.magic, STATE_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.chunkSize != (uint32_t) mem.chunkSize() ||
+        header.chunkCount != (uint32_t) mem.chunkCount() ||
+        header.tablesSize != (uint32_t) mem.tablesSize() ||
+        header.writtenChunks > header.chunkCount) {
         throw EmulatorException(EmulatorException::ErrorCode::INVALID_OPCODE,
-                              "Failed to open state file");
+                              "State file does not match the memory configuration");
     }
 
-    // Load CPU state
-    file.read(reinterpret_cast<char*>(&state), sizeof(State8080));
-
-    // Load memory contents
-    for (uint32_t i = 0; i < 0x10000; i++) {
-        memory->at(i) = file.get();
+    State8080 loaded;
+    file.read(reinterpret_cast<char*>(&loaded), sizeof(State8080));
+    std::vector<uint8_t> tables(header.tablesSize);
+    file.read(reinterpret_cast<char*>(tables.data()), tables.size());
+    std::vector<uint8_t> data(header.chunkSize);
+    for (uint32_t i = 0; i < header.writtenChunks; i++) {
+        uint32_t chunk = 0;
+        file.read(reinterpret_cast<char*>(&chunk), sizeof(uint32_t));
+        checkFile(file, "Truncated state file");
+        if (chunk >= header.chunkCount) {
+            throw EmulatorException(EmulatorException::ErrorCode::INVALID_OPCODE,
+                                  "Bad chunk index in state file");
+        }
+        file.read(reinterpret_cast<char*>(data.data()), data.size());
+        checkFile(file, "Truncated state file");
+        mem.write((int) chunk, data.data());
     }
+    checkFile(file, "Truncated state file");
+    mem.loadTables(tables.data());
+    state = loaded;
+
+    if (sharedMemory == memory)
+        sharedMemory = nullptr;
+    savedMemory = memory;
+    savedEpoch = mem.checkpoint();
 }
 
-void StateManager::createSnapshot(const char* description, const State8080& state, const MemoryBase* memory) {
+StateManager::SnapshotId StateManager::createSnapshot(const char* description, const State8080& state,
+                                                      const MemoryBase* memory) {
+    ChunkView mem(memory);
+    uint32_t ended = mem.checkpoint();
+    size_t chunkSize = mem.chunkSize();
+
     Snapshot snapshot;
     snapshot.description = description;
     snapshot.state = state;
-    
-    // Copy memory contents
-    snapshot.memory.reserve(0x10000);
-    for (uint32_t i = 0; i < 0x10000; i++) {
-        // Use const_cast since we know we're only reading
-        snapshot.memory.push_back(const_cast<MemoryBase*>(memory)->at(i));
+    snapshot.tables.resize(mem.tablesSize());
+    mem.saveTables(snapshot.tables.data());
+
+    const Snapshot* shared = (sharedMemory == memory) ? &snapshots[sharedId] : nullptr;
+    snapshot.chunks.reserve(mem.chunkCount());
+    for (int chunk = 0; chunk < mem.chunkCount(); chunk++) {
+        if (shared != nullptr && !mem.isWrittenSince(chunk, sharedEpoch)) {
+            snapshot.chunks.push_back(shared->chunks[chunk]);
+        } else {
+            const uint8_t* data = mem.read(chunk);
+            snapshot.chunks.push_back(std::make_shared<const std::vector<uint8_t>>(data, data + chunkSize));
+            copiedChunks++;
+        }
     }
-    
+
+    SnapshotId id = (SnapshotId) snapshots.size();
     snapshots.push_back(std::move(snapshot));
+    byDescription[description] = id;
+    sharedMemory = memory;
+    sharedId = id;
+    sharedEpoch = ended;
+    return id;
 }
 
-void StateManager::restoreSnapshot(const char* description, State8080& state, MemoryBase* memory) {
-    auto it = std::find_if(snapshots.begin(), snapshots.end(),
-                          [description](const Snapshot& s) { 
-                              return s.description == description; 
-                          });
-    
-    if (it == snapshots.end()) {
+const StateManager::Snapshot& StateManager::find(SnapshotId id) const {
+    if (id >= snapshots.size()) {
         throw EmulatorException(EmulatorException::ErrorCode::INVALID_OPCODE,
                               "Snapshot not found");
     }
-    
-    state = it->state;
-    for (uint32_t i = 0; i < 0x10000; i++) {
-        memory->at(i) = it->memory[i];
+    return snapshots[id];
+}
+
+void StateManager::restoreSnapshot(SnapshotId id, State8080& state, MemoryBase* memory) {
+    const Snapshot& snapshot = find(id);
+    ChunkView mem(memory);
+    if (snapshot.chunks.size() != (size_t) mem.chunkCount() ||
+        snapshot.chunks[0]->size() != mem.chunkSize() || snapshot.tables.size() != mem.tablesSize()) {
+        throw EmulatorException(EmulatorException::ErrorCode::INVALID_OPCODE,
+                              "Snapshot does not match the memory configuration");
+    }
+
+    // Chunks still holding what the current snapshot shares with this one
+    // are already right.
+    const Snapshot* current = (sharedMemory == memory) ? &snapshots[sharedId] : nullptr;
+    for (int chunk = 0; chunk < mem.chunkCount(); chunk++) {
+        if (current != nullptr && current->chunks[chunk] == snapshot.chunks[chunk] &&
+            !mem.isWrittenSince(chunk, sharedEpoch))
+            continue;
+        mem.write(chunk, snapshot.chunks[chunk]->data());
+    }
+    mem.loadTables(snapshot.tables.data());
+    state = snapshot.state;
+
+    sharedMemory = memory;
+    sharedId = id;
+    sharedEpoch = mem.checkpoint();
+}
+
+void StateManager::restoreSnapshot(const char* description, State8080& state, MemoryBase* memory) {
+    auto it = byDescription.find(description);
+    if (it == byDescription.end()) {
+        throw EmulatorException(EmulatorException::ErrorCode::INVALID_OPCODE,
+                              "Snapshot not found");
     }
+    restoreSnapshot(it->second, state, memory);
 }
 
 // Profiler Implementation
@@ -510,6 +385,64 @@ void Profiler::reset() {
     for (auto& profile : profiles) {
         profile = InstructionProfile{};
     }
+    countdown = sampleInterval;
+    addresses.clear();
+    stacks.clear();
+    calls.clear();
+}
+
+void Profiler::setSampleInterval(unsigned interval) {
+    sampleInterval = std::max(interval, 1u);
+    countdown = sampleInterval;
+}
+
+void Profiler::recordSample(int slot, uint16_t pc, const uint8_t* code, unsigned cycles) {
+    if ((size_t) slot >= addresses.size()) {
+        addresses.resize(slot + 1);
+    }
+    if (addresses[slot].empty()) {
+        addresses[slot].resize(0x10000, AddressProfile{});
+    }
+    AddressProfile& address = addresses[slot][pc];
+    address.samples++;
+    address.cycles += cycles;
+    if (address.length == 0) {
+        char mnemonic[DISASSEMBLY_SIZE];
+        address.length = static_cast<uint8_t>(Disassemble8080Op(code, sizeof(address.code), mnemonic, sizeof(mnemonic)));
+        memcpy(address.code, code, address.length);
+    }
+}
+
+void Profiler::recordFlow(int slot, uint8_t opcode, uint16_t sp, uint16_t spAfter, uint16_t target, uint64_t now) {
+    if ((size_t) slot >= stacks.size()) {
+        stacks.resize(slot + 1);
+    }
+    std::vector<Frame>& stack = stacks[slot];
+    bool isReturn = opcode == 0xc9 || (opcode & 0xc7) == 0xc0;
+    if (!isReturn && spAfter == static_cast<uint16_t>(sp - 2)) {
+        Frame frame = {target, stack.empty() ? static_cast<uint32_t>(PROFILE_ROOT) : stack.back().routine, now};
+        if (stack.size() == PROFILE_CALL_DEPTH) {
+            stack.erase(stack.begin());
+        }
+        stack.push_back(frame);
+        calls[callKey(slot, frame.caller, frame.routine)].calls++;
+    } else if (isReturn && spAfter == static_cast<uint16_t>(sp + 2) && !stack.empty()) {
+        const Frame& frame = stack.back();
+        calls[callKey(slot, frame.caller, frame.routine)].cycles += now - frame.entered;
+        stack.pop_back();
+    }
+}
+
+const AddressProfile* Profiler::getAddressProfile(int slot, uint16_t pc) const {
+    if ((size_t) slot >= addresses.size() || addresses[slot].empty()) {
+        return nullptr;
+    }
+    return &addresses[slot][pc];
+}
+
+const CallProfile* Profiler::getCallProfile(int slot, uint32_t caller, uint16_t callee) const {
+    auto it = calls.find(callKey(slot, caller, callee));
+    return it == calls.end() ? nullptr : &it->second;
 }
 
 void Profiler::generateReport(const char* filename) {
@@ -533,6 +466,79 @@ void Profiler::generateReport(const char* filename) {
                  << std::setw(11) << profile.cache_misses << "\n";
         }
     }
+
+    struct HotSpot {
+        int slot;
+        uint16_t pc;
+        const AddressProfile* profile;
+    };
+    std::vector<HotSpot> hotSpots;
+    std::vector<uint64_t> processSamples(addresses.size()), processCycles(addresses.size());
+    uint64_t totalCycles = 0;
+    for (size_t slot = 0; slot < addresses.size(); slot++) {
+        for (size_t pc = 0; pc < addresses[slot].size(); pc++) {
+            const AddressProfile& address = addresses[slot][pc];
+            if (address.samples == 0) continue;
+            hotSpots.push_back({static_cast<int>(slot), static_cast<uint16_t>(pc), &address});
+            processSamples[slot] += address.samples;
+            processCycles[slot] += address.cycles;
+            totalCycles += address.cycles;
+        }
+    }
+
+    file << "\nProcesses, 1 in " << std::dec << sampleInterval << " instructions sampled\n";
+    file << "Process | Samples    | Cycles\n";
+    file << "--------+------------+-------------\n";
+    for (size_t slot = 0; slot < processSamples.size(); slot++) {
+        if (processSamples[slot] == 0) continue;
+        file << std::setfill(' ') << std::setw(7) << slot << " | "
+             << std::setw(10) << processSamples[slot] << " | "
+             << std::setw(12) << processCycles[slot] << "\n";
+    }
+
+    size_t listed = std::min(hotSpots.size(), static_cast<size_t>(PROFILE_HOT_SPOTS));
+    std::partial_sort(hotSpots.begin(), hotSpots.begin() + listed, hotSpots.end(),
+                      [](const HotSpot& a, const HotSpot& b) {
+                          return a.profile->cycles > b.profile->cycles;
+                      });
+    file << "\nHot spots by sampled cycles\n";
+    file << "Process | PC   | Samples    | Cycles       | %     | Instruction\n";
+    file << "--------+------+------------+--------------+-------+----------------\n";
+    for (size_t i = 0; i < listed; i++) {
+        const HotSpot& spot = hotSpots[i];
+        char mnemonic[DISASSEMBLY_SIZE] = "?";
+        if (spot.profile->length != 0) {
+            Disassemble8080Op(spot.profile->code, spot.profile->length, mnemonic, sizeof(mnemonic));
+        }
+        file << std::setfill(' ') << std::setw(7) << spot.slot << " | "
+             << std::hex << std::setfill('0') << std::setw(4) << spot.pc << " | "
+             << std::dec << std::setfill(' ') << std::setw(10) << spot.profile->samples << " | "
+             << std::setw(12) << spot.profile->cycles << " | "
+             << std::fixed << std::setprecision(2) << std::setw(5)
+             << (100.0 * spot.profile->cycles / totalCycles) << " | "
+             << mnemonic << "\n";
+    }
+
+    std::vector<std::pair<uint64_t, CallProfile>> edges(calls.begin(), calls.end());
+    std::sort(edges.begin(), edges.end(),
+              [](const std::pair<uint64_t, CallProfile>& a, const std::pair<uint64_t, CallProfile>& b) {
+                  return a.second.cycles > b.second.cycles;
+              });
+    file << "\nCall graph, cycles until the matching return\n";
+    file << "Process | Caller | Callee | Calls      | Cycles\n";
+    file << "--------+--------+--------+------------+-------------\n";
+    for (const auto& edge : edges) {
+        uint32_t caller = static_cast<uint32_t>(edge.first >> 16) & 0x1ffff;
+        file << std::setfill(' ') << std::setw(7) << (edge.first >> 33) << " | ";
+        if (caller == PROFILE_ROOT) {
+            file << "root  ";
+        } else {
+            file << std::hex << std::setfill('0') << std::setw(4) << caller << "  ";
+        }
+        file << " | " << std::hex << std::setfill('0') << std::setw(4) << (edge.first & 0xffff) << "   | "
+             << std::dec << std::setfill(' ') << std::setw(10) << edge.second.calls << " | "
+             << std::setw(12) << edge.second.cycles << "\n";
+    }
 }
 
 // Enhanced CPU8080 Implementation with optimizations
@@ -541,15 +547,15 @@ EnhancedCPU8080::EnhancedCPU8080(State8080* state, MemoryBase* memory)
       tracingEnabled(false),
       profilingEnabled(false),
       bankingEnabled(false),
-      memoryBanking(4, 0x4000),
-      memoryCache(std::make_unique<MemoryCache>(memory)),
-      cacheFlushCounter(0) {
+      memoryBanking(4, 0x4000) {
     
     // Set state after base class initialization
+    ownState = this->state;
     this->state = state;
-    
-    // Initialize instruction cache
-    instructionCache.reserve(1024);  // Pre-allocate space for commonly used code
+}
+
+EnhancedCPU8080::~EnhancedCPU8080() {
+    this->state = ownState;
 }
 
 void EnhancedCPU8080::enableTracing(bool enable) {
@@ -570,86 +576,40 @@ void EnhancedCPU8080::enableBanking(bool enable) {
     bankingEnabled = enable;
 }
 
+// Instructions come from the CPU8080 decode cache, shared with EmulateBlock
+// and invalidated by guest writes to decoded code.
 unsigned EnhancedCPU8080::Emulate8080p(int debug) {
-    auto start_time = std::chrono::high_resolution_clock::now();
-    
-    // Get the current instruction
-    uint8_t *opcode = &this->memory->at(this->state->pc);
-    uint64_t current_cycle = 0;
-    
-    // Check instruction cache first
-    if (!debug) {
-        auto cache_it = instructionCache.find(this->state->pc);
-        if (cache_it != instructionCache.end()) {
-            const auto& cached = cache_it->second;
-            
-            // Skip execution if instruction doesn't affect flags and no memory access
-            if (!cached.affects_flags && !INSTRUCTION_TABLE[*opcode].memory_access) {
-                // Fast path - apply cached results
-                this->state->a = cached.result_a;
-                this->state->b = cached.result_b;
-                this->state->c = cached.result_c;
-                this->state->d = cached.result_d;
-                this->state->e = cached.result_e;
-                this->state->h = cached.result_h;
-                this->state->l = cached.result_l;
-                
-                this->state->pc += cached.length;
-                current_cycle = cached.cycles;
-                
-                // Record profiling if enabled
-                if (profilingEnabled) {
-                    auto end_time = std::chrono::high_resolution_clock::now();
-                    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>
-                                  (end_time - start_time).count();
-                    profiler.recordExecution(*opcode, current_cycle, false);
-                }
-                
-                return current_cycle;
-            }
-        }
-    }
-    
-    // Cache miss or debug mode - execute normally
-    current_cycle = CPU8080::Emulate8080p(debug);
-    
-    // Cache the result if appropriate
-    if (!debug && instructionCache.size() < 1024) {
-        CachedInstruction cached;
-        cached.length = INSTRUCTION_TABLE[*opcode].length;
-        cached.cycles = current_cycle;
-        cached.affects_flags = INSTRUCTION_TABLE[*opcode].affects_flags;
-        cached.result_a = this->state->a;
-        cached.result_b = this->state->b;
-        cached.result_c = this->state->c;
-        cached.result_d = this->state->d;
-        cached.result_e = this->state->e;
-        cached.result_h = this->state->h;
-        cached.result_l = this->state->l;
-        
-        instructionCache[this->state->pc - cached.length] = cached;
+    uint16_t pc = this->state->pc;
+    uint16_t sp = this->state->sp;
+    int slot = processSlot();
+    uint8_t code[3] = {interrupt_code, 0, 0};   // An interrupt runs its RST
+    bool cache_miss = false;
+    if ((tracingEnabled || profilingEnabled) && interrupt == 0) {
+        uint64_t misses = blockCache->getOpMisses();
+        memcpy(code, blockCache->lookupOp(this->memory, slot, pc)->bytes, sizeof(code));
+        cache_miss = blockCache->getOpMisses() != misses;
     }
-    
+    // Profiling counts clock cycles, it never reads the host clock.
+    bool sampled = profilingEnabled && profiler.sampleDue();
+
+    unsigned current_cycle = EmulateCached(debug);
+
     // Record trace if enabled
     if (tracingEnabled) {
-        tracer.addTrace(this->state->pc, *opcode, *this->state, current_cycle);
+        tracer.addTrace(pc, code[0], *this->state, current_cycle);
     }
-    
+
     // Record profiling if enabled
     if (profilingEnabled) {
-        auto end_time = std::chrono::high_resolution_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>
-                       (end_time - start_time).count();
-        bool cache_miss = duration > (current_cycle * 10);
-        profiler.recordExecution(*opcode, current_cycle, cache_miss);
-    }
-    
-    // Flush memory cache periodically
-    if (++cacheFlushCounter >= 1000) {
-        memoryCache->flush();
-        cacheFlushCounter = 0;
+        profiler.recordExecution(code[0], current_cycle, cache_miss);
+        if (sampled) {
+            profiler.recordSample(slot, pc, code, current_cycle);
+        }
+        if (Profiler::isFlow(code[0])) {
+            profiler.recordFlow(slot, code[0], sp, this->state->sp, this->state->pc, getProcessCycles(slot));
+        }
     }
-    
+
     return current_cycle;
 }
 
@@ -659,14 +619,18 @@ EmulatorTest::EmulatorTest() {
 }
 
 void EmulatorTest::setUp() {
-    memory = std::make_unique<Memory>(0x10000);
+    memory = std::make_unique<FlatMemory>();
     state = State8080{};
     cpu = std::make_unique<EnhancedCPU8080>(&state, memory.get());
 }
 
+EmulatorTest::~EmulatorTest() {
+    tearDown();
+}
+
 void EmulatorTest::tearDown() {
-    memory.reset();
     cpu.reset();
+    memory.reset();
 }
 
 void EmulatorTest::assertCondition(bool condition, const char* message) {
@@ -675,12 +639,18 @@ void EmulatorTest::assertCondition(bool condition, const char* message) {
     }
 }
 
+void EmulatorTest::execute(uint16_t pc) {
+    state.pc = pc;
+    cpu->invalidateCode();      // The test writes code behind the cache's back
+    cpu->Emulate8080p(0);
+}
+
 void EmulatorTest::testArithmetic() {
     // Test ADD instructions
     state.a = 0x05;
     state.b = 0x03;
     memory->at(0) = 0x80;  // ADD B
-    cpu->Emulate8080p(0);
+    execute(0);
     assertCondition(state.a == 0x08, "ADD B failed");
     assertCondition(!state.cc.cy, "Carry flag incorrectly set");
     
@@ -688,7 +658,7 @@ void EmulatorTest::testArithmetic() {
     state.a = 0xFF;
     state.b = 0x01;
     memory->at(0) = 0x80;  // ADD B
-    cpu->Emulate8080p(0);
+    execute(0);
     assertCondition(state.a == 0x00, "ADD B with carry failed");
     assertCondition(state.cc.cy, "Carry flag not set");
     assertCondition(state.cc.z, "Zero flag not set");
@@ -697,21 +667,21 @@ void EmulatorTest::testArithmetic() {
     state.a = 0x05;
     state.b = 0x03;
     memory->at(0) = 0x90;  // SUB B
-    cpu->Emulate8080p(0);
+    execute(0);
     assertCondition(state.a == 0x02, "SUB B failed");
     
     // Test SUB with borrow
     state.a = 0x00;
     state.b = 0x01;
     memory->at(0) = 0x90;  // SUB B
-    cpu->Emulate8080p(0);
+    execute(0);
     assertCondition(state.a == 0xFF, "SUB B with borrow failed");
     assertCondition(state.cc.cy, "Carry flag not set");
     
     // Test DAA (Decimal Adjust Accumulator)
     state.a = 0x9B;
     memory->at(0) = 0x27;  // DAA
-    cpu->Emulate8080p(0);
+    execute(0);
     assertCondition(state.a == 0x01, "DAA failed");
     assertCondition(state.cc.cy, "DAA carry flag not set");
 }
@@ -721,27 +691,27 @@ void EmulatorTest::testLogic() {
     state.a = 0x0F;
     state.b = 0x0A;
     memory->at(0) = 0xA0;  // ANA B
-    cpu->Emulate8080p(0);
+    execute(0);
     assertCondition(state.a == 0x0A, "ANA B failed");
     
     // Test OR instructions
     state.a = 0x0F;
     state.b = 0xF0;
     memory->at(0) = 0xB0;  // ORA B
-    cpu->Emulate8080p(0);
+    execute(0);
     assertCondition(state.a == 0xFF, "ORA B failed");
     
     // Test XOR instructions
     state.a = 0xFF;
     state.b = 0x0F;
     memory->at(0) = 0xA8;  // XRA B
-    cpu->Emulate8080p(0);
+    execute(0);
     assertCondition(state.a == 0xF0, "XRA B failed");
     
     // Test CMA (Complement Accumulator)
     state.a = 0xAA;
     memory->at(0) = 0x2F;  // CMA
-    cpu->Emulate8080p(0);
+    execute(0);
     assertCondition(state.a == 0x55, "CMA failed");
 }
 
@@ -750,7 +720,7 @@ void EmulatorTest::testBranching() {
     memory->at(0) = 0xC3;  // JMP
     memory->at(1) = 0x10;  // Low byte of address
     memory->at(2) = 0x00;  // High byte of address
-    cpu->Emulate8080p(0);
+    execute(0);
     assertCondition(state.pc == 0x0010, "JMP failed");
     
     // Test conditional jumps
@@ -759,7 +729,7 @@ void EmulatorTest::testBranching() {
     memory->at(0x0010) = 0xCA;  // JZ
     memory->at(0x0011) = 0x20;  // Low byte
     memory->at(0x0012) = 0x00;  // High byte
-    cpu->Emulate8080p(0);
+    execute(0x0010);
     assertCondition(state.pc == 0x0020, "JZ (taken) failed");
     
     // JZ when zero flag is clear
@@ -767,7 +737,7 @@ void EmulatorTest::testBranching() {
     memory->at(0x0020) = 0xCA;  // JZ
     memory->at(0x0021) = 0x30;  // Low byte
     memory->at(0x0022) = 0x00;  // High byte
-    cpu->Emulate8080p(0);
+    execute(0x0020);
     assertCondition(state.pc == 0x0023, "JZ (not taken) failed");
     
     // Test CALL and RET
@@ -775,12 +745,12 @@ void EmulatorTest::testBranching() {
     memory->at(0x0024) = 0x40;  // Low byte
     memory->at(0x0025) = 0x00;  // High byte
     uint16_t oldSP = state.sp;
-    cpu->Emulate8080p(0);
+    execute(0x0023);
     assertCondition(state.pc == 0x0040, "CALL failed");
-    assertCondition(state.sp == oldSP - 2, "CALL stack push failed");
+    assertCondition(state.sp == (uint16_t) (oldSP - 2), "CALL stack push failed");
     
     memory->at(0x0040) = 0xC9;  // RET
-    cpu->Emulate8080p(0);
+    execute(0x0040);
     assertCondition(state.pc == 0x0026, "RET failed");
     assertCondition(state.sp == oldSP, "RET stack pop failed");
 }
@@ -791,7 +761,7 @@ void EmulatorTest::testMemoryOps() {
     memory->at(1) = 0x10;  // Low byte of address
     memory->at(2) = 0x00;  // High byte of address
     memory->at(0x0010) = 0x55;  // Test value
-    cpu->Emulate8080p(0);
+    execute(0);
     assertCondition(state.a == 0x55, "LDA failed");
     
     // Test STA instruction
@@ -799,7 +769,7 @@ void EmulatorTest::testMemoryOps() {
     memory->at(0) = 0x32;  // STA
     memory->at(1) = 0x20;  // Low byte of address
     memory->at(2) = 0x00;  // High byte of address
-    cpu->Emulate8080p(0);
+    execute(0);
     assertCondition(memory->at(0x0020) == 0xAA, "STA failed");
     
     // Test LHLD instruction
@@ -808,7 +778,7 @@ void EmulatorTest::testMemoryOps() {
     memory->at(2) = 0x00;  // High byte of address
     memory->at(0x0030) = 0x78;  // Low byte of value
     memory->at(0x0031) = 0x56;  // High byte of value
-    cpu->Emulate8080p(0);
+    execute(0);
     assertCondition(state.l == 0x78, "LHLD (low) failed");
     assertCondition(state.h == 0x56, "LHLD (high) failed");
     
@@ -818,45 +788,853 @@ void EmulatorTest::testMemoryOps() {
     memory->at(0) = 0x22;  // SHLD
     memory->at(1) = 0x40;  // Low byte of address
     memory->at(2) = 0x00;  // High byte of address
-    cpu->Emulate8080p(0);
+    execute(0);
     assertCondition(memory->at(0x0040) == 0x12, "SHLD (low) failed");
     assertCondition(memory->at(0x0041) == 0x34, "SHLD (high) failed");
 }
 
 void EmulatorTest::testInterrupts() {
-    // Test interrupt handling
+    // Test interrupt handling: the interrupt code is the RST run in place
+    // of the next instruction, which is where it returns to
     state.int_enable = 1;
     uint16_t oldPC = state.pc;
     uint16_t oldSP = state.sp;
     
-    cpu->raiseInterrupt(0x08);
-    cpu->Emulate8080p(0);
+    cpu->raiseInterrupt(0xCF);  // RST 1
+    execute(oldPC);
     
     // Check interrupt vector
     assertCondition(state.pc == 0x0008, "Interrupt vector failed");
     // Check stack push
-    assertCondition(state.sp == oldSP - 2, "Interrupt stack push failed");
+    assertCondition(state.sp == (uint16_t) (oldSP - 2), "Interrupt stack push failed");
     // Check return address
-    uint16_t retAddr = (memory->at(oldSP - 1) << 8) | memory->at(oldSP - 2);
-    assertCondition(retAddr == oldPC + 1, "Interrupt return address failed");
+    uint16_t retAddr = (memory->at((uint16_t) (oldSP - 1)) << 8) | memory->at((uint16_t) (oldSP - 2));
+    assertCondition(retAddr == oldPC, "Interrupt return address failed");
     
     // Test interrupt disable
     state.int_enable = 0;
     oldPC = state.pc;
-    cpu->raiseInterrupt(0x10);
-    cpu->Emulate8080p(0);
+    cpu->raiseInterrupt(0xD7);  // RST 2
+    execute(oldPC);
     assertCondition(state.pc == oldPC + 1, "Disabled interrupt was taken");
 }
 
-void EmulatorTest::runAllTests() {
+namespace {
+    const char* const ENGINE_NAMES[EmulatorTest::ENGINE_COUNT] = {"step", "block", "cached", "translated"};
+
+    const uint64_t ENGINE_TEST_CYCLES = 300000;    ///< Per program and engine
+    const int ENGINE_MEMORY_CHECK = 64;            ///< Boundaries between memory compares
+
+    // Random programs keep to a small hot area so blocks get translated.
+    const uint16_t TEST_CODE = 0x4100;             ///< 256 bytes every jump lands in
+    const uint16_t TEST_DATA = 0x5000;             ///< 512 bytes most operands point at
+    const uint16_t TEST_STACK = 0x5180;
+
+    bool isUnimplemented(uint8_t opcode) {
+        return ((opcode & 0xc7) == 0 && opcode != 0) || opcode == 0xcb || opcode == 0xd9 ||
+               opcode == 0xdd || opcode == 0xed || opcode == 0xfd;
+    }
+
+    // Random byte, rarely an unimplemented opcode so programs run a while.
+    uint8_t randomByte(std::mt19937& random) {
+        uint8_t value = static_cast<uint8_t>(random());
+        if (isUnimplemented(value) && random() % 60 != 0)
+            value = static_cast<uint8_t>((value & 0x3f) | 0x40);
+        return value;
+    }
+
+    // With slots, a self-modifying store may land in another slot's
+    // TEST_CODE: past a slot's share of the 64K the MMU is in the next one's.
+    uint16_t randomAddress(std::mt19937& random, int slots) {
+        switch (random() % (slots > 1 ? 8 : 20)) {
+            case 0: return static_cast<uint16_t>(0xfff0 + random() % 16);   // Wraps past the top
+            case 1: return static_cast<uint16_t>(random());
+            case 2:                                                         // Self-modifying
+                return static_cast<uint16_t>(TEST_CODE + random() % 0x100 + (random() % slots) * (0x10000 / slots));
+            default: return static_cast<uint16_t>(TEST_DATA + random() % 0x200);
+        }
+    }
+
+    // Instructions all over the 64K, branches into TEST_CODE and the RST
+    // vectors jumping there too. With slots, now and then a PCHL moves
+    // the base register to another slot, which runs its own TEST_CODE.
+    void generateProgram(std::mt19937& random, uint8_t* image, int slots = 1) {
+        for (int i = 0; i < 0x10000; i++)
+            image[i] = randomByte(random);
+        for (int pc = 0; pc < 0xfffd;) {
+            if (slots > 1 && pc < 0xfff0 && random() % 24 == 0) {
+                uint16_t base = static_cast<uint16_t>((random() % slots) * (0x10000 / slots));
+                uint16_t target = static_cast<uint16_t>(TEST_CODE + random() % 0x100);
+                const uint8_t switchSlot[] = {
+                    0x11, static_cast<uint8_t>(base & 0xff), static_cast<uint8_t>(base >> 8),     // LXI D,base
+                    0x21, static_cast<uint8_t>(target & 0xff), static_cast<uint8_t>(target >> 8), // LXI H,target
+                    0xe9                                                                            // PCHL
+                };
+                memcpy(&image[pc], switchSlot, sizeof(switchSlot));
+                pc += sizeof(switchSlot);
+                continue;
+            }
+            uint8_t opcode = static_cast<uint8_t>(random());
+            if (random() % 8 == 0)
+                opcode = static_cast<uint8_t>(0xc2 | (random() % 8) << 3 | (random() % 2) << 2);   // Jcc, Ccc
+            if (random() % 40 == 0)
+                opcode = 0xc9;                                  // RET
+            if (opcode == 0x76 && random() % 4 != 0)
+                opcode = 0x00;                                  // HLT ends the program
+            if (isUnimplemented(opcode) && random() % 30 != 0)
+                opcode = static_cast<uint8_t>(0x80 + random() % 0x40);
+            if ((opcode & 0xc7) == 0xc7 && random() % 4 != 0)
+                opcode = static_cast<uint8_t>(0x40 + random() % 0x30);  // Fewer RSTs
+            int length = BlockCache::instructionLength(opcode);
+            image[pc] = opcode;
+            if (length == 2)
+                image[pc + 1] = randomByte(random);
+            if (length == 3) {
+                bool branch = (opcode & 0xc7) == 0xc2 || (opcode & 0xc7) == 0xc4 || opcode == 0xc3 || opcode == 0xcd;
+                uint16_t address = branch ? static_cast<uint16_t>(TEST_CODE + random() % 0x100)
+                                          : randomAddress(random, slots);
+                if (opcode == 0x31)                             // LXI SP
+                    address = static_cast<uint16_t>(TEST_STACK - 0x80 + random() % 0x100);
+                image[pc + 1] = static_cast<uint8_t>(address & 0xff);
+                image[pc + 2] = static_cast<uint8_t>(address >> 8);
+            }
+            pc += length;
+        }
+        for (int vector = 0; vector < 0x40; vector += 8) {
+            image[vector] = 0xc3;                               // JMP TEST_CODE
+            image[vector + 1] = static_cast<uint8_t>(TEST_CODE & 0xff);
+            image[vector + 2] = static_cast<uint8_t>(TEST_CODE >> 8);
+        }
+    }
+
+    unsigned advance(CPU8080& cpu, EmulatorTest::Engine engine) {
+        switch (engine) {
+            case EmulatorTest::ENGINE_STEP: return cpu.Emulate8080p(0);
+            case EmulatorTest::ENGINE_CACHED: return cpu.EmulateCached(0);
+            default: return cpu.EmulateBlock(0);
+        }
+    }
+
+    bool isStopped(const CPU8080& cpu) {
+        return cpu.getFault() != NULL || (cpu.getTotalCycles() != 0 && cpu.isHalted());
+    }
+
+    // Empty if the two engines agree, else what differs.
+    std::string compareEngines(const CPU8080& x, const CPU8080& y) {
+        const State8080& a = *x.getState();
+        const State8080& b = *y.getState();
+        char text[512];
+        if (a.a != b.a || a.b != b.b || a.c != b.c || a.d != b.d || a.e != b.e || a.h != b.h || a.l != b.l ||
+            a.sp != b.sp || a.pc != b.pc || memcmp(&a.cc, &b.cc, 1) != 0 || a.int_enable != b.int_enable ||
+            a.zsp_pending != b.zsp_pending) {
+            uint8_t flagsA, flagsB;
+            memcpy(&flagsA, &a.cc, 1);
+            memcpy(&flagsB, &b.cc, 1);
+            snprintf(text, sizeof(text),
+                     "pc %04x/%04x sp %04x/%04x a %02x/%02x bc %02x%02x/%02x%02x de %02x%02x/%02x%02x "
+                     "hl %02x%02x/%02x%02x flags %02x/%02x ei %d/%d",
+                     a.pc, b.pc, a.sp, b.sp, a.a, b.a, a.b, a.c, b.b, b.c, a.d, a.e, b.d, b.e,
+                     a.h, a.l, b.h, b.l, flagsA, flagsB, a.int_enable, b.int_enable);
+            return text;
+        }
+        if (x.scheduler_timer != y.scheduler_timer || x.interrupt != y.interrupt ||
+            x.interrupt_code != y.interrupt_code) {
+            snprintf(text, sizeof(text), "timer %u/%u interrupt %d/%d code %02x/%02x",
+                     x.scheduler_timer, y.scheduler_timer, x.interrupt, y.interrupt,
+                     x.interrupt_code, y.interrupt_code);
+            return text;
+        }
+        if (x.getInstructionCount() != y.getInstructionCount()) {
+            snprintf(text, sizeof(text), "instructions %llu/%llu", (unsigned long long) x.getInstructionCount(),
+                     (unsigned long long) y.getInstructionCount());
+            return text;
+        }
+        if ((x.getFault() == NULL) != (y.getFault() == NULL))
+            return std::string("fault ") + (x.getFault() ? x.getFault() : "none") + "/" +
+                   (y.getFault() ? y.getFault() : "none");
+        return "";
+    }
+
+    std::string compareMemory(MemoryBase& x, MemoryBase& y) {
+        for (uint32_t address = 0; address < 0x10000; address++) {
+            if (x.at(address) != y.at(address)) {
+                char text[64];
+                snprintf(text, sizeof(text), "memory at %04x %02x/%02x", address, x.at(address), y.at(address));
+                return text;
+            }
+        }
+        return "";
+    }
+}
+
+void EmulatorTest::testEngines(uint32_t seed, int programs) {
+    // Process 1 runs a block, then the kernel stores to 4001, which is
+    // process 1's 0001, and switches back: MVI A,2 has to be stored at 3000.
+    static const uint8_t crossSlot[][8] = {
+        {0x40, 0x00, 0x3e, 0x01},                 // 0000 MVI A,1
+        {0x40, 0x02, 0x32, 0x00, 0x30},           // 0002 STA 3000
+        {0x40, 0x05, 0x0c},                       // 0005 INR C
+        {0x40, 0x06, 0x79},                       // 0006 MOV A,C
+        {0x40, 0x07, 0xfe, 0x02},                 // 0007 CPI 2
+        {0x40, 0x09, 0xca, 0x20, 0x00},           // 0009 JZ 0020
+        {0x40, 0x0c, 0x11, 0x00, 0x00},           // 000c LXI D,0000
+        {0x40, 0x0f, 0x21, 0x00, 0x01},           // 000f LXI H,0100
+        {0x40, 0x12, 0xe9},                       // 0012 PCHL
+        {0x40, 0x20, 0x76},                       // 0020 HLT
+        {0x01, 0x00, 0x3e, 0x02},                 // Kernel 0100 MVI A,2
+        {0x01, 0x02, 0x32, 0x01, 0x40},           // 0102 STA 4001
+        {0x01, 0x05, 0x11, 0x00, 0x40},           // 0105 LXI D,4000
+        {0x01, 0x08, 0x21, 0x00, 0x00},           // 0108 LXI H,0000
+        {0x01, 0x0b, 0xe9},                       // 010b PCHL
+    };
+    static uint8_t image[0x10000];
+    std::mt19937 random(seed);
+    for (int program = -1; program < programs; program++) {
+        // Flat, paged with one process, paged with four.
+        bool paged = program % 3 != 0;
+        int processes = program % 3 == 2 || program < 0 ? 4 : 1;
+        uint16_t base = 0x4000;
+        int pageSize = 1024;
+        uint16_t quantum = 0xffff;
+        uint32_t registers = 0;
+        if (program < 0) {
+            memset(image, 0, sizeof(image));
+            for (size_t i = 0; i < sizeof(crossSlot) / sizeof(crossSlot[0]); i++) {
+                int length = BlockCache::instructionLength(crossSlot[i][2]);
+                memcpy(&image[crossSlot[i][0] << 8 | crossSlot[i][1]], &crossSlot[i][2], length);
+            }
+        } else {
+            generateProgram(random, image, processes);
+            base = static_cast<uint16_t>((random() % processes) * (GUEST_SPACE / processes));
+            pageSize = 64 << (random() % 4);
+            quantum = static_cast<uint16_t>(20 + random() % 400);
+            registers = random();
+        }
+
+        State8080 states[ENGINE_COUNT];
+        std::unique_ptr<MemoryBase> memories[ENGINE_COUNT];
+        std::unique_ptr<EnhancedCPU8080> cpus[ENGINE_COUNT];
+        int engines = 0;
+        for (int i = 0; i < ENGINE_COUNT; i++) {
+            if (paged) {
+                Memory* mem = new Memory(0x2000, PageLog::LOG_OFF, pageSize, processes);
+                for (uint32_t address = 0; address < 0x10000; address++)
+                    mem->writeAt(address) = image[address];
+                mem->setBaseRegister(base);
+                memories[i].reset(mem);
+            } else {
+                FlatMemory* mem = new FlatMemory();
+                memcpy(mem->bytes, image, sizeof(image));
+                memories[i].reset(mem);
+            }
+            states[i] = State8080{};
+            State8080& s = states[i];
+            std::mt19937 values(registers);
+            s.a = values(); s.b = values(); s.c = values(); s.d = values();
+            s.e = values(); s.h = values(); s.l = values();
+            uint8_t flags = static_cast<uint8_t>((values() & 0xd7) | 0x02);
+            memcpy(&s.cc, &flags, 1);
+            s.sp = TEST_STACK;
+            s.pc = TEST_CODE;
+            s.int_enable = 1;
+            if (program < 0) {
+                s.c = 0;
+                s.pc = 0;
+                s.int_enable = 0;
+            }
+            cpus[i].reset(new EnhancedCPU8080(&states[i], memories[i].get()));
+            cpus[i]->setExitOnFault(false);
+            cpus[i]->setQuantum(quantum);
+            if (i == ENGINE_TRANSLATED && !cpus[i]->setTranslation(true)) {
+                cpus[i].reset();
+                continue;
+            }
+            engines = i + 1;
+        }
+
+        for (int boundary = 0; ; boundary++) {
+            // Up to the next instruction boundary every engine stops at.
+            uint64_t target;
+            bool level;
+            do {
+                target = 0;
+                for (int i = 0; i < engines; i++)
+                    target = std::max(target, cpus[i]->getTotalCycles());
+                level = true;
+                for (int i = 0; i < engines; i++) {
+                    while (cpus[i]->getTotalCycles() < target && !isStopped(*cpus[i]))
+                        advance(*cpus[i], static_cast<Engine>(i));
+                    level = level && cpus[i]->getTotalCycles() == target;
+                }
+            } while (!level && !isStopped(*cpus[0]));
+
+            bool checkMemory = boundary % ENGINE_MEMORY_CHECK == ENGINE_MEMORY_CHECK - 1 ||
+                               target >= ENGINE_TEST_CYCLES || isStopped(*cpus[0]);
+            for (int i = 1; i < engines; i++) {
+                std::string difference;
+                if (cpus[i]->getTotalCycles() != cpus[0]->getTotalCycles())
+                    difference = "cycles " + std::to_string(cpus[0]->getTotalCycles()) + "/" +
+                                 std::to_string(cpus[i]->getTotalCycles());
+                else
+                    difference = compareEngines(*cpus[0], *cpus[i]);
+                if (difference.empty() && checkMemory && !paged)
+                    difference = compareMemory(*memories[0], *memories[i]);
+                if (!difference.empty()) {
+                    std::string message = std::string(ENGINE_NAMES[i]) + " differs from step in program " +
+                                          std::to_string(program) + " of seed " + std::to_string(seed) +
+                                          " at cycle " + std::to_string(target) + ": " + difference;
+                    assertCondition(false, message.c_str());
+                }
+            }
+            if (target >= ENGINE_TEST_CYCLES || isStopped(*cpus[0]))
+                break;
+            advance(*cpus[0], ENGINE_STEP);
+        }
+
+        // Reading a paged memory back faults pages in, so only at the end.
+        // Fault counts are not compared: a cached block is not fetched again
+        // when its page is evicted, so the engines fault at different times.
+        if (paged) {
+            for (int i = 1; i < engines; i++) {
+                std::string difference = compareMemory(*memories[0], *memories[i]);
+                if (!difference.empty()) {
+                    std::string message = std::string(ENGINE_NAMES[i]) + " differs from step in program " +
+                                          std::to_string(program) + " of seed " + std::to_string(seed) +
+                                          ": " + difference;
+                    assertCondition(false, message.c_str());
+                }
+            }
+        }
+        if (program < 0)
+            assertCondition(states[0].pc == 0x0021 && memories[0]->at(0x3000) == 2,
+                            "Kernel store to another process's code was not seen");
+    }
+}
+
+void EmulatorTest::testIdleSkip(uint32_t seed, int programs) {
+    // The timer handler, RST 5, counts to 5 and then sets the flag the
+    // main loop polls; after that the guest spins with interrupts off.
+    static const uint8_t idleGuest[][4] = {
+        {0x00, 0xc3, 0x00, 0x02},     // JMP 0200
+        {0x28, 0x3a, 0x00, 0x06},     // LDA 0600
+        {0x2b, 0x3c},                 // INR A
+        {0x2c, 0x32, 0x00, 0x06},     // STA 0600
+        {0x2f, 0xfe, 0x05},           // CPI 5
+        {0x31, 0xc2, 0x38, 0x00},     // JNZ 0038
+        {0x34, 0x32, 0x01, 0x06},     // STA 0601
+        {0x38, 0xfb},                 // EI
+        {0x39, 0xc9},                 // RET
+    };
+    static const uint8_t idleMain[] = {
+        0x31, 0x00, 0x04,             // 0200 LXI SP,0400
+        0xfb,                         // 0203 EI
+        0x3a, 0x01, 0x06,             // 0204 LDA 0601
+        0xb7,                         // 0207 ORA A
+        0xca, 0x04, 0x02,             // 0208 JZ 0204
+        0xf3,                         // 020b DI
+        0xc3, 0x0c, 0x02,             // 020c JMP 020c
+    };
+    static uint8_t image[0x10000];
+    std::mt19937 random(seed);
+    for (int program = -1; program < programs; program++) {
+        uint16_t quantum;
+        if (program < 0) {
+            memset(image, 0, sizeof(image));
+            for (size_t i = 0; i < sizeof(idleGuest) / sizeof(idleGuest[0]); i++) {
+                int length = BlockCache::instructionLength(idleGuest[i][1]);
+                memcpy(&image[idleGuest[i][0]], &idleGuest[i][1], length);
+            }
+            memcpy(&image[0x0200], idleMain, sizeof(idleMain));
+            quantum = 2000;
+        } else {
+            generateProgram(random, image);
+            quantum = static_cast<uint16_t>(20 + random() % 4000);
+        }
+
+        State8080 states[2];
+        FlatMemory memories[2];
+        std::unique_ptr<EnhancedCPU8080> cpus[2];
+        for (int i = 0; i < 2; i++) {
+            memcpy(memories[i].bytes, image, sizeof(image));
+            states[i] = State8080{};
+            states[i].sp = TEST_STACK;
+            states[i].pc = program < 0 ? 0 : TEST_CODE;
+            cpus[i].reset(new EnhancedCPU8080(&states[i], &memories[i]));
+            cpus[i]->setExitOnFault(false);
+            cpus[i]->setQuantum(quantum);
+            cpus[i]->setIdleSkip(i == 1);
+        }
+
+        CPU8080::StopReason reasons[2];
+        do {
+            uint64_t budget = 500 + random() % 20000;
+            for (int i = 0; i < 2; i++) {
+                CPU8080& cpu = *cpus[i];
+                reasons[i] = cpu.Run(budget);
+            }
+            std::string difference;
+            if (reasons[0] != reasons[1])
+                difference = "stop reason " + std::to_string(reasons[0]) + "/" + std::to_string(reasons[1]);
+            else if (cpus[0]->getTotalCycles() != cpus[1]->getTotalCycles())
+                difference = "cycles " + std::to_string(cpus[0]->getTotalCycles()) + "/" +
+                             std::to_string(cpus[1]->getTotalCycles());
+            else
+                difference = compareEngines(*cpus[0], *cpus[1]);
+            if (difference.empty())
+                difference = compareMemory(memories[0], memories[1]);
+            if (!difference.empty()) {
+                std::string message = "idle skip differs in program " + std::to_string(program) + " of seed " +
+                                      std::to_string(seed) + " at cycle " +
+                                      std::to_string(cpus[0]->getTotalCycles()) + ": " + difference;
+                assertCondition(false, message.c_str());
+            }
+        } while (reasons[0] != CPU8080::STOP_HALT && reasons[0] != CPU8080::STOP_FAULT &&
+                 cpus[0]->getTotalCycles() < ENGINE_TEST_CYCLES);
+
+        if (program < 0) {
+            assertCondition(states[1].pc == 0x020c && states[1].int_enable == 0, "Idle guest did not finish polling");
+            assertCondition(cpus[1]->getIdleCycles() > ENGINE_TEST_CYCLES / 2, "Idle loop was not skipped");
+        }
+    }
+}
+
+void EmulatorTest::testPageSharing(uint32_t seed) {
+    static uint8_t program[2048];
+    for (size_t i = 0; i < sizeof(program); i++)
+        program[i] = static_cast<uint8_t>(i * 7 + 1);
+    const uint16_t space = GUEST_SPACE / PROCESS_COUNT;
+
+    {
+        Memory mem(FRAME_COUNT * PAGE_SIZE, PageLog::LOG_OFF);
+        mem.setPageSharing(true);
+        mem.loadImage(0, program, sizeof(program));
+        mem.loadImage(space, program, sizeof(program));
+        mem.setBaseRegister(0);
+        uint8_t first = mem.at(0x10);
+        mem.setBaseRegister(space);
+        assertCondition(mem.at(0x10) == first, "Shared page read back wrong");
+        assertCondition(mem.getSharedMappingCount() == 1, "Same program page not shared");
+        mem.at(0x3000);
+        mem.setBaseRegister(2 * space);
+        mem.at(0x3000);
+        assertCondition(mem.getSharedMappingCount() == 2, "Zero page not shared");
+
+        mem.setBaseRegister(space);
+        mem.writeAt(0x10) = static_cast<uint8_t>(first + 1);
+        assertCondition(mem.getCopyOnWriteCount() == 1, "Store to a shared page not copied");
+        assertCondition(mem.at(0x10) == static_cast<uint8_t>(first + 1), "Copied page lost the store");
+        mem.setBaseRegister(0);
+        assertCondition(mem.at(0x10) == first, "Store leaked into the other process");
+        int shared = 0;
+        for (int frame = 0; frame < mem.getFrameCount(); frame++)
+            shared += mem.getFrameSharers(frame) > 1;
+        assertCondition(shared == 1, "Only the zero page should still be shared");
+    }
+
+    static const char* const policies[] = {"fifo", "clock", "lru", "ws"};
+    std::mt19937 random(seed);
+    for (int run = 0; run < 16; run++) {
+        int frames = 1 + random() % 8;
+        int pageSize = 64 << (random() % 5);
+        std::unique_ptr<Memory> memories[2];
+        for (int i = 0; i < 2; i++) {
+            memories[i].reset(new Memory(static_cast<uint64_t>(frames) * pageSize, PageLog::LOG_OFF, pageSize));
+            memories[i]->setReplacementPolicy(ReplacementPolicy::create(policies[run % 4], frames));
+            memories[i]->setPageSharing(i == 1);
+            for (int process = 0; process < PROCESS_COUNT; process += 2)
+                memories[i]->loadImage(process * space, program, sizeof(program));
+        }
+        // Mostly a few pages, so frames fill up with equal bytes.
+        for (int step = 0; step < 20000; step++) {
+            uint32_t choice = random();
+            uint16_t base = static_cast<uint16_t>((random() % PROCESS_COUNT) * space);
+            uint32_t address = random() % 2 ? random() % sizeof(program) : random() % space;
+            uint8_t value = static_cast<uint8_t>(random() % 3 == 0 ? 0 : random());
+            for (int i = 0; i < 2; i++) {
+                if (choice % 8 == 0)
+                    memories[i]->setBaseRegister(base);
+                else if (choice % 8 == 1)
+                    memories[i]->writeAt(address) = value;
+            }
+            if (choice % 8 >= 2 && memories[0]->at(address) != memories[1]->at(address)) {
+                std::string message = "page sharing changed what run " + std::to_string(run) + " of seed " +
+                                      std::to_string(seed) + " reads at step " + std::to_string(step);
+                assertCondition(false, message.c_str());
+            }
+        }
+        for (int process = 0; process < PROCESS_COUNT; process++) {
+            for (int i = 0; i < 2; i++)
+                memories[i]->setBaseRegister(static_cast<uint16_t>(process * space));
+            for (uint32_t address = 0; address < space; address++) {
+                if (memories[0]->at(address) != memories[1]->at(address)) {
+                    std::string message = "page sharing changed memory of run " + std::to_string(run) +
+                                          " of seed " + std::to_string(seed);
+                    assertCondition(false, message.c_str());
+                }
+            }
+        }
+        assertCondition(memories[1]->getSharedMappingCount() > 0, "Nothing was shared");
+    }
+}
+
+void EmulatorTest::testStateManager(uint32_t seed) {
+    static uint8_t expected[3][0x10000];    // Memory as snapshot, and file, i saw it
+    static uint8_t model[0x10000];
+    const char* const files[2] = {"os_test_state.full", "os_test_state.incremental"};
+    std::mt19937 random(seed);
+    for (int run = 0; run < 8; run++) {
+        bool paged = run % 4 != 0;
+        int pageSize = 64 << (random() % 4);
+        int processes = 1 << (random() % 3);
+        int frames = 8 + random() % 16;
+        auto makeMemory = [&](int size) -> MemoryBase* {
+            if (!paged) return new FlatMemory();
+            return new Memory(static_cast<uint64_t>(frames) * size, PageLog::LOG_OFF, size, processes);
+        };
+        std::unique_ptr<MemoryBase> memory(makeMemory(pageSize));
+        Memory* mem = dynamic_cast<Memory*>(memory.get());
+        std::string where = "run " + std::to_string(run) + " of seed " + std::to_string(seed);
+
+        // A few hot addresses, so a store often hits a page whose TLB entry
+        // was writable before the last checkpoint.
+        uint16_t hot[4];
+        for (int i = 0; i < 4; i++)
+            hot[i] = static_cast<uint16_t>(random());
+        auto scribble = [&](int stores) {
+            for (int step = 0; step < stores + 8; step++) {
+                uint16_t address = step >= stores ? hot[step % 4]           // Twice, so the TLB has them
+                                 : random() % 32 ? hot[random() % 4] : static_cast<uint16_t>(random());
+                uint8_t value = static_cast<uint8_t>(random());
+                if (mem != nullptr)
+                    mem->writeAt(address) = value;
+                else
+                    memory->at(address) = value;
+                model[address] = value;
+                if (random() % 256 == 0)
+                    memory->at(static_cast<uint16_t>(random()));    // Fault, evict
+            }
+        };
+        auto check = [&](MemoryBase& m, const uint8_t* bytes, const char* what) {
+            for (uint32_t address = 0; address < 0x10000; address++) {
+                if (m.at(address) != bytes[address]) {
+                    std::string message = std::string(what) + " wrong at " + std::to_string(address) + " in " + where;
+                    assertCondition(false, message.c_str());
+                }
+            }
+        };
+
+        memset(model, 0, sizeof(model));
+        StateManager manager;
+        State8080 states[3];
+        StateManager::SnapshotId ids[3];
+        for (int round = 0; round < 3; round++) {
+            scribble(round == 0 ? 4000 : 300);
+            memcpy(expected[round], model, sizeof(model));
+            states[round] = State8080{};
+            states[round].a = static_cast<uint8_t>(random());
+            states[round].pc = static_cast<uint16_t>(random());
+            states[round].sp = static_cast<uint16_t>(random());
+            std::string name = "round " + std::to_string(round);
+            ids[round] = manager.createSnapshot(name.c_str(), states[round], memory.get());
+            if (round < 2)
+                manager.saveState(files[round], states[round], memory.get(), round == 1);
+        }
+        if (mem != nullptr)
+            assertCondition(manager.getCopiedChunkCount() < 3 * static_cast<uint64_t>(mem->getChunkCount()),
+                            ("Snapshots shared no chunks in " + where).c_str());
+
+        // Restoring over stores made since, the chunks they touched have
+        // to come back while the rest stay shared.
+        for (int restore = 0; restore < 6; restore++) {
+            int round = random() % 3;
+            State8080 state{};
+            if (restore % 2 == 0)
+                manager.restoreSnapshot(ids[round], state, memory.get());
+            else
+                manager.restoreSnapshot(("round " + std::to_string(round)).c_str(), state, memory.get());
+            assertCondition(state.a == states[round].a && state.pc == states[round].pc &&
+                            state.sp == states[round].sp, ("Snapshot state wrong in " + where).c_str());
+            check(*memory, expected[round], "Restored snapshot");
+            memcpy(model, expected[round], sizeof(model));
+            scribble(200);
+        }
+
+        // The full file, then it and the incremental one on top of it.
+        // Reading faults pages in, so the chain is not read in between.
+        for (int last = 0; last < 2; last++) {
+            std::unique_ptr<MemoryBase> loaded(makeMemory(pageSize));
+            StateManager loader;
+            State8080 state{};
+            for (int file = 0; file <= last; file++)
+                loader.loadState(files[file], state, loaded.get());
+            assertCondition(state.pc == states[last].pc, ("Loaded state wrong in " + where).c_str());
+            check(*loaded, expected[last], "Loaded state file");
+        }
+        if (mem != nullptr) {
+            std::ifstream full(files[0], std::ios::binary | std::ios::ate);
+            std::ifstream incremental(files[1], std::ios::binary | std::ios::ate);
+            assertCondition(incremental.tellg() < full.tellg(), ("Incremental file not smaller in " + where).c_str());
+
+            std::unique_ptr<MemoryBase> other(makeMemory(pageSize * 2));
+            State8080 state{};
+            bool thrown = false;
+            try {
+                manager.restoreSnapshot(ids[0], state, other.get());
+            } catch (const EmulatorException&) {
+                thrown = true;
+            }
+            assertCondition(thrown, ("Snapshot restored into another page size in " + where).c_str());
+        }
+    }
+    for (int file = 0; file < 2; file++)
+        std::remove(files[file]);
+}
+
+void EmulatorTest::testTracer(uint32_t seed) {
+    const size_t entries = 3 * TRACE_KEYFRAME_INTERVAL + 100;   // Three keyframes
+
+    // The same entries every call: mostly small steps, now and then a jump
+    // either way, a new stack pointer, a few registers or the flags.
+    // Returns the table decode should print.
+    auto feed = [&](InstructionTracer& tracer) {
+        std::mt19937 random(seed);
+        std::string table;
+        State8080 s{};
+        uint16_t pc = 0x0100;
+        uint64_t cycle = 0;
+        char line[128];
+        for (size_t i = 0; i < entries; i++) {
+            uint32_t choice = random();
+            pc = static_cast<uint16_t>(choice % 16 == 0 ? random() : pc + 1 + random() % 3);
+            if (choice % 7 == 0)
+                s.sp = static_cast<uint16_t>(random());
+            uint8_t* registers[7] = {&s.a, &s.b, &s.c, &s.d, &s.e, &s.h, &s.l};
+            for (int r = 0; r < 7; r++)
+                if (random() % 5 == 0) *registers[r] = static_cast<uint8_t>(random());
+            if (choice % 3 == 0) {
+                uint8_t flags = static_cast<uint8_t>((random() & 0xd7) | 0x02);
+                memcpy(&s.cc, &flags, 1);
+            }
+            cycle += choice % 64 == 0 ? 100000 + random() : 4 + random() % 14;
+            tracer.addTrace(pc, static_cast<uint8_t>(random()), s, cycle);
+            InstructionTracer::formatEntry(line, sizeof(line), tracer.get(tracer.size() - 1));
+            table += line;
+        }
+        return table;
+    };
+
+    std::vector<uint8_t> region(entries * 32 + 8);
+    InstructionTracer tracer;
+    tracer.startStream(region.data(), region.size());
+    std::string expected = feed(tracer);
+    tracer.stopStream();
+    size_t used = tracer.getRegionUsed();
+    assertCondition(tracer.getDroppedBytes() == 0 && used > 8 && used < region.size(), "Trace stream size wrong");
+    assertCondition(memcmp(region.data(), TRACE_STREAM_MAGIC, 8) == 0, "Trace stream magic missing");
+    const uint8_t* records = region.data() + 8;
+    size_t length = used - 8;
+
+    // All at once, then in random pieces: a record cut off at the end of
+    // a piece is left for the next one. Each piece is followed by junk, so
+    // a record read past the end decodes wrong.
+    std::mt19937 random(seed);
+    std::vector<uint8_t> piece;
+    for (int pass = 0; pass < 2; pass++) {
+        std::ostringstream out;
+        InstructionTracer::TraceEntry previous;
+        memset(&previous, 0, sizeof(previous));
+        size_t start = 0;
+        while (start < length) {
+            size_t end = pass == 0 ? length : std::min(length, start + 1 + random() % 40);
+            piece.assign(records + start, records + end);
+            piece.resize(end - start + 32, 0xa5);
+            size_t consumed = InstructionTracer::decode(piece.data(), end - start, out, previous);
+            assertCondition(consumed <= end - start, "Trace record decoded past the end of the data");
+            if (end == length)
+                assertCondition(consumed == end - start, "Trace stream has trailing bytes");
+            start += consumed;
+        }
+        assertCondition(out.str() == expected,
+                        pass == 0 ? "Trace stream decoded wrong" : "Trace stream decoded wrong in pieces");
+    }
+
+    // A region that fills up ends in part of a record, which is dropped:
+    // what decodes is the start of the table.
+    std::vector<uint8_t> part(length / 2 + 8);
+    InstructionTracer small;
+    small.startStream(part.data(), part.size());
+    feed(small);
+    small.stopStream();
+    assertCondition(small.getRegionUsed() == part.size() && small.getDroppedBytes() == used - part.size(),
+                    "Full trace region not counted");
+    std::ostringstream out;
+    InstructionTracer::TraceEntry previous;
+    memset(&previous, 0, sizeof(previous));
+    size_t consumed = InstructionTracer::decode(part.data() + 8, part.size() - 8, out, previous);
+    std::string prefix = out.str();
+    assertCondition(consumed > 0 && !prefix.empty() && prefix.size() < expected.size() &&
+                    expected.compare(0, prefix.size(), prefix) == 0, "Truncated trace stream decoded wrong");
+}
+
+void EmulatorTest::testSystemCalls() {
+    // Five PRINT_STRs of 130 cycles each against a quantum of 100, so every
+    // call's charge runs the quantum out. The timer handler, RST 5, counts
+    // its runs at 0300.
+    static const uint8_t guest[][8] = {
+        {0x00, 0x00, 0xc3, 0x40, 0x00},           // 0000 JMP 0040
+        {0x00, 0x03, 0xd5},                       // 0003 PUSH D, the GTU_OS stub of the ASM programs
+        {0x00, 0x04, 0xe5},                       // 0004 PUSH H
+        {0x00, 0x05, 0xf5},                       // 0005 PUSH PSW
+        {0x00, 0x07, 0x00},                       // 0007 NOP, the system call
+        {0x00, 0x08, 0xf1},                       // 0008 POP PSW
+        {0x00, 0x09, 0xe1},                       // 0009 POP H
+        {0x00, 0x0a, 0xd1},                       // 000a POP D
+        {0x00, 0x0b, 0xc9},                       // 000b RET
+        {0x00, 0x28, 0xc3, 0x80, 0x00},           // 0028 JMP 0080
+        {0x00, 0x40, 0x31, 0x00, 0x04},           // 0040 LXI SP,0400
+        {0x00, 0x43, 0x3e, 0x06},                 // 0043 MVI A,SET_QUANTUM
+        {0x00, 0x45, 0x01, 0x64, 0x00},           // 0045 LXI B,100
+        {0x00, 0x48, 0xcd, 0x03, 0x00},           // 0048 CALL 0003
+        {0x00, 0x4b, 0xfb},                       // 004b EI
+        {0x00, 0x4c, 0x1e, 0x05},                 // 004c MVI E,5
+        {0x00, 0x4e, 0x3e, 0x01},                 // 004e MVI A,PRINT_STR
+        {0x00, 0x50, 0x01, 0x00, 0x02},           // 0050 LXI B,0200
+        {0x00, 0x53, 0xcd, 0x03, 0x00},           // 0053 CALL 0003
+        {0x00, 0x56, 0x1d},                       // 0056 DCR E
+        {0x00, 0x57, 0xc2, 0x4e, 0x00},           // 0057 JNZ 004e
+        {0x00, 0x5a, 0x76},                       // 005a HLT
+        {0x00, 0x80, 0xf5},                       // 0080 PUSH PSW
+        {0x00, 0x81, 0x3a, 0x00, 0x03},           // 0081 LDA 0300
+        {0x00, 0x84, 0x3c},                       // 0084 INR A
+        {0x00, 0x85, 0x32, 0x00, 0x03},           // 0085 STA 0300
+        {0x00, 0x88, 0xf1},                       // 0088 POP PSW
+        {0x00, 0x89, 0xfb},                       // 0089 EI
+        {0x00, 0x8a, 0xc9},                       // 008a RET
+    };
+    static const char text[] = "hello, world\n";
+
+    for (int translated = 0; translated < 2; translated++) {
+        FlatMemory mem;
+        for (size_t i = 0; i < sizeof(guest) / sizeof(guest[0]); i++) {
+            int length = BlockCache::instructionLength(guest[i][2]);
+            memcpy(&mem.bytes[guest[i][0] << 8 | guest[i][1]], &guest[i][2], length);
+        }
+        memcpy(&mem.bytes[0x0200], text, sizeof(text));
+        State8080 s{};
+        EnhancedCPU8080 cpu(&s, &mem);
+        cpu.setTranslation(translated == 1);
+        std::ostringstream out;
+        uint64_t printed;
+        {
+            GTUOS os(nullptr, &out);
+            CPU8080::StopReason reason;
+            do {
+                reason = cpu.Run(1000);
+                if (reason == CPU8080::STOP_SYSCALL)
+                    os.handleCall(cpu, 0);
+            } while (reason != CPU8080::STOP_HALT && reason != CPU8080::STOP_FAULT &&
+                     cpu.getTotalCycles() < 100000);
+            printed = os.getSyscall(PRINT_STR_CODE).calls;
+        }
+        std::string expected;
+        for (int i = 0; i < 5; i++)
+            expected += text;
+        assertCondition(cpu.isHalted() && printed == 5 && out.str() == expected,
+                        "A system call ran again after its cycles ran the quantum out");
+        assertCondition(mem.bytes[0x0300] >= 5, "Timer interrupt not taken after system calls");
+    }
+}
+
+void EmulatorTest::timeOpcodes(std::ostream& out, int iterations) {
+    const uint16_t code = 0x1000;
+    const uint16_t data = 0x8000;
+    struct Timing {
+        uint8_t opcode;
+        uint16_t operand;
+        double nanoseconds;
+    };
+    std::vector<Timing> timings;
+    std::vector<int> unimplemented;
+    for (int opcode = 0; opcode < 256; opcode++) {
+        FlatMemory mem;
+        State8080 s{};
+        EnhancedCPU8080 timed(&s, &mem);
+        CPU8080& base = timed;
+        timed.setExitOnFault(false);
+        // Jumps and calls come back to the instruction, loads and stores
+        // go to data, so its own bytes never change.
+        bool memoryOperand = opcode == 0x22 || opcode == 0x2a || opcode == 0x32 || opcode == 0x3a;
+        uint16_t operand = memoryOperand ? data : code;
+        mem.bytes[code] = static_cast<uint8_t>(opcode);
+        mem.bytes[code + 1] = static_cast<uint8_t>(operand & 0xff);
+        mem.bytes[code + 2] = static_cast<uint8_t>(operand >> 8);
+        mem.bytes[data + 0x1000] = static_cast<uint8_t>(code & 0xff);   // RET and XTHL at the stack
+        mem.bytes[data + 0x1001] = static_cast<uint8_t>(code >> 8);
+
+        auto reset = [&s]() {
+            s.b = 0x80; s.c = 0x00;
+            s.d = 0x80; s.e = 0x10;
+            s.h = 0x80; s.l = 0x20;
+            s.sp = 0x9000;
+            s.pc = 0x1000;
+            s.int_enable = 0;
+        };
+        reset();
+        base.Emulate8080p(0);
+        if (timed.getFault() != NULL) {
+            unimplemented.push_back(opcode);
+            continue;
+        }
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            reset();
+            base.Emulate8080p(0);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        timings.push_back(Timing{static_cast<uint8_t>(opcode), operand, seconds * 1e9 / iterations});
+    }
+
+    std::sort(timings.begin(), timings.end(), [](const Timing& a, const Timing& b) {
+        return a.nanoseconds > b.nanoseconds;
+    });
+    out << "Opcode | Instruction      | Cycles | ns\n"
+        << "-------+------------------+--------+--------\n";
+    for (size_t i = 0; i < timings.size(); i++) {
+        uint8_t bytes[3] = {timings[i].opcode, static_cast<uint8_t>(timings[i].operand & 0xff),
+                            static_cast<uint8_t>(timings[i].operand >> 8)};
+        char mnemonic[DISASSEMBLY_SIZE];
+        Disassemble8080Op(bytes, sizeof(bytes), mnemonic, sizeof(mnemonic));
+        char line[96];
+        snprintf(line, sizeof(line), "    %02x | %-16s | %6d | %6.2f\n", timings[i].opcode, mnemonic,
+                 TIMING_TABLE[timings[i].opcode].base_cycles, timings[i].nanoseconds);
+        out << line;
+    }
+    out << "Unimplemented:";
+    for (size_t i = 0; i < unimplemented.size(); i++) {
+        char hex[8];
+        snprintf(hex, sizeof(hex), " %02x", unimplemented[i]);
+        out << hex;
+    }
+    out << "\n";
+}
+
+bool EmulatorTest::runAllTests() {
     try {
         testArithmetic();
         testLogic();
         testBranching();
         testMemoryOps();
         testInterrupts();
+        testEngines();
+        testIdleSkip();
+        testPageSharing();
+        testStateManager();
+        testTracer();
+        testSystemCalls();
         std::cout << "All tests passed successfully!\n";
+        return true;
     } catch (const std::exception& e) {
         std::cerr << "Test failed: " << e.what() << "\n";
+        return false;
     }
-} 
\ No newline at end of file
+}
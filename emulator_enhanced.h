@@ -4,7 +4,6 @@
 #include <cstdint>
 #include <cstdio>
 #include <vector>
-#include <queue>
 #include <memory>
 #include <stdexcept>
 #include <array>
@@ -14,9 +13,8 @@
 #include <unordered_map>
 #include "emulator_base.h"
 #include "memory_manager.h"
-
-// Forward declarations
-class MemoryCache;
+#include "interrupt_controller.h"
+#include "instruction_tracer.h"
 
 /**
  * @brief Pre-calculated parity lookup table for fast parity checking
@@ -46,87 +44,27 @@ private:
     ErrorCode code;
 };
 
-/**
- * @brief Instruction tracing facility for debugging and analysis
- * Maintains a circular buffer of recent instruction executions
- */
-class InstructionTracer {
-public:
-    struct TraceEntry {
-        uint16_t pc;          ///< Program counter
-        uint8_t opcode;       ///< Executed opcode
-        State8080 state;      ///< CPU state snapshot
-        uint64_t cycle;       ///< Cycle count at execution
-    };
-
-    /**
-     * @brief Add a new trace entry
-     * @param pc Program counter value
-     * @param opcode Executed instruction
-     * @param state CPU state
-     * @param cycle Current cycle count
-     */
-    void addTrace(uint16_t pc, uint8_t opcode, const State8080& state, uint64_t cycle);
-
-    /**
-     * @brief Save trace buffer to a file in human-readable format
-     * @param filename Output file path
-     * @throws EmulatorException if file cannot be opened
-     */
-    void dumpTrace(const char* filename);
-    
-    void clear() { trace_buffer.clear(); }
-    void setMaxEntries(size_t max) { max_entries = max; }
-
-private:
-    std::vector<TraceEntry> trace_buffer;
-    size_t max_entries = 1000;
-};
-
-/**
- * @brief Priority-based interrupt controller
- * Manages interrupt requests with priority levels
- */
-class InterruptController {
-public:
-    struct InterruptRequest {
-        uint8_t code;         ///< Interrupt vector
-        uint8_t priority;     ///< Priority level (0-255, higher = more priority)
-        bool pending;         ///< Whether interrupt is pending
-    };
-
-    /**
-     * @brief Queue a new interrupt request
-     * @param code Interrupt vector
-     * @param priority Priority level
-     */
-    void queueInterrupt(uint8_t code, uint8_t priority);
-    
-    bool hasInterrupt() const { return !int_queue.empty(); }
-    
-    /**
-     * @brief Get the next pending interrupt
-     * @return Next interrupt request
-     * @throws EmulatorException if no interrupts pending
-     */
-    InterruptRequest getNextInterrupt();
-    
-    void clear() { while(!int_queue.empty()) int_queue.pop(); }
-
-private:
-    std::queue<InterruptRequest> int_queue;
-};
+#define BANK_PAGE_SHIFT  8                           // 256-byte pages in the bank map
+#define BANK_PAGE_SIZE   (1 << BANK_PAGE_SHIFT)
+#define BANK_PAGES       (0x10000 >> BANK_PAGE_SHIFT)
 
 /**
  * @brief Memory bank controller for extended memory support
- * Implements bank switching and memory mapping
+ * Implements bank switching and memory mapping. Every page of the 64K
+ * address space points straight into a bank or is unmapped; the page map
+ * is rebuilt by mapMemory and switchBank, so an access is one table lookup
+ * with no exception handling unless it faults. Mappings take precedence;
+ * other addresses below the bank size go to the current bank.
+ * As a MemoryBase it can stand in for Memory: at() reads and writes without
+ * the read-only check, stores meant to honour it go through writeAt().
  */
-class MemoryBankController {
+class MemoryBankController : public MemoryBase {
 public:
     /**
      * @brief Initialize memory bank controller
      * @param num_banks Number of memory banks
-     * @param bank_size Size of each bank in bytes
+     * @param bank_size Size of each bank in bytes, a multiple of BANK_PAGE_SIZE
+     * @throws EmulatorException if there are no banks or bank_size is invalid
      */
     MemoryBankController(size_t num_banks = 4, size_t bank_size = 0x4000);
     
@@ -141,11 +79,13 @@ public:
     
     /**
      * @brief Map memory bank to address space
-     * @param address Base address for mapping
+     * @param address Base address for mapping, a multiple of BANK_PAGE_SIZE
      * @param bank Bank number to map
-     * @throws EmulatorException if bank number invalid
+     * @param readOnly Reject writes through write(), drop them through writeAt()
+     * @throws EmulatorException if bank number invalid, address unaligned,
+     *         or the range leaves the address space or overlaps a mapping
      */
-    void mapMemory(uint16_t address, uint8_t bank);
+    void mapMemory(uint16_t address, uint8_t bank, bool readOnly = false);
     
     /**
      * @brief Read byte from current bank
@@ -153,17 +93,50 @@ public:
      * @return Byte value
      * @throws EmulatorException if address invalid
      */
-    uint8_t read(uint16_t address);
+    uint8_t read(uint16_t address) const {
+        const Page& page = pages[address >> BANK_PAGE_SHIFT];
+        if (page.data == nullptr) unmapped(address);
+        return page.data[address & (BANK_PAGE_SIZE - 1)];
+    }
     
     /**
      * @brief Write byte to current bank
      * @param address Address within bank
      * @param value Byte to write
-     * @throws EmulatorException if address invalid
+     * @throws EmulatorException if address invalid or read-only
      */
-    void write(uint16_t address, uint8_t value);
+    void write(uint16_t address, uint8_t value) {
+        const Page& page = pages[address >> BANK_PAGE_SHIFT];
+        if (page.data == nullptr || page.readOnly) rejectWrite(address);
+        page.data[address & (BANK_PAGE_SIZE - 1)] = value;
+    }
+
+    // Store target for address; stores to a read-only page are dropped, as by ROM.
+    uint8_t& writeAt(uint16_t address) {
+        const Page& page = pages[address >> BANK_PAGE_SHIFT];
+        if (page.data == nullptr) unmapped(address);
+        if (page.readOnly) return discard;
+        return page.data[address & (BANK_PAGE_SIZE - 1)];
+    }
+
+    // MemoryBase: ind is a CPU address, physicalAt takes bank * bank size + offset.
+    uint8_t& at(uint32_t ind) override {
+        const Page& page = pages[(ind >> BANK_PAGE_SHIFT) & (BANK_PAGES - 1)];
+        if (page.data == nullptr) unmapped(ind);
+        return page.data[ind & (BANK_PAGE_SIZE - 1)];
+    }
+    uint8_t& physicalAt(uint32_t ind) override;
 
 private:
+    struct Page {
+        uint8_t* data;        ///< Start of the page in its bank, nullptr if unmapped
+        bool readOnly;
+    };
+
+    [[noreturn]] void unmapped(uint32_t address) const;
+    [[noreturn]] void rejectWrite(uint16_t address) const;
+    void rebuildPages();
+
     std::vector<std::unique_ptr<uint8_t[]>> banks;
     uint8_t currentBank;
     size_t bankSize;
@@ -172,36 +145,80 @@ private:
     struct BankMapping {
         uint8_t bank;         ///< Bank number
         uint16_t baseAddr;    ///< Base address in CPU space
-        uint16_t size;        ///< Mapping size
+        uint32_t size;        ///< Mapping size
         bool readOnly;        ///< Read-only mapping
     };
     std::vector<BankMapping> mappings;
+    std::array<Page, BANK_PAGES> pages;
+    uint8_t discard;          ///< Target of dropped read-only stores
 };
 
-// Instruction timing
-struct InstructionTiming {
-    uint8_t base_cycles;
-    uint8_t condition_cycles;
-    uint8_t memory_cycles;
-};
-
-extern const InstructionTiming TIMING_TABLE[256];
-
-// State management
+/**
+ * @brief Checkpoints of the CPU state and the paged Memory
+ * A snapshot holds every backing store page and frame of the Memory (see
+ * Memory::getChunk) plus its tables, so restoring one reproduces the page
+ * tables and frame contents exactly. Chunks the MMU has not seen written
+ * since the previous snapshot of the same Memory are shared with it
+ * instead of copied. Any other MemoryBase is saved as the 64K its at()
+ * reaches, copied whole every time; an unmapped address throws there, as
+ * at() does. A CPU running on the memory needs invalidateCode()
+ * after a restore or load. The CPU8080 interrupt latch and scheduler timer
+ * are not part of State8080, so take snapshots with no interrupt latched.
+ */
 class StateManager {
 public:
-    void saveState(const char* filename, const State8080& state, const MemoryBase* memory);
+    typedef uint32_t SnapshotId;
+
+    /**
+     * @brief Write the state to a file
+     * @param incremental Only write chunks changed since the previous
+     *        saveState of the same memory; a full file is written otherwise.
+     * @throws EmulatorException if file cannot be opened
+     */
+    void saveState(const char* filename, const State8080& state, const MemoryBase* memory,
+                   bool incremental = false);
+    /**
+     * @brief Read a file written by saveState
+     * An incremental file is applied on top of the state the file before
+     * it left, so a chain is loaded in the order it was saved.
+     * @throws EmulatorException if file cannot be opened or does not fit memory
+     */
     void loadState(const char* filename, State8080& state, MemoryBase* memory);
-    void createSnapshot(const char* description, const State8080& state, const MemoryBase* memory);
+    SnapshotId createSnapshot(const char* description, const State8080& state, const MemoryBase* memory);
+    /**
+     * @brief Restore a snapshot, O(1) lookup
+     * @throws EmulatorException if no snapshot has that id or description
+     */
+    void restoreSnapshot(SnapshotId id, State8080& state, MemoryBase* memory);
     void restoreSnapshot(const char* description, State8080& state, MemoryBase* memory);
 
+    size_t getSnapshotCount() const { return snapshots.size(); }
+    // Chunks copied for all snapshots; shared chunks are counted once.
+    uint64_t getCopiedChunkCount() const { return copiedChunks; }
+
 private:
+    typedef std::shared_ptr<const std::vector<uint8_t>> Chunk;
+
     struct Snapshot {
         std::string description;
         State8080 state;
-        std::vector<uint8_t> memory;
+        std::vector<uint8_t> tables;
+        std::vector<Chunk> chunks;
     };
-    std::vector<Snapshot> snapshots;
+
+    const Snapshot& find(SnapshotId id) const;
+
+    std::vector<Snapshot> snapshots;    // Indexed by SnapshotId
+    std::unordered_map<std::string, SnapshotId> byDescription;
+    uint64_t copiedChunks = 0;
+
+    // Snapshot the memory matched as of epoch sharedEpoch, see Memory::checkpoint.
+    const MemoryBase* sharedMemory = nullptr;
+    SnapshotId sharedId = 0;
+    uint32_t sharedEpoch = 0;
+    // Last saveState, the base of an incremental file.
+    const MemoryBase* savedMemory = nullptr;
+    uint32_t savedEpoch = 0;
 };
 
 // Instruction profiling
@@ -212,6 +229,32 @@ struct InstructionProfile {
     uint64_t cache_misses;
 };
 
+// Sampled instructions at one guest address of one process
+struct AddressProfile {
+    uint64_t samples;
+    uint64_t cycles;
+    uint8_t length;       ///< 0 until code holds the instruction
+    uint8_t code[3];
+};
+
+// Guest calls from one routine to another, cycles include nested calls
+struct CallProfile {
+    uint64_t calls;
+    uint64_t cycles;
+};
+
+#define PROFILE_HOT_SPOTS   32      // Addresses listed in the report
+#define PROFILE_CALL_DEPTH  256     // Shadow stack frames kept per process
+#define PROFILE_ROOT        0x10000 // Caller of calls made outside any known routine
+
+/**
+ * @brief Guest profile counted in clock cycles, never the host clock
+ * Per opcode totals cover every instruction. The per process, per address
+ * histogram takes one instruction in every sample interval. The call graph
+ * follows every CALL, RST and RET that changed SP and keeps a shadow stack
+ * per process; returns without a matching call, such as from an interrupt
+ * handler, are ignored.
+ */
 class Profiler {
 public:
     void recordExecution(uint8_t opcode, uint64_t cycles, bool cache_miss = false);
@@ -219,35 +262,163 @@ public:
     void generateReport(const char* filename);
     const InstructionProfile& getProfile(uint8_t opcode) const { return profiles[opcode]; }
 
+    // Sample one instruction in interval, 1 samples them all.
+    void setSampleInterval(unsigned interval);
+    unsigned getSampleInterval() const { return sampleInterval; }
+    // Whether the instruction about to run is sampled; call once per instruction.
+    bool sampleDue() {
+        if (--countdown != 0) return false;
+        countdown = sampleInterval;
+        return true;
+    }
+    /**
+     * @brief Count a sampled instruction in the hot-spot histogram
+     * @param code Its bytes, kept the first time pc is sampled
+     */
+    void recordSample(int slot, uint16_t pc, const uint8_t* code, unsigned cycles);
+    // CALL, RST and RET family, the only opcodes recordFlow acts on
+    static bool isFlow(uint8_t opcode) {
+        return (opcode & 0xc0) == 0xc0 && ((opcode & 0x03) == 0 || (opcode & 0x07) == 0x07 ||
+                                            opcode == 0xc9 || opcode == 0xcd);
+    }
+    /**
+     * @brief Follow a call or return for the call graph
+     * @param sp Stack pointer before the instruction
+     * @param target pc after it
+     * @param now Clock cycles the process has run so far
+     */
+    void recordFlow(int slot, uint8_t opcode, uint16_t sp, uint16_t spAfter, uint16_t target, uint64_t now);
+
+    const AddressProfile* getAddressProfile(int slot, uint16_t pc) const;
+    const CallProfile* getCallProfile(int slot, uint32_t caller, uint16_t callee) const;
+
 private:
+    struct Frame {
+        uint16_t routine;
+        uint32_t caller;      ///< Routine or PROFILE_ROOT
+        uint64_t entered;
+    };
+
+    static uint64_t callKey(int slot, uint32_t caller, uint16_t callee) {
+        return ((uint64_t) slot << 33) | ((uint64_t) caller << 16) | callee;
+    }
+
     std::array<InstructionProfile, 256> profiles{};
+    unsigned sampleInterval = 1;
+    unsigned countdown = 1;
+    std::vector<std::vector<AddressProfile>> addresses;    // 64K entries per process slot
+    std::vector<std::vector<Frame>> stacks;                 // Per process slot
+    std::unordered_map<uint64_t, CallProfile> calls;        // By callKey
 };
 
 // Testing framework
+class EnhancedCPU8080;
+
 class EmulatorTest {
 public:
+    // Ways to run CPU8080 code, compared against each other by testEngines.
+    enum Engine {
+        ENGINE_STEP,        ///< Emulate8080p, one instruction at a time
+        ENGINE_BLOCK,       ///< EmulateBlock, pre-decoded basic blocks
+        ENGINE_CACHED,      ///< EmulateCached, the per process decode cache
+        ENGINE_TRANSLATED,  ///< EmulateBlock with hot blocks as host code
+        ENGINE_COUNT
+    };
+
     EmulatorTest();
+    ~EmulatorTest();
     void testArithmetic();
     void testLogic();
     void testBranching();
     void testMemoryOps();
     void testInterrupts();
-    void runAllTests();
+    /**
+     * @brief Run random programs through every engine in lockstep
+     *
+     * Each engine gets its own copy of the program, flat or paged with one
+     * or four processes, and runs up to the next instruction boundary all
+     * of them reach; there the registers, flags, cycle and instruction
+     * counts, pending interrupt and fault have to agree, and now and then
+     * all of memory. The timer interrupt is on, so interrupt entry is
+     * covered too. A fixed program first has the kernel store into another
+     * process's code. ENGINE_TRANSLATED is skipped on hosts without a
+     * translator.
+     */
+    void testEngines(uint32_t seed = 1, int programs = 40);
+    /**
+     * @brief Run with and without idle skipping in step, see setIdleSkip
+     *
+     * A guest that polls a flag its timer handler sets, then spins with
+     * interrupts off, and random programs, each run through Run on two
+     * CPUs. After every Run both must agree on registers, timer, cycles,
+     * instructions and memory, and the polling guest must have skipped.
+     */
+    void testIdleSkip(uint32_t seed = 1, int programs = 20);
+    /**
+     * @brief Memory with and without page sharing in step
+     *
+     * The same program in two processes and zero pages end up in one
+     * frame, and a store copies the page out. Then random loads, stores
+     * and process switches go to both memories, which have to read back
+     * the same bytes with every frame count and policy.
+     */
+    void testPageSharing(uint32_t seed = 1);
+    /**
+     * @brief StateManager round trips, paged and flat
+     *
+     * Three snapshots with random stores before each, the first two also
+     * saved as a full and an incremental file. Restoring the snapshots in
+     * random order over newer stores, and loading the files into a fresh
+     * memory, has to bring back every byte and the registers. Paged
+     * snapshots must share chunks, and a snapshot must not restore into
+     * memory of another page size.
+     */
+    void testStateManager(uint32_t seed = 1);
+    /**
+     * @brief InstructionTracer stream round trip
+     *
+     * Entries past three keyframes, with jumps both ways and changes to
+     * sp, the registers and the flags, are streamed to a region; decode
+     * has to print the same table whole and fed in random pieces. A region
+     * too small keeps a prefix that decodes to the start of the table.
+     */
+    void testTracer(uint32_t seed = 1);
+    /**
+     * @brief A guest run through Run and GTUOS::handleCall, as main does
+     *
+     * Every system call's cycles run the quantum out; each call must still
+     * run once, and the timer interrupt be taken after it.
+     */
+    void testSystemCalls();
+    /**
+     * @brief Host time of every opcode's handler through Emulate8080p
+     *
+     * Each opcode runs iterations times from the same registers, with
+     * memory operands and jump targets pointing back at itself, so nothing
+     * but the instruction is timed. Slowest first.
+     */
+    void timeOpcodes(std::ostream& out, int iterations = 200000);
+    // All of the above but timeOpcodes; false once one has failed.
+    bool runAllTests();
 
 private:
     State8080 state;
     std::unique_ptr<MemoryBase> memory;
-    std::unique_ptr<CPU8080> cpu;
+    std::unique_ptr<EnhancedCPU8080> cpu;
     
     void setUp();
     void tearDown();
     void assertCondition(bool condition, const char* message);
+    // Run the instruction just poked into memory at pc.
+    void execute(uint16_t pc);
 };
 
 // Enhanced CPU8080 class
 class EnhancedCPU8080 : public CPU8080 {
 public:
+    // Runs on state, which stays the caller's.
     EnhancedCPU8080(State8080* state, MemoryBase* memory);
+    ~EnhancedCPU8080();
     
     // Enhanced features
     void enableTracing(bool enable = true);
@@ -259,7 +430,7 @@ public:
     
     // Access to enhancement features
     InstructionTracer& getTracer() { return tracer; }
-    InterruptController& getInterruptController() { return intController; }
+    InterruptController& getInterruptController() { return *interrupts; }
     MemoryBankController& getMemoryBankController() { return memoryBanking; }
     StateManager& getStateManager() { return stateManager; }
     Profiler& getProfiler() { return profiler; }
@@ -268,30 +439,12 @@ private:
     bool tracingEnabled;
     bool profilingEnabled;
     bool bankingEnabled;
+    State8080* ownState;      ///< CPU8080's own, handed back to be freed
     
     InstructionTracer tracer;
-    InterruptController intController;
     MemoryBankController memoryBanking;
     StateManager stateManager;
     Profiler profiler;
-
-    // Cache-related members
-    struct CachedInstruction {
-        uint8_t length;
-        uint8_t cycles;
-        bool affects_flags;
-        uint8_t result_a;
-        uint8_t result_b;
-        uint8_t result_c;
-        uint8_t result_d;
-        uint8_t result_e;
-        uint8_t result_h;
-        uint8_t result_l;
-    };
-    
-    std::unordered_map<uint16_t, CachedInstruction> instructionCache;
-    std::unique_ptr<MemoryCache> memoryCache;
-    uint32_t cacheFlushCounter = 0;
 };
 
 #endif 
\ No newline at end of file
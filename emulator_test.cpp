@@ -0,0 +1,77 @@
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include "emulator_enhanced.h"
+
+// Unit tests of the CPU, `make test` runs them.
+//
+// EmulatorTest's instruction checks run first, then random programs go
+// through every execution engine in lockstep (see EmulatorTest::testEngines).
+// A failure prints what differed, with the seed and program to reproduce
+// it, and the exit status is 1. --time-opcodes skips the tests and writes
+// the host time of every opcode's handler instead, slowest first.
+
+namespace {
+    bool startsWith(const char *text, const char *prefix, const char **rest) {
+        size_t length = strlen(prefix);
+        if (strncmp(text, prefix, length) != 0) return false;
+        *rest = text + length;
+        return true;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t seed = 1;
+    int programs = 40;
+    bool moreEngines = false;   // Another seed or count than runAllTests's
+    bool timeOpcodes = false;
+    int iterations = 200000;
+    const char *output = NULL;
+    for (int i = 1; i < argc; i++) {
+        const char *value;
+        if (startsWith(argv[i], "--seed=", &value)) {
+            seed = static_cast<uint32_t>(strtoul(value, NULL, 10));
+            moreEngines = true;
+        } else if (startsWith(argv[i], "--programs=", &value)) {
+            programs = atoi(value);
+            moreEngines = true;
+        } else if (startsWith(argv[i], "--iterations=", &value)) iterations = atoi(value);
+        else if (startsWith(argv[i], "--output=", &value)) output = value;
+        else if (strcmp(argv[i], "--time-opcodes") == 0) timeOpcodes = true;
+        else {
+            std::cerr << "Usage: os_test [--seed=n] [--programs=n]\n"
+                         "       os_test --time-opcodes [--iterations=n] [--output=file]\n";
+            return 2;
+        }
+    }
+
+    EmulatorTest test;
+    if (timeOpcodes) {
+        if (output == NULL) {
+            test.timeOpcodes(std::cout, iterations);
+            return 0;
+        }
+        std::ofstream out(output);
+        if (!out) {
+            std::cerr << "error: Couldn't open " << output << "--\n";
+            return 1;
+        }
+        test.timeOpcodes(out, iterations);
+        return 0;
+    }
+
+    if (!test.runAllTests())
+        return 1;
+    if (moreEngines) {
+        try {
+            test.testEngines(seed, programs);
+        } catch (const std::exception& e) {
+            std::cerr << "Test failed: " << e.what() << "\n";
+            return 1;
+        }
+        std::cout << "Engines agree on " << programs << " programs of seed " << seed << "\n";
+    }
+    return 0;
+}
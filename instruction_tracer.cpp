@@ -0,0 +1,280 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <mutex>
+#include <algorithm>
+#include "instruction_tracer.h"
+
+#define CONTROL_SP       0x01   // Record control bits
+#define CONTROL_KEYFRAME 0x80
+#define MAX_RECORD       32     // Bytes, longest encoded entry
+
+namespace {
+    // Streams with a running writer. The emulator leaves through exit() on
+    // an unimplemented instruction, which is when the trace matters most,
+    // so they are drained from an atexit hook too.
+    std::mutex openStreamsLock;
+    std::vector<InstructionTracer *> openStreams;
+
+    void stopOpenStreams() {
+        std::vector<InstructionTracer *> streams;
+        {
+            std::lock_guard<std::mutex> guard(openStreamsLock);
+            streams = openStreams;
+        }
+        for (size_t i = 0; i < streams.size(); i++)
+            streams[i]->stopStream();
+    }
+
+    size_t putVarint(uint8_t *out, uint64_t value) {
+        size_t length = 0;
+        while (value >= 0x80) {
+            out[length++] = (uint8_t) (value | 0x80);
+            value >>= 7;
+        }
+        out[length++] = (uint8_t) value;
+        return length;
+    }
+
+    // false if the varint runs past the end of data.
+    bool getVarint(const uint8_t *data, size_t length, size_t &pos, uint64_t &value) {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (pos >= length) return false;
+            uint8_t byte = data[pos++];
+            value |= (uint64_t) (byte & 0x7f) << shift;
+            if (!(byte & 0x80)) return true;
+        }
+        return true;
+    }
+
+    uint64_t zigzag(int64_t value) {
+        return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+    }
+
+    int64_t unzigzag(uint64_t value) {
+        return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+    }
+}
+
+InstructionTracer::InstructionTracer()
+    : ring(TRACE_RING_ENTRIES), count(0), head(0), tail(0), stopping(false),
+      region(NULL), regionSize(0), regionUsed(0), droppedBytes(0) {
+    queue = (TraceEntry *) malloc(TRACE_STREAM_ENTRIES * sizeof(TraceEntry));
+}
+
+InstructionTracer::~InstructionTracer() {
+    stopStream();
+    free(queue);
+}
+
+void InstructionTracer::setMaxEntries(size_t max) {
+    size_t capacity = 1;
+    while (capacity < max)
+        capacity <<= 1;
+    ring.assign(capacity, TraceEntry());
+    count = 0;
+}
+
+void InstructionTracer::addTrace(uint16_t pc, uint8_t opcode, const State8080& state, uint64_t cycle) {
+    TraceEntry &entry = ring[count & (ring.size() - 1)];
+    count++;
+    entry.pc = pc;
+    entry.sp = state.sp;
+    entry.opcode = opcode;
+    entry.regs[0] = state.a;
+    entry.regs[1] = state.b;
+    entry.regs[2] = state.c;
+    entry.regs[3] = state.d;
+    entry.regs[4] = state.e;
+    entry.regs[5] = state.h;
+    entry.regs[6] = state.l;
+    memcpy(&entry.flags, &state.cc, 1);
+    entry.cycle = cycle;
+
+    if (!writer.joinable()) return;
+    // Blocks while the queue is full, so the stream has no gaps.
+    uint64_t h = head.load(std::memory_order_relaxed);
+    while (h - tail.load(std::memory_order_acquire) >= TRACE_STREAM_ENTRIES)
+        std::this_thread::yield();
+    queue[h & (TRACE_STREAM_ENTRIES - 1)] = entry;
+    head.store(h + 1, std::memory_order_release);
+}
+
+bool InstructionTracer::startStream(const char* path) {
+    stopStream();
+    streamFile.open(path, std::ios::out | std::ios::trunc | std::ios::binary);
+    if (!streamFile.is_open()) return false;
+    startWriter();
+    return true;
+}
+
+void InstructionTracer::startStream(uint8_t* memory, size_t size) {
+    stopStream();
+    region = memory;
+    regionSize = size;
+    startWriter();
+}
+
+void InstructionTracer::startWriter() {
+    regionUsed.store(0);
+    droppedBytes.store(0);
+    head.store(0);
+    tail.store(0);
+    stopping.store(false);
+    emit((const uint8_t *) TRACE_STREAM_MAGIC, 8);
+    writer = std::thread(&InstructionTracer::writerLoop, this);
+
+    std::lock_guard<std::mutex> guard(openStreamsLock);
+    static bool hooked = false;
+    if (!hooked) {
+        std::atexit(stopOpenStreams);
+        hooked = true;
+    }
+    openStreams.push_back(this);
+}
+
+void InstructionTracer::stopStream() {
+    if (writer.joinable()) {
+        stopping.store(true, std::memory_order_release);
+        writer.join();
+        std::lock_guard<std::mutex> guard(openStreamsLock);
+        openStreams.erase(std::remove(openStreams.begin(), openStreams.end(), this), openStreams.end());
+    }
+    if (streamFile.is_open()) streamFile.close();
+    region = NULL;
+}
+
+void InstructionTracer::emit(const uint8_t* data, size_t length) {
+    if (streamFile.is_open()) {
+        streamFile.write((const char *) data, length);
+        return;
+    }
+    size_t used = regionUsed.load(std::memory_order_relaxed);
+    size_t count = std::min(length, regionSize - used);
+    memcpy(region + used, data, count);
+    regionUsed.store(used + count, std::memory_order_release);
+    droppedBytes.store(droppedBytes.load(std::memory_order_relaxed) + (length - count), std::memory_order_relaxed);
+}
+
+// Consumer side: delta-encodes against the previous entry written.
+void InstructionTracer::writerLoop() {
+    std::vector<uint8_t> chunk;
+    TraceEntry previous;
+    memset(&previous, 0, sizeof(previous));
+    uint64_t written = 0;
+    for (;;) {
+        bool done = stopping.load(std::memory_order_acquire);
+        uint64_t h = head.load(std::memory_order_acquire);
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        if (h == t) {
+            if (done) break;
+            if (streamFile.is_open()) streamFile.flush();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        chunk.resize((size_t) (h - t) * MAX_RECORD);
+        size_t used = 0;
+        for (uint64_t i = t; i < h; i++, written++) {
+            const TraceEntry &entry = queue[i & (TRACE_STREAM_ENTRIES - 1)];
+            uint8_t *record = &chunk[used];
+            size_t length = 3;
+            record[2] = entry.opcode;
+            if (written % TRACE_KEYFRAME_INTERVAL == 0) {
+                record[0] = 0xff;
+                record[1] = CONTROL_KEYFRAME;
+                record[length++] = entry.pc & 0xff;
+                record[length++] = entry.pc >> 8;
+                record[length++] = entry.sp & 0xff;
+                record[length++] = entry.sp >> 8;
+                memcpy(record + length, entry.regs, 7);
+                length += 7;
+                record[length++] = entry.flags;
+                length += putVarint(record + length, entry.cycle);
+            } else {
+                uint8_t changed = 0;
+                for (int r = 0; r < 7; r++)
+                    if (entry.regs[r] != previous.regs[r]) changed |= 1 << r;
+                if (entry.flags != previous.flags) changed |= 0x80;
+                record[0] = changed;
+                record[1] = (entry.sp != previous.sp) ? CONTROL_SP : 0;
+                length += putVarint(record + length, zigzag((int16_t) (entry.pc - previous.pc)));
+                if (record[1] & CONTROL_SP) {
+                    record[length++] = entry.sp & 0xff;
+                    record[length++] = entry.sp >> 8;
+                }
+                for (int r = 0; r < 7; r++)
+                    if (changed & (1 << r)) record[length++] = entry.regs[r];
+                if (changed & 0x80) record[length++] = entry.flags;
+                length += putVarint(record + length, zigzag((int64_t) (entry.cycle - previous.cycle)));
+            }
+            used += length;
+            previous = entry;
+        }
+        tail.store(h, std::memory_order_release);
+        emit(chunk.data(), used);
+    }
+    if (streamFile.is_open()) streamFile.flush();
+}
+
+const char* InstructionTracer::tableHeader() {
+    return "PC    | Opcode | A  B  C  D  E  H  L  | Flags | Cycle\n"
+           "------+--------+--------------------+-------+-------\n";
+}
+
+void InstructionTracer::formatEntry(char* line, size_t size, const TraceEntry& entry) {
+    ConditionCodes cc;
+    memcpy(&cc, &entry.flags, 1);
+    snprintf(line, size, "%04x | %02x     | %02x %02x %02x %02x %02x %02x %02x | %c%c%c%c%c | %llu\n",
+             entry.pc, entry.opcode, entry.regs[0], entry.regs[1], entry.regs[2], entry.regs[3],
+             entry.regs[4], entry.regs[5], entry.regs[6],
+             cc.z ? 'Z' : '.', cc.s ? 'S' : '.', cc.p ? 'P' : '.', cc.cy ? 'C' : '.', cc.ac ? 'A' : '.',
+             (unsigned long long) entry.cycle);
+}
+
+size_t InstructionTracer::decode(const uint8_t* data, size_t length, std::ostream& out, TraceEntry& previous) {
+    char line[128];
+    size_t start = 0;
+    while (start < length) {
+        size_t pos = start;
+        if (length - pos < 3) break;
+        uint8_t changed = data[pos];
+        uint8_t control = data[pos + 1];
+        TraceEntry entry = previous;
+        entry.opcode = data[pos + 2];
+        pos += 3;
+        uint64_t value;
+        if (control & CONTROL_KEYFRAME) {
+            if (length - pos < 12) break;
+            entry.pc = data[pos] | (data[pos + 1] << 8);
+            entry.sp = data[pos + 2] | (data[pos + 3] << 8);
+            memcpy(entry.regs, data + pos + 4, 7);
+            entry.flags = data[pos + 11];
+            pos += 12;
+            if (!getVarint(data, length, pos, value)) break;
+            entry.cycle = value;
+        } else {
+            if (!getVarint(data, length, pos, value)) break;
+            entry.pc = (uint16_t) (previous.pc + unzigzag(value));
+            size_t needed = (control & CONTROL_SP) ? 2 : 0;
+            for (int r = 0; r < 8; r++)
+                if (changed & (1 << r)) needed++;
+            if (length - pos < needed) break;
+            if (control & CONTROL_SP) {
+                entry.sp = data[pos] | (data[pos + 1] << 8);
+                pos += 2;
+            }
+            for (int r = 0; r < 7; r++)
+                if (changed & (1 << r)) entry.regs[r] = data[pos++];
+            if (changed & 0x80) entry.flags = data[pos++];
+            if (!getVarint(data, length, pos, value)) break;
+            entry.cycle = previous.cycle + (uint64_t) unzigzag(value);
+        }
+        formatEntry(line, sizeof(line), entry);
+        out << line;
+        previous = entry;
+        start = pos;
+    }
+    return start;
+}
@@ -0,0 +1,119 @@
+#ifndef INSTRUCTION_TRACER_H
+#define INSTRUCTION_TRACER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <thread>
+#include <fstream>
+#include <ostream>
+#include <vector>
+#include "emulator_base.h"
+
+#define TRACE_RING_ENTRIES      1024        // Default capacity, power of two
+#define TRACE_STREAM_ENTRIES    (1 << 16)   // Entries queued for the writer, power of two
+#define TRACE_KEYFRAME_INTERVAL 4096        // Entries between full records
+#define TRACE_STREAM_MAGIC      "I8080TR1"
+
+/**
+ * @brief Instruction tracing facility for debugging and analysis
+ * Keeps the most recent executions in a fixed power-of-two ring, O(1) per
+ * trace. Optionally every entry is also queued to a background thread
+ * that delta-encodes it into a binary stream, to a file or a caller-owned
+ * memory region such as a mapped file; trace_decode prints the stream as
+ * the dumpTrace table.
+ *
+ * Stream records, after the 8-byte magic, little endian:
+ *   changed:u8 control:u8 opcode:u8
+ *   keyframe (control bit 7), every TRACE_KEYFRAME_INTERVAL entries:
+ *     pc:u16 sp:u16 a b c d e h l flags cycle:varint
+ *   otherwise:
+ *     pc delta:zigzag varint, sp:u16 if control bit 0,
+ *     each register whose changed bit is set (bit 0 a ... bit 6 l,
+ *     bit 7 flags), cycle delta:zigzag varint
+ */
+class InstructionTracer {
+public:
+    struct TraceEntry {
+        uint16_t pc;          ///< Program counter
+        uint16_t sp;          ///< Stack pointer
+        uint8_t opcode;       ///< Executed opcode
+        uint8_t regs[7];      ///< A, B, C, D, E, H, L
+        uint8_t flags;        ///< ConditionCodes as a PSW byte
+        uint64_t cycle;       ///< Cycle count at execution
+    };
+
+    InstructionTracer();
+    ~InstructionTracer();
+
+    /**
+     * @brief Add a new trace entry
+     * @param pc Program counter value
+     * @param opcode Executed instruction
+     * @param state CPU state
+     * @param cycle Current cycle count
+     */
+    void addTrace(uint16_t pc, uint8_t opcode, const State8080& state, uint64_t cycle);
+
+    /**
+     * @brief Save trace buffer to a file in human-readable format
+     * @param filename Output file path
+     * @throws EmulatorException if file cannot be opened, see emulator_enhanced.cpp
+     */
+    void dumpTrace(const char* filename);
+
+    void clear() { count = 0; }
+    // Rounded up to a power of two; drops the entries held so far.
+    void setMaxEntries(size_t max);
+    size_t size() const { return count < ring.size() ? (size_t) count : ring.size(); }
+    // i-th entry held, the oldest first.
+    const TraceEntry& get(size_t i) const { return ring[(count - size() + i) & (ring.size() - 1)]; }
+
+    // Start streaming every later entry; a running stream is stopped first.
+    bool startStream(const char* path);
+    // region receives the magic and records until it is full; the rest
+    // is counted in getDroppedBytes.
+    void startStream(uint8_t* region, size_t size);
+    // Drains the queue, then stops the writer.
+    void stopStream();
+    bool isStreaming() const { return writer.joinable(); }
+    // Any thread, while the writer runs too: the region's first
+    // getRegionUsed() bytes are written by the time it returns them.
+    size_t getRegionUsed() const { return regionUsed.load(std::memory_order_acquire); }
+    uint64_t getDroppedBytes() const { return droppedBytes.load(std::memory_order_relaxed); }
+
+    static const char* tableHeader();
+    // One table row, newline included, into line.
+    static void formatEntry(char* line, size_t size, const TraceEntry& entry);
+    /**
+     * Print stream records as table rows.
+     * @param previous Decoder state, zeroed before the first call.
+     * @return Bytes consumed, a trailing partial record is left over.
+     */
+    static size_t decode(const uint8_t* data, size_t length, std::ostream& out, TraceEntry& previous);
+
+private:
+    void startWriter();
+    void writerLoop();
+    void emit(const uint8_t* data, size_t length);
+
+    InstructionTracer(const InstructionTracer&);
+    void operator=(const InstructionTracer&);
+
+    std::vector<TraceEntry> ring;
+    uint64_t count;
+
+    // Stream queue, single producer (the CPU) and single consumer.
+    TraceEntry* queue;
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    std::atomic<bool> stopping;
+    std::thread writer;
+    std::ofstream streamFile;
+    uint8_t* region;
+    size_t regionSize;
+    std::atomic<size_t> regionUsed;     // Written by the writer thread only
+    std::atomic<uint64_t> droppedBytes;
+};
+
+#endif
@@ -0,0 +1,82 @@
+#include "interrupt_controller.h"
+
+InterruptController::InterruptController() : count(0), sequence(0), coalesced(0) {
+    for (int i = 0; i < INTERRUPT_VECTORS; i++)
+        position[i] = -1;
+}
+
+bool InterruptController::queueInterrupt(uint8_t code, uint8_t priority) {
+    int index = position[code];
+    if (index >= 0) {
+        coalesced++;
+        if (priority > heap[index].priority) {
+            heap[index].priority = priority;
+            siftUp(index);
+        }
+        return false;
+    }
+    _heapEntry entry = {code, priority, sequence++};
+    place(count++, entry);
+    siftUp(count - 1);
+    return true;
+}
+
+bool InterruptController::tryGetNext(InterruptRequest &request) {
+    if (count == 0)
+        return false;
+    request.code = heap[0].code;
+    request.priority = heap[0].priority;
+    request.pending = true;
+    position[heap[0].code] = -1;
+    if (--count > 0) {
+        place(0, heap[count]);
+        siftDown(0);
+    }
+    return true;
+}
+
+void InterruptController::clear() {
+    for (int i = 0; i < count; i++)
+        position[heap[i].code] = -1;
+    count = 0;
+}
+
+bool InterruptController::before(int a, int b) const {
+    if (heap[a].priority != heap[b].priority)
+        return heap[a].priority > heap[b].priority;
+    // Wrap safe as long as fewer than 2^31 requests are in flight.
+    return (int32_t) (heap[a].sequence - heap[b].sequence) < 0;
+}
+
+void InterruptController::place(int index, const _heapEntry &entry) {
+    heap[index] = entry;
+    position[entry.code] = (int16_t) index;
+}
+
+void InterruptController::siftUp(int index) {
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (!before(index, parent))
+            break;
+        _heapEntry entry = heap[index];
+        place(index, heap[parent]);
+        place(parent, entry);
+        index = parent;
+    }
+}
+
+void InterruptController::siftDown(int index) {
+    for (;;) {
+        int best = index;
+        int left = 2 * index + 1;
+        int right = left + 1;
+        if (left < count && before(left, best)) best = left;
+        if (right < count && before(right, best)) best = right;
+        if (best == index)
+            break;
+        _heapEntry entry = heap[index];
+        place(index, heap[best]);
+        place(best, entry);
+        index = best;
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef INTERRUPT_CONTROLLER_H
+#define INTERRUPT_CONTROLLER_H
+
+#include <cstdint>
+
+#define INTERRUPT_VECTORS           256     // Any opcode byte can be a vector
+#define INTERRUPT_PRIORITY_DEFAULT  0x80
+#define INTERRUPT_PRIORITY_TIMER    0xc0
+
+// Pending interrupt requests, highest priority first and in arrival order
+// within a priority.
+// A vector is pending at most once: raising it again only lifts its
+// priority, so the heap is bounded by INTERRUPT_VECTORS and a burst of timer
+// ticks leaves a single request behind.
+
+class InterruptController {
+public:
+    struct InterruptRequest {
+        uint8_t code;         ///< Interrupt vector
+        uint8_t priority;     ///< Priority level (0-255, higher = more priority)
+        bool pending;         ///< Whether interrupt is pending
+    };
+
+    InterruptController();
+
+    /**
+     * Queue a new interrupt request, O(log n).
+     * @param code Interrupt vector
+     * @param priority Priority level
+     * @return false if code was already pending and the request was merged.
+     */
+    bool queueInterrupt(uint8_t code, uint8_t priority);
+
+    bool hasInterrupt() const { return count != 0; }
+    bool isPending(uint8_t code) const { return position[code] >= 0; }
+    int getPendingCount() const { return count; }
+    // Requests merged into one already pending, see CPU8080::raiseInterrupt.
+    uint64_t getCoalescedCount() const { return coalesced; }
+    void noteCoalesced() { coalesced++; }
+
+    /**
+     * Remove the next pending interrupt, O(log n).
+     * @param request Receives it, untouched when nothing is pending.
+     * @return false if no interrupt is pending.
+     */
+    bool tryGetNext(InterruptRequest &request);
+
+    /**
+     * Get the next pending interrupt
+     * @return Next interrupt request
+     * @throws EmulatorException if no interrupts pending, see emulator_enhanced.cpp
+     */
+    InterruptRequest getNextInterrupt();
+
+    void clear();
+
+private:
+    typedef struct _heapEntry {
+        uint8_t code;
+        uint8_t priority;
+        uint32_t sequence;      // Arrival order, breaks priority ties
+    } _heapEntry;
+
+    bool before(int a, int b) const;
+    void place(int index, const _heapEntry &entry);
+    void siftUp(int index);
+    void siftDown(int index);
+
+    _heapEntry heap[INTERRUPT_VECTORS];
+    int16_t position[INTERRUPT_VECTORS];   // Heap index of a vector, -1 if not pending
+    int count;
+    uint32_t sequence;
+    uint64_t coalesced;
+};
+
+#endif
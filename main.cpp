@@ -1,38 +1,171 @@
 #include <iostream>
+#include <chrono>
+#include <cstring>
 #include "emulator_base.h"
 #include "os_core.h"
 #include "memory_manager.h"
+#include "batch_runner.h"
+#include "runtime_stats.h"
+
+// Cycles the CPU may run before control returns to main.
+#define RUN_CYCLE_BUDGET 100000
+
+namespace {
+    // Set while --syscall-stats output is owed. Guests usually end on an
+    // unimplemented instruction, which leaves through exit().
+    GTUOS *statsOS = NULL;
+
+    void printSyscallStats() {
+        if (statsOS == NULL) return;
+        statsOS->flush();
+        statsOS->printSyscallStats(std::cerr);
+        statsOS = NULL;
+    }
+
+    // Set while --stats is publishing; the last sample is taken on the way
+    // out, through exit() as well.
+    RuntimeStats *liveStats = NULL;
+    const CPU8080 *liveCPU = NULL;
+    const Memory *liveMemory = NULL;
+    const GTUOS *liveOS = NULL;
+    uint64_t runNanoseconds = 0;
+
+    void finishStats() {
+        if (liveStats == NULL) return;
+        liveStats->sample(*liveCPU, *liveMemory, *liveOS, runNanoseconds);
+        delete liveStats;
+        liveStats = NULL;
+    }
+
+    bool startsWith(const char *text, const char *prefix, const char **rest) {
+        size_t length = strlen(prefix);
+        if (strncmp(text, prefix, length) != 0) return false;
+        *rest = text + length;
+        return true;
+    }
+}
 
 int main (int argc, char**argv)
 {
-    if (argc != 3){
-        std::cerr << "Usage: prog exeFile debugOption\n";
+    // Switches may appear anywhere; the rest are positional.
+    bool fastSwitch = false;
+    bool syscallStats = false;
+    bool batch = false;
+    bool translate = false;
+    bool sharePages = false;
+    const char *statsPath = NULL;
+    int statsInterval = STATS_INTERVAL_MS;
+    int positional = 1;
+    for (int i = 1; i < argc; i++) {
+        const char *value;
+        if (strcmp(argv[i], "--fast-switch") == 0) fastSwitch = true;
+        else if (strcmp(argv[i], "--syscall-stats") == 0) syscallStats = true;
+        else if (strcmp(argv[i], "--batch") == 0) batch = true;
+        else if (strcmp(argv[i], "--translate") == 0) translate = true;
+        else if (strcmp(argv[i], "--share-pages") == 0) sharePages = true;
+        else if (startsWith(argv[i], "--stats=", &value)) statsPath = value;
+        else if (startsWith(argv[i], "--stats-interval=", &value)) statsInterval = atoi(value);
+        else argv[positional++] = argv[i];
+    }
+    argc = positional;
+
+    if (batch) {
+        if (argc < 3 || argc > 4) {
+            std::cerr << "Usage: prog --batch manifest outputDirectory [threads]\n";
+            exit(1);
+        }
+        std::vector<BatchRunner::_job> jobs;
+        std::string error;
+        if (!BatchRunner::parseManifest(argv[1], jobs, error)) {
+            std::cerr << error << "\n";
+            exit(1);
+        }
+        BatchRunner runner(jobs, (argc >= 4) ? atoi(argv[3]) : 0);
+        runner.run(argv[2]);
+        runner.printSummary(std::cout);
+        return 0;
+    }
+
+    if (argc < 3 || argc > 8){
+        std::cerr << "Usage: prog [--fast-switch] [--syscall-stats] [--translate] [--share-pages] [--stats=file [--stats-interval=ms]] exeFile debugOption [off|summary|full|binary"
+                     " [fifo|clock|lru|ws [frames [pageSize [processes]]]]]\n"
+                     "       prog --batch manifest outputDirectory [threads]\n";
         exit(1);
     }
     int DEBUG = atoi(argv[2]);
 
-    Memory mem(0x100000);
+    PageLog::LogMode logMode = PageLog::LOG_FULL;
+    if (argc >= 4 && !PageLog::modeFromName(argv[3], logMode)) {
+        std::cerr << "Unknown log mode " << argv[3] << "\n";
+        exit(1);
+    }
+
+    int frames = (argc >= 6) ? atoi(argv[5]) : FRAME_COUNT;
+    int pageSize = (argc >= 7) ? atoi(argv[6]) : PAGE_SIZE;
+    int processes = (argc >= 8) ? atoi(argv[7]) : PROCESS_COUNT;
+    const char *configError = Memory::isValidConfig(frames, pageSize, processes);
+    if (configError != NULL) {
+        std::cerr << "Bad memory configuration: " << configError << "\n";
+        exit(1);
+    }
+
+    Memory mem((uint64_t) frames * pageSize, logMode, pageSize, processes);
+    if (argc >= 5) {
+        ReplacementPolicy *policy = ReplacementPolicy::create(argv[4], mem.getFrameCount());
+        if (policy == NULL) {
+            std::cerr << "Unknown replacement policy " << argv[4] << "\n";
+            exit(1);
+        }
+        mem.setReplacementPolicy(policy);
+    }
+    mem.setPageSharing(sharePages);
     CPU8080 theCPU(&mem);
+    theCPU.setFastContextSwitch(fastSwitch);
+    if (translate && !theCPU.setTranslation(true))
+        std::cerr << "No block translator for this host, interpreting\n";
     GTUOS	theOS;
+    if (syscallStats) {
+        statsOS = &theOS;
+        atexit(printSyscallStats);
+    }
+
+    if (statsPath != NULL) {
+        liveStats = new RuntimeStats(mem.getProcessCount());
+        liveCPU = &theCPU;
+        liveMemory = &mem;
+        liveOS = &theOS;
+        if (!liveStats->publish(statsPath, statsInterval)) {
+            std::cerr << "error: Couldn't write " << statsPath << "--\n";
+            exit(1);
+        }
+        atexit(finishStats);
+    }
 
     theCPU.ReadFileIntoMemoryAt(argv[1], 0x0000);
     for(int i=0;i<1000;i++){
         std::cout <<(int)mem.physicalAt(i);
     }
 
-    int i=1;
+    CPU8080::StopReason reason;
     do
     {
-        setbuf(stdout, 0);
-        fflush(stdout);
-        theCPU.Emulate8080p(DEBUG);
-        if(theCPU.isSystemCall() && theCPU.interrupt==0){
-            theOS.handleCall(theCPU,DEBUG);
+        if (liveStats == NULL)
+            reason = theCPU.Run(RUN_CYCLE_BUDGET, DEBUG);
+        else {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            reason = theCPU.Run(RUN_CYCLE_BUDGET, DEBUG);
+            runNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
         }
-        i++;
-
-    }	while (!theCPU.isHalted())
+        // GTUOS decides when guest output is written; the CPU never flushes.
+        if (reason == CPU8080::STOP_SYSCALL)
+            theOS.handleCall(theCPU, DEBUG);
+        if (liveStats != NULL)
+            liveStats->sample(theCPU, mem, theOS, runNanoseconds);
+    }	while (reason != CPU8080::STOP_HALT)
             ;
+    finishStats();
+    printSyscallStats();
     return 0;
 }
 
@@ -1,144 +1,545 @@
 #include <iostream>
+#include <chrono>
 #include <cstring>
 #include <fstream>
 #include "memory_manager.h"
 
-Memory::Memory(uint64_t size) {
-    realMem = (uint8_t *) calloc(8192, sizeof(uint8_t));
-    virtualMemory[0] = (uint8_t *) calloc(0x4000, sizeof(uint8_t));
-    virtualMemory[1] = (uint8_t *) calloc(0x4000, sizeof(uint8_t));
-    virtualMemory[2] = (uint8_t *) calloc(0x4000, sizeof(uint8_t));
-    virtualMemory[3] = (uint8_t *) calloc(0x4000, sizeof(uint8_t));
+Memory::Memory(uint64_t size, PageLog::LogMode logMode, int pageSize, int processCount) {
+    this->frameCount = (int) (size / pageSize);
+    this->pageSize = pageSize;
+    for (pageShift = 0; (1 << pageShift) < pageSize; pageShift++)
+        ;
+    this->processCount = processCount;
+    processSpace = GUEST_SPACE / processCount;
+    pagesPerTable = (int) (processSpace / pageSize);
+    entryCount = processCount * pagesPerTable;
+
+    realMem = (uint8_t *) calloc((size_t) frameCount * pageSize, sizeof(uint8_t));
+    virtualMemory = (uint8_t *) calloc((size_t) processCount * processSpace, sizeof(uint8_t));
+    pageTables = (_pageTableEntry *) calloc(entryCount, sizeof(_pageTableEntry));
+    frameOwners = (int *) calloc(frameCount, sizeof(int));
+    packedTables = (uint8_t *) calloc(entryCount, 3);
+    pendingImage = (_imageSource *) calloc(entryCount, sizeof(_imageSource));
+    chunkEpoch = (uint32_t *) calloc(entryCount + frameCount, sizeof(uint32_t));
+    processFaults = (uint64_t *) calloc(processCount, sizeof(uint64_t));
+    nextSharer = (int *) calloc(entryCount, sizeof(int));
+    frameHashes = (uint64_t *) calloc(frameCount, sizeof(uint64_t));
+    frameIndexed = (uint8_t *) calloc(frameCount, sizeof(uint8_t));
+    shareScratch = (uint8_t *) calloc(pageSize, sizeof(uint8_t));
+    epoch = 1;
     baseRegister = 0;
     limitRegister = 0;
-
-    for (int i = 0; i < 4; i++) {
-        for (int j = 0; j < 16; j++) {
-            pageTables[i].entry[j].valid = 0;
-            pageTables[i].entry[j].pageFrame = 0;
-            pageTables[i].entry[j].referenced = 0;
-            pageTables[i].entry[j].modified = 0;
-        }
+    processIndex = 0;
+    flushTLB();
+    for (int i = 0; i < frameCount; i++) {
+        frameOwners[i] = -1;
     }
-    systemOutput.open("system.txt", std::ios::out);
+    for (int i = 0; i < entryCount; i++)
+        nextSharer[i] = -1;
+    policy = new FifoPolicy(frameCount);
+    pageFaults = 0;
+    writeBacks = 0;
+    contextSwitches = 0;
+    evictions = 0;
+    tlbHits = 0;
+    tlbMisses = 0;
+    faultNanoseconds = 0;
+    sharing = false;
+    sharedMappings = 0;
+    copyOnWrites = 0;
+    pageLog.open(logMode);
 
-    std::ofstream pageoutput;
-    pageoutput.open("pagetable.txt", std::ios::out |std::ios::trunc);
-    pageoutput.close();
+}
 
+const char *Memory::isValidConfig(int frameCount, int pageSize, int processCount) {
+    if (frameCount < 1 || frameCount > 0xffff)
+        return "frame count must be between 1 and 65535";
+    if (processCount < 1 || processCount > 128 || (processCount & (processCount - 1)))
+        return "process count must be a power of two up to 128";
+    if (pageSize < 1 || (pageSize & (pageSize - 1)) || pageSize > GUEST_SPACE / processCount)
+        return "page size must be a power of two no larger than a process";
+    // PageLog writes the page count of a table in 16 bits.
+    if (GUEST_SPACE / processCount / pageSize > 0xffff)
+        return "a process can have at most 65535 pages";
+    return NULL;
 }
 
 uint8_t &Memory::at(uint32_t ind) {
     return MemoryManagementUnit(ind, 0);
 }
 
-uint8_t &Memory::MemoryManagementUnit(uint32_t address, int kernelCall) {
-    int pTable = 0;
-    if (kernelCall == 1) {
-        pTable = 0;
-    } else if (baseRegister == 0x0000) {
-        pTable = 0;
-    } else if (baseRegister == 0x4000) {
-        pTable = 1;
-    } else if (baseRegister == 0x8000) {
-        pTable = 2;
-    } else if (baseRegister == 0xc000) {
-        pTable = 3;
-    }
-    _pageTable *pageTable = &(pageTables[pTable]);
-    int pageTableIndex = address / 1024;
-    int offset = (address % 1024);
-    int pageFrame = pageTable->entry[pageTableIndex].pageFrame;
-
-    if (pageTable->entry[pageTableIndex].valid == 0) {
-        pageFrame =nextPageFrame();
-        printPageFault(pTable, address, static_cast<uint32_t>((pageFrame * 1024) + offset), pageFrame);
-        for (int k = 0; k < 16; k++) {
-            for (int i = 0; i < 4; i++) {
-                if (this->pageTables[i].entry[k].valid == 1 &&
-                    this->pageTables[i].entry[k].pageFrame == pageFrame) {
-                    for (int j = 0; j < 1024; j++) {
-                        virtualMemory[i][(k * 1024) + j] = realMem[(pageFrame * 1024) + j];
-                    }
-                    this->pageTables[i].entry[k].valid = 0;
-                    this->pageTables[i].entry[k].modified = 1;
-                    break;
-                }
-            }
+uint8_t &Memory::writeAt(uint32_t ind) {
+    return MemoryManagementUnit(ind, 0, 1);
+}
+
+uint8_t &Memory::MemoryManagementUnit(uint32_t address, int kernelCall, int write) {
+    int pTable = (kernelCall == 1) ? 0 : getProcessIndex();
+    int offset = address & (pageSize - 1);
+
+    // Addresses past a process's space run into the next tables' entries,
+    // wrapping after the last one, so everything is keyed by the flat index.
+    int entryIndex = (pTable * pagesPerTable + (int) (address >> pageShift)) % entryCount;
+
+    // A TLB entry is only filled once the referenced bit is set, so a hit
+    // has nothing left to update in the page table.
+    _tlbEntry *tlbEntry = &tlb[entryIndex % TLB_SIZE];
+    if (tlbEntry->index == entryIndex && (!write || tlbEntry->writable)) {
+        tlbHits++;
+        return tlbEntry->frame[offset];
+    }
+    tlbMisses++;
+
+    _pageTableEntry *entry = &pageTables[entryIndex];
+    int pageFrame = entry->pageFrame;
+
+    if (entry->valid == 0) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        pageFaults++;
+        processFaults[entryIndex / pagesPerTable]++;
+        // A store makes the page private straight away, so only reads look
+        // for a frame that already holds its bytes.
+        const uint8_t *content = NULL;
+        uint64_t hash = 0;
+        pageFrame = -1;
+        if (sharing && !write) {
+            content = pageContent(entryIndex);
+            hash = hashPage(content);
+            pageFrame = findSharedFrame(hash, content);
         }
-        for (int i = 0; i < 1024; i++) {
-            realMem[(pageFrame * 1024) + i] = virtualMemory[pTable][(pageTableIndex * 1024) + i];
-            pageTable->entry[pageTableIndex].referenced = 0;
-            pageTable->entry[pageTableIndex].modified = 0;
+        if (pageFrame >= 0) {
+            sharedMappings++;
+            printPageFault(pTable, address, static_cast<uint32_t>((pageFrame * pageSize) + offset), pageFrame);
+            nextSharer[entryIndex] = frameOwners[pageFrame];
+            frameOwners[pageFrame] = entryIndex;
+        } else {
+            pageFrame =nextPageFrame();
+            printPageFault(pTable, address, static_cast<uint32_t>((pageFrame * pageSize) + offset), pageFrame);
+            evictFrame(pageFrame);
+            if (content != NULL)
+                memcpy(&realMem[pageFrame * pageSize], content, pageSize);
+            else {
+                memcpy(&realMem[pageFrame * pageSize], &virtualMemory[(size_t) entryIndex * pageSize], pageSize);
+                // A clean page keeps reloading from the program image.
+                if (pendingImage[entryIndex].data != NULL)
+                    memcpy(&realMem[pageFrame * pageSize], pendingImage[entryIndex].data, pendingImage[entryIndex].length);
+            }
+            frameOwners[pageFrame] = entryIndex;
+            nextSharer[entryIndex] = -1;
+            noteFrameWrite(pageFrame);
+            policy->pageLoaded(*this, pageFrame);
+            if (content != NULL)
+                indexFrame(pageFrame, hash);
         }
-        this->pageTables[pTable].entry[pageTableIndex].valid=1;
-        pageTable->entry[pageTableIndex].pageFrame = pageFrame;
+        entry->valid = 1;
+        entry->referenced = 0;
+        entry->modified = write;
+        entry->pageFrame = pageFrame;
         printPageTables();
-    } else pageTable->entry[pageTableIndex].referenced = 1;
+        faultNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    } else {
+        entry->referenced = 1;
+        if (write) {
+            if (frameOwners[pageFrame] != entryIndex || nextSharer[entryIndex] >= 0)
+                pageFrame = breakSharing(entryIndex, pTable, address, offset);
+            else if (frameIndexed[pageFrame])
+                unindexFrame(pageFrame);
+            entry->modified = 1;
+            noteFrameWrite(pageFrame);
+        }
+        tlbEntry->index = entryIndex;
+        // Stores stay visible here once per checkpoint epoch.
+        tlbEntry->writable = entry->modified && chunkEpoch[entryCount + pageFrame] == epoch;
+        tlbEntry->frame = &realMem[pageFrame * pageSize];
+    }
+
+    return realMem[(pageFrame * pageSize) + offset];
+
+}
+
+// First store to a page whose frame other pages share: it moves to a frame
+// of its own with a copy of the bytes, which is a page fault of its own.
+// When the policy picks the shared frame itself, the other pages leave it
+// instead.
+int Memory::breakSharing(int entryIndex, int pTable, uint32_t address, uint32_t offset) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int shared = pageTables[entryIndex].pageFrame;
+    unmapEntry(entryIndex);
+    copyOnWrites++;
+    pageFaults++;
+    processFaults[entryIndex / pagesPerTable]++;
+    int pageFrame = nextPageFrame();
+    printPageFault(pTable, address, static_cast<uint32_t>((pageFrame * pageSize) + offset), pageFrame);
+    evictFrame(pageFrame);
+    if (pageFrame != shared)
+        memcpy(&realMem[pageFrame * pageSize], &realMem[shared * pageSize], pageSize);
+    frameOwners[pageFrame] = entryIndex;
+    pageTables[entryIndex].pageFrame = pageFrame;
+    policy->pageLoaded(*this, pageFrame);
+    printPageTables();
+    faultNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    return pageFrame;
+}
+
+void Memory::evictFrame(int frame) {
+    int owner = frameOwners[frame];
+    if (owner < 0) return;
+    evictions++;
+    unindexFrame(frame);
+    while (owner >= 0) {
+        _pageTableEntry *evicted = &pageTables[owner];
+        // A page that was only read still matches its backing store.
+        if (evicted->modified) {
+            memcpy(&virtualMemory[(size_t) owner * pageSize], &realMem[frame * pageSize], pageSize);
+            pendingImage[owner].data = NULL;
+            noteStoreWrite(owner);
+            writeBacks++;
+        }
+        evicted->valid = 0;
+        evicted->modified = 0;
+        invalidateTLB(owner);
+        int next = nextSharer[owner];
+        nextSharer[owner] = -1;
+        owner = next;
+    }
+    frameOwners[frame] = -1;
+}
 
-    return realMem[(pageFrame * 1024) + offset];
+void Memory::unmapEntry(int index) {
+    int frame = pageTables[index].pageFrame;
+    int *link = &frameOwners[frame];
+    while (*link != index)
+        link = &nextSharer[*link];
+    *link = nextSharer[index];
+    nextSharer[index] = -1;
+    if (frameOwners[frame] < 0)
+        unindexFrame(frame);
+}
 
+const uint8_t *Memory::pageContent(int index) {
+    memcpy(shareScratch, &virtualMemory[(size_t) index * pageSize], pageSize);
+    if (pendingImage[index].data != NULL)
+        memcpy(shareScratch, pendingImage[index].data, pendingImage[index].length);
+    return shareScratch;
+}
+
+int Memory::findSharedFrame(uint64_t hash, const uint8_t *content) const {
+    auto range = sharedFrames.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (memcmp(&realMem[it->second * pageSize], content, pageSize) == 0)
+            return it->second;
+    }
+    return -1;
+}
+
+void Memory::indexFrame(int frame, uint64_t hash) {
+    frameHashes[frame] = hash;
+    frameIndexed[frame] = 1;
+    sharedFrames.emplace(hash, frame);
+}
+
+void Memory::unindexFrame(int frame) {
+    if (!frameIndexed[frame]) return;
+    auto range = sharedFrames.equal_range(frameHashes[frame]);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == frame) {
+            sharedFrames.erase(it);
+            break;
+        }
+    }
+    frameIndexed[frame] = 0;
+}
+
+// FNV-1a over 64-bit words; page sizes below 8 bytes go a byte at a time.
+uint64_t Memory::hashPage(const uint8_t *page) const {
+    uint64_t hash = 14695981039346656037ULL;
+    if (pageSize < 8) {
+        for (int i = 0; i < pageSize; i++)
+            hash = (hash ^ page[i]) * 1099511628211ULL;
+        return hash;
+    }
+    for (int i = 0; i < pageSize; i += 8) {
+        uint64_t word;
+        memcpy(&word, page + i, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+void Memory::setPageSharing(bool enable) {
+    sharing = enable;
+    if (!enable) {
+        sharedFrames.clear();
+        memset(frameIndexed, 0, frameCount);
+    }
+}
+
+int Memory::getFrameSharers(int frame) const {
+    int count = 0;
+    for (int owner = frameOwners[frame]; owner >= 0; owner = nextSharer[owner])
+        count++;
+    return count;
 }
 
 void Memory::printPageFault(int currentProcess,uint32_t virtualAddress, uint32_t physicalAddress, int pageToBeReplaced) {
-    char outTex[256];
-    std::sprintf(outTex, "PAGEFAULT: %d,%04x,%04x,%d", currentProcess, virtualAddress, physicalAddress, pageToBeReplaced);
-    systemOutput << outTex << std::endl;
+    pageLog.logPageFault(currentProcess, virtualAddress, physicalAddress, pageToBeReplaced);
 }
 
 void Memory::printPageTables() {
-    std::ofstream pageOutput;
-    pageOutput.open("pagetable.txt",std::ios::out | std::ios::app);
-    for (int i = 0; i < 4; i++) {
-        pageOutput << "Page Table " << i << ":" << std::endl;
-        for (int j = 0; j < 16; j++) {
-            pageOutput << "Index: " << j;
-            pageOutput << " Valid Bit: " << pageTables[i].entry[j].valid;
-            pageOutput << " Frame: " << pageTables[i].entry[j].pageFrame;
-            pageOutput << " Referenced Bit: " << pageTables[i].entry[j].referenced;
-            pageOutput << " Modified Bit: " << pageTables[i].entry[j].modified;
-            pageOutput << std::endl;
-        }
+    if (!pageLog.wantsPageTables()) return;
+    uint8_t *entry = packedTables;
+    for (int i = 0; i < entryCount; i++, entry += 3) {
+        entry[0] = pageTables[i].pageFrame & 0xff;
+        entry[1] = (pageTables[i].pageFrame >> 8) & 0xff;
+        entry[2] = (pageTables[i].valid & 1) |
+                   ((pageTables[i].referenced & 1) << 1) |
+                   ((pageTables[i].modified & 1) << 2);
     }
-    pageOutput.close();
+    pageLog.logPageTables(packedTables, processCount, pagesPerTable);
 }
 
 
+// The start of each process slot is addressed in its backing store, where
+// programs are loaded; anything else is a kernel access.
 uint8_t &Memory::physicalAt(uint32_t ind) {
-    int virtualMemInd = 0;
-    uint32_t index = ind;
-    if (ind == 0x0000) virtualMemInd = 0;
-    else if (ind == 0x4000) {
-        virtualMemInd = 1;
-        index = index - 0x4000;
-    } else if (ind == 0x8000) {
-        virtualMemInd = 2;
-        index = index - 0x8000;
-    } else if (ind == 0xc000) {
-        virtualMemInd = 3;
-        index = index - 0xc000;
-    }else{
-        return kernelCall(ind);
-    }
-    return virtualMemory[virtualMemInd][index];
+    if (ind % processSpace == 0 && ind / processSpace < (uint32_t) processCount) {
+        materializePage((int) (ind >> pageShift));
+        return virtualMemory[ind];
+    }
+    return kernelCall(ind);
+}
+
+// The process bases live in the backing store, which is what a write-back
+// would update anyway.
+uint8_t &Memory::physicalWriteAt(uint32_t ind) {
+    if (ind % processSpace == 0 && ind / processSpace < (uint32_t) processCount) {
+        materializePage((int) (ind >> pageShift));
+        noteStoreWrite((int) (ind >> pageShift));
+        return virtualMemory[ind];
+    }
+    return kernelWrite(ind);
+}
+
+bool Memory::loadImage(uint32_t offset, const uint8_t *data, size_t length) {
+    if (offset >= (uint32_t) processCount * processSpace ||
+        (offset % processSpace) + length > processSpace)
+        return false;
+    size_t done = 0;
+    while (done < length) {
+        uint32_t address = offset + (uint32_t) done;
+        int index = (int) (address >> pageShift);
+        uint32_t inPage = address & (pageSize - 1);
+        size_t count = pageSize - inPage;
+        if (count > length - done) count = length - done;
+
+        dropPage(index);
+        if (inPage == 0) {
+            // A shorter image still leaves the rest of the page to the
+            // previous one.
+            if (count < (size_t) pageSize) materializePage(index);
+            pendingImage[index].data = data + done;
+            pendingImage[index].length = (uint32_t) count;
+        } else {
+            materializePage(index);
+            memcpy(&virtualMemory[address], data + done, count);
+            noteStoreWrite(index);
+        }
+        done += count;
+    }
+    return true;
+}
+
+// Takes a page out of its frame, writing it back first if modified, so the
+// next access faults it in from the backing store.
+void Memory::dropPage(int index) {
+    _pageTableEntry *entry = &pageTables[index];
+    if (!entry->valid) return;
+    if (entry->modified) {
+        memcpy(&virtualMemory[(size_t) index * pageSize], &realMem[entry->pageFrame * pageSize], pageSize);
+        pendingImage[index].data = NULL;
+        noteStoreWrite(index);
+        writeBacks++;
+    }
+    unmapEntry(index);
+    entry->valid = 0;
+    entry->modified = 0;
+    invalidateTLB(index);
+}
+
+void Memory::materializePage(int index) {
+    _imageSource *source = &pendingImage[index];
+    if (source->data == NULL) return;
+    memcpy(&virtualMemory[(size_t) index * pageSize], source->data, source->length);
+    source->data = NULL;
+    noteStoreWrite(index);
+}
+
+uint32_t Memory::checkpoint() {
+    for (int i = 0; i < entryCount; i++)
+        materializePage(i);
+    for (int i = 0; i < TLB_SIZE; i++)
+        tlb[i].writable = 0;
+    return epoch++;
+}
+
+size_t Memory::getTablesSize() const {
+    return (size_t) entryCount * sizeof(_pageTableEntry) + (size_t) frameCount * sizeof(int) +
+           (size_t) entryCount * sizeof(int) + 2 * sizeof(uint16_t) + 2 * sizeof(uint64_t);
+}
+
+// Raw host layout, like the State8080 that goes with it.
+void Memory::saveTables(uint8_t *out) const {
+    memcpy(out, pageTables, (size_t) entryCount * sizeof(_pageTableEntry));
+    out += (size_t) entryCount * sizeof(_pageTableEntry);
+    memcpy(out, frameOwners, (size_t) frameCount * sizeof(int));
+    out += (size_t) frameCount * sizeof(int);
+    memcpy(out, nextSharer, (size_t) entryCount * sizeof(int));
+    out += (size_t) entryCount * sizeof(int);
+    memcpy(out, &baseRegister, sizeof(uint16_t));
+    memcpy(out + sizeof(uint16_t), &limitRegister, sizeof(uint16_t));
+    out += 2 * sizeof(uint16_t);
+    memcpy(out, &pageFaults, sizeof(uint64_t));
+    memcpy(out + sizeof(uint64_t), &writeBacks, sizeof(uint64_t));
+}
+
+// The tables of a checkpoint, whose images were all materialized.
+void Memory::loadTables(const uint8_t *in) {
+    memcpy(pageTables, in, (size_t) entryCount * sizeof(_pageTableEntry));
+    in += (size_t) entryCount * sizeof(_pageTableEntry);
+    memcpy(frameOwners, in, (size_t) frameCount * sizeof(int));
+    in += (size_t) frameCount * sizeof(int);
+    memcpy(nextSharer, in, (size_t) entryCount * sizeof(int));
+    in += (size_t) entryCount * sizeof(int);
+    memcpy(&baseRegister, in, sizeof(uint16_t));
+    memcpy(&limitRegister, in + sizeof(uint16_t), sizeof(uint16_t));
+    processIndex = processIndexOf(baseRegister);
+    in += 2 * sizeof(uint16_t);
+    memcpy(&pageFaults, in, sizeof(uint64_t));
+    memcpy(&writeBacks, in + sizeof(uint64_t), sizeof(uint64_t));
+    for (int i = 0; i < entryCount; i++)
+        pendingImage[i].data = NULL;
+    flushTLB();
+    // The restored frames are indexed again, those whose pages are all clean.
+    sharedFrames.clear();
+    memset(frameIndexed, 0, frameCount);
+    if (!sharing) return;
+    for (int frame = 0; frame < frameCount; frame++) {
+        bool clean = frameOwners[frame] >= 0;
+        for (int owner = frameOwners[frame]; owner >= 0 && clean; owner = nextSharer[owner])
+            clean = !pageTables[owner].modified;
+        if (clean)
+            indexFrame(frame, hashPage(&realMem[frame * pageSize]));
+    }
+}
+
+void Memory::flushTLB() {
+    for (int i = 0; i < TLB_SIZE; i++) {
+        tlb[i].index = -1;
+        tlb[i].writable = 0;
+        tlb[i].frame = NULL;
+    }
+}
+
+void Memory::invalidateTLB(int index) {
+    _tlbEntry *entry = &tlb[index % TLB_SIZE];
+    if (entry->index == index)
+        entry->index = -1;
+}
+
+// Fills the entry exactly as the MMU's hit path would, which leaves the
+// page table as it is once the referenced bit is set.
+void Memory::prefetchPage(uint32_t ind) {
+    int entryIndex = (processIndex * pagesPerTable + (int) (ind >> pageShift)) % entryCount;
+    _tlbEntry *tlbEntry = &tlb[entryIndex % TLB_SIZE];
+    if (tlbEntry->index == entryIndex) return;
+    _pageTableEntry *entry = &pageTables[entryIndex];
+    if (entry->valid == 0 || entry->referenced == 0) return;
+    tlbEntry->index = entryIndex;
+    tlbEntry->writable = entry->modified && chunkEpoch[entryCount + entry->pageFrame] == epoch;
+    tlbEntry->frame = &realMem[entry->pageFrame * pageSize];
 }
 
 int Memory::nextPageFrame() {
-    int index = pageFrameIndexes[currentPageFrame];
-    currentPageFrame++;
-    currentPageFrame = currentPageFrame % 8;
-    return index;
+    return policy->selectVictim(*this);
+}
+
+void Memory::setReplacementPolicy(ReplacementPolicy *newPolicy) {
+    delete policy;
+    policy = newPolicy;
+}
+
+// A shared frame is referenced through any of its pages.
+bool Memory::isFrameReferenced(int frame) const {
+    for (int owner = frameOwners[frame]; owner >= 0; owner = nextSharer[owner]) {
+        if (pageTables[owner].referenced != 0)
+            return true;
+    }
+    return false;
+}
+
+// The TLB entries go too, so the next access walks the table and sets the
+// bit again.
+void Memory::clearFrameReferenced(int frame) {
+    for (int owner = frameOwners[frame]; owner >= 0; owner = nextSharer[owner]) {
+        pageTables[owner].referenced = 0;
+        invalidateTLB(owner);
+    }
 }
 
 uint8_t &Memory::kernelCall(uint32_t ind) {
-    std::string processName[4]={"Init","Sum","Sort","Prime"};
+    return kernelAccess(ind, 0);
+}
+
+uint8_t &Memory::kernelWrite(uint32_t ind) {
+    return kernelAccess(ind, 1);
+}
+
+void Memory::kernelReadBlock(uint32_t ind, uint8_t *out, size_t length) {
+    while (length > 0) {
+        size_t count = pageSize - (ind & (pageSize - 1));
+        if (count > length) count = length;
+        memcpy(out, &MemoryManagementUnit(ind, 1), count);
+        ind += (uint32_t) count;
+        out += count;
+        length -= count;
+    }
+}
+
+void Memory::kernelWriteBlock(uint32_t ind, const uint8_t *data, size_t length) {
+    while (length > 0) {
+        size_t count = pageSize - (ind & (pageSize - 1));
+        if (count > length) count = length;
+        memcpy(&MemoryManagementUnit(ind, 1, 1), data, count);
+        ind += (uint32_t) count;
+        data += count;
+        length -= count;
+    }
+}
+
+const uint8_t *Memory::readSpan(uint32_t ind, uint32_t *length) {
+    *length = spanLength(ind);
+    return &MemoryManagementUnit(ind, 0);
+}
+
+uint8_t *Memory::writeSpan(uint32_t ind, uint32_t *length) {
+    *length = spanLength(ind);
+    return &MemoryManagementUnit(ind, 0, 1);
+}
+
+uint32_t Memory::spanLength(uint32_t ind) const {
+    uint32_t count = pageSize - (ind & (pageSize - 1));
+    if (ind < 0x10000 && count > 0x10000 - ind) count = 0x10000 - ind;
+    return count;
+}
+
+uint8_t &Memory::kernelAccess(uint32_t ind, int write) {
    if(ind ==256){
         int current = kernelCall(0x0d0a);
         int next = kernelCall(static_cast<uint32_t>(((current + 2) * 256) + 2));
-        systemOutput << "CSEVENT: " << current << ", " << processName[current] << "," << next << ","
-                       << processName[next] << std::endl;
+        logContextSwitch(current, next);
     }
-    return MemoryManagementUnit(ind, 1);
+    return MemoryManagementUnit(ind, 1, write);
 }
 
 
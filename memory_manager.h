@@ -4,6 +4,15 @@
 #include <cstdlib>
 #include "memory_base.h"
 #include <fstream>
+#include <unordered_map>
+#include "page_log.h"
+#include "replacement_policy.h"
+
+#define TLB_SIZE 64     // Direct mapped on the flat page table entry index
+#define FRAME_COUNT 8   // Defaults, see Memory::isValidConfig
+#define PAGE_SIZE 1024
+#define PROCESS_COUNT 4
+#define GUEST_SPACE 0x10000     // Split evenly between the process slots
 
 // This is just a simple memory with no virtual addresses.
 // You will write your own memory with base and limit registers.
@@ -17,36 +26,259 @@ public:
         int referenced;
     }_pageTableEntry;
 
-    typedef struct _pageTable{
-        _pageTableEntry entry[16];
-    }_pageTable;
+    // Translation of one (page table, virtual page) to its frame in realMem,
+    // tagged with the flat entry index. writable is set once the page is
+    // marked modified, and its frame written in the current checkpoint
+    // epoch, so a store hitting a clean entry still walks the table.
+    typedef struct _tlbEntry{
+        int index;
+        int writable;
+        uint8_t *frame;
+    }_tlbEntry;
+
+    // Program bytes not yet copied into a backing store page. They start
+    // at the beginning of the page; data is NULL when nothing is pending.
+    typedef struct _imageSource{
+        const uint8_t *data;
+        uint32_t length;
+    }_imageSource;
 
-    Memory(uint64_t size);
+    /**
+     * @param size Physical memory in bytes, size / pageSize frames.
+     * @param logMode Page log output.
+     * @param pageSize Bytes per page, a power of two.
+     * @param processCount Page tables and backing stores, a power of two.
+     *        Process i owns GUEST_SPACE / processCount bytes and is selected
+     *        by a base register of i times that.
+     */
+    Memory(uint64_t size, PageLog::LogMode logMode = PageLog::LOG_FULL,
+           int pageSize = PAGE_SIZE, int processCount = PROCESS_COUNT);
     ~Memory() {
-        systemOutput.close();
+        pageLog.close();
+        delete policy;
         free(realMem);
+        free(virtualMemory);
+        free(pageTables);
+        free(frameOwners);
+        free(packedTables);
+        free(pendingImage);
+        free(chunkEpoch);
+        free(processFaults);
+        free(nextSharer);
+        free(frameHashes);
+        free(frameIndexed);
+        free(shareScratch);
     }
+    // NULL when the configuration is usable, otherwise what is wrong with it.
+    static const char *isValidConfig(int frameCount, int pageSize, int processCount);
     virtual uint8_t & at(uint32_t ind);
     virtual uint8_t & physicalAt(uint32_t ind);
+    // Store counterparts of at(), physicalAt() and kernelCall(). They mark
+    // the page modified, which is what decides the write-back on eviction,
+    // so every guest or kernel store has to go through one of them.
+    uint8_t & writeAt(uint32_t ind);
+    uint8_t & physicalWriteAt(uint32_t ind);
+    uint8_t & kernelWrite(uint32_t ind);
+    // at() when write is 0, otherwise writeAt(), with the TLB hit inline
+    // for the interpreter (see PagedModel); misses go to the MMU.
+    uint8_t & access(uint32_t ind, int write) {
+        int entryIndex = (processIndex * pagesPerTable + (int) (ind >> pageShift)) % entryCount;
+        _tlbEntry *tlbEntry = &tlb[entryIndex % TLB_SIZE];
+        if (tlbEntry->index == entryIndex && (!write || tlbEntry->writable)) {
+            tlbHits++;
+            return tlbEntry->frame[ind & (pageSize - 1)];
+        }
+        return MemoryManagementUnit(ind, 0, write);
+    }
+    // Fetch unit hint: ind is where the next instruction starts. When that
+    // is the first byte of a page, its TLB entry is filled ahead of the
+    // fetch, but only for a resident page whose referenced bit is already
+    // set, so nothing a miss would record is skipped and it never faults.
+    void prefetch(uint32_t ind) {
+        if ((ind & (pageSize - 1)) == 0) prefetchPage(ind);
+    }
+    // Kernel copies, translated once per page rather than once per byte.
+    void kernelReadBlock(uint32_t ind, uint8_t *out, size_t length);
+    void kernelWriteBlock(uint32_t ind, const uint8_t *data, size_t length);
+    // Host view of the running process's bytes from virtual address ind to
+    // the end of its page, or of the 64K address space. length receives the
+    // byte count. The span is only valid until the next MMU access, which
+    // may evict its frame; writeSpan marks the page modified.
+    const uint8_t * readSpan(uint32_t ind, uint32_t *length);
+    uint8_t * writeSpan(uint32_t ind, uint32_t *length);
+    /**
+     * Load a program image at a guest physical address. Resident pages in
+     * the range are dropped; whole pages are filled from data on their
+     * first fault, so data has to stay valid (see ProgramCache).
+     * @return false if the image runs past the end of the process slot.
+     */
+    bool loadImage(uint32_t offset, const uint8_t *data, size_t length);
     uint16_t getBaseRegister() const { return baseRegister;}
     uint16_t getLimitRegister() const { return limitRegister;}
-    void setBaseRegister(uint16_t base) { this->baseRegister = base;}
+    void setBaseRegister(uint16_t base) {
+        if (base != baseRegister) flushTLB();
+        this->baseRegister = base;
+        processIndex = processIndexOf(base);
+    }
     void setLimitRegister(uint16_t limit) {this->limitRegister = limit;}
-    uint8_t & MemoryManagementUnit(uint32_t, int kernelCall);
+    // Page table of the running process, selected by the base register.
+    int getProcessIndex() const { return processIndex; }
+    int getProcessCount() const { return processCount; }
+    uint32_t getProcessSpace() const { return processSpace; }
+    int getPageSize() const { return pageSize; }
+    uint8_t & MemoryManagementUnit(uint32_t, int kernelCall, int write = 0);
     void printPageFault(int currentProcess,uint32_t virtualAddress,uint32_t physicalAddress,int pageToBeReplaced);
     void printPageTables();
-    std::ofstream systemOutput;
+    void logContextSwitch(int current, int next) {
+        contextSwitches++;
+        pageLog.logContextSwitch(current, next);
+    }
+    // Reopens the page logs, truncating them, in directory unless it is
+    // NULL; call before running guest code.
+    void setLogMode(PageLog::LogMode mode, const char *directory = NULL) { pageLog.open(mode, directory); }
+    PageLog::LogMode getLogMode() const { return pageLog.getMode(); }
     int nextPageFrame();
+    // Takes ownership of policy; call before running guest code.
+    void setReplacementPolicy(ReplacementPolicy *policy);
+    const ReplacementPolicy *getReplacementPolicy() const { return policy; }
+    uint64_t getPageFaultCount() const { return pageFaults; }
+    uint64_t getWriteBackCount() const { return writeBacks; }
+    // Context switches logged, by the guest's handler or ProcessTable. Not
+    // part of a checkpoint.
+    uint64_t getContextSwitchCount() const { return contextSwitches; }
+    // For RuntimeStats, none of them part of a checkpoint either. Faults
+    // are counted per page table; evictions are faults that displaced a
+    // page, clean or not. Misses are lookups that went past the TLB to the
+    // page tables, and fault time is host time spent handling page faults.
+    uint64_t getProcessFaultCount(int table) const { return processFaults[table]; }
+    uint64_t getEvictionCount() const { return evictions; }
+    uint64_t getTlbHitCount() const { return tlbHits; }
+    uint64_t getTlbMissCount() const { return tlbMisses; }
+    uint64_t getFaultNanoseconds() const { return faultNanoseconds; }
+
+    /**
+     * Opt-in: a page faulted in for reading whose bytes match a clean
+     * resident frame, such as the same program image in another process or
+     * a page of zeros, is mapped to that frame instead of taking one of its
+     * own. Shared frames are never written: the first store to one gives
+     * the storing page a copy in a frame of its own, which counts as a page
+     * fault. Frames are found by a hash of their bytes and compared in full.
+     */
+    void setPageSharing(bool enable);
+    bool isPageSharing() const { return sharing; }
+    // Faults served by mapping an already loaded frame, and stores that
+    // broke a page out of a shared frame.
+    uint64_t getSharedMappingCount() const { return sharedMappings; }
+    uint64_t getCopyOnWriteCount() const { return copyOnWrites; }
+    // Flat entries mapped to frame, 0 when it is free.
+    int getFrameSharers(int frame) const;
+
+    // Frame view used by replacement policies.
+    int getFrameCount() const { return frameCount; }
+    bool isFrameUsed(int frame) const { return frameOwners[frame] >= 0; }
+    bool isFrameReferenced(int frame) const;
+    void clearFrameReferenced(int frame);
     uint8_t& kernelCall(uint32_t ind);
+    void flushTLB();
+    void invalidateTLB(int index);
+
+    // Checkpoint support, see StateManager. The backing stores and the
+    // frames are cut into pageSize chunks: chunk i < entryCount is the
+    // backing store page of flat entry i, the rest are the frames in order.
+    // Together with the tables they are the whole state of the memory.
+    int getChunkCount() const { return entryCount + frameCount; }
+    const uint8_t * getChunk(int chunk) const { return chunkData(chunk); }
+    // For restoring a chunk; it counts as written.
+    uint8_t * writeChunk(int chunk) {
+        chunkEpoch[chunk] = epoch;
+        return chunkData(chunk);
+    }
+    /**
+     * Start a new checkpoint epoch. Pending program images are copied into
+     * the backing stores, and the TLB loses write permission so the next
+     * store to every page is seen by the MMU again.
+     * @return Epoch that ended; pass it to isChunkWrittenSince.
+     */
+    uint32_t checkpoint();
+    bool isChunkWrittenSince(int chunk, uint32_t since) const { return chunkEpoch[chunk] > since; }
+    // Page tables, frame owners, registers and counters; not the
+    // replacement policy's history.
+    size_t getTablesSize() const;
+    void saveTables(uint8_t *out) const;
+    void loadTables(const uint8_t *in);
 
 private:
+    void prefetchPage(uint32_t ind);
+    uint8_t & kernelAccess(uint32_t ind, int write);
+    int processIndexOf(uint16_t base) const {
+        return (base & (processSpace - 1)) ? 0 : base / processSpace;
+    }
+    uint32_t spanLength(uint32_t ind) const;
+    uint8_t * chunkData(int chunk) const {
+        if (chunk < entryCount) return &virtualMemory[(size_t) chunk * pageSize];
+        return &realMem[(size_t) (chunk - entryCount) * pageSize];
+    }
+    void noteFrameWrite(int frame) { chunkEpoch[entryCount + frame] = epoch; }
+    void noteStoreWrite(int index) { chunkEpoch[index] = epoch; }
+    void dropPage(int index);
+    void materializePage(int index);
+    // Every page in frame out of it, written back if modified.
+    void evictFrame(int frame);
+    // index out of its frame's owners; the frame is free once none are left.
+    void unmapEntry(int index);
+    int breakSharing(int entryIndex, int pTable, uint32_t address, uint32_t offset);
+    // The bytes a fault of index loads, in shareScratch.
+    const uint8_t * pageContent(int index);
+    int findSharedFrame(uint64_t hash, const uint8_t *content) const;
+    void indexFrame(int frame, uint64_t hash);
+    void unindexFrame(int frame);
+    uint64_t hashPage(const uint8_t *page) const;
+
+    int frameCount;
+    int pageSize;
+    int pageShift;
+    int processCount;
+    uint32_t processSpace;
+    int pagesPerTable;
+    int entryCount;         // processCount * pagesPerTable
+
     uint8_t * realMem;
     uint16_t baseRegister;
     uint16_t limitRegister;
-    uint8_t * virtualMemory[4];
-    _pageTable pageTables[4];
-    int pageFrameIndexes[8]={0,1,2,3,4,5,6,7};
-    int currentPageFrame=0;
+    int processIndex;       // Page table the base register selects, 0 if unaligned
+    // Backing stores of every process, one arena; process i starts at
+    // i * processSpace, so a flat entry index times pageSize is its page.
+    uint8_t * virtualMemory;
+    // Every page table, flat: table i starts at i * pagesPerTable.
+    _pageTableEntry * pageTables;
+    // Reverse map, the flat entry index loaded in each frame, -1 when free.
+    // Further entries sharing the frame follow through nextSharer.
+    int * frameOwners;
+    int * nextSharer;       // Per flat entry, -1 at the end of the list
+    uint8_t * packedTables; // printPageTables scratch, 3 bytes per entry
+    _imageSource * pendingImage;    // Per flat entry
+    ReplacementPolicy *policy;
+    uint64_t pageFaults;
+    uint64_t contextSwitches;
+    uint64_t writeBacks;
+    uint64_t * processFaults;   // Per page table
+    uint64_t evictions;
+    uint64_t tlbHits;
+    uint64_t tlbMisses;
+    uint64_t faultNanoseconds;
+    // Page sharing. Only clean frames, whose pages all match their backing
+    // stores, are in sharedFrames; the first store to one takes it out.
+    bool sharing;
+    std::unordered_multimap<uint64_t, int> sharedFrames;    // Hash to frame
+    uint64_t * frameHashes;
+    uint8_t * frameIndexed;
+    uint8_t * shareScratch;     // One page
+    uint64_t sharedMappings;
+    uint64_t copyOnWrites;
+    _tlbEntry tlb[TLB_SIZE];
+    PageLog pageLog;
+    uint32_t epoch;         // Checkpoint epoch, see checkpoint()
+    uint32_t * chunkEpoch;  // Epoch of each chunk's last write
 
 
 };
@@ -0,0 +1,58 @@
+#ifndef MEMORY_MODEL_H
+#define MEMORY_MODEL_H
+
+#include <cstdint>
+#include <cstring>
+#include "memory_base.h"
+#include "memory_manager.h"
+#include "emulator_enhanced.h"
+
+// Plain 64K of RAM: no paging, base register or processes. What the unit
+// tests and EmulatorTest run on.
+class FlatMemory : public MemoryBase {
+public:
+    FlatMemory() { memset(bytes, 0, sizeof(bytes)); }
+    virtual uint8_t & at(uint32_t ind) { return bytes[ind & 0xffff]; }
+    virtual uint8_t & physicalAt(uint32_t ind) { return bytes[ind & 0xffff]; }
+
+    uint8_t bytes[0x10000];
+};
+
+// How the interpreter reaches each concrete memory type. CPU8080 has its
+// execution templates instantiated once per model and picks the one for
+// its memory when it is constructed, so every guest load, store and fetch
+// is a direct call the compiler can inline instead of MemoryBase::at.
+//   load(m, a)      byte at CPU address a
+//   store(m, a)     byte at a, to be written
+//   slot(m)         process slot the base register selects
+//   setBase(m, b)   set the base register, ignored without processes
+//   prefetch(m, a)  hint that the next instruction starts at a
+
+struct PagedModel {
+    typedef Memory Type;
+    static uint8_t & load(Memory *m, uint32_t a) { return m->access(a, 0); }
+    static uint8_t & store(Memory *m, uint32_t a) { return m->access(a, 1); }
+    static int slot(const Memory *m) { return m->getProcessIndex(); }
+    static void setBase(Memory *m, uint16_t base) { m->setBaseRegister(base); }
+    static void prefetch(Memory *m, uint32_t a) { m->prefetch(a); }
+};
+
+struct FlatModel {
+    typedef FlatMemory Type;
+    static uint8_t & load(FlatMemory *m, uint32_t a) { return m->bytes[a & 0xffff]; }
+    static uint8_t & store(FlatMemory *m, uint32_t a) { return m->bytes[a & 0xffff]; }
+    static int slot(const FlatMemory *) { return 0; }
+    static void setBase(FlatMemory *, uint16_t) {}
+    static void prefetch(FlatMemory *, uint32_t) {}
+};
+
+struct BankedModel {
+    typedef MemoryBankController Type;
+    static uint8_t & load(MemoryBankController *m, uint32_t a) { return m->MemoryBankController::at(a); }
+    static uint8_t & store(MemoryBankController *m, uint32_t a) { return m->writeAt((uint16_t) a); }
+    static int slot(const MemoryBankController *) { return 0; }
+    static void setBase(MemoryBankController *, uint16_t) {}
+    static void prefetch(MemoryBankController *, uint32_t) {}
+};
+
+#endif
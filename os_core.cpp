@@ -1,83 +1,119 @@
 #include <iostream>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
 #include "emulator_base.h"
 #include "os_core.h"
 #include "memory_manager.h"
+#include "block_cache.h"
 
 using namespace std;
 
 GTUOS::~GTUOS() {
+    delete console;
     if (ofn.is_open()) ofn.close();
     if (ifn.is_open()) ifn.close();
 
 }
 
-GTUOS::GTUOS() {
-    usingFiles = false;
+GTUOS::GTUOS(bool useFiles) {
+    usingFiles = useFiles;
     if (!usingFiles) {
         in = &cin;
         out = &cout;
     } else {
-        ifn.open("input.txt");
         in = &ifn;
 
         ofn.open("output.txt", ios::out);
         out = &ofn;
     }
+    console = new ConsoleIO(out);
+    if (!usingFiles || !console->preload("input.txt"))
+        console->setInput(in);
+    registerDefaults();
+}
+
+GTUOS::GTUOS(std::istream *input, std::ostream *output) {
+    usingFiles = false;
+    in = input;
+    out = output;
+    console = new ConsoleIO(out);
+    console->setInput(in);
+    registerDefaults();
+}
+
+void GTUOS::registerDefaults() {
+    for (int code = 0; code < SYSCALL_COUNT; code++) {
+        syscalls[code].name = NULL;
+        syscalls[code].calls = 0;
+        syscalls[code].cycles = 0;
+        syscalls[code].nanoseconds = 0;
+    }
+    registerSyscall(PRINT_B_CODE, "PRINT_B", [this](CPU8080 &cpu) { return PRINT_B(cpu); });
+    registerSyscall(PRINT_MEM_CODE, "PRINT_MEM", [this](CPU8080 &cpu) { return PRINT_MEM(cpu); });
+    registerSyscall(PRINT_STR_CODE, "PRINT_STR", [this](CPU8080 &cpu) { return PRINT_STR(cpu); });
+    registerSyscall(READ_B_CODE, "READ_B", [this](CPU8080 &cpu) { return READ_B(cpu); });
+    registerSyscall(READ_STR_CODE, "READ_STR", [this](CPU8080 &cpu) { return READ_STR(cpu); });
+    registerSyscall(READ_MEM_CODE, "READ_MEM", [this](CPU8080 &cpu) { return READ_MEM(cpu); });
+    registerSyscall(LOAD_EXEC_CODE, "LOAD_EXEC", [this](CPU8080 &cpu) { return LOAD_EXEC(cpu); });
+    registerSyscall(PROCESS_EXIT_CODE, "PROCESS_EXIT", [this](CPU8080 &cpu) { return PROCESS_EXIT(cpu); });
+    registerSyscall(SET_QUANTUM_CODE, "SET_QUANTUM", [this](CPU8080 &cpu) { return SET_QUANTUM(cpu); });
 }
 
 /**
  * Handle system call and redirect related function.
  * @param cpu Emulator object.
  * @param DEBUG If debug = 1, you can see detail about system call on console screen
- * @return Now, zero.
+ * @return Clock cycles of the call.
  */
 uint64_t GTUOS::handleCall(CPU8080 &cpu, int DEBUG) {
     debugMode = DEBUG;
     debugMode = 0;
 
-    uint8_t RegA = cpu.state->a;
-    switch (RegA) {
-        case PRINT_B_CODE:
-            if (DEBUG == 1) *out << "\tSystemcall - PRINT_B" << endl;
-            PRINT_B(cpu);
-            break;
-        case PRINT_MEM_CODE:
-            if (DEBUG == 1) *out << "\tSystemcall - PRINT_MEM" << endl;
-            PRINT_MEM(cpu);
-            break;
-        case PRINT_STR_CODE:
-            if (DEBUG == 1) *out << "\tSystemcall - PRINT_STR" << endl;
-            PRINT_STR(cpu);
-            break;
-        case READ_B_CODE:
-            if (DEBUG == 1) *out << "\tSystemcall - READ_B" << endl;
-            READ_B(cpu);
-            break;
-        case READ_STR_CODE:
-            if (DEBUG == 1) *out << "\tSystemcall - READ_STR" << endl;
-            READ_STR(cpu);
-            break;
-        case READ_MEM_CODE:
-            if (DEBUG == 1) *out << "\tSystemcall - READ_MEM" << endl;
-            READ_MEM(cpu);
-            break;
-        case LOAD_EXEC_CODE:
-            if (DEBUG == 1) *out << "\tSystemcall - LOAD_EXEC" << endl;
-            LOAD_EXEC(cpu);
-            break;
-        case PROCESS_EXIT_CODE:
-            if (DEBUG == 1) *out << "\tSystemcall - PROCESS_EXIT" << endl;
-            PROCESS_EXIT(cpu);
-            break;
-        case SET_QUANTUM_CODE:
-            if (DEBUG == 1) *out << "\tSystemcall - SET_QUANTUM" << endl;
-            SET_QUANTUM(cpu);
-            break;
-        default:
-            if (DEBUG == 1) *out << "Undhandled system call" << endl;
-            break;
+    _syscall *call = &syscalls[cpu.state->a];
+    ConsoleIO &io = *console;
+    int cycles = 0;
+    if (call->name != NULL) {
+        if (DEBUG == 1) {
+            io.write("\tSystemcall - ");
+            io.write(call->name);
+            io.put('\n');
+        }
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        cycles = call->handler(cpu);
+        call->nanoseconds += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        call->calls++;
+        call->cycles += cycles;
+    } else {
+        if (DEBUG == 1) io.write("Undhandled system call\n");
+    }
+    cpu.chargeCycles(cycles);
+    // Trace lines are printed as the CPU runs, so guest output has to keep
+    // up with them; otherwise it is written out in large chunks.
+    if (CPU8080::traceLevelFor(DEBUG) != CPU8080::TRACE_NONE) io.flush();
+    else io.flushIfDue();
+    return cycles;
+}
+
+void GTUOS::registerSyscall(uint8_t code, const char *name, SyscallHandler handler) {
+    _syscall *call = &syscalls[code];
+    call->name = name;
+    call->handler = handler;
+    call->calls = 0;
+    call->cycles = 0;
+    call->nanoseconds = 0;
+}
+
+void GTUOS::printSyscallStats(std::ostream &stats) const {
+    char line[128];
+    for (int code = 0; code < SYSCALL_COUNT; code++) {
+        const _syscall *call = &syscalls[code];
+        if (call->name == NULL || call->calls == 0) continue;
+        snprintf(line, sizeof(line), "%-13s %3d: %10llu calls %10llu cycles %12llu ns %8llu ns/call\n",
+                 call->name, code, (unsigned long long) call->calls, (unsigned long long) call->cycles,
+                 (unsigned long long) call->nanoseconds, (unsigned long long) (call->nanoseconds / call->calls));
+        stats << line;
     }
-    return 0;
 }
 
 /**
@@ -86,8 +122,9 @@ uint64_t GTUOS::handleCall(CPU8080 &cpu, int DEBUG) {
  * @return Clock cycle. 10
  */
 int GTUOS::PRINT_B(const CPU8080 &cpu) {
-    if (debugMode == 1) *out << "\tContent of register B: " << (int) cpu.state->b << endl;
-    else *out << (int) cpu.state->b;
+    if (debugMode == 1) console->write("\tContent of register B: ");
+    console->putNumber(cpu.state->b);
+    if (debugMode == 1) console->put('\n');
     return 10;
 }
 
@@ -101,10 +138,13 @@ int GTUOS::PRINT_MEM(const CPU8080 &cpu) {
 
     uint16_t address = cpu.state->b | cpu.state->c;
 
-    if (debugMode == 1)
-        *out << "\tContent of memory address " << address << " : " << (int) (cpu.memory->at(address)) << endl;
-    else
-        *out << (int) (cpu.memory->at(address));
+    if (debugMode == 1) {
+        console->write("\tContent of memory address ");
+        console->putNumber(address);
+        console->write(" : ");
+    }
+    console->putNumber(cpu.memory->at(address));
+    if (debugMode == 1) console->put('\n');
 
 
     return 10;
@@ -122,13 +162,13 @@ int GTUOS::READ_B(const CPU8080 &cpu) {
     uint8_t number;
 
 
-    if (!(*in >> decimalNumber)) goodRead = false;
+    if (!console->readInt(decimalNumber)) goodRead = false;
 
     if (decimalNumber >= 0 && decimalNumber <= 255 && goodRead) {
         number = (uint8_t) decimalNumber;
         cpu.state->b = number;
     } else {
-        *out << "You can enter only decimal numbers between 0-255. Now B=0" << endl;
+        console->write("You can enter only decimal numbers between 0-255. Now B=0\n");
         cpu.state->b = 0;
     }
     return 10;
@@ -144,32 +184,54 @@ int GTUOS::READ_B(const CPU8080 &cpu) {
 int GTUOS::READ_MEM(const CPU8080 &cpu) {
     int decimalNumber;
     uint16_t address = cpu.state->b | cpu.state->c;
-    *in >> decimalNumber;
+    bool goodRead = console->readInt(decimalNumber);
 
-    if (decimalNumber >= 0 && decimalNumber <= 255) {
-        cpu.memory->at(address) = (uint8_t) decimalNumber;
+    uint8_t value = 0;
+    if (goodRead && decimalNumber >= 0 && decimalNumber <= 255) {
+        value = (uint8_t) decimalNumber;
     } else {
-        *out << "You can enter only decimal numbers between 0-255. Now MEM[BC] = 0" << endl;
-        cpu.memory->at(address) = 0;
+        console->write("You can enter only decimal numbers between 0-255. Now MEM[BC] = 0\n");
     }
+    if (cpu.paged != NULL)
+        cpu.paged->writeAt(address) = value;
+    else
+        cpu.memory->at(address) = value;
+    cpu.blockCache->noteWrite(cpu.processSlot(), address);
     return 10;
 
 }
 
 /**
  * Pring string pointed BC registers.
+ * The string is copied to the console a page at a time, straight from the
+ * frame; a memory without pages is read a byte at a time.
  * @param cpu CPU emulator object.
  * @return Clock cycle. 10 per character.
  */
 int GTUOS::PRINT_STR(const CPU8080 &cpu) {
+    Memory *mem = cpu.paged;
     uint16_t address = (cpu.state->b << 8) | cpu.state->c;
-    if (debugMode == 1) *out << "\tString starting from address " << address << endl << "\t";
+    if (debugMode == 1) {
+        console->write("\tString starting from address ");
+        console->putNumber(address);
+        console->write("\n\t");
+    }
     uint16_t cycle = 0;
-    char readedChar;
-    while ((readedChar = cpu.memory->at(address)) != '\0') {
-        *out << (readedChar);
-        if (readedChar == '\t') address++; //\t bastırdığımız zaman sonrasını null yapıyor. O yüzden adresi 2 arttırdım.
-        address++;
+    for (;;) {
+        uint32_t length = 1;
+        const uint8_t *span = mem != NULL ? mem->readSpan(address, &length) : &cpu.memory->at(address);
+        uint32_t count = 0;
+        while (count < length && span[count] != '\0' && span[count] != '\t')
+            count++;
+        console->write(span, count);
+        cycle += count;
+        address += count;
+        if (count == length)
+            continue;
+        if (span[count] == '\0')
+            break;
+        console->put('\t');
+        address += 2; //\t bastırdığımız zaman sonrasını null yapıyor. O yüzden adresi 2 arttırdım.
         cycle++;
     }
     return cycle * 10;
@@ -179,25 +241,32 @@ int GTUOS::PRINT_STR(const CPU8080 &cpu) {
 
 /**
  * Get string from user and put it into MEM[BC].
+ * The line is copied into guest memory a page at a time, or a byte at a
+ * time without pages.
  * @param cpu CPU emulator object.
  * @return clock cyles. 10 per character.
  */
 int GTUOS::READ_STR(const CPU8080 &cpu) {
+    Memory *mem = cpu.paged;
     uint16_t address = cpu.state->b | cpu.state->c;
     string input;
-    *out << "Enter a string: " << std::endl;
-
-    //Sometimes below two lines may be required to clear the buffer.
-    std::cin.clear();
-    std::cin.sync();
-
-    getline(*in, input);
-
-    uint32_t i;
-    for (i = 0; i < input.length(); i++) {
-        cpu.memory->at(address + i) = (uint8_t) input[i];
+    console->write("Enter a string: \n");
+
+    if (!console->readLine(input))
+        input.clear();
+
+    size_t done = 0;
+    while (done <= input.length()) {
+        uint32_t length = 1;
+        uint8_t *span = mem != NULL ? mem->writeSpan(address, &length) : &cpu.memory->at(address);
+        // The terminating NUL is copied with the last piece.
+        size_t count = std::min((size_t) length, input.length() + 1 - done);
+        memcpy(span, input.c_str() + done, count);
+        for (size_t i = 0; i < count; i++)
+            cpu.blockCache->noteWrite(cpu.processSlot(), (uint16_t) (address + i));
+        address += (uint16_t) count;
+        done += count;
     }
-    cpu.memory->at(i + address) = '\0';
     return static_cast<int>(10 * input.length());
 }
 
@@ -210,11 +279,12 @@ int GTUOS::READ_STR(const CPU8080 &cpu) {
 int GTUOS::LOAD_EXEC(CPU8080 &cpu) {
 
     int address = (cpu.state->b << 8) | cpu.state->c;
-    char *fileName = (char *) malloc(256);
+    char fileName[256];
     uint16_t cycle = 0;
-    while ((fileName[cycle] = cpu.memory->at(address + cycle)) != '\0') {
+    while (cycle < sizeof(fileName) - 1 && (fileName[cycle] = cpu.memory->at(address + cycle)) != '\0') {
         cycle++;
     }
+    fileName[cycle] = '\0';
 
     int addressHL;
     addressHL = (cpu.state->h << 8) | cpu.state->l;
@@ -225,13 +295,13 @@ int GTUOS::LOAD_EXEC(CPU8080 &cpu) {
 }
 
 /**
- * Sets quantum. 
+ * Sets quantum, in clock cycles, from BC.
  * @param cpu emulator object
  * @return cycle number
  */
 int GTUOS::SET_QUANTUM(CPU8080 &cpu) {
 
-    cpu.setQuantum(cpu.state->b);
+    cpu.setQuantum((cpu.state->b << 8) | cpu.state->c);
     return 7;
 
 }
@@ -243,19 +313,29 @@ int GTUOS::SET_QUANTUM(CPU8080 &cpu) {
  */
 int GTUOS::PROCESS_EXIT(CPU8080 &cpu) {
 
-
-    Memory *mem = (Memory *) cpu.memory;
+    console->flush();
+
+    // The kernel's process table, physical memory without pages.
+    Memory *mem = cpu.paged;
+    MemoryBase *memory = cpu.memory;
+    auto kernelCall = [mem, memory](uint32_t a) -> uint8_t & {
+        return mem != NULL ? mem->kernelCall(a) : memory->physicalAt(a);
+    };
+    auto kernelWrite = [mem, memory](uint32_t a) -> uint8_t & {
+        return mem != NULL ? mem->kernelWrite(a) : memory->physicalAt(a);
+    };
     uint8_t pid = 0;
-    pid = mem->kernelCall(0x0d0a);
+    pid = kernelCall(0x0d0a);
     int changed = 0;
     for (int i = 0; i < 10; i++) {
         uint32_t a = static_cast<uint32_t>((i + 2) * 256 + 2);
-        if (mem->kernelCall(a) == pid && mem->kernelCall(a) != 0) {
-            if (mem->kernelCall((pid + 2) * 256 + 2) == i) {
+        if (kernelCall(a) == pid && kernelCall(a) != 0) {
+            if (kernelCall((pid + 2) * 256 + 2) == i) {
                 changed = 0;
                 break;
             } else {
-                mem->kernelCall(a) = mem->kernelCall((pid + 2) * 256 + 2);
+                kernelWrite(a) = kernelCall((pid + 2) * 256 + 2);
+                cpu.blockCache->noteWrite(0, a);
                 changed = 1;
                 break;
             }
@@ -263,7 +343,8 @@ int GTUOS::PROCESS_EXIT(CPU8080 &cpu) {
     }
 
     if (changed == 0) {
-        mem->kernelCall(0x0d00) = 1;
+        kernelWrite(0x0d00) = 1;
+        cpu.blockCache->noteWrite(0, 0x0d00);
     }
 
 
@@ -2,7 +2,11 @@
 #define OS_CORE_H
 
 #include "emulator_base.h"
+#include "console_io.h"
 #include <fstream>
+#include <istream>
+#include <ostream>
+#include <functional>
 
 #define PRINT_B_CODE     4
 #define PRINT_MEM_CODE   3
@@ -14,14 +18,42 @@
 #define PROCESS_EXIT_CODE    9
 #define SET_QUANTUM_CODE    6
 #define CYCLE_PER_CALL 10
+#define SYSCALL_COUNT 256   // Indexed by register A
+
 class GTUOS {
 public:
-	GTUOS();
+	// Runs one system call and returns the clock cycles it took.
+	typedef std::function<int(CPU8080 &cpu)> SyscallHandler;
+
+	typedef struct _syscall {
+		const char *name;       // NULL while nothing is registered
+		SyscallHandler handler;
+		uint64_t calls;
+		uint64_t cycles;
+		uint64_t nanoseconds;   // Host time spent in the handler
+	} _syscall;
+
+	// useFiles reads input.txt up front and writes output.txt instead of the console.
+	GTUOS(bool useFiles = false);
+	// Console on caller-owned streams, for hosts running many instances.
+	// input may be NULL, every read then sees the end of input.
+	GTUOS(std::istream *input, std::ostream *output);
 
 	~GTUOS();
 
+	/**
+	 * Run the system call selected by register A and charge its cycles to
+	 * the calling process, see CPU8080::chargeCycles.
+	 * @return Clock cycles of the call, 0 if nothing is registered for A.
+	 */
 	uint64_t handleCall(CPU8080 &cpu, int DEBUG);
 
+	// Replaces whatever was registered for code; counters start over.
+	void registerSyscall(uint8_t code, const char *name, SyscallHandler handler);
+	const _syscall &getSyscall(uint8_t code) const { return syscalls[code]; }
+	// One line per registered call that ran: calls, cycles, host time.
+	void printSyscallStats(std::ostream &stats) const;
+
 	int PRINT_B(const CPU8080 &cpu);
 
 	int PRINT_MEM(const CPU8080 &cpu);
@@ -40,12 +72,18 @@ public:
 
 	int SET_QUANTUM(CPU8080 &cpu);
 
+	// Write out buffered guest output now.
+	void flush() { console->flush(); }
 
 private:
+	void registerDefaults();
+
 	int debugMode;
 	bool usingFiles;
 	std::istream *in;
 	std::ostream *out;
+	ConsoleIO *console;     // Every guest read and write goes through it
+	_syscall syscalls[SYSCALL_COUNT];
 
 	std::ifstream ifn;
 	std::ofstream ofn;
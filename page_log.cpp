@@ -0,0 +1,237 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include "page_log.h"
+
+namespace {
+    // Logs with a running writer. The emulator leaves through exit() on an
+    // unimplemented instruction, so they are drained from an atexit hook too.
+    std::mutex openLogsLock;
+    std::vector<PageLog *> openLogs;
+
+    void closeOpenLogs() {
+        std::vector<PageLog *> logs;
+        {
+            std::lock_guard<std::mutex> guard(openLogsLock);
+            logs = openLogs;
+        }
+        for (size_t i = 0; i < logs.size(); i++)
+            logs[i]->close();
+    }
+
+    const char *processName[4] = {"Init", "Sum", "Sort", "Prime"};
+
+    const char *nameOf(int process) {
+        if (process < 0 || process >= 4) return "";
+        return processName[process];
+    }
+
+    void put16(uint8_t *out, uint32_t value) {
+        out[0] = value & 0xff;
+        out[1] = (value >> 8) & 0xff;
+    }
+
+    void put32(uint8_t *out, uint32_t value) {
+        put16(out, value & 0xffff);
+        put16(out + 2, value >> 16);
+    }
+
+    uint32_t get16(const uint8_t *in) {
+        return in[0] | (in[1] << 8);
+    }
+
+    uint32_t get32(const uint8_t *in) {
+        return get16(in) | (get16(in + 2) << 16);
+    }
+}
+
+PageLog::PageLog() : mode(LOG_OFF), head(0), tail(0), stopping(false) {
+    ring = (uint8_t *) malloc(LOG_RING_SIZE);
+}
+
+PageLog::~PageLog() {
+    close();
+    free(ring);
+}
+
+bool PageLog::modeFromName(const char *name, LogMode &mode) {
+    if (strcmp(name, "off") == 0) mode = LOG_OFF;
+    else if (strcmp(name, "summary") == 0) mode = LOG_SUMMARY;
+    else if (strcmp(name, "full") == 0) mode = LOG_FULL;
+    else if (strcmp(name, "binary") == 0) mode = LOG_BINARY;
+    else return false;
+    return true;
+}
+
+void PageLog::open(LogMode newMode, const char *directory) {
+    close();
+    mode = newMode;
+    std::string prefix = (directory != NULL) ? std::string(directory) + "/" : std::string();
+    switch (mode) {
+        case LOG_OFF:
+            return;
+        case LOG_SUMMARY:
+            systemOutput.open(prefix + SYSTEM_LOG_FILE, std::ios::out | std::ios::trunc);
+            break;
+        case LOG_FULL:
+            systemOutput.open(prefix + SYSTEM_LOG_FILE, std::ios::out | std::ios::trunc);
+            pageOutput.open(prefix + PAGETABLE_LOG_FILE, std::ios::out | std::ios::trunc);
+            break;
+        case LOG_BINARY:
+            binaryOutput.open(prefix + BINARY_LOG_FILE, std::ios::out | std::ios::trunc | std::ios::binary);
+            binaryOutput.write(BINARY_LOG_MAGIC, 8);
+            break;
+    }
+    head.store(0);
+    tail.store(0);
+    stopping.store(false);
+    writer = std::thread(&PageLog::writerLoop, this);
+
+    std::lock_guard<std::mutex> guard(openLogsLock);
+    static bool hooked = false;
+    if (!hooked) {
+        std::atexit(closeOpenLogs);
+        hooked = true;
+    }
+    openLogs.push_back(this);
+}
+
+void PageLog::close() {
+    if (writer.joinable()) {
+        stopping.store(true, std::memory_order_release);
+        writer.join();
+        std::lock_guard<std::mutex> guard(openLogsLock);
+        openLogs.erase(std::remove(openLogs.begin(), openLogs.end(), this), openLogs.end());
+    }
+    if (systemOutput.is_open()) systemOutput.close();
+    if (pageOutput.is_open()) pageOutput.close();
+    if (binaryOutput.is_open()) binaryOutput.close();
+    mode = LOG_OFF;
+}
+
+void PageLog::logPageFault(int process, uint32_t virtualAddress, uint32_t physicalAddress, int frame) {
+    if (mode == LOG_OFF) return;
+    uint8_t record[12];
+    record[0] = RECORD_PAGEFAULT;
+    record[1] = (uint8_t) process;
+    put32(record + 2, virtualAddress);
+    put32(record + 6, physicalAddress);
+    put16(record + 10, (uint32_t) frame);
+    put(record, sizeof(record));
+}
+
+void PageLog::logContextSwitch(int current, int next) {
+    if (mode == LOG_OFF) return;
+    uint8_t record[3] = {RECORD_CSEVENT, (uint8_t) current, (uint8_t) next};
+    put(record, sizeof(record));
+}
+
+void PageLog::logPageTables(const uint8_t *entries, int tables, int perTable) {
+    if (!wantsPageTables()) return;
+    uint8_t header[4] = {RECORD_PAGETABLES, (uint8_t) tables};
+    put16(header + 2, (uint32_t) perTable);
+    put(header, sizeof(header));
+    put(entries, (size_t) tables * perTable * 3);
+}
+
+// Producer side. Records are published only once complete, so the writer
+// never sees half of one. Blocks while the ring is full.
+void PageLog::put(const uint8_t *data, size_t length) {
+    uint64_t h = head.load(std::memory_order_relaxed);
+    while (LOG_RING_SIZE - (h - tail.load(std::memory_order_acquire)) < length)
+        std::this_thread::yield();
+    for (size_t i = 0; i < length; i++)
+        ring[(h + i) & (LOG_RING_SIZE - 1)] = data[i];
+    head.store(h + length, std::memory_order_release);
+}
+
+void PageLog::writerLoop() {
+    std::vector<uint8_t> chunk;
+    size_t pending = 0;     // Undecoded bytes left at the start of chunk
+    for (;;) {
+        bool done = stopping.load(std::memory_order_acquire);
+        uint64_t h = head.load(std::memory_order_acquire);
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        if (h == t) {
+            if (done) break;
+            systemOutput.flush();
+            pageOutput.flush();
+            binaryOutput.flush();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        chunk.resize(pending + (h - t));
+        for (uint64_t i = t; i < h; i++)
+            chunk[pending + (i - t)] = ring[i & (LOG_RING_SIZE - 1)];
+        tail.store(h, std::memory_order_release);
+
+        if (mode == LOG_BINARY) {
+            binaryOutput.write((const char *) chunk.data(), chunk.size());
+            pending = 0;
+        } else {
+            size_t used = decode(chunk.data(), chunk.size(),
+                                 systemOutput.is_open() ? &systemOutput : NULL,
+                                 pageOutput.is_open() ? &pageOutput : NULL);
+            pending = chunk.size() - used;
+            for (size_t i = 0; i < pending; i++)
+                chunk[i] = chunk[used + i];
+        }
+    }
+    systemOutput.flush();
+    pageOutput.flush();
+    binaryOutput.flush();
+}
+
+size_t PageLog::decode(const uint8_t *data, size_t length, std::ostream *systemOut, std::ostream *pageOut) {
+    char line[256];
+    size_t pos = 0;
+    while (pos < length) {
+        const uint8_t *record = data + pos;
+        size_t left = length - pos;
+        if (record[0] == RECORD_PAGEFAULT) {
+            if (left < 12) break;
+            if (systemOut) {
+                std::snprintf(line, sizeof(line), "PAGEFAULT: %d,%04x,%04x,%d\n", record[1],
+                              get32(record + 2), get32(record + 6), get16(record + 10));
+                *systemOut << line;
+            }
+            pos += 12;
+        } else if (record[0] == RECORD_CSEVENT) {
+            if (left < 3) break;
+            if (systemOut) {
+                std::snprintf(line, sizeof(line), "CSEVENT: %d, %s,%d,%s\n", record[1], nameOf(record[1]),
+                              record[2], nameOf(record[2]));
+                *systemOut << line;
+            }
+            pos += 3;
+        } else if (record[0] == RECORD_PAGETABLES) {
+            if (left < 4) break;
+            int tables = record[1];
+            int perTable = get16(record + 2);
+            size_t size = 4 + (size_t) tables * perTable * 3;
+            if (left < size) break;
+            if (pageOut) {
+                const uint8_t *entry = record + 4;
+                for (int i = 0; i < tables; i++) {
+                    std::snprintf(line, sizeof(line), "Page Table %d:\n", i);
+                    *pageOut << line;
+                    for (int j = 0; j < perTable; j++, entry += 3) {
+                        std::snprintf(line, sizeof(line),
+                                      "Index: %d Valid Bit: %d Frame: %d Referenced Bit: %d Modified Bit: %d\n",
+                                      j, entry[2] & 1, get16(entry), (entry[2] >> 1) & 1, (entry[2] >> 2) & 1);
+                        *pageOut << line;
+                    }
+                }
+            }
+            pos += size;
+        } else {
+            // Unknown record, nothing after it can be trusted.
+            return length;
+        }
+    }
+    return pos;
+}
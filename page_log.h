@@ -0,0 +1,98 @@
+#ifndef PAGE_LOG_H
+#define PAGE_LOG_H
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <thread>
+#include <fstream>
+#include <ostream>
+#include <string>
+
+#define SYSTEM_LOG_FILE     "system.txt"
+#define PAGETABLE_LOG_FILE  "pagetable.txt"
+#define BINARY_LOG_FILE     "system.bin"
+#define BINARY_LOG_MAGIC    "I8080LG2"
+#define LOG_RING_SIZE       (1 << 20)   // Bytes, power of two
+
+// Asynchronous writer for the PAGEFAULT / CSEVENT lines of system.txt and
+// the page table dumps of pagetable.txt.
+//
+// The emulator encodes each event as a compact binary record into a
+// single-producer / single-consumer ring buffer and returns immediately. A
+// background thread drains the ring and either formats the records as text
+// or copies them verbatim to system.bin, which page_log_decode turns back into
+// the text files offline.
+//
+// Record layout, little endian:
+//   'F' process:u8 virtual:u32 physical:u32 frame:u16     page fault
+//   'C' current:u8 next:u8                                context switch
+//   'T' tables:u8 entries:u16 { frame:u16 flags:u8 }...   page table dump
+//        flags: bit 0 valid, bit 1 referenced, bit 2 modified
+
+class PageLog {
+public:
+    enum LogMode {
+        LOG_OFF,        // Nothing is written
+        LOG_SUMMARY,    // system.txt only, page tables are not dumped
+        LOG_FULL,       // system.txt and pagetable.txt
+        LOG_BINARY      // Every record in system.bin
+    };
+
+    enum RecordType {
+        RECORD_PAGEFAULT = 'F',
+        RECORD_CSEVENT = 'C',
+        RECORD_PAGETABLES = 'T'
+    };
+
+    PageLog();
+    ~PageLog();
+
+    // Creates the files of the mode, in directory unless it is NULL, and
+    // starts the writer thread.
+    void open(LogMode mode, const char *directory = NULL);
+    // Drains every queued record, stops the writer and closes the files.
+    void close();
+
+    // Mode for its command line name (off, summary, full, binary).
+    static bool modeFromName(const char *name, LogMode &mode);
+
+    LogMode getMode() const { return mode; }
+    bool isEnabled() const { return mode != LOG_OFF; }
+    bool wantsPageTables() const { return mode == LOG_FULL || mode == LOG_BINARY; }
+
+    void logPageFault(int process, uint32_t virtualAddress, uint32_t physicalAddress, int frame);
+    void logContextSwitch(int current, int next);
+    // entries holds tables * perTable packed entries, 3 bytes each.
+    void logPageTables(const uint8_t *entries, int tables, int perTable);
+
+    /**
+     * Format records as today's text output.
+     * @param data Encoded records.
+     * @param length Bytes available in data.
+     * @param systemOut Receives PAGEFAULT and CSEVENT lines, may be NULL.
+     * @param pageOut Receives page table dumps, may be NULL.
+     * @return Bytes consumed, a trailing partial record is left over.
+     */
+    static size_t decode(const uint8_t *data, size_t length, std::ostream *systemOut, std::ostream *pageOut);
+
+private:
+    void put(const uint8_t *data, size_t length);
+    void writerLoop();
+
+    PageLog(const PageLog &);
+    void operator=(const PageLog &);
+
+    LogMode mode;
+    uint8_t *ring;
+    std::atomic<uint64_t> head;     // Written only by the emulator thread
+    std::atomic<uint64_t> tail;     // Written only by the writer thread
+    std::atomic<bool> stopping;
+    std::thread writer;
+
+    std::ofstream systemOutput;
+    std::ofstream pageOutput;
+    std::ofstream binaryOutput;
+};
+
+#endif
@@ -0,0 +1,37 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <cstring>
+#include "page_log.h"
+
+// Turns a system.bin written in PageLog::LOG_BINARY mode back into the
+// system.txt and pagetable.txt the emulator writes in LOG_FULL mode.
+
+int main(int argc, char **argv)
+{
+    if (argc != 2 && argc != 4) {
+        std::cerr << "Usage: page_log_decode binFile [systemFile pageTableFile]\n";
+        return 1;
+    }
+    const char *systemName = (argc == 4) ? argv[2] : SYSTEM_LOG_FILE;
+    const char *pageName = (argc == 4) ? argv[3] : PAGETABLE_LOG_FILE;
+
+    std::ifstream in(argv[1], std::ios::in | std::ios::binary);
+    if (!in) {
+        std::cerr << "error: Couldn't open " << argv[1] << "\n";
+        return 1;
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (data.size() < 8 || memcmp(data.data(), BINARY_LOG_MAGIC, 8) != 0) {
+        std::cerr << "error: " << argv[1] << " is not a binary page log\n";
+        return 1;
+    }
+
+    std::ofstream systemOut(systemName, std::ios::out | std::ios::trunc);
+    std::ofstream pageOut(pageName, std::ios::out | std::ios::trunc);
+    size_t used = PageLog::decode(data.data() + 8, data.size() - 8, &systemOut, &pageOut);
+    if (used != data.size() - 8) {
+        std::cerr << "warning: " << (data.size() - 8 - used) << " trailing bytes ignored\n";
+    }
+    return 0;
+}
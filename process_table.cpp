@@ -0,0 +1,81 @@
+#include <cstring>
+#include "process_table.h"
+#include "memory_manager.h"
+#include "block_cache.h"
+
+namespace {
+    uint32_t entryAddress(int pid) {
+        return PROCESS_TABLE_BASE + (uint32_t) pid * PROCESS_ENTRY_SIZE;
+    }
+}
+
+ProcessTable::ProcessTable() {
+    memset(blocks, 0, sizeof(blocks));
+    switches = 0;
+}
+
+int ProcessTable::switchProcess(State8080 *state, Memory *memory, BlockCache *code) {
+    int current = memory->kernelCall(RUNNING_PROCESS_ADDR) % PROCESS_TABLE_SLOTS;
+    uint16_t base = memory->getBaseRegister();
+    _processControlBlock *out = &blocks[current];
+
+    uint8_t entry[PCB_SAVED];
+    memory->kernelReadBlock(entryAddress(current), entry, PCB_SAVED);
+    entry[PCB_STATE] = 0;
+    entry[PCB_PID] = (uint8_t) current;
+    entry[PCB_A] = state->a;
+    entry[PCB_A + 1] = state->b;
+    entry[PCB_A + 2] = state->c;
+    entry[PCB_A + 3] = state->d;
+    entry[PCB_A + 4] = state->e;
+    entry[PCB_A + 5] = state->h;
+    entry[PCB_A + 6] = state->l;
+    entry[PCB_SP] = state->sp & 0xff;
+    entry[PCB_SP + 1] = (state->sp >> 8) & 0xff;
+    entry[PCB_PC] = state->pc & 0xff;
+    entry[PCB_PC + 1] = (state->pc >> 8) & 0xff;
+    entry[PCB_BASE] = base & 0xff;
+    entry[PCB_BASE + 1] = (base >> 8) & 0xff;
+    entry[PCB_FLAGS] = *(uint8_t *) &state->cc;
+    memory->kernelWriteBlock(entryAddress(current), entry, PCB_SAVED);
+    code->noteWrite(0, (uint16_t) entryAddress(current));
+    code->noteWrite(0, (uint16_t) (entryAddress(current) + PCB_SAVED - 1));
+
+    out->valid = 1;
+    out->running = 0;
+    out->next = entry[PCB_NEXT];
+    out->regs = *state;
+    out->base = base;
+
+    int next = entry[PCB_NEXT] % PROCESS_TABLE_SLOTS;
+    _processControlBlock *in = &blocks[next];
+    memory->kernelReadBlock(entryAddress(next), entry, PCB_SAVED);
+    entry[PCB_STATE] = 1;
+    entry[PCB_PID] = (uint8_t) next;
+    memory->kernelWriteBlock(entryAddress(next), entry, PCB_PID + 1);
+    memory->kernelWrite(RUNNING_PROCESS_ADDR) = (uint8_t) next;
+    code->noteWrite(0, (uint16_t) entryAddress(next));
+    code->noteWrite(0, RUNNING_PROCESS_ADDR);
+    memory->logContextSwitch(current, next);
+
+    state->a = entry[PCB_A];
+    state->b = entry[PCB_A + 1];
+    state->c = entry[PCB_A + 2];
+    state->d = entry[PCB_A + 3];
+    state->e = entry[PCB_A + 4];
+    state->h = entry[PCB_A + 5];
+    state->l = entry[PCB_A + 6];
+    state->sp = entry[PCB_SP] | (entry[PCB_SP + 1] << 8);
+    state->pc = entry[PCB_PC] | (entry[PCB_PC + 1] << 8);
+    *(uint8_t *) &state->cc = entry[PCB_FLAGS];
+    state->int_enable = 1;
+    memory->setBaseRegister(entry[PCB_BASE] | (entry[PCB_BASE + 1] << 8));
+
+    in->valid = 1;
+    in->running = 1;
+    in->next = entry[PCB_NEXT];
+    in->regs = *state;
+    in->base = memory->getBaseRegister();
+    switches++;
+    return next;
+}
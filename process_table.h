@@ -0,0 +1,67 @@
+#ifndef PROCESS_TABLE_H
+#define PROCESS_TABLE_H
+
+#include <cstdint>
+#include "emulator_base.h"
+
+class Memory;
+class BlockCache;
+
+// Layout of the microkernel.asm process table, in kernel (page table 0)
+// addresses. Entry i lives at PROCESS_TABLE_BASE + i * PROCESS_ENTRY_SIZE.
+#define PROCESS_TABLE_BASE    0x0200
+#define PROCESS_ENTRY_SIZE    0x0100
+#define PROCESS_TABLE_SLOTS   10
+#define RUNNING_PROCESS_ADDR  0x0d0a
+#define TIMER_INTERRUPT       0xef      // RST 5, see CPU8080::dispatchScheduler
+
+#define PCB_STATE   0x00    // 1 running, 0 ready
+#define PCB_PID     0x01
+#define PCB_NEXT    0x02
+#define PCB_A       0x03    // Then B, C, D, E, H, L
+#define PCB_SP      0x0a    // Low byte first, as are PC and BASE
+#define PCB_PC      0x0c
+#define PCB_BASE    0x0e
+#define PCB_FLAGS   0x10
+#define PCB_SAVED   0x11    // Bytes up to and including the flags
+
+// Host side fast path for the timer interrupt.
+// Without it, every register is spilled to the interrupt buffer one
+// kernelCall at a time and readFromInterruptBuffer copies it into the table
+// and back out again in guest code. switchProcess does the same table
+// update with one bulk write and one bulk read through the MMU and logs a
+// single CSEVENT; the table in guest memory stays exactly what the guest
+// handler would have left, so the kernel and PROCESS_EXIT keep working.
+// The guest handler's process state printout is skipped.
+
+class ProcessTable {
+public:
+    typedef struct _processControlBlock {
+        int valid;
+        uint8_t running;
+        uint8_t next;
+        State8080 regs;
+        uint16_t base;
+    } _processControlBlock;
+
+    ProcessTable();
+
+    /**
+     * Save the interrupted process and resume the next one.
+     * @param state CPU registers, replaced by the next process's.
+     * @param memory Kernel memory holding the table; gets the new base register.
+     * @param code Told about the kernel stores, as for any guest write.
+     * @return pid of the process resumed.
+     */
+    int switchProcess(State8080 *state, Memory *memory, BlockCache *code);
+
+    // Host copy of entry pid as of the last switch through here.
+    const _processControlBlock &get(int pid) const { return blocks[pid]; }
+    uint64_t getSwitchCount() const { return switches; }
+
+private:
+    _processControlBlock blocks[PROCESS_TABLE_SLOTS];
+    uint64_t switches;
+};
+
+#endif
@@ -0,0 +1,46 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "program_cache.h"
+
+ProgramCache::~ProgramCache() {
+    for (std::map<std::string, _programImage>::iterator it = images.begin(); it != images.end(); ++it) {
+        if (it->second.data != NULL)
+            munmap((void *) it->second.data, it->second.size);
+    }
+}
+
+const ProgramCache::_programImage *ProgramCache::load(const char *path) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::map<std::string, _programImage>::iterator it = images.find(path);
+    if (it != images.end())
+        return &it->second;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return NULL;
+    }
+    _programImage image;
+    image.data = NULL;
+    image.size = (size_t) info.st_size;
+    if (image.size > 0) {
+        void *mapped = mmap(NULL, image.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            close(fd);
+            return NULL;
+        }
+        image.data = (const uint8_t *) mapped;
+    }
+    close(fd);
+    return &(images[path] = image);
+}
+
+ProgramCache &ProgramCache::shared() {
+    static ProgramCache cache;
+    return cache;
+}
@@ -0,0 +1,36 @@
+#ifndef PROGRAM_CACHE_H
+#define PROGRAM_CACHE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <string>
+
+// Read-only mappings of program images, keyed by path.
+// A .com file is mmap'd the first time it is loaded and stays mapped for the
+// life of the emulator, so every later load of the same path, from any
+// process or Memory, shares the same pages. Memory copies from the mapping
+// into a frame on the first fault of each page instead of at load time.
+
+class ProgramCache {
+public:
+    typedef struct _programImage {
+        const uint8_t *data;    // NULL for an empty file
+        size_t size;
+    } _programImage;
+
+    ~ProgramCache();
+
+    // Image of path, mapped on first use. NULL if it cannot be opened.
+    const _programImage * load(const char *path);
+
+    // The cache every CPU8080 loads through.
+    static ProgramCache & shared();
+
+private:
+    std::mutex lock;
+    std::map<std::string, _programImage> images;
+};
+
+#endif
@@ -0,0 +1,73 @@
+#include <cstring>
+#include "replacement_policy.h"
+#include "memory_manager.h"
+
+ReplacementPolicy *ReplacementPolicy::create(const char *name, int frameCount) {
+    if (strcmp(name, "fifo") == 0) return new FifoPolicy(frameCount);
+    if (strcmp(name, "clock") == 0) return new ClockPolicy(frameCount);
+    if (strcmp(name, "lru") == 0) return new AgingPolicy(frameCount);
+    if (strcmp(name, "ws") == 0) return new WorkingSetPolicy(frameCount);
+    return NULL;
+}
+
+int FifoPolicy::selectVictim(Memory &memory) {
+    (void) memory;
+    int frame = next;
+    next = (next + 1) % frameCount;
+    return frame;
+}
+
+int ClockPolicy::selectVictim(Memory &memory) {
+    // Terminates within two turns: the first one clears every bit.
+    for (;;) {
+        int frame = hand;
+        hand = (hand + 1) % frameCount;
+        if (!memory.isFrameUsed(frame) || !memory.isFrameReferenced(frame))
+            return frame;
+        memory.clearFrameReferenced(frame);
+    }
+}
+
+int AgingPolicy::selectVictim(Memory &memory) {
+    int victim = -1;
+    for (int frame = 0; frame < (int) age.size(); frame++) {
+        if (!memory.isFrameUsed(frame)) {
+            if (victim < 0 || memory.isFrameUsed(victim)) victim = frame;
+            continue;
+        }
+        age[frame] = (age[frame] >> 1) | (memory.isFrameReferenced(frame) ? 0x80 : 0);
+        memory.clearFrameReferenced(frame);
+        if (victim < 0 || (memory.isFrameUsed(victim) && age[frame] < age[victim]))
+            victim = frame;
+    }
+    return victim;
+}
+
+void AgingPolicy::pageLoaded(Memory &memory, int frame) {
+    (void) memory;
+    age[frame] = 0x80;
+}
+
+int WorkingSetPolicy::selectVictim(Memory &memory) {
+    now++;
+    int oldest = -1;
+    int outside = -1;
+    for (int frame = 0; frame < (int) lastUse.size(); frame++) {
+        if (!memory.isFrameUsed(frame))
+            return frame;
+        if (memory.isFrameReferenced(frame)) {
+            lastUse[frame] = now;
+            memory.clearFrameReferenced(frame);
+        }
+        if (oldest < 0 || lastUse[frame] < lastUse[oldest])
+            oldest = frame;
+        if (now - lastUse[frame] > window && (outside < 0 || lastUse[frame] < lastUse[outside]))
+            outside = frame;
+    }
+    return outside >= 0 ? outside : oldest;
+}
+
+void WorkingSetPolicy::pageLoaded(Memory &memory, int frame) {
+    (void) memory;
+    lastUse[frame] = now;
+}
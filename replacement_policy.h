@@ -0,0 +1,84 @@
+#ifndef REPLACEMENT_POLICY_H
+#define REPLACEMENT_POLICY_H
+
+#include <cstdint>
+#include <vector>
+
+class Memory;
+
+// Chooses the physical frame a faulting page is loaded into.
+// Policies see frames only through Memory's frame accessors
+// (isFrameUsed, isFrameReferenced, clearFrameReferenced), which go through
+// the reverse frame map, so no policy has to walk the page tables.
+
+class ReplacementPolicy {
+public:
+    virtual ~ReplacementPolicy() {}
+    virtual const char *getName() const = 0;
+    // Frame to load the next faulting page into. Free frames come first.
+    virtual int selectVictim(Memory &memory) = 0;
+    // Called once the faulting page occupies frame.
+    virtual void pageLoaded(Memory &memory, int frame) { (void) memory; (void) frame; }
+
+    /**
+     * Build a policy by name.
+     * @param name fifo, clock, lru or ws
+     * @param frameCount Physical frames managed.
+     * @return New policy, NULL if the name is unknown.
+     */
+    static ReplacementPolicy *create(const char *name, int frameCount);
+};
+
+// Frames in load order, the original behaviour.
+class FifoPolicy : public ReplacementPolicy {
+public:
+    FifoPolicy(int frameCount) : frameCount(frameCount), next(0) {}
+    virtual const char *getName() const { return "fifo"; }
+    virtual int selectVictim(Memory &memory);
+private:
+    int frameCount;
+    int next;
+};
+
+// Second chance: a referenced frame has its bit cleared and is skipped once.
+class ClockPolicy : public ReplacementPolicy {
+public:
+    ClockPolicy(int frameCount) : frameCount(frameCount), hand(0) {}
+    virtual const char *getName() const { return "clock"; }
+    virtual int selectVictim(Memory &memory);
+private:
+    int frameCount;
+    int hand;
+};
+
+// LRU approximation by aging: on every fault each frame's counter is shifted
+// right and its referenced bit moved into the top bit; the lowest counter
+// is evicted.
+class AgingPolicy : public ReplacementPolicy {
+public:
+    AgingPolicy(int frameCount) : age(frameCount, 0) {}
+    virtual const char *getName() const { return "lru"; }
+    virtual int selectVictim(Memory &memory);
+    virtual void pageLoaded(Memory &memory, int frame);
+private:
+    std::vector<uint8_t> age;
+};
+
+// Working set: virtual time advances by one per fault. A frame referenced
+// since the last fault is in the working set; one unreferenced for more than
+// window faults has left it and is evicted first, otherwise the frame with
+// the oldest use goes.
+class WorkingSetPolicy : public ReplacementPolicy {
+public:
+    WorkingSetPolicy(int frameCount, uint64_t window = 4)
+        : lastUse(frameCount, 0), window(window), now(0) {}
+    virtual const char *getName() const { return "ws"; }
+    virtual int selectVictim(Memory &memory);
+    virtual void pageLoaded(Memory &memory, int frame);
+private:
+    std::vector<uint64_t> lastUse;
+    uint64_t window;
+    uint64_t now;
+};
+
+#endif
@@ -0,0 +1,140 @@
+#include <cstdio>
+#include <chrono>
+#include <fstream>
+#include "runtime_stats.h"
+
+namespace {
+    const char *const COUNTER_NAMES[RuntimeStats::STAT_COUNT] = {
+        "samples", "instructions", "cycles", "idle_cycles", "page_faults", "evictions", "write_backs",
+        "shared_mappings", "copy_on_writes",
+        "tlb_hits", "tlb_misses", "context_switches", "syscalls",
+        "host_ns.cpu", "host_ns.mmu", "host_ns.os"
+    };
+}
+
+RuntimeStats::RuntimeStats(int processCount)
+    : processFaults(processCount), intervalMs(STATS_INTERVAL_MS), stopping(false) {
+    for (int i = 0; i < STAT_COUNT; i++) {
+        counters[i].value.store(0, std::memory_order_relaxed);
+        counters[i].name.store(NULL, std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < processFaults.size(); i++) {
+        processFaults[i].value.store(0, std::memory_order_relaxed);
+        processFaults[i].name.store(NULL, std::memory_order_relaxed);
+    }
+    for (int code = 0; code < SYSCALL_COUNT; code++) {
+        syscalls[code].value.store(0, std::memory_order_relaxed);
+        syscalls[code].name.store(NULL, std::memory_order_relaxed);
+    }
+}
+
+RuntimeStats::~RuntimeStats() {
+    stopPublishing();
+}
+
+void RuntimeStats::sample(const CPU8080 &cpu, const Memory &mem, const GTUOS &os, uint64_t runNanoseconds) {
+    uint64_t calls = 0;
+    uint64_t osNanoseconds = 0;
+    for (int code = 0; code < SYSCALL_COUNT; code++) {
+        const GTUOS::_syscall &call = os.getSyscall((uint8_t) code);
+        if (call.name == NULL || call.calls == 0) continue;
+        calls += call.calls;
+        osNanoseconds += call.nanoseconds;
+        syscalls[code].name.store(call.name, std::memory_order_relaxed);
+        syscalls[code].value.store(call.calls, std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < processFaults.size(); i++)
+        processFaults[i].value.store(mem.getProcessFaultCount((int) i), std::memory_order_relaxed);
+
+    uint64_t mmuNanoseconds = mem.getFaultNanoseconds();
+    const uint64_t values[STAT_COUNT] = {
+        get(STAT_SAMPLES) + 1,
+        cpu.getInstructionCount(),
+        cpu.getTotalCycles(),
+        cpu.getIdleCycles(),
+        mem.getPageFaultCount(),
+        mem.getEvictionCount(),
+        mem.getWriteBackCount(),
+        mem.getSharedMappingCount(),
+        mem.getCopyOnWriteCount(),
+        mem.getTlbHitCount(),
+        mem.getTlbMissCount(),
+        mem.getContextSwitchCount(),
+        calls,
+        runNanoseconds > mmuNanoseconds ? runNanoseconds - mmuNanoseconds : 0,
+        mmuNanoseconds,
+        osNanoseconds
+    };
+    for (int i = 0; i < STAT_COUNT; i++)
+        counters[i].value.store(values[i], std::memory_order_relaxed);
+}
+
+void RuntimeStats::write(std::ostream &out) const {
+    char line[96];
+    for (int i = 0; i < STAT_COUNT; i++) {
+        snprintf(line, sizeof(line), "%s %llu\n", COUNTER_NAMES[i], (unsigned long long) get((Counter) i));
+        out << line;
+        if (i == STAT_PAGE_FAULTS) {
+            for (size_t table = 0; table < processFaults.size(); table++) {
+                snprintf(line, sizeof(line), "page_faults.%d %llu\n", (int) table,
+                         (unsigned long long) getProcessFaults((int) table));
+                out << line;
+            }
+        } else if (i == STAT_TLB_MISSES) {
+            uint64_t hits = get(STAT_TLB_HITS);
+            uint64_t lookups = hits + get(STAT_TLB_MISSES);
+            snprintf(line, sizeof(line), "tlb_hit_rate %.4f\n", lookups > 0 ? (double) hits / lookups : 0.0);
+            out << line;
+        } else if (i == STAT_SYSCALLS) {
+            for (int code = 0; code < SYSCALL_COUNT; code++) {
+                const char *name = syscalls[code].name.load(std::memory_order_relaxed);
+                if (name == NULL) continue;
+                snprintf(line, sizeof(line), "syscalls.%s %llu\n", name,
+                         (unsigned long long) getSyscalls((uint8_t) code));
+                out << line;
+            }
+        }
+    }
+}
+
+bool RuntimeStats::publish(const char *path, int intervalMs) {
+    stopPublishing();
+    this->path = path;
+    this->intervalMs = intervalMs > 0 ? intervalMs : STATS_INTERVAL_MS;
+    if (!writeFile())
+        return false;
+    stopping = false;
+    publisher = std::thread(&RuntimeStats::publisherLoop, this);
+    return true;
+}
+
+void RuntimeStats::stopPublishing() {
+    if (!publisher.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(stopLock);
+        stopping = true;
+    }
+    stopSignal.notify_one();
+    publisher.join();
+    writeFile();
+}
+
+bool RuntimeStats::writeFile() const {
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream out(temporary.c_str());
+        if (!out)
+            return false;
+        write(out);
+        if (!out)
+            return false;
+    }
+    return rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+void RuntimeStats::publisherLoop() {
+    std::unique_lock<std::mutex> lock(stopLock);
+    while (!stopSignal.wait_for(lock, std::chrono::milliseconds(intervalMs), [this] { return stopping; }))
+        writeFile();
+}
@@ -0,0 +1,116 @@
+#ifndef RUNTIME_STATS_H
+#define RUNTIME_STATS_H
+
+#include <cstdint>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "emulator_base.h"
+#include "memory_manager.h"
+#include "os_core.h"
+
+#define STATS_INTERVAL_MS   1000    // Default time between stats file writes
+
+// Counters of a running emulator that another thread can read at any time.
+//
+// The engine keeps its own plain counters (CPU8080, Memory, GTUOS) and
+// never touches this class. The emulator thread calls sample() between
+// Run calls, which copies them here with relaxed atomic stores; every
+// counter sits on its own cache line, so the reader never shares a line
+// the emulator is writing. A sample is not taken atomically as a whole:
+// two counters may be a Run apart, each is exact for its own sample.
+//
+// publish() starts a thread that rewrites a stats file every interval,
+// through a temporary file and a rename, so a reader such as
+// `watch cat stats.txt` always sees a whole report:
+//   samples 412
+//   instructions 36518211
+//   cycles 41200000
+//   idle_cycles 12000000        Credited by skipping idle loops
+//   page_faults 5231
+//   page_faults.0 1820          per process
+//   evictions 5223
+//   write_backs 2210
+//   shared_mappings 310         Faults served by a frame with the same bytes
+//   copy_on_writes 12           Stores breaking a page out of one
+//   tlb_hits 40122344
+//   tlb_misses 611021
+//   tlb_hit_rate 0.9850
+//   context_switches 5100
+//   syscalls 930
+//   syscalls.PRINT_B 900        per registered call that ran
+//   host_ns.cpu 1983221000      Run, less page fault handling
+//   host_ns.mmu 52110000        Page fault handling
+//   host_ns.os 8123000          System call handlers
+
+class RuntimeStats {
+public:
+    enum Counter {
+        STAT_SAMPLES,
+        STAT_INSTRUCTIONS,
+        STAT_CYCLES,
+        STAT_IDLE_CYCLES,
+        STAT_PAGE_FAULTS,
+        STAT_EVICTIONS,
+        STAT_WRITE_BACKS,
+        STAT_SHARED_MAPPINGS,
+        STAT_COPY_ON_WRITES,
+        STAT_TLB_HITS,
+        STAT_TLB_MISSES,
+        STAT_CONTEXT_SWITCHES,
+        STAT_SYSCALLS,
+        STAT_CPU_NS,
+        STAT_MMU_NS,
+        STAT_OS_NS,
+        STAT_COUNT
+    };
+
+    explicit RuntimeStats(int processCount);
+    // Stops publishing, after one last write.
+    ~RuntimeStats();
+
+    /**
+     * Copy the engine's counters. Emulator thread only.
+     * @param runNanoseconds Host time spent in CPU8080::Run so far, page
+     *        fault handling included.
+     */
+    void sample(const CPU8080 &cpu, const Memory &mem, const GTUOS &os, uint64_t runNanoseconds);
+
+    // Any thread.
+    uint64_t get(Counter counter) const { return counters[counter].value.load(std::memory_order_relaxed); }
+    uint64_t getProcessFaults(int table) const { return processFaults[table].value.load(std::memory_order_relaxed); }
+    uint64_t getSyscalls(uint8_t code) const { return syscalls[code].value.load(std::memory_order_relaxed); }
+    // The report in the format above.
+    void write(std::ostream &out) const;
+
+    // Rewrite path every intervalMs until stopPublishing. false if the
+    // file cannot be written.
+    bool publish(const char *path, int intervalMs = STATS_INTERVAL_MS);
+    void stopPublishing();
+
+private:
+    typedef struct alignas(64) _slot {
+        std::atomic<uint64_t> value;
+        std::atomic<const char *> name;     // Syscalls only, NULL until one ran
+    } _slot;
+
+    bool writeFile() const;
+    void publisherLoop();
+
+    _slot counters[STAT_COUNT];
+    std::vector<_slot> processFaults;
+    _slot syscalls[SYSCALL_COUNT];
+
+    std::string path;
+    int intervalMs;
+    std::thread publisher;
+    std::mutex stopLock;
+    std::condition_variable stopSignal;
+    bool stopping;
+};
+
+#endif
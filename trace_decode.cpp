@@ -0,0 +1,45 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <cstring>
+#include "instruction_tracer.h"
+
+// Prints a binary trace written by InstructionTracer::startStream as the
+// table InstructionTracer::dumpTrace writes.
+
+int main(int argc, char **argv)
+{
+    if (argc != 2 && argc != 3) {
+        std::cerr << "Usage: trace_decode traceFile [tableFile]\n";
+        return 1;
+    }
+
+    std::ifstream in(argv[1], std::ios::in | std::ios::binary);
+    if (!in) {
+        std::cerr << "error: Couldn't open " << argv[1] << "\n";
+        return 1;
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (data.size() < 8 || memcmp(data.data(), TRACE_STREAM_MAGIC, 8) != 0) {
+        std::cerr << "error: " << argv[1] << " is not an instruction trace\n";
+        return 1;
+    }
+
+    std::ofstream file;
+    if (argc == 3) {
+        file.open(argv[2], std::ios::out | std::ios::trunc);
+        if (!file) {
+            std::cerr << "error: Couldn't open " << argv[2] << "\n";
+            return 1;
+        }
+    }
+    std::ostream &out = (argc == 3) ? file : std::cout;
+    out << InstructionTracer::tableHeader();
+    InstructionTracer::TraceEntry previous;
+    memset(&previous, 0, sizeof(previous));
+    size_t used = InstructionTracer::decode(data.data() + 8, data.size() - 8, out, previous);
+    if (used != data.size() - 8) {
+        std::cerr << "warning: " << (data.size() - 8 - used) << " trailing bytes ignored\n";
+    }
+    return 0;
+}